@@ -35,6 +35,7 @@ public:
 	void Run(T * obj, bool (T::*threadFunc)());
 	void Run(T * obj, int (T::*threadFunc)());
 	bool IsRunning();
+	bool WaitUntilFinished(DWORD milliseconds = INFINITE);
 	void Stop();
 
 private:
@@ -217,6 +218,24 @@ bool CSimpleThread<T>::IsRunning()
 	return ret;
 }
 
+/*
+ * Blocks until the thread function has returned (returns immediately if no thread has been started).
+ *
+ * 'milliseconds' - Maximum waiting time
+ * Returns false if the thread is still running after the given time.
+ */
+template <class T>
+bool CSimpleThread<T>::WaitUntilFinished(DWORD milliseconds /*= INFINITE*/)
+{
+	CSingleLock singleLock(&m_CriticalSect, TRUE);
+	HANDLE thread = m_Thread;
+	singleLock.Unlock();
+
+	if (thread == NULL)
+		return true;
+	return ::WaitForSingleObject(thread, milliseconds) == WAIT_OBJECT_0;
+}
+
 /*
  * Immediately stops the currently running thread.
  */
@@ -1,11 +1,16 @@
 #include "AdaptiveBinariser.h"
 #include "ImageTransformer.h"
 #include "WienerFilter.h"
+#include "RowKernelHelpers.h"
 #include "OpenCvImageWriter.h"
 
 namespace PRImA
 {
 
+//Sauvola binarisation for the rough estimation of foreground regions
+static const double SAUVOLA_K = 0.2;
+static const int SAUVOLA_WINDOW = 40;
+
 /*
  * Class CAdaptiveBinariser
  *
@@ -21,11 +26,13 @@ CAdaptiveBinariser::CAdaptiveBinariser(COpenCvImage * inputImage) : CAlgorithm(L
 {
 	m_Debug = false;
 	m_Upsample = true;
+	m_DownsampleBeforePostProcessing = false;
+	m_Tiled = false;
+	m_TileHeight = 512;
 	m_InputImage = inputImage;
 	m_T = NULL;
 	m_Is = NULL;
 	m_I = NULL;
-	m_Iu = NULL;
 	m_S = NULL;
 	m_B = NULL;
 	m_ConnComps = NULL;
@@ -34,6 +41,10 @@ CAdaptiveBinariser::CAdaptiveBinariser(COpenCvImage * inputImage) : CAlgorithm(L
 	m_AverageComponentWidth = 3;
 	m_AverageComponentHeight = 3;
 	m_DeleteGreyScaleSourceImage = true;
+	m_NoiseVariance = -1.0;
+	m_HasThresholdStatistics = false;
+	m_AverageBackground = 0.0;
+	m_AverageDifference = 0.0;
 }
 
 /*
@@ -44,7 +55,6 @@ CAdaptiveBinariser::~CAdaptiveBinariser()
 	if (m_DeleteGreyScaleSourceImage)
 		delete m_Is;
 	delete m_I;
-	delete m_Iu;
 	delete m_S;
 	delete m_B;
 	delete m_ConnComps;
@@ -90,7 +100,13 @@ void CAdaptiveBinariser::DoRun()
 	SetProgress(10);
 
 	//Run method
-	ProcessSourceImage();
+	if (m_Tiled)
+	{
+		if (!ProcessSourceImageTiled())
+			return; //Cancelled
+	}
+	else
+		ProcessSourceImage();
 
 	m_Success = true;
 }
@@ -106,6 +122,7 @@ void CAdaptiveBinariser::ProcessSourceImage()
 
 	//Rough estimation of foreground regions
 	EstimateForegroundRegions();
+	ExtractConnectedComponents();
 	SetProgress(30);
 
 	//Background surface estimation using interpolation
@@ -121,23 +138,386 @@ void CAdaptiveBinariser::ProcessSourceImage()
 	SetProgress(90);
 
 	//Down-sample
-	if (m_Upsample)
+	if (IsThresholdImageUpsampled())
 		Downsample();
 	SetProgress(100);
 }
 
+/*
+ * Black 4-connected components of a band of rows of a bi-level image (tiled execution).
+ * Only the bounding boxes are kept (that's all that is needed for the average component size),
+ * plus the runs of the first and the last row, so that components continuing in the neighbouring
+ * bands can be merged afterwards (see GetAverageComponentSize()).
+ */
+class CBandComponents
+{
+public:
+	struct CRunInfo
+	{
+		int x1;
+		int x2;
+		int component;
+	};
+
+	/*
+	 * Extracts the components of the rows [firstRow, endRow) of S ('yOffset' is added to the y coordinates)
+	 */
+	void Extract(COpenCvRowAccess<const uchar, 1> S, int firstRow, int endRow, int yOffset)
+	{
+		int width = S.GetWidth();
+		std::vector<int> parents;
+		std::vector<cv::Rect> boxes;
+		std::vector<CRunInfo> previousRuns, currentRuns;
+
+		for (int y = firstRow; y < endRow; y++)
+		{
+			COpenCvRowSpan<const uchar, 1> row = S.GetRow(y);
+			currentRuns.clear();
+			int j = 0; //First run of the previous row that may overlap
+			int x = 0;
+			while (x < width)
+			{
+				if (row[x] != 0)
+				{
+					x++;
+					continue;
+				}
+				CRunInfo run;
+				run.x1 = x;
+				while (x < width && row[x] == 0)
+					x++;
+				run.x2 = x - 1;
+
+				//Overlapping runs of the previous row (4-connected, same as CConnCompCollection)
+				int label = -1;
+				while (j < (int)previousRuns.size() && previousRuns[j].x2 < run.x1)
+					j++;
+				for (int k = j; k < (int)previousRuns.size() && previousRuns[k].x1 <= run.x2; k++)
+				{
+					int other = Find(parents, previousRuns[k].component);
+					if (label < 0)
+						label = other;
+					else if (other != label)
+					{
+						parents[other] = label;
+						boxes[label] |= boxes[other];
+					}
+				}
+				cv::Rect runBox(run.x1, y + yOffset, run.x2 - run.x1 + 1, 1);
+				if (label < 0) //New component
+				{
+					label = (int)parents.size();
+					parents.push_back(label);
+					boxes.push_back(runBox);
+				}
+				else
+					boxes[label] |= runBox;
+				run.component = label;
+				currentRuns.push_back(run);
+			}
+			if (y == firstRow)
+				m_FirstRowRuns = currentRuns;
+			previousRuns.swap(currentRuns);
+		}
+		m_LastRowRuns = previousRuns;
+
+		//Compact (one index per component)
+		std::vector<int> indices(parents.size(), -1);
+		m_Boxes.clear();
+		for (size_t i = 0; i < parents.size(); i++)
+		{
+			if (parents[i] == (int)i)
+			{
+				indices[i] = (int)m_Boxes.size();
+				m_Boxes.push_back(boxes[i]);
+			}
+		}
+		for (size_t i = 0; i < m_FirstRowRuns.size(); i++)
+			m_FirstRowRuns[i].component = indices[Find(parents, m_FirstRowRuns[i].component)];
+		for (size_t i = 0; i < m_LastRowRuns.size(); i++)
+			m_LastRowRuns[i].component = indices[Find(parents, m_LastRowRuns[i].component)];
+	};
+
+	/*
+	 * Root of the given label (with path halving)
+	 */
+	static int Find(std::vector<int> & parents, int label)
+	{
+		while (parents[label] != label)
+		{
+			parents[label] = parents[parents[label]];
+			label = parents[label];
+		}
+		return label;
+	};
+
+public:
+	std::vector<cv::Rect>	m_Boxes;
+	std::vector<CRunInfo>	m_FirstRowRuns;
+	std::vector<CRunInfo>	m_LastRowRuns;
+};
+
+/*
+ * Merges the components of consecutive bands and calculates the average width and height
+ * (same as CConnCompCollection::GetAverageWidth() and GetAverageHeight())
+ * 'noiseFilter' - Components with a bounding box area smaller or equal to this value are skipped
+ */
+static void GetAverageComponentSize(const std::vector<CBandComponents> & bands, int noiseFilter, double & averageWidth, double & averageHeight)
+{
+	std::vector<int> offsets(bands.size() + 1, 0);
+	for (size_t i = 0; i < bands.size(); i++)
+		offsets[i + 1] = offsets[i] + (int)bands[i].m_Boxes.size();
+
+	std::vector<int> parents(offsets[bands.size()]);
+	std::vector<cv::Rect> boxes(parents.size());
+	for (size_t i = 0; i < bands.size(); i++)
+	{
+		for (size_t c = 0; c < bands[i].m_Boxes.size(); c++)
+		{
+			parents[offsets[i] + c] = offsets[i] + (int)c;
+			boxes[offsets[i] + c] = bands[i].m_Boxes[c];
+		}
+	}
+
+	//Merge components touching across band borders
+	for (size_t i = 0; i + 1 < bands.size(); i++)
+	{
+		const std::vector<CBandComponents::CRunInfo> & upper = bands[i].m_LastRowRuns;
+		const std::vector<CBandComponents::CRunInfo> & lower = bands[i + 1].m_FirstRowRuns;
+		size_t j = 0;
+		for (size_t k = 0; k < lower.size(); k++)
+		{
+			while (j < upper.size() && upper[j].x2 < lower[k].x1)
+				j++;
+			for (size_t u = j; u < upper.size() && upper[u].x1 <= lower[k].x2; u++)
+			{
+				int a = CBandComponents::Find(parents, offsets[i] + upper[u].component);
+				int b = CBandComponents::Find(parents, offsets[i + 1] + lower[k].component);
+				if (a != b)
+				{
+					parents[b] = a;
+					boxes[a] |= boxes[b];
+				}
+			}
+		}
+	}
+
+	long long totalWidth = 0;
+	long long totalHeight = 0;
+	int count = 0;
+	for (size_t i = 0; i < parents.size(); i++)
+	{
+		if (parents[i] == (int)i && (long long)boxes[i].width * boxes[i].height > noiseFilter)
+		{
+			totalWidth += boxes[i].width;
+			totalHeight += boxes[i].height;
+			count++;
+		}
+	}
+	averageWidth = count > 0 ? (double)totalWidth / (double)count : 1.0;
+	averageHeight = count > 0 ? (double)totalHeight / (double)count : 1.0;
+}
+
+/*
+ * Parallel loop body for the tiled execution (tiles of rows).
+ * Each tile is processed by a separate binariser for the tile rows plus overlap (see GetTileOverlap()),
+ * with the global statistics of the previous stages preset. Only the rows of the tile itself are used.
+ */
+class CAdaptiveBinariser::CTileKernel : public cv::ParallelLoopBody
+{
+public:
+	static const int STAGE_NOISE		= 0;	//Local variances for the noise variance of the Wiener filter
+	static const int STAGE_COMPONENTS	= 1;	//Connected components of S
+	static const int STAGE_STATISTICS	= 2;	//Sums for b and delta
+	static const int STAGE_BINARISATION	= 3;	//Final result
+
+	CTileKernel(CAdaptiveBinariser * binariser, int stage, std::vector<double> & varianceSums,
+				std::vector<CBandComponents> & components, std::vector<long long> & statistics)
+		: m_Binariser(binariser), m_Stage(stage), m_VarianceSums(varianceSums), m_Components(components), m_Statistics(statistics)
+	{
+		m_Overlap = binariser->GetTileOverlap(stage);
+		if (stage == STAGE_BINARISATION)
+			m_OutputData = binariser->m_T->GetData();
+	};
+
+	void operator()(const cv::Range & tiles) const
+	{
+		cv::Mat source = m_Binariser->m_Is->GetData(false);
+		int height = source.rows;
+		for (int tile = tiles.start; tile < tiles.end; tile++)
+		{
+			if (m_Binariser->HasStopSignal())
+				return;
+
+			int y0 = tile * m_Binariser->m_TileHeight;
+			int y1 = min(height, y0 + m_Binariser->m_TileHeight);
+			int top = max(0, y0 - m_Overlap);
+			int bottom = min(height, y1 + m_Overlap);
+
+			if (m_Stage == STAGE_NOISE) //Local variances of the Wiener filter, summed up per row
+			{
+				WienerFilterVarianceSums(source, y0, y1, &m_VarianceSums[y0], cv::Size(3, 3));
+				continue;
+			}
+
+			//Binariser for the tile with overlap (shares the pixel data of the source image)
+			CAdaptiveBinariser binariser((COpenCvImage*)NULL);
+			binariser.m_Is = (COpenCvGreyScaleImage*)COpenCvImage::Create(source.rowRange(top, bottom), COpenCvImage::TYPE_GREYSCALE, false);
+			binariser.m_Upsample = m_Binariser->m_Upsample;
+			binariser.m_DownsampleBeforePostProcessing = m_Binariser->m_DownsampleBeforePostProcessing;
+			binariser.m_NoiseVariance = m_Binariser->m_NoiseVariance;
+			binariser.m_AverageComponentWidth = m_Binariser->m_AverageComponentWidth;
+			binariser.m_AverageComponentHeight = m_Binariser->m_AverageComponentHeight;
+			binariser.m_HasThresholdStatistics = m_Binariser->m_HasThresholdStatistics;
+			binariser.m_AverageBackground = m_Binariser->m_AverageBackground;
+			binariser.m_AverageDifference = m_Binariser->m_AverageDifference;
+
+			binariser.PreprocessSourceImage();
+			binariser.EstimateForegroundRegions();
+			if (m_Stage == STAGE_COMPONENTS)
+			{
+				m_Components[tile].Extract(binariser.m_S->GetRowAccess<uchar, 1>(), y0 - top, y1 - top, top);
+				continue;
+			}
+
+			binariser.EstimateBackgroundSurface();
+			if (m_Stage == STAGE_STATISTICS)
+			{
+				binariser.CalculateBackgroundStatistics(y0 - top, y1 - top, m_Statistics[3 * tile], m_Statistics[3 * tile + 1], m_Statistics[3 * tile + 2]);
+				continue;
+			}
+
+			binariser.Thresholding();
+			binariser.PostProcess();
+			if (binariser.IsThresholdImageUpsampled())
+				binariser.Downsample();
+
+			COpenCvRowAccess<const uchar, 1> T = binariser.m_T->GetRowAccess<uchar, 1>();
+			for (int y = y0; y < y1; y++)
+				memcpy((uchar*)m_OutputData.ptr<uchar>(y), T.GetRow(y - top).GetPixels(), source.cols);
+			delete binariser.m_T;
+		}
+	}
+
+private:
+	CAdaptiveBinariser *			m_Binariser;
+	int								m_Stage;
+	int								m_Overlap;
+	std::vector<double> &			m_VarianceSums;
+	std::vector<CBandComponents> &	m_Components;
+	std::vector<long long> &		m_Statistics;
+	cv::Mat							m_OutputData;	//Pixels of the final image (stage binarisation)
+};
+
+/*
+ * Binarise source image in tiles (see SetTiling())
+ * Returns false if cancelled by a stop signal (there is no output image in that case).
+ */
+bool CAdaptiveBinariser::ProcessSourceImageTiled()
+{
+	int width = m_Is->GetWidth();
+	int height = m_Is->GetHeight();
+	int tiles = (height + m_TileHeight - 1) / m_TileHeight;
+	std::vector<double> varianceSums(height, 0.0);
+	std::vector<CBandComponents> components(tiles);
+	std::vector<long long> statistics(3 * tiles, 0);
+
+	//Noise variance for the Wiener filter (average of the local variances, rows summed up in order)
+	cv::parallel_for_(cv::Range(0, tiles), CTileKernel(this, CTileKernel::STAGE_NOISE, varianceSums, components, statistics), tiles);
+	if (HasStopSignal())
+		return false;
+	double varianceSum = 0.0;
+	for (int y = 0; y < height; y++)
+		varianceSum += varianceSums[y];
+	m_NoiseVariance = varianceSum / ((double)height * width);
+	SetProgress(20);
+
+	//Average component size of S
+	cv::parallel_for_(cv::Range(0, tiles), CTileKernel(this, CTileKernel::STAGE_COMPONENTS, varianceSums, components, statistics), tiles);
+	if (HasStopSignal())
+		return false;
+	double averageWidth, averageHeight;
+	GetAverageComponentSize(components, 3, averageWidth, averageHeight);
+	components.clear();
+	m_AverageComponentWidth = max(10, (int)averageHeight); //Same as ExtractConnectedComponents()
+	m_AverageComponentHeight = max(10, (int)averageWidth);
+	SetProgress(40);
+
+	//b and delta
+	cv::parallel_for_(cv::Range(0, tiles), CTileKernel(this, CTileKernel::STAGE_STATISTICS, varianceSums, components, statistics), tiles);
+	if (HasStopSignal())
+		return false;
+	long long blackCount = 0, backgroundSum = 0, differenceSum = 0;
+	for (int i = 0; i < tiles; i++)
+	{
+		blackCount += statistics[3 * i];
+		backgroundSum += statistics[3 * i + 1];
+		differenceSum += statistics[3 * i + 2];
+	}
+	SetThresholdStatistics(blackCount, backgroundSum, differenceSum);
+	SetProgress(60);
+
+	//Thresholding and post-processing
+	m_T = COpenCvImage::CreateB(width, height, RGBWHITE);
+	cv::parallel_for_(cv::Range(0, tiles), CTileKernel(this, CTileKernel::STAGE_BINARISATION, varianceSums, components, statistics), tiles);
+	if (HasStopSignal()) //Some tiles have been skipped
+	{
+		delete m_T;
+		m_T = NULL;
+		return false;
+	}
+	SetProgress(100);
+	return true;
+}
+
+/*
+ * Rows of overlap needed above and below a tile, so that the tile rows are the same as for the full image
+ * (sum of the neighbourhood sizes of all steps up to the given stage of CTileKernel, plus a small margin)
+ */
+int CAdaptiveBinariser::GetTileOverlap(int stage)
+{
+	if (stage == CTileKernel::STAGE_NOISE)
+		return 0; //WienerFilterVarianceSums() works on the whole source image
+
+	int overlap = 1 + SAUVOLA_WINDOW / 2 + 1; //Wiener filter and Sauvola
+	if (stage == CTileKernel::STAGE_COMPONENTS)
+		return overlap;
+
+	overlap += m_AverageComponentHeight + 1; //Background surface
+	if (stage == CTileKernel::STAGE_STATISTICS)
+		return overlap;
+
+	//Post-processing (same window sizes as in PostProcess())
+	int n = (int)(0.15 * (double)(2 * m_AverageComponentHeight));
+	int n2 = n / 2;
+	int dy = (int)(0.25 * n);
+	int postProcessingRows = 2 * n2 + max(n2, dy) + 1;
+
+	if (IsThresholdImageUpsampled()) //Cubic upsampling, post-processing at twice the size, cubic downsampling
+		return overlap + 2 + (postProcessingRows + 1) / 2 + 2;
+	if (m_Upsample) //Cubic upsampling and downsampling
+		return overlap + 4 + postProcessingRows;
+	return overlap + postProcessingRows;
+}
+
 /*
  * Preprocess greyscale source image using Weiner filter
  */
 void CAdaptiveBinariser::PreprocessSourceImage()
 {
-	cv::Mat1b dst33;
+	cv::Mat dst33;
 	//m_I = COpenCvImage::CreateG(m_Is->GetWidth(), m_Is->GetHeight(), RGBWHITE);
 
-	double estimatedNoiseVariance;
-
 	// Call to WienerFilter function with a 3x3 kernel and estimated noise variances
-	estimatedNoiseVariance = WienerFilter(m_Is->GetData(), dst33, cv::Size(3, 3));
+	// (the noise variance is given for tiles)
+	if (m_NoiseVariance < 0.0)
+		m_NoiseVariance = WienerFilter(m_Is->GetData(false), dst33, cv::Size(3, 3));
+	else
+		WienerFilter(m_Is->GetData(false), dst33, m_NoiseVariance, cv::Size(3, 3));
+
+	//All intermediate images are 8 bit (16 bit values are divided by 256)
+	if (dst33.depth() != CV_8U)
+		dst33.convertTo(dst33, CV_8U, 1.0 / 256.0);
 
 	m_I = (COpenCvGreyScaleImage*)COpenCvImage::Create(dst33, COpenCvImage::TYPE_GREYSCALE, false);
 
@@ -150,9 +530,7 @@ void CAdaptiveBinariser::PreprocessSourceImage()
  */
 void CAdaptiveBinariser::EstimateForegroundRegions()
 {
-	m_S = CImageTransformer::SauvolaBinarization(m_I, 0.2, 40);
-
-	ExtractConnectedComponents();
+	m_S = CImageTransformer::SauvolaBinarization(m_I, SAUVOLA_K, SAUVOLA_WINDOW);
 
 	if (m_Debug)
 		SaveImage(m_S, L"c:\\temp\\adaptiveBinariser\\S.tif");
@@ -175,8 +553,73 @@ void CAdaptiveBinariser::ExtractConnectedComponents()
 	m_AverageComponentHeight = max(10, (int)m_ConnComps->GetAverageWidth(3)); //m_CompHeightHistogram->GetMaxIndex());
 }
 
+/*
+ * Parallel loop body for the background surface estimation (bands of rows).
+ * Foreground pixels get the average grey level of the background pixels within their neighbourhood
+ * (pixels outside the image count as background with grey level 255).
+ * The window sums are taken from masked integral images, so each pixel is O(1).
+ */
+class CBackgroundSurfaceKernel : public cv::ParallelLoopBody
+{
+public:
+	CBackgroundSurfaceKernel(COpenCvRowAccess<const uchar, 1> S, COpenCvRowAccess<uchar, 1> B,
+							 const std::vector<uint32_t> & sums, const std::vector<uint32_t> & counts, int dx, int dy)
+		: m_S(S), m_B(B), m_Sums(sums), m_Counts(counts), m_Dx(dx), m_Dy(dy) {};
+
+	void operator()(const cv::Range & rows) const
+	{
+		int width = m_S.GetWidth();
+		int height = m_S.GetHeight();
+		size_t stride = width + 1;
+		long long windowArea = (long long)(2 * m_Dx + 1) * (2 * m_Dy + 1);
+
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			COpenCvRowSpan<const uchar, 1> rowS = m_S.GetRow(y);
+			COpenCvRowSpan<uchar, 1> rowB = m_B.GetRow(y);
+
+			int top = max(0, y - m_Dy);
+			int bottom = min(height - 1, y + m_Dy);
+			const uint32_t * sumsAbove = &m_Sums[top * stride];
+			const uint32_t * sumsBelow = &m_Sums[(bottom + 1) * stride];
+			const uint32_t * countsAbove = &m_Counts[top * stride];
+			const uint32_t * countsBelow = &m_Counts[(bottom + 1) * stride];
+
+			for (int x = 0; x < width; x++)
+			{
+				//Foreground pixel?
+				if (rowS[x] != 0)
+					continue;
+
+				//Interpolate (the window sums are exact modulo 2^32)
+				int left = max(0, x - m_Dx);
+				int right = min(width - 1, x + m_Dx);
+				uint32_t sum = sumsBelow[right + 1] - sumsBelow[left] - sumsAbove[right + 1] + sumsAbove[left];
+				uint32_t count = countsBelow[right + 1] - countsBelow[left] - countsAbove[right + 1] + countsAbove[left];
+				long long outside = windowArea - (long long)(right - left + 1) * (bottom - top + 1);
+
+				long long sum1 = sum + 255 * outside;
+				long long sum2 = count + outside;
+				if (sum2 > 0)
+					rowB[x] = (uchar)(int)((double)sum1 / (double)sum2);
+				else
+					rowB[x] = 255;
+			}
+		}
+	}
+
+private:
+	COpenCvRowAccess<const uchar, 1>	m_S;
+	COpenCvRowAccess<uchar, 1>			m_B;
+	const std::vector<uint32_t> &		m_Sums;
+	const std::vector<uint32_t> &		m_Counts;
+	int									m_Dx;
+	int									m_Dy;
+};
+
 /*
  * Background surface estimation using interpolation
+ * (each foreground pixel of S gets the average of the background pixels of I in its neighbourhood)
  */
 void CAdaptiveBinariser::EstimateBackgroundSurface()
 {
@@ -184,38 +627,43 @@ void CAdaptiveBinariser::EstimateBackgroundSurface()
 
 	int dx = m_AverageComponentHeight;
 	int dy = m_AverageComponentHeight;
-	
-	for (int y = 0; y < m_I->GetHeight(); y++)
+
+	//All intermediate images are 8 bit single channel (see PreprocessSourceImage())
+	COpenCvRowAccess<const uchar, 1> I = m_I->GetRowAccess<uchar, 1>();
+	COpenCvRowAccess<const uchar, 1> S = m_S->GetRowAccess<uchar, 1>();
+	int width = m_I->GetWidth();
+	int height = m_I->GetHeight();
+
+	//Masked integral images: sum of the background grey levels and number of background pixels
+	//((height+1) x (width+1), first row and column are 0)
+	size_t stride = width + 1;
+	std::vector<uint32_t> sums(stride * (height + 1), 0);
+	std::vector<uint32_t> counts(stride * (height + 1), 0);
+	for (int y = 0; y < height; y++)
 	{
-		for (int x = 0; x < m_I->GetWidth(); x++)
+		COpenCvRowSpan<const uchar, 1> rowI = I.GetRow(y);
+		COpenCvRowSpan<const uchar, 1> rowS = S.GetRow(y);
+		const uint32_t * sumsAbove = &sums[y * stride];
+		const uint32_t * countsAbove = &counts[y * stride];
+		uint32_t * curSums = &sums[(y + 1) * stride];
+		uint32_t * curCounts = &counts[(y + 1) * stride];
+		uint32_t rowSum = 0;
+		uint32_t rowCount = 0;
+		for (int x = 0; x < width; x++)
 		{
-			//Foreground pixel?
-			if (m_S->IsBlack(x, y))
+			if (rowS[x] != 0) //White
 			{
-				//Interpolate
-				int sum1 = 0;
-				int sum2 = 0;
-				//int val = 0;
-				for (int iy = y - dy; iy <= y + dy; iy++)
-				{
-					for (int ix = x - dx; ix <= x + dx; ix++)
-					{
-						//val = m_S->IsBlack(ix, iy, false) ? 0 : 1;
-						if (m_S->IsWhite(ix, iy, true))
-						{
-							sum1 += m_I->GetGreyLevel(ix, iy, 255);
-							sum2++;
-						}
-					}
-				}
-				if (sum2 > 0)
-					m_B->SetGreyLevel(x, y, (int)((double)sum1 / (double)sum2));
-				else
-					m_B->SetGreyLevel(x, y, 255);
+				rowSum += rowI[x];
+				rowCount++;
 			}
+			curSums[x + 1] = sumsAbove[x + 1] + rowSum;
+			curCounts[x + 1] = countsAbove[x + 1] + rowCount;
 		}
 	}
 
+	cv::parallel_for_(cv::Range(0, height), CBackgroundSurfaceKernel(S, m_B->GetWritableRowAccess<uchar, 1>(), sums, counts, dx, dy),
+					  GetRowBandCount(width, height));
+
 	if (m_Debug)
 		SaveImage(m_B, L"c:\\temp\\adaptiveBinariser\\B.tif");
 
@@ -232,94 +680,136 @@ void CAdaptiveBinariser::EstimateBackgroundSurface()
 }
 
 /*
- * Final thresholding
+ * Parallel loop body for the thresholding with virtual upsampling (bands of rows of I).
+ * Each band of I (plus a halo) is upsampled to twice the size with cubic interpolation and compared
+ * against the threshold for the background surface B. The result is either kept at twice the size
+ * or scaled back down to the size of I (same as Downsample()), so the upsampled image I is never
+ * allocated as a whole.
+ * resize() treats the tile borders as image borders, but the halo covers the interpolation kernels
+ * of all rows that are kept, so the result is the same as for a full-size resize.
  */
-void CAdaptiveBinariser::Thresholding()
+class CUpsampledThresholdKernel : public cv::ParallelLoopBody
 {
-	double d = 0.0;
-	double q = 0.6;
-	double p1 = 0.5;
-	double p2 = 0.8;
-	double delta = 0.0;
-	double b = 0.0; //Average background value 
+public:
+	static const int BAND_HEIGHT	= 64;	//Rows of I per band
+	static const int HALO			= 8;	//Additional rows of I above and below each band
 
-	//Calculate b
-	int count = 0;
-	int sum = 0;
-	for (int y = 0; y < m_B->GetHeight(); y++)
+	CUpsampledThresholdKernel(const cv::Mat & I, COpenCvRowAccess<const uchar, 1> B, const double * dLookup,
+							  COpenCvRowAccess<uchar, 1> T, bool downsample)
+		: m_I(I), m_B(B), m_DLookup(dLookup), m_T(T), m_Downsample(downsample) {};
+
+	void operator()(const cv::Range & bands) const
 	{
-		for (int x = 0; x < m_B->GetWidth(); x++)
+		int width = m_I.cols;
+		int height = m_I.rows;
+		cv::Mat tileIu, tileT, tileTd;
+		for (int band = bands.start; band < bands.end; band++)
 		{
-			if (m_S->IsBlack(x, y))
+			int y0 = band * BAND_HEIGHT;
+			int y1 = min(height, y0 + BAND_HEIGHT);
+			int top = max(0, y0 - HALO);
+			int bottom = min(height, y1 + HALO);
+
+			//Upsample
+			cv::resize(m_I.rowRange(top, bottom), tileIu, cv::Size(width * 2, (bottom - top) * 2), 0.0, 0.0, cv::INTER_CUBIC);
+
+			//Threshold
+			tileT.create(tileIu.rows, tileIu.cols, CV_8UC1);
+			for (int yu = 0; yu < tileIu.rows; yu++)
 			{
-				count++;
-				sum += m_B->GetGreyLevel(x, y);
+				COpenCvRowSpan<const uchar, 1> rowB = m_B.GetRow(top + yu / 2);
+				const uchar * rowIu = tileIu.ptr<uchar>(yu);
+				uchar * rowT = tileT.ptr<uchar>(yu);
+				for (int xu = 0; xu < tileIu.cols; xu++)
+				{
+					int bg = rowB[xu / 2];
+					rowT[xu] = bg - rowIu[xu] > m_DLookup[bg] ? 0 : 255;
+				}
 			}
-			//if (m_S->IsWhite(x, y))
-			//{
-			//	count++;
-			//	sum += m_B->GetGreyLevel(x, y);
-			//}
-		}
-	}
-	if (count > 0)
-		b = (double)sum / (double)count;
 
-	//Calculate delta
-	int sum1 = 0;
-	int sum2 = 0;
-	for (int y = 0; y < m_B->GetHeight(); y++)
-	{
-		for (int x = 0; x < m_B->GetWidth(); x++)
-		{
-			sum1 += m_B->GetGreyLevel(x, y) - m_I->GetGreyLevel(x, y);
-			if (m_S->IsBlack(x, y))
-				sum2 += 1;
+			if (!m_Downsample) //Keep at twice the size
+			{
+				for (int yu = 2 * y0; yu < 2 * y1; yu++)
+					memcpy(m_T.GetRow(yu).GetPixels(), tileT.ptr<uchar>(yu - 2 * top), tileT.cols);
+			}
+			else //Scale back down and binarise (see Downsample())
+			{
+				cv::resize(tileT, tileTd, cv::Size(width, bottom - top), 0.0, 0.0, cv::INTER_CUBIC);
+				for (int y = y0; y < y1; y++)
+				{
+					const uchar * src = tileTd.ptr<uchar>(y - top);
+					COpenCvRowSpan<uchar, 1> rowT = m_T.GetRow(y);
+					for (int x = 0; x < width; x++)
+						rowT[x] = src[x] < 127 ? 0 : 255; //Same as COpenCvImageOps::MiddleThreshold()
+				}
+			}
 		}
 	}
-	delta = (double)sum1 / (double)sum2;
 
-	//Threshold
-	if (m_Upsample)
-	{
-		int newWidth = m_I->GetWidth() * 2;
-		int newHeight = m_I->GetHeight() * 2;
-		cv::Mat resizedData(newHeight, newWidth, m_I->GetData().type());
+private:
+	const cv::Mat &						m_I;
+	COpenCvRowAccess<const uchar, 1>	m_B;
+	const double *						m_DLookup;
+	COpenCvRowAccess<uchar, 1>			m_T;
+	bool								m_Downsample;
+};
 
-		int method = cv::INTER_CUBIC;
+/*
+ * Final thresholding
+ * (if upsampling is enabled, at twice the resolution of I without creating the upsampled image I)
+ */
+void CAdaptiveBinariser::Thresholding()
+{
+	double q = 0.6;
+	double p1 = 0.5;
+	double p2 = 0.8;
 
-		cv::resize(m_I->GetData(), resizedData, cv::Size(newWidth, newHeight), 0.0, 0.0, method);
+	//All intermediate images are 8 bit single channel (see PreprocessSourceImage())
+	COpenCvRowAccess<const uchar, 1> B = m_B->GetRowAccess<uchar, 1>();
+	COpenCvRowAccess<const uchar, 1> I = m_I->GetRowAccess<uchar, 1>();
+	int width = m_B->GetWidth();
+	int height = m_B->GetHeight();
 
-		m_Iu = (COpenCvGreyScaleImage*)COpenCvImage::Create(resizedData, COpenCvImage::TYPE_GREYSCALE, false);
+	//b and delta (single pass, given for tiles)
+	if (!m_HasThresholdStatistics)
+	{
+		long long blackCount, backgroundSum, differenceSum;
+		CalculateBackgroundStatistics(0, height, blackCount, backgroundSum, differenceSum);
+		SetThresholdStatistics(blackCount, backgroundSum, differenceSum);
+	}
+	double b = m_AverageBackground; //Average background value
+	double delta = m_AverageDifference;
 
-		m_T = COpenCvImage::CreateB(m_Iu->GetWidth(), m_Iu->GetHeight(), RGBWHITE);
+	//The threshold d only depends on the background value -> lookup table
+	double dLookup[256];
+	for (int bg = 0; bg < 256; bg++)
+		dLookup[bg] = q * delta * ((1.0 - p2) / (1.0 + exp((-4.0*bg / (b * (1.0 - p1))) + 2.0*(1.0 + p1) / (1.0 - p1))) + p2);
 
-		int x = 0, y = 0;
-		for (int yu = 0; yu < m_T->GetHeight(); yu++)
-		{
-			y = yu / 2;
-			for (int xu = 0; xu < m_T->GetWidth(); xu++)
-			{
-				x = xu / 2;
-				d = q * delta * ((1.0 - p2) / (1.0 + exp((-4.0*m_B->GetGreyLevel(x, y) / (b * (1.0 - p1))) + 2.0*(1.0 + p1) / (1.0 - p1))) + p2);
+	//Threshold
+	if (m_Upsample) //Upsampled on the fly, band by band
+	{
+		bool downsample = !IsThresholdImageUpsampled();
+		m_T = downsample ? COpenCvImage::CreateB(width, height, RGBWHITE) : COpenCvImage::CreateB(width * 2, height * 2, RGBWHITE);
 
-				if (m_B->GetGreyLevel(x, y) - m_Iu->GetGreyLevel(xu, yu) > d)
-					m_T->SetBlack(xu, yu);
-			}
-		}
+		cv::Mat dataI = m_I->GetData(false);
+		int bands = (height + CUpsampledThresholdKernel::BAND_HEIGHT - 1) / CUpsampledThresholdKernel::BAND_HEIGHT;
+		cv::parallel_for_(cv::Range(0, bands), CUpsampledThresholdKernel(dataI, B, dLookup, m_T->GetWritableRowAccess<uchar, 1>(), downsample));
 	}
 	else //Don't upsample
 	{
 		m_T = COpenCvImage::CreateB(m_I->GetWidth(), m_I->GetHeight(), RGBWHITE);
 
+		COpenCvRowAccess<uchar, 1> T = m_T->GetWritableRowAccess<uchar, 1>();
 		for (int y = 0; y < m_T->GetHeight(); y++)
 		{
+			COpenCvRowSpan<const uchar, 1> rowB = B.GetRow(y);
+			COpenCvRowSpan<const uchar, 1> rowI = I.GetRow(y);
+			COpenCvRowSpan<uchar, 1> rowT = T.GetRow(y);
 			for (int x = 0; x < m_T->GetWidth(); x++)
 			{
-				d = q * delta * ((1.0 - p2) / (1.0 + exp((-4.0*m_B->GetGreyLevel(x, y) / (b * (1.0 - p1))) + 2.0*(1.0 + p1) / (1.0 - p1))) + p2);
-
-				if (m_B->GetGreyLevel(x, y) - m_I->GetGreyLevel(x, y) > d)
-					m_T->SetBlack(x, y);
+				int bg = rowB[x];
+				if (bg - rowI[x] > dLookup[bg])
+					rowT[x] = 0; //Black
 			}
 		}
 	}
@@ -329,79 +819,235 @@ void CAdaptiveBinariser::Thresholding()
 }
 
 /*
- * Post-processing using growing and shrinking
+ * Sums for b and delta over the rows [firstRow, endRow)
+ * 'blackCount' - Number of foreground pixels of S
+ * 'backgroundSum' - Sum of B under the foreground pixels of S
+ * 'differenceSum' - Sum of B-I over all pixels
  */
-void CAdaptiveBinariser::PostProcess()
+void CAdaptiveBinariser::CalculateBackgroundStatistics(int firstRow, int endRow, long long & blackCount, long long & backgroundSum,
+													   long long & differenceSum)
 {
-	int lh = 2 * m_AverageComponentHeight;
-	int n = (int)(0.15 * (double)lh);
-	int n2 = n / 2;
-	int ksh = (int)(0.9 * (double)(n * n));
-	int psh = 0;
-
-	//Shrink
-	COpenCvBiLevelImage * temp = (COpenCvBiLevelImage*)m_T->Clone();
-	for (int y = 0; y < m_T->GetHeight(); y++)
+	COpenCvRowAccess<const uchar, 1> B = m_B->GetRowAccess<uchar, 1>();
+	COpenCvRowAccess<const uchar, 1> I = m_I->GetRowAccess<uchar, 1>();
+	COpenCvRowAccess<const uchar, 1> S = m_S->GetRowAccess<uchar, 1>();
+	int width = m_B->GetWidth();
+
+	blackCount = 0;
+	backgroundSum = 0;
+	differenceSum = 0;
+	for (int y = firstRow; y < endRow; y++)
 	{
-		for (int x = 0; x < m_T->GetWidth(); x++)
+		COpenCvRowSpan<const uchar, 1> rowB = B.GetRow(y);
+		COpenCvRowSpan<const uchar, 1> rowI = I.GetRow(y);
+		COpenCvRowSpan<const uchar, 1> rowS = S.GetRow(y);
+		int count = 0;
+		int sum = 0;
+		int sum1 = 0;
+		for (int x = 0; x < width; x++)
 		{
-			if (m_T->IsBlack(x, y))
+			if (rowS[x] == 0) //Black
 			{
-				psh = m_T->CountPixels(false, x - n2, y - n2, x + n2, y + n2, false);
-				if (psh > ksh)
-					temp->SetWhite(x, y);
+				count++;
+				sum += rowB[x];
 			}
+			sum1 += rowB[x] - rowI[x];
 		}
+		blackCount += count;
+		backgroundSum += sum;
+		differenceSum += sum1;
 	}
-	if (m_Debug)
-		SaveImage(temp, L"c:\\temp\\adaptiveBinariser\\T2.tif");
-	delete m_T;
-	m_T = temp;
+}
 
-	//Grow
-	int ksw = (int)(0.05 * (double)(n * n));
-	int psw = 0;
-	int dx = (int)(0.25 * n);
-	int dy = dx;
-	temp = (COpenCvBiLevelImage*)m_T->Clone();
-	for (int y = 0; y < m_T->GetHeight(); y++)
+/*
+ * Sets b and delta from the sums of CalculateBackgroundStatistics()
+ */
+void CAdaptiveBinariser::SetThresholdStatistics(long long blackCount, long long backgroundSum, long long differenceSum)
+{
+	m_AverageBackground = 0.0;
+	if (blackCount > 0)
+		m_AverageBackground = (double)backgroundSum / (double)blackCount;
+	m_AverageDifference = (double)differenceSum / (double)blackCount;
+	m_HasThresholdStatistics = true;
+}
+
+/*
+ * Running black pixel counts per column of a bi-level image over the rows [y-r, y+r] (clipped to the image).
+ * Updated row by row when moving down (one object per thread and band of rows).
+ */
+class CRunningColumnCounts
+{
+public:
+	CRunningColumnCounts(COpenCvRowAccess<const uchar, 1> image, int r)
+		: m_Image(image), m_R(r), m_Counts(image.GetWidth(), 0), m_Prefix(image.GetWidth() + 1, 0)
+	{
+		m_FirstRow = -1;
+		m_NextRow = -1;
+		m_WindowHeight = 0;
+	};
+
+	/*
+	 * Moves the window to row 'y' (rows have to be visited in ascending order without gaps)
+	 */
+	void MoveTo(int y)
 	{
-		for (int x = 0; x < m_T->GetWidth(); x++)
+		int width = m_Image.GetWidth();
+		int top = max(0, y - m_R);
+		int bottom = min(m_Image.GetHeight() - 1, y + m_R);
+		if (m_FirstRow < 0)
+			m_FirstRow = m_NextRow = top;
+
+		for (; m_FirstRow < top; m_FirstRow++)
 		{
-			if (m_T->IsWhite(x, y))
-			{
-				psw = m_T->CountPixels(false, x - n2, y - n2, x + n2, y + n2, true);
+			COpenCvRowSpan<const uchar, 1> row = m_Image.GetRow(m_FirstRow);
+			for (int x = 0; x < width; x++)
+				if (row[x] == 0)
+					m_Counts[x]--;
+		}
+		for (; m_NextRow <= bottom; m_NextRow++)
+		{
+			COpenCvRowSpan<const uchar, 1> row = m_Image.GetRow(m_NextRow);
+			for (int x = 0; x < width; x++)
+				if (row[x] == 0)
+					m_Counts[x]++;
+		}
+		for (int x = 0; x < width; x++)
+			m_Prefix[x + 1] = m_Prefix[x] + m_Counts[x];
+		m_WindowHeight = bottom - top + 1;
+	};
+
+	/*
+	 * Number of black pixels in the columns [x-r, x+r] (clipped) of the current window
+	 */
+	inline int CountBlack(int x) const
+	{
+		return m_Prefix[min(m_Image.GetWidth(), x + m_R + 1)] - m_Prefix[max(0, x - m_R)];
+	};
 
-				int sumx = 0;
-				int sumy = 0;
-				if (m_Upsample)
+	/*
+	 * Number of pixels of the current window around column x (clipped)
+	 */
+	inline int GetArea(int x) const
+	{
+		return (min(m_Image.GetWidth() - 1, x + m_R) - max(0, x - m_R) + 1) * m_WindowHeight;
+	};
+
+private:
+	COpenCvRowAccess<const uchar, 1>	m_Image;
+	int									m_R;
+	std::vector<int>					m_Counts;
+	std::vector<int>					m_Prefix;
+	int									m_FirstRow;
+	int									m_NextRow;
+	int									m_WindowHeight;
+};
+
+/*
+ * Parallel loop body for the shrink step and the second grow step of the post-processing (bands of rows).
+ * Shrink: Black pixels with more than 'limit' white pixels in their neighbourhood become white.
+ * Grow: White pixels with more than 'limit' black pixels in their neighbourhood become black.
+ * (Only pixels within the image are counted.)
+ */
+class CShrinkGrowKernel : public cv::ParallelLoopBody
+{
+public:
+	CShrinkGrowKernel(COpenCvRowAccess<const uchar, 1> T, COpenCvRowAccess<uchar, 1> dest, int n2, int limit, bool shrink)
+		: m_T(T), m_Dest(dest), m_N2(n2), m_Limit(limit), m_Shrink(shrink) {};
+
+	void operator()(const cv::Range & rows) const
+	{
+		int width = m_T.GetWidth();
+		CRunningColumnCounts counts(m_T, m_N2);
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			counts.MoveTo(y);
+			COpenCvRowSpan<const uchar, 1> rowT = m_T.GetRow(y);
+			COpenCvRowSpan<uchar, 1> rowDest = m_Dest.GetRow(y);
+			for (int x = 0; x < width; x++)
+			{
+				if (m_Shrink && rowT[x] == 0)
 				{
-					for (int iy = y - dy; iy <= y + dy; iy++)
-					{
-						for (int ix = x - dx; ix <= x + dx; ix++)
-						{
-							if (m_S->IsBlack(ix/2, iy/2, true))
-							{
-								sumx += ix;
-								sumy += iy;
-							}
-						}
-					}
+					if (counts.GetArea(x) - counts.CountBlack(x) > m_Limit)
+						rowDest[x] = 255;
 				}
-				else //Not upsampled
+				else if (!m_Shrink && rowT[x] != 0)
 				{
-					for (int iy = y - dy; iy <= y + dy; iy++)
-					{
-						for (int ix = x - dx; ix <= x + dx; ix++)
-						{
-							if (m_S->IsBlack(ix, iy, true))
-							{
-								sumx += ix;
-								sumy += iy;
-							}
-						}
-					}
+					if (counts.CountBlack(x) > m_Limit)
+						rowDest[x] = 0;
 				}
+			}
+		}
+	}
+
+private:
+	COpenCvRowAccess<const uchar, 1>	m_T;
+	COpenCvRowAccess<uchar, 1>			m_Dest;
+	int									m_N2;
+	int									m_Limit;
+	bool								m_Shrink;
+};
+
+/*
+ * Parallel loop body for the first grow step of the post-processing (bands of rows).
+ * White pixels of T become black if there are more than 'limit' black pixels in their neighbourhood in T
+ * and the centre of the black pixels of S in the (2dx+1) x (2dy+1) neighbourhood is close enough.
+ * Pixels of S outside the image count as black. If T is upsampled, pixel (x, y) of T maps to (x/2, y/2) of S.
+ *
+ * The counts and coordinate sums for S are kept as running column sums over the window rows
+ * (columns -dx to width+dx-1), so each pixel is O(1).
+ */
+class CGrowKernel : public cv::ParallelLoopBody
+{
+public:
+	CGrowKernel(COpenCvRowAccess<const uchar, 1> T, COpenCvRowAccess<const uchar, 1> S, COpenCvRowAccess<uchar, 1> dest,
+				int n2, int limit, int dx, int dy, bool upsampled)
+		: m_T(T), m_S(S), m_Dest(dest), m_N2(n2), m_Limit(limit), m_Dx(dx), m_Dy(dy), m_Upsampled(upsampled) {};
+
+	void operator()(const cv::Range & rows) const
+	{
+		int width = m_T.GetWidth();
+		int extWidth = width + 2 * m_Dx;
+		CRunningColumnCounts counts(m_T, m_N2);
+
+		//Black pixels of S per column (index ix+dx) and the sum of their y coordinates
+		std::vector<long long> colCounts(extWidth, 0), colSumsY(extWidth, 0);
+		std::vector<long long> prefixCounts(extWidth + 1, 0), prefixSumsX(extWidth + 1, 0), prefixSumsY(extWidth + 1, 0);
+		std::vector<uchar> black(extWidth);
+
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			counts.MoveTo(y);
+
+			//Update the column sums of S
+			if (y == rows.start)
+			{
+				for (int iy = y - m_Dy; iy <= y + m_Dy; iy++)
+					AddRow(iy, 1, black, colCounts, colSumsY);
+			}
+			else
+			{
+				AddRow(y - m_Dy - 1, -1, black, colCounts, colSumsY);
+				AddRow(y + m_Dy, 1, black, colCounts, colSumsY);
+			}
+			for (int i = 0; i < extWidth; i++)
+			{
+				prefixCounts[i + 1] = prefixCounts[i] + colCounts[i];
+				prefixSumsX[i + 1] = prefixSumsX[i] + (i - m_Dx) * colCounts[i];
+				prefixSumsY[i + 1] = prefixSumsY[i] + colSumsY[i];
+			}
+
+			COpenCvRowSpan<const uchar, 1> rowT = m_T.GetRow(y);
+			COpenCvRowSpan<uchar, 1> rowDest = m_Dest.GetRow(y);
+			for (int x = 0; x < width; x++)
+			{
+				if (rowT[x] == 0)
+					continue;
+
+				int psw = counts.CountBlack(x);
+
+				//Window [x-dx, x+dx] -> indices [x, x+2dx]
+				long long sumx = prefixSumsX[x + 2 * m_Dx + 1] - prefixSumsX[x];
+				long long sumy = prefixSumsY[x + 2 * m_Dx + 1] - prefixSumsY[x];
+
 				int xa = x;
 				if (psw > 0)
 					xa = (int)((double)sumx / (double)psw);
@@ -409,11 +1055,84 @@ void CAdaptiveBinariser::PostProcess()
 				if (psw > 0)
 					ya = (int)((double)sumy / (double)psw);
 
-				if (psw > ksw && abs(x - xa) < dx && abs(y - ya) < dy)
-					temp->SetBlack(x, y);
+				if (psw > m_Limit && abs(x - xa) < m_Dx && abs(y - ya) < m_Dy)
+					rowDest[x] = 0;
 			}
 		}
 	}
+
+private:
+	/*
+	 * Adds (sign 1) or removes (sign -1) row 'iy' (may be outside the image) to/from the column sums of S
+	 */
+	void AddRow(int iy, int sign, std::vector<uchar> & black, std::vector<long long> & colCounts, std::vector<long long> & colSumsY) const
+	{
+		int extWidth = (int)black.size();
+		int sy = m_Upsampled ? iy / 2 : iy; //Truncated like the coordinates of the original implementation
+		if (sy < 0 || sy >= m_S.GetHeight())
+			memset(&black[0], 1, extWidth);
+		else
+		{
+			COpenCvRowSpan<const uchar, 1> rowS = m_S.GetRow(sy);
+			for (int i = 0; i < extWidth; i++)
+			{
+				int ix = i - m_Dx;
+				int sx = m_Upsampled ? ix / 2 : ix;
+				black[i] = (sx < 0 || sx >= m_S.GetWidth() || rowS[sx] == 0) ? 1 : 0;
+			}
+		}
+		for (int i = 0; i < extWidth; i++)
+		{
+			if (black[i])
+			{
+				colCounts[i] += sign;
+				colSumsY[i] += sign * iy;
+			}
+		}
+	}
+
+private:
+	COpenCvRowAccess<const uchar, 1>	m_T;
+	COpenCvRowAccess<const uchar, 1>	m_S;
+	COpenCvRowAccess<uchar, 1>			m_Dest;
+	int									m_N2;
+	int									m_Limit;
+	int									m_Dx;
+	int									m_Dy;
+	bool								m_Upsampled;
+};
+
+/*
+ * Post-processing using growing and shrinking
+ * (all window counts and sums are running sums, so each pixel is O(1); the steps run in parallel by row bands)
+ */
+void CAdaptiveBinariser::PostProcess()
+{
+	int lh = 2 * m_AverageComponentHeight;
+	int n = (int)(0.15 * (double)lh);
+	int n2 = n / 2;
+	int ksh = (int)(0.9 * (double)(n * n));
+	int height = m_T->GetHeight();
+
+	//Bands of rows (each band has to fill its window first, so the bands should not be too small)
+	int ksw = (int)(0.05 * (double)(n * n));
+	int dx = (int)(0.25 * n);
+	int dy = dx;
+	double bands = max(1, min(cv::getNumThreads(), height / (4 * (2 * max(n2, dy) + 1))));
+
+	//Shrink
+	COpenCvBiLevelImage * temp = (COpenCvBiLevelImage*)m_T->Clone();
+	cv::parallel_for_(cv::Range(0, height), CShrinkGrowKernel(m_T->GetRowAccess<uchar, 1>(), temp->GetWritableRowAccess<uchar, 1>(),
+															  n2, ksh, true), bands);
+	if (m_Debug)
+		SaveImage(temp, L"c:\\temp\\adaptiveBinariser\\T2.tif");
+	delete m_T;
+	m_T = temp;
+
+	//Grow
+	temp = (COpenCvBiLevelImage*)m_T->Clone();
+	cv::parallel_for_(cv::Range(0, height), CGrowKernel(m_T->GetRowAccess<uchar, 1>(), m_S->GetRowAccess<uchar, 1>(),
+														temp->GetWritableRowAccess<uchar, 1>(), n2, ksw, dx, dy, IsThresholdImageUpsampled()), bands);
 	if (m_Debug)
 		SaveImage(temp, L"c:\\temp\\adaptiveBinariser\\T3.tif");
 	delete m_T;
@@ -422,19 +1141,8 @@ void CAdaptiveBinariser::PostProcess()
 	//Grow 2
 	int ksw2 = (int)(0.35 * (double)(n * n));
 	temp = (COpenCvBiLevelImage*)m_T->Clone();
-	for (int y = 0; y < m_T->GetHeight(); y++)
-	{
-		for (int x = 0; x < m_T->GetWidth(); x++)
-		{
-			if (m_T->IsWhite(x, y))
-			{
-				psw = m_T->CountPixels(false, x - n2, y - n2, x + n2, y + n2, true);
-
-				if (psw > ksw2)
-					temp->SetBlack(x, y);
-			}
-		}
-	}
+	cv::parallel_for_(cv::Range(0, height), CShrinkGrowKernel(m_T->GetRowAccess<uchar, 1>(), temp->GetWritableRowAccess<uchar, 1>(),
+															  n2, ksw2, false), bands);
 	if (m_Debug)
 		SaveImage(temp, L"c:\\temp\\adaptiveBinariser\\T4.tif");
 	delete m_T;
@@ -448,11 +1156,11 @@ void CAdaptiveBinariser::Downsample()
 {
 	int newWidth = m_I->GetWidth();
 	int newHeight = m_I->GetHeight();
-	cv::Mat resizedData(newHeight, newWidth, m_T->GetData().type());
+	cv::Mat resizedData = COpenCvImage::AllocateMatrix(newHeight, newWidth, m_T->GetData(false).type());
 
 	int method = cv::INTER_CUBIC;
 
-	cv::resize(m_T->GetData(), resizedData, cv::Size(newWidth, newHeight), 0.0, 0.0, method);
+	cv::resize(m_T->GetData(false), resizedData, cv::Size(newWidth, newHeight), 0.0, 0.0, method);
 
 	delete m_T;
 	m_T = (COpenCvBiLevelImage*)COpenCvImage::Create(resizedData, COpenCvImage::TYPE_BILEVEL, true);
@@ -26,25 +26,60 @@ public:
 
 	COpenCvBiLevelImage * GetOutputImage();
 
+	/*
+	 * Thresholding at twice the resolution (better quality). The upsampled image is calculated on the fly.
+	 * 'downsampleBeforePostProcessing' - If true, the threshold image is scaled back down right away and
+	 *                                    post-processed at the original resolution (a quarter of the memory)
+	 */
+	inline void SetUpsample(bool upsample, bool downsampleBeforePostProcessing = false)
+	{
+		m_Upsample = upsample;
+		m_DownsampleBeforePostProcessing = downsampleBeforePostProcessing;
+	};
+
+	/*
+	 * Tiled execution: All steps run on horizontal tiles (with an overlap covering the neighbourhoods of all steps)
+	 * in parallel. Only the global statistics (noise variance, average component size, average background and
+	 * difference) are collected across the tiles, so the result is the same as for the full-image execution,
+	 * but the intermediate images only exist per tile (no debug images).
+	 * 'tileHeight' - Rows per tile (without overlap)
+	 */
+	inline void SetTiling(bool tiled, int tileHeight = 512)
+	{
+		m_Tiled = tiled;
+		m_TileHeight = tileHeight < 64 ? 64 : tileHeight;
+	};
+
+private:
+	class CTileKernel; //Parallel loop body for the tiled execution
+
 private:
 	void ProcessSourceImage();
+	bool ProcessSourceImageTiled();
+	int GetTileOverlap(int stage);
 	void PreprocessSourceImage();
 	void EstimateForegroundRegions();
 	void EstimateBackgroundSurface();
 	void ExtractConnectedComponents();
 	void Thresholding();
+	void CalculateBackgroundStatistics(int firstRow, int endRow, long long & blackCount, long long & backgroundSum, long long & differenceSum);
+	void SetThresholdStatistics(long long blackCount, long long backgroundSum, long long differenceSum);
 	void PostProcess();
 	void Downsample();
 	void SaveImage(COpenCvImage * img, CUniString filePath);
 
+	inline bool IsThresholdImageUpsampled() { return m_Upsample && !m_DownsampleBeforePostProcessing; };
+
 private:
 	bool m_Debug;
 	bool m_Upsample;
+	bool m_DownsampleBeforePostProcessing;
+	bool m_Tiled;
+	int m_TileHeight;
 	COpenCvImage * m_InputImage;
 	COpenCvBiLevelImage * m_T;
 	COpenCvGreyScaleImage * m_Is; //Greyscale source image
 	COpenCvGreyScaleImage * m_I; //Greyscale image after preprocessing
-	COpenCvGreyScaleImage * m_Iu; //Upsampled greyscale image after preprocessing
 	COpenCvBiLevelImage * m_S; //Binary image for foreground estimation
 	COpenCvGreyScaleImage * m_B; //Greyscale image with estimated background
 	bool m_DeleteGreyScaleSourceImage;
@@ -53,6 +88,10 @@ private:
 	CHistogram * m_CompWidthHistogram;
 	int m_AverageComponentWidth;
 	int m_AverageComponentHeight;
+	double m_NoiseVariance; //For the Wiener filter (negative: estimate from the image)
+	bool m_HasThresholdStatistics; //Average background and difference known (calculated or given for a tile)
+	double m_AverageBackground; //b (average background value under the foreground of S)
+	double m_AverageDifference; //delta (average difference between background and I)
 };
 
 
@@ -0,0 +1,519 @@
+#include "BinaryMorphology.h"
+#include <algorithm>
+#include <map>
+#include <cmath>
+
+using namespace cv;
+
+namespace PRImA {
+
+
+/*
+ * Class CStructuringElement
+ *
+ * Structuring element for binary morphology (see CBinaryMorphology).
+ * Consists of hits (pixels that have to be black) and misses (pixels that have to be white, hit-or-miss only).
+ * Both are offsets relative to the origin of the element (x to the right, y down).
+ */
+
+/*
+ * Constructor (empty element)
+ */
+CStructuringElement::CStructuringElement()
+{
+}
+
+/*
+ * Constructor from a pattern string (row by row, 'width' * 'height' characters):
+ * 'x' is a hit, 'o' is a miss, any other character (e.g. ' ' or '.') is ignored.
+ *
+ * 'originX', 'originY' - Position of the origin within the pattern (default: centre)
+ */
+CStructuringElement::CStructuringElement(int width, int height, const char * pattern, int originX /*= -1*/, int originY /*= -1*/)
+{
+	if (originX < 0)
+		originX = width / 2;
+	if (originY < 0)
+		originY = height / 2;
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			char c = pattern[y * width + x];
+			if (c == 'x' || c == 'X')
+				AddHit(x - originX, y - originY);
+			else if (c == 'o' || c == 'O')
+				AddMiss(x - originX, y - originY);
+		}
+	}
+}
+
+/*
+ * Constructor from a mask (8 bit, one channel). Non-zero values are hits.
+ *
+ * 'originX', 'originY' - Position of the origin within the mask (default: centre)
+ */
+CStructuringElement::CStructuringElement(const Mat & mask, int originX /*= -1*/, int originY /*= -1*/)
+{
+	if (originX < 0)
+		originX = mask.cols / 2;
+	if (originY < 0)
+		originY = mask.rows / 2;
+
+	for (int y = 0; y < mask.rows; y++)
+	{
+		const uchar * row = mask.ptr<uchar>(y);
+		for (int x = 0; x < mask.cols; x++)
+			if (row[x] != 0)
+				AddHit(x - originX, y - originY);
+	}
+}
+
+/*
+ * Filled rectangle with the origin in the centre
+ */
+CStructuringElement CStructuringElement::Rectangle(int width, int height)
+{
+	CStructuringElement element;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			element.AddHit(x - width / 2, y - height / 2);
+	return element;
+}
+
+/*
+ * Cross (plus sign) of the given width and height with the origin in the centre
+ * (3 gives the 4-neighbourhood)
+ */
+CStructuringElement CStructuringElement::Cross(int size)
+{
+	CStructuringElement element;
+	for (int i = 0; i < size; i++)
+	{
+		element.AddHit(i - size / 2, 0);
+		element.AddHit(0, i - size / 2);
+	}
+	return element;
+}
+
+/*
+ * Digital line of the given length through the origin (centre of the line)
+ *
+ * 'angle' - Angle in degrees, counter-clockwise (0 = horizontal, 90 = vertical)
+ */
+CStructuringElement CStructuringElement::Line(int length, double angle)
+{
+	CStructuringElement element;
+	double rad = angle * CV_PI / 180.0;
+	double dx = cos(rad);
+	double dy = -sin(rad);
+
+	//One pixel per step along the major axis (no gaps)
+	double major = max(fabs(dx), fabs(dy));
+	double half = (length - 1) / 2.0;
+	for (int i = 0; i < length; i++)
+		element.AddHit(cvRound((i - half) * dx / major), cvRound((i - half) * dy / major));
+	return element;
+}
+
+/*
+ * Adds a hit (pixel that has to be black), if not already contained
+ */
+void CStructuringElement::AddHit(int dx, int dy)
+{
+	Point p(dx, dy);
+	if (std::find(m_Hits.begin(), m_Hits.end(), p) == m_Hits.end())
+		m_Hits.push_back(p);
+}
+
+/*
+ * Adds a miss (pixel that has to be white, hit-or-miss only), if not already contained
+ */
+void CStructuringElement::AddMiss(int dx, int dy)
+{
+	Point p(dx, dy);
+	if (std::find(m_Misses.begin(), m_Misses.end(), p) == m_Misses.end())
+		m_Misses.push_back(p);
+}
+
+
+/*
+ * Class CBinaryMorphology
+ *
+ * Binary morphology on packed bi-level pixel matrices (black = foreground).
+ * All operations work on whole 64 bit words of a row (shifts and and/or operations):
+ * Rectangles are decomposed into a horizontal and a vertical pass, other elements into horizontal runs.
+ * Runs of length n take O(log n) word operations per word (doubling).
+ * Pixels outside the matrix are regarded as white.
+ */
+
+/*
+ * Reads 64 bits of a row starting at the given bit position (can be negative or beyond the row).
+ * Bits outside the row (x < 0 or x >= width) are 1 if 'outsideBlack' is true, otherwise 0.
+ */
+static inline uint64_t ReadBitsFilled(const uint64_t * row, int wordsPerRow, int width, int bitPos, bool outsideBlack)
+{
+	uint64_t bits = CPackedBitMatrix::ReadBits(row, wordsPerRow, bitPos);
+	if (outsideBlack)
+	{
+		int first = max(0, -bitPos);
+		int last = min(CPackedBitMatrix::WORD_BITS - 1, width - 1 - bitPos);
+		uint64_t inside = first <= last ? CPackedBitMatrix::RangeMask(first, last) : 0;
+		bits |= ~inside;
+	}
+	return bits;
+}
+
+/*
+ * dst = dst & src or dst = dst | src for a row of words
+ */
+static inline void CombineWords(uint64_t * dst, const uint64_t * src, int count, bool useAnd)
+{
+	if (useAnd)
+	{
+		for (int w = 0; w < count; w++)
+			dst[w] &= src[w];
+	}
+	else
+	{
+		for (int w = 0; w < count; w++)
+			dst[w] |= src[w];
+	}
+}
+
+/*
+ * Horizontal run of one row (doubling).
+ * The result is an extended row with 'margin' pixels on both sides: Bit q of 'buffer' is the and/or
+ * of the source pixels [q - margin, q - margin + length - 1] (margin has to be large enough for all bits that are read).
+ */
+void CBinaryMorphology::CombineRun(const uint64_t * src, int wordsPerRow, int width, uint64_t * dst, int length, int margin,
+								   bool useAnd, bool outsideBlack, std::vector<uint64_t> & buffer)
+{
+	int extWords = (width + 2 * margin + CPackedBitMatrix::WORD_BITS - 1) / CPackedBitMatrix::WORD_BITS;
+	buffer.resize(extWords);
+	for (int w = 0; w < extWords; w++)
+		buffer[w] = ReadBitsFilled(src, wordsPerRow, width, w * CPackedBitMatrix::WORD_BITS - margin, outsideBlack);
+
+	//Run length k -> 2k (in place, the words to the right are read before they are changed)
+	int k = 1;
+	for (; 2 * k <= length; k *= 2)
+	{
+		for (int w = 0; w < extWords; w++)
+		{
+			uint64_t shifted = CPackedBitMatrix::ReadBits(&buffer[0], extWords, w * CPackedBitMatrix::WORD_BITS + k);
+			buffer[w] = useAnd ? buffer[w] & shifted : buffer[w] | shifted;
+		}
+	}
+	//Remainder (overlapping runs, and/or are idempotent)
+	if (k < length)
+	{
+		for (int w = 0; w < extWords; w++)
+		{
+			uint64_t shifted = CPackedBitMatrix::ReadBits(&buffer[0], extWords, w * CPackedBitMatrix::WORD_BITS + length - k);
+			buffer[w] = useAnd ? buffer[w] & shifted : buffer[w] | shifted;
+		}
+	}
+
+	if (dst != NULL)
+		memcpy(dst, &buffer[0], extWords * sizeof(uint64_t));
+}
+
+/*
+ * Horizontal pass: dst(x, y) = and/or of src(x + first, y) ... src(x + last, y)
+ */
+void CBinaryMorphology::CombineRows(const CPackedBitMatrix & src, CPackedBitMatrix & dst, int first, int last,
+									bool useAnd, bool outsideBlack)
+{
+	int width = src.GetWidth();
+	int height = src.GetHeight();
+	int wordsPerRow = src.GetWordsPerRow();
+	int margin = max(0, max(-first, last));
+	int extWords = (width + 2 * margin + CPackedBitMatrix::WORD_BITS - 1) / CPackedBitMatrix::WORD_BITS;
+
+	dst.Create(width, height);
+	std::vector<uint64_t> buffer;
+	for (int y = 0; y < height; y++)
+	{
+		CombineRun(src.GetRow(y), wordsPerRow, width, NULL, last - first + 1, margin, useAnd, outsideBlack, buffer);
+		uint64_t * dstRow = dst.GetRow(y);
+		for (int w = 0; w < wordsPerRow; w++)
+			dstRow[w] = CPackedBitMatrix::ReadBits(&buffer[0], extWords, w * CPackedBitMatrix::WORD_BITS + first + margin);
+	}
+	dst.ClearPadding();
+}
+
+/*
+ * Vertical pass: dst(x, y) = and/or of src(x, y + first) ... src(x, y + last)
+ */
+void CBinaryMorphology::CombineColumns(const CPackedBitMatrix & src, CPackedBitMatrix & dst, int first, int last,
+									   bool useAnd, bool outsideBlack)
+{
+	int width = src.GetWidth();
+	int height = src.GetHeight();
+	int wordsPerRow = src.GetWordsPerRow();
+	int length = last - first + 1;
+	int margin = max(0, max(-first, last));
+
+	//Extended rows (row e is source row e - margin)
+	int extRows = height + 2 * margin;
+	std::vector<uint64_t> rows((size_t)extRows * wordsPerRow, outsideBlack ? ~(uint64_t)0 : 0);
+	if (wordsPerRow > 0 && height > 0)
+		memcpy(&rows[(size_t)margin * wordsPerRow], src.GetRow(0), (size_t)height * wordsPerRow * sizeof(uint64_t));
+
+	//Run length k -> 2k (in place, the rows below are read before they are changed)
+	int k = 1;
+	for (; 2 * k <= length; k *= 2)
+		for (int e = 0; e + k < extRows; e++)
+			CombineWords(&rows[(size_t)e * wordsPerRow], &rows[(size_t)(e + k) * wordsPerRow], wordsPerRow, useAnd);
+	//Remainder (overlapping runs)
+	if (k < length)
+		for (int e = 0; e + length - k < extRows; e++)
+			CombineWords(&rows[(size_t)e * wordsPerRow], &rows[(size_t)(e + length - k) * wordsPerRow], wordsPerRow, useAnd);
+
+	dst.Create(width, height);
+	for (int y = 0; y < height; y++)
+		memcpy(dst.GetRow(y), &rows[(size_t)(y + first + margin) * wordsPerRow], wordsPerRow * sizeof(uint64_t));
+	dst.ClearPadding();
+}
+
+/*
+ * dst(p) = and/or of src(p + o) for all offsets o
+ *
+ * 'outsideBlack' - Pixels outside the source are regarded as black (otherwise white)
+ */
+void CBinaryMorphology::Combine(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const std::vector<Point> & offsets,
+								bool useAnd, bool outsideBlack)
+{
+	if (offsets.empty() || src.GetWidth() == 0 || src.GetHeight() == 0)
+	{
+		dst = src;
+		return;
+	}
+
+	int width = src.GetWidth();
+	int height = src.GetHeight();
+
+	//Bounding box
+	int left = offsets[0].x, right = offsets[0].x, top = offsets[0].y, bottom = offsets[0].y;
+	for (size_t i = 1; i < offsets.size(); i++)
+	{
+		left = min(left, offsets[i].x);
+		right = max(right, offsets[i].x);
+		top = min(top, offsets[i].y);
+		bottom = max(bottom, offsets[i].y);
+	}
+
+	//Rectangle (the offsets are distinct) -> separable
+	if ((long long)(right - left + 1) * (bottom - top + 1) == (long long)offsets.size())
+	{
+		CPackedBitMatrix temp;
+		CombineRows(src, temp, left, right, useAnd, outsideBlack);
+		CombineColumns(temp, dst, top, bottom, useAnd, outsideBlack);
+		return;
+	}
+
+	//Decompose into horizontal runs
+	std::vector<Point> sorted(offsets);
+	std::sort(sorted.begin(), sorted.end(), [](const Point & a, const Point & b) { return a.y < b.y || (a.y == b.y && a.x < b.x); });
+	std::vector<Vec3i> runs; //y, first x, last x
+	for (size_t i = 0; i < sorted.size(); i++)
+	{
+		if (!runs.empty() && runs.back()[0] == sorted[i].y && runs.back()[2] + 1 == sorted[i].x)
+			runs.back()[2] = sorted[i].x;
+		else
+			runs.push_back(Vec3i(sorted[i].y, sorted[i].x, sorted[i].x));
+	}
+
+	//Horizontal runs of the source (extended rows), one matrix per run length
+	int margin = max(0, max(-left, right));
+	int extWords = (width + 2 * margin + CPackedBitMatrix::WORD_BITS - 1) / CPackedBitMatrix::WORD_BITS;
+	std::map<int, std::vector<uint64_t> > runImages;
+	std::vector<uint64_t> buffer;
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		int length = runs[r][2] - runs[r][1] + 1;
+		if (runImages.find(length) != runImages.end())
+			continue;
+		std::vector<uint64_t> & runImage = runImages[length];
+		runImage.resize((size_t)height * extWords);
+		for (int y = 0; y < height; y++)
+			CombineRun(src.GetRow(y), src.GetWordsPerRow(), width, &runImage[(size_t)y * extWords], length, margin, useAnd, outsideBlack, buffer);
+	}
+
+	//Combine the shifted runs
+	CPackedBitMatrix result(width, height, useAnd);
+	int wordsPerRow = result.GetWordsPerRow();
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		const std::vector<uint64_t> & runImage = runImages[runs[r][2] - runs[r][1] + 1];
+		int dy = runs[r][0];
+		int bitOffset = runs[r][1] + margin;
+		for (int y = 0; y < height; y++)
+		{
+			uint64_t * dstRow = result.GetRow(y);
+			int sy = y + dy;
+			if (sy < 0 || sy >= height)
+			{
+				if (useAnd && !outsideBlack)
+					memset(dstRow, 0, wordsPerRow * sizeof(uint64_t));
+				else if (!useAnd && outsideBlack)
+					memset(dstRow, 0xFF, wordsPerRow * sizeof(uint64_t));
+				continue;
+			}
+			const uint64_t * runRow = &runImage[(size_t)sy * extWords];
+			for (int w = 0; w < wordsPerRow; w++)
+			{
+				uint64_t bits = CPackedBitMatrix::ReadBits(runRow, extWords, w * CPackedBitMatrix::WORD_BITS + bitOffset);
+				dstRow[w] = useAnd ? dstRow[w] & bits : dstRow[w] | bits;
+			}
+		}
+	}
+	result.ClearPadding();
+	dst = result;
+}
+
+/*
+ * Erosion (thins the black objects)
+ *
+ * 'iterations' - Number of times the erosion is applied
+ */
+void CBinaryMorphology::Erode(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element,
+							  int iterations /*= 1*/)
+{
+	if (&dst != &src)
+		dst = src;
+	for (int i = 0; i < iterations; i++)
+		Combine(dst, dst, element.GetHits(), true, false);
+}
+
+/*
+ * Dilation (thickens the black objects)
+ *
+ * 'iterations' - Number of times the dilation is applied
+ */
+void CBinaryMorphology::Dilate(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element,
+							   int iterations /*= 1*/)
+{
+	//Reflected element
+	std::vector<Point> offsets(element.GetHits());
+	for (size_t i = 0; i < offsets.size(); i++)
+		offsets[i] = -offsets[i];
+
+	if (&dst != &src)
+		dst = src;
+	for (int i = 0; i < iterations; i++)
+		Combine(dst, dst, offsets, false, false);
+}
+
+/*
+ * Opening (erosion followed by dilation; removes black objects smaller than the element)
+ *
+ * 'iterations' - Number of erosions, followed by the same number of dilations
+ */
+void CBinaryMorphology::Open(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element,
+							 int iterations /*= 1*/)
+{
+	Erode(src, dst, element, iterations);
+	Dilate(dst, dst, element, iterations);
+}
+
+/*
+ * Closing (dilation followed by erosion; fills white gaps smaller than the element)
+ *
+ * 'iterations' - Number of dilations, followed by the same number of erosions
+ */
+void CBinaryMorphology::Close(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element,
+							  int iterations /*= 1*/)
+{
+	Dilate(src, dst, element, iterations);
+	Erode(dst, dst, element, iterations);
+}
+
+/*
+ * Hit-or-miss transform: A pixel is black if all hits of the element placed at the pixel are black
+ * and all misses are white (pixels outside the matrix are white).
+ */
+void CBinaryMorphology::HitOrMiss(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element)
+{
+	CPackedBitMatrix result;
+	if (!element.GetHits().empty())
+		Combine(src, result, element.GetHits(), true, false);
+	else
+		result.Create(src.GetWidth(), src.GetHeight(), true);
+
+	if (!element.GetMisses().empty())
+	{
+		//Misses: erosion of the inverted matrix (outside is black there)
+		CPackedBitMatrix inverted(src);
+		inverted.Invert();
+		Combine(inverted, inverted, element.GetMisses(), true, true);
+		result.And(inverted);
+	}
+	dst = result;
+}
+
+/*
+ * Applies the given operation to a bi-level image.
+ * Packed images are processed directly, otherwise the pixels are packed temporarily.
+ *
+ * 'operation' - One of OPERATION_ERODE, OPERATION_DILATE, OPERATION_OPEN, OPERATION_CLOSE, OPERATION_HIT_OR_MISS
+ * 'iterations' - See Erode(), Dilate(), Open() and Close() (ignored for hit-or-miss)
+ * Returns: New image with the same storage (packed or not) and pixel type, or NULL
+ */
+COpenCvBiLevelImage * CBinaryMorphology::Apply(COpenCvBiLevelImage * image, int operation, const CStructuringElement & element,
+											   int iterations /*= 1*/)
+{
+	if (image == NULL)
+		return NULL;
+
+	//Source bits
+	CPackedBitMatrix temp;
+	const CPackedBitMatrix * src = image->GetPackedData();
+	int type;
+	if (src != NULL)
+		type = image->GetPackedType();
+	else
+	{
+		Mat data = image->GetData(false);
+		temp.FromMat(data);
+		src = &temp;
+		type = data.type();
+	}
+
+	CPackedBitMatrix * result = new CPackedBitMatrix();
+	if (operation == OPERATION_ERODE)
+		Erode(*src, *result, element, iterations);
+	else if (operation == OPERATION_DILATE)
+		Dilate(*src, *result, element, iterations);
+	else if (operation == OPERATION_OPEN)
+		Open(*src, *result, element, iterations);
+	else if (operation == OPERATION_CLOSE)
+		Close(*src, *result, element, iterations);
+	else if (operation == OPERATION_HIT_OR_MISS)
+		HitOrMiss(*src, *result, element);
+	else
+	{
+		delete result;
+		return NULL;
+	}
+
+	COpenCvBiLevelImage * resImage;
+	if (image->GetPackedData() != NULL) //Packed
+	{
+		resImage = new COpenCvBiLevelImage();
+		resImage->SetPackedData(result, type);
+	}
+	else
+	{
+		Mat data = COpenCvImage::AllocateMatrix(result->GetHeight(), result->GetWidth(), type);
+		result->ToMat(data, type, image->GetMaxValueForColorChannel());
+		delete result;
+		resImage = (COpenCvBiLevelImage*)COpenCvImage::Create(data, COpenCvImage::TYPE_BILEVEL, false);
+	}
+	resImage->CopyImageInfo(image->GetImageInfo());
+	return resImage;
+}
+
+
+} //end namespace
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "OpenCvImage.h"
+#include "PackedBitMatrix.h"
+#include <vector>
+
+namespace PRImA {
+
+/*
+ * Class CStructuringElement
+ *
+ * Structuring element for binary morphology (see CBinaryMorphology).
+ * Consists of hits (pixels that have to be black) and misses (pixels that have to be white, hit-or-miss only).
+ * Both are offsets relative to the origin of the element (x to the right, y down).
+ */
+class CStructuringElement
+{
+public:
+	CStructuringElement();
+	CStructuringElement(int width, int height, const char * pattern, int originX = -1, int originY = -1);
+	CStructuringElement(const cv::Mat & mask, int originX = -1, int originY = -1);
+
+	static CStructuringElement Rectangle(int width, int height);
+	static CStructuringElement Cross(int size);
+	static CStructuringElement Line(int length, double angle);
+
+	void AddHit(int dx, int dy);
+	void AddMiss(int dx, int dy);
+
+	inline const std::vector<cv::Point> & GetHits() const { return m_Hits; };
+	inline const std::vector<cv::Point> & GetMisses() const { return m_Misses; };
+
+private:
+	std::vector<cv::Point>	m_Hits;
+	std::vector<cv::Point>	m_Misses;
+};
+
+
+/*
+ * Class CBinaryMorphology
+ *
+ * Binary morphology on packed bi-level pixel matrices (black = foreground).
+ * All operations work on whole 64 bit words of a row (shifts and and/or operations):
+ * Rectangles are decomposed into a horizontal and a vertical pass, other elements into horizontal runs.
+ * Runs of length n take O(log n) word operations per word (doubling).
+ * Pixels outside the matrix are regarded as white.
+ *
+ * Erosion: A pixel stays black if all hits of the element placed at the pixel are black.
+ * Dilation: A pixel becomes black if it is hit by the (reflected) element placed at a black pixel.
+ *
+ * The destination can be the source matrix.
+ */
+class CBinaryMorphology
+{
+public:
+	static const int OPERATION_ERODE		= 0;
+	static const int OPERATION_DILATE		= 1;
+	static const int OPERATION_OPEN			= 2;
+	static const int OPERATION_CLOSE		= 3;
+	static const int OPERATION_HIT_OR_MISS	= 4;
+
+private:
+	CBinaryMorphology();
+
+public:
+	static void Erode(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element, int iterations = 1);
+	static void Dilate(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element, int iterations = 1);
+	static void Open(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element, int iterations = 1);
+	static void Close(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element, int iterations = 1);
+	static void HitOrMiss(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const CStructuringElement & element);
+
+	static COpenCvBiLevelImage * Apply(COpenCvBiLevelImage * image, int operation, const CStructuringElement & element, int iterations = 1);
+
+private:
+	static void Combine(const CPackedBitMatrix & src, CPackedBitMatrix & dst, const std::vector<cv::Point> & offsets,
+						bool useAnd, bool outsideBlack);
+	static void CombineRows(const CPackedBitMatrix & src, CPackedBitMatrix & dst, int first, int last, bool useAnd, bool outsideBlack);
+	static void CombineColumns(const CPackedBitMatrix & src, CPackedBitMatrix & dst, int first, int last, bool useAnd, bool outsideBlack);
+	static void CombineRun(const uint64_t * src, int wordsPerRow, int width, uint64_t * dst, int length, int margin,
+						   bool useAnd, bool outsideBlack, std::vector<uint64_t> & buffer);
+};
+
+} //end namespace
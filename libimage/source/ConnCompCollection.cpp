@@ -381,60 +381,70 @@ bool CConnCompCollection::ExtractComponentsFromImage(COpenCvBiLevelImage * image
 	int height = image->GetHeight();
 	//m_FourConnected = fourConnected;
 	
-	int x, y;
 	bool componentColor = lookForBlack;
-	bool inRun;
+	bool success = true;
 
 	vector<vector<CRun*>> runs(height);
-	int xStart = x1;
 
-	//Iterate through pixel lines
-	for(y = y1; y <= y2; y++)
+	//Resolve the pixel format once and scan the rows directly
+	image->WithRowAccess([&](auto pixels)
 	{
-		inRun = false;
-		//Find runs in current line
-		for(x = x1; x <= x2; x++) //Handle the last pixel after the loop
+		int x, y;
+		bool inRun;
+		int xStart = x1;
+
+		//Iterate through pixel lines
+		for(y = y1; y <= y2; y++)
 		{
-			//Start of run
-			if(image->IsBlack(x,y) == componentColor && !inRun) 
-			{
-				inRun = true;
-				xStart = x;
-			}
-			//End of run
-			else if(image->IsBlack(x,y) != componentColor && inRun)
+			auto row = pixels.GetRow(y);
+			inRun = false;
+			//Find runs in current line
+			for(x = x1; x <= x2; x++) //Handle the last pixel after the loop
 			{
-				inRun = false;
-				if(!AddRun(runs, y, xStart, x - 1, fourConnected))
-					return false;
+				bool black = row[x] == 0;
+				//Start of run
+				if(black == componentColor && !inRun) 
+				{
+					inRun = true;
+					xStart = x;
+				}
+				//End of run
+				else if(black != componentColor && inRun)
+				{
+					inRun = false;
+					if(!AddRun(runs, y, xStart, x - 1, fourConnected))
+					{
+						success = false;
+						return;
+					}
+				}
 			}
-		}
-		//Handle last pixel of the current line (better performance than doing than within the loop)
-		x = x2;
-		if (!inRun)
-		{
-			if (image->IsBlack(x,y)) //Last pixel is a run
+			//Handle last pixel of the current line (better performance than doing than within the loop)
+			x = x2;
+			bool lastAdded;
+			if (!inRun)
 			{
-				if(!AddRun(runs,y,x,x, fourConnected))
-					return false;
+				if (row[x] == 0) //Last pixel is a run
+					lastAdded = AddRun(runs,y,x,x, fourConnected);
+				else
+					lastAdded = true;
 			}
-		}
-		else //inRun
-		{
-			if (image->IsBlack(x,y)) //Run ends with line
+			else //inRun
 			{
-				if(!AddRun(runs, y, xStart, x, fourConnected))
-					return false;
+				if (row[x] == 0) //Run ends with line
+					lastAdded = AddRun(runs, y, xStart, x, fourConnected);
+				else //Run ends one pixel before line end
+					lastAdded = AddRun(runs, y, xStart, x-1, fourConnected);
 			}
-			else //Run ends one pixel before line end
+			if (!lastAdded)
 			{
-				if(!AddRun(runs, y, xStart, x-1, fourConnected))
-					return false;
+				success = false;
+				return;
 			}
 		}
-	}
+	});
 
-	return true;
+	return success;
 }
 
 /*
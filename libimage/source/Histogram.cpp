@@ -119,8 +119,6 @@ void CHistogram::BreakProfile()
 
 bool CHistogram::CreateHorzProjProf(COpenCvBiLevelImage * Image)
 {
-	int x, y;
-
 	delete [] m_Histogram;
 
 	m_ValueCount = Image->GetHeight();
@@ -131,22 +129,23 @@ bool CHistogram::CreateHorzProjProf(COpenCvBiLevelImage * Image)
 	}
 	memset(m_Histogram,0,sizeof(int) * m_ValueCount);
 
-	for(y = 0; y < Image->GetHeight(); y++)
+	int width = Image->GetWidth();
+	Image->ForEachRow([&](int y, auto row)
 	{
-		for(x = 0; x < Image->GetWidth(); x++)
+		int count = 0;
+		for(int x = 0; x < width; x++)
 		{
-			if(Image->IsBlack(x,y))
-				m_Histogram[y]++;
+			if(row[x] == 0) //Black
+				count++;
 		}
-	}
+		m_Histogram[y] = count;
+	});
 
 	return true;
 }
 
 bool CHistogram::CreateHorzProjProfVertStrip(COpenCvBiLevelImage * Image, int StartX, int EndX)
 {
-	int x, y;
-
 	if(StartX >= Image->GetWidth() || EndX>=Image->GetWidth() || StartX > EndX)
 		return false;
 
@@ -160,22 +159,22 @@ bool CHistogram::CreateHorzProjProfVertStrip(COpenCvBiLevelImage * Image, int St
 
 	memset(m_Histogram, 0, sizeof(int) * m_ValueCount);
 
-	for(y = 0; y < m_ValueCount; y++)
+	Image->ForEachRow([&](int y, auto row)
 	{
-		for(x = StartX; x <= EndX; x++)
+		int count = 0;
+		for(int x = StartX; x <= EndX; x++)
 		{
-			if(Image->IsBlack(x,y))
-				m_Histogram[y]++;
+			if(row[x] == 0) //Black
+				count++;
 		}
-	}
+		m_Histogram[y] = count;
+	});
 
 	return true;
 }
 
 bool CHistogram::CreateVertProjProf(COpenCvBiLevelImage * Image)
 {
-	int x, y;
-
 	delete m_Histogram;
 
 	m_ValueCount = Image->GetWidth();
@@ -186,14 +185,15 @@ bool CHistogram::CreateVertProjProf(COpenCvBiLevelImage * Image)
 	}
 	memset(m_Histogram,0,sizeof(int) * m_ValueCount);
 
-	for(y = 0; y < Image->GetHeight(); y++)
+	int width = Image->GetWidth();
+	Image->ForEachRow([&](int y, auto row)
 	{
-		for(x = 0; x < Image->GetWidth(); x++)
+		for(int x = 0; x < width; x++)
 		{
-			if(Image->IsBlack(x,y))
+			if(row[x] == 0) //Black
 				m_Histogram[x]++;
 		}
-	}
+	});
 
 	return true;
 }
@@ -215,16 +215,16 @@ bool CHistogram::CreateVertProjProf(COpenCvBiLevelImage * Image, int left, int t
 	
 	memset(m_Histogram,0,sizeof(int) * m_ValueCount);
 
-	int binIndex=0;
-	for(int x = left; x <= right; x++)
+	//Row by row (memory order), accumulating into the column bins
+	Image->ForEachRow([&](int y, auto row)
 	{
-		for(int y = top; y <= bottom; y++)
+		int binIndex=0;
+		for(int x = left; x <= right; x++, binIndex++)
 		{
-			if(Image->IsBlack(x,y))
+			if(row[x] == 0) //Black
 				m_Histogram[binIndex]++;
 		}
-		binIndex++;
-	}
+	}, top, bottom);
 
 	return true;
 }
@@ -236,7 +236,7 @@ bool CHistogram::CreateHorzProjProf(COpenCvBiLevelImage * Image, int left, int t
 {
 	delete m_Histogram;
 
-	m_ValueCount =	top - bottom + 1; //Total number of bins
+	m_ValueCount =	bottom - top + 1; //Total number of bins
 	m_Histogram = new int[m_ValueCount];
 	
 	if(m_Histogram==NULL)
@@ -246,16 +246,16 @@ bool CHistogram::CreateHorzProjProf(COpenCvBiLevelImage * Image, int left, int t
 	
 	memset(m_Histogram,0,sizeof(int) * m_ValueCount);
 
-	int binIndex=0;
-	for(int y = top; y <= bottom; y++)
+	Image->ForEachRow([&](int y, auto row)
 	{
+		int count = 0;
 		for(int x = left; x <= right; x++)
 		{
-			if(Image->IsBlack(x,y))
-				m_Histogram[binIndex]++;
+			if(row[x] == 0) //Black
+				count++;
 		}
-		binIndex++;
-	}
+		m_Histogram[y - top] = count;
+	}, top, bottom);
 
 	return true;
 }
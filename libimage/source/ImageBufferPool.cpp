@@ -0,0 +1,392 @@
+#include "ImageBufferPool.h"
+#include <thread>
+#include <functional>
+
+using namespace cv;
+
+namespace PRImA {
+
+/*
+ * Class CImageBufferPool
+ *
+ * OpenCV matrix allocator that keeps released pixel buffers and hands them out again
+ * for matrices with the same type and size.
+ */
+
+/*
+ * Constructor
+ *
+ * 'maxBytesHeld' - Memory cap for the free buffers that are kept for recycling
+ */
+CImageBufferPool::CImageBufferPool(size_t maxBytesHeld /*= DEFAULT_MAX_BYTES_HELD*/)
+	: m_MaxBytesHeld(maxBytesHeld), m_ReleaseSequence(0), m_BytesHeld(0), m_BuffersHeld(0), m_Requests(0), m_Hits(0), m_Discarded(0)
+{
+}
+
+/*
+ * Destructor
+ * Frees all buffers held by the pool. Matrices that are still using buffers of this pool
+ * must not be released after the pool has been deleted.
+ */
+CImageBufferPool::~CImageBufferPool()
+{
+	Clear();
+}
+
+/*
+ * Allocates the data of a matrix (see cv::MatAllocator).
+ * Uses a free buffer of the same type and size, if available.
+ *
+ * 'data' - User-allocated data (not pooled) or NULL
+ * 'step' - Steps of the dimensions (in/out)
+ */
+UMatData * CImageBufferPool::allocate(int dims, const int * sizes, int type, void * data, size_t * step,
+										int /*flags*/, UMatUsageFlags /*usageFlags*/) const
+{
+	//Total size and steps (as cv::StdMatAllocator)
+	size_t total = CV_ELEM_SIZE(type);
+	for (int i = dims-1; i >= 0; i--)
+	{
+		if (step != NULL)
+		{
+			if (data != NULL && step[i] != CV_AUTOSTEP)
+			{
+				CV_Assert(total <= step[i]);
+				total = step[i];
+			}
+			else
+				step[i] = total;
+		}
+		total *= sizes[i];
+	}
+
+	UMatData * u = new UMatData(this);
+	u->size = total;
+	u->allocatorFlags_ = CV_MAT_TYPE(type); //Remembered for the pool key
+	if (data != NULL)
+	{
+		u->data = u->origdata = (uchar*)data;
+		u->flags |= UMatData::USER_ALLOCATED;
+		return u;
+	}
+
+	CBufferKey key;
+	key.type = CV_MAT_TYPE(type);
+	key.size = total;
+	uchar * buffer = TakeBuffer(key);
+	if (buffer == NULL)
+		buffer = (uchar*)fastMalloc(total);
+	u->data = u->origdata = buffer;
+	return u;
+}
+
+/*
+ * See cv::MatAllocator (nothing to do for host memory)
+ */
+bool CImageBufferPool::allocate(UMatData * data, int /*accessflags*/, UMatUsageFlags /*usageFlags*/) const
+{
+	return data != NULL;
+}
+
+/*
+ * Releases the data of a matrix (see cv::MatAllocator).
+ * The buffer is kept for recycling if the memory cap allows it.
+ */
+void CImageBufferPool::deallocate(UMatData * data) const
+{
+	if (data == NULL)
+		return;
+
+	CV_Assert(data->urefcount >= 0);
+	CV_Assert(data->refcount >= 0);
+	if (data->refcount == 0)
+	{
+		if (!(data->flags & UMatData::USER_ALLOCATED))
+		{
+			CBufferKey key;
+			key.type = data->allocatorFlags_;
+			key.size = data->size;
+			ReturnBuffer(key, data->origdata);
+			data->origdata = NULL;
+		}
+		delete data;
+	}
+}
+
+/*
+ * Sets the memory cap for free buffers. Buffers exceeding the new cap are freed.
+ */
+void CImageBufferPool::SetMaxBytesHeld(size_t maxBytesHeld)
+{
+	m_MaxBytesHeld = maxBytesHeld;
+	TrimToMaxBytes();
+}
+
+/*
+ * Frees all buffers held by the pool (buffers in use are not affected).
+ */
+void CImageBufferPool::Clear()
+{
+	for (int i=0; i<THREAD_CACHE_COUNT; i++)
+	{
+		CThreadCache & cache = m_ThreadCaches[i];
+		CSingleLock lock(&cache.lock, TRUE);
+		for (size_t b=0; b<cache.buffers.size(); b++)
+		{
+			m_BytesHeld -= cache.buffers[b].key.size;
+			m_BuffersHeld--;
+			fastFree(cache.buffers[b].buffer);
+		}
+		cache.buffers.clear();
+	}
+
+	CSingleLock lock(&m_CriticalSect, TRUE);
+	for (CFreeBufferList::iterator it = m_SharedBuffers.begin(); it != m_SharedBuffers.end(); it++)
+	{
+		m_BytesHeld -= it->key.size;
+		m_BuffersHeld--;
+		fastFree(it->buffer);
+	}
+	m_SharedBuffers.clear();
+	m_FreeBuffers.clear();
+}
+
+/*
+ * Returns a snapshot of the usage counters
+ */
+CImageBufferPoolStatistics CImageBufferPool::GetStatistics() const
+{
+	CImageBufferPoolStatistics stats;
+	stats.requests = m_Requests;
+	stats.hits = m_Hits;
+	stats.misses = stats.requests - stats.hits;
+	stats.discarded = m_Discarded;
+	stats.bytesHeld = m_BytesHeld;
+	stats.buffersHeld = m_BuffersHeld;
+	return stats;
+}
+
+/*
+ * Resets the request, hit and discard counters
+ */
+void CImageBufferPool::ResetStatistics()
+{
+	m_Requests = 0;
+	m_Hits = 0;
+	m_Discarded = 0;
+}
+
+/*
+ * Removes a free buffer with the given key from the pool (cache of the calling thread first).
+ * Returns NULL if there is none.
+ */
+uchar * CImageBufferPool::TakeBuffer(const CBufferKey & key) const
+{
+	m_Requests++;
+
+	uchar * buffer = NULL;
+	CThreadCache & cache = GetThreadCache();
+	{
+		CSingleLock lock(&cache.lock, TRUE);
+		for (int i=(int)cache.buffers.size()-1; i>=0; i--) //Most recently released first
+		{
+			if (cache.buffers[i].key == key)
+			{
+				buffer = cache.buffers[i].buffer;
+				cache.buffers.erase(cache.buffers.begin() + i);
+				break;
+			}
+		}
+	}
+
+	if (buffer == NULL)
+	{
+		CSingleLock lock(&m_CriticalSect, TRUE);
+		std::multimap<CBufferKey, CFreeBufferList::iterator>::iterator it = m_FreeBuffers.find(key);
+		if (it != m_FreeBuffers.end())
+		{
+			buffer = it->second->buffer;
+			m_SharedBuffers.erase(it->second);
+			m_FreeBuffers.erase(it);
+		}
+	}
+
+	if (buffer != NULL)
+	{
+		m_BytesHeld -= key.size;
+		m_BuffersHeld--;
+		m_Hits++;
+	}
+	return buffer;
+}
+
+/*
+ * Puts a released buffer into the cache of the calling thread.
+ * If the cache is full, its oldest buffer is moved to the shared pool.
+ * If the memory cap is reached, the least recently released free buffers are freed to make room
+ * (or the given buffer is freed, if it is larger than the cap or there is nothing left to free).
+ */
+void CImageBufferPool::ReturnBuffer(const CBufferKey & key, uchar * buffer) const
+{
+	bool reserved = key.size <= m_MaxBytesHeld;
+	while (reserved && !ReserveBytes(key.size))
+		reserved = FreeOldestBuffer();
+	if (!reserved)
+	{
+		m_Discarded++;
+		fastFree(buffer);
+		return;
+	}
+	m_BuffersHeld++;
+
+	CFreeBuffer freeBuffer;
+	freeBuffer.key = key;
+	freeBuffer.buffer = buffer;
+	freeBuffer.sequence = m_ReleaseSequence++;
+
+	CThreadCache & cache = GetThreadCache();
+	CSingleLock cacheLock(&cache.lock, TRUE);
+	if ((int)cache.buffers.size() >= THREAD_CACHE_SIZE)
+	{
+		InsertIntoSharedPool(cache.buffers.front());
+		cache.buffers.erase(cache.buffers.begin());
+	}
+	cache.buffers.push_back(freeBuffer);
+}
+
+/*
+ * Adds a free buffer to the shared pool, keeping the pool in release order
+ * (buffers moved from different thread caches can arrive out of order).
+ */
+void CImageBufferPool::InsertIntoSharedPool(const CFreeBuffer & freeBuffer) const
+{
+	CSingleLock lock(&m_CriticalSect, TRUE);
+	CFreeBufferList::iterator pos = m_SharedBuffers.end();
+	while (pos != m_SharedBuffers.begin())
+	{
+		CFreeBufferList::iterator prev = pos;
+		prev--;
+		if (prev->sequence < freeBuffer.sequence)
+			break;
+		pos = prev;
+	}
+	pos = m_SharedBuffers.insert(pos, freeBuffer);
+	m_FreeBuffers.insert(std::make_pair(freeBuffer.key, pos));
+}
+
+/*
+ * Frees the least recently released free buffer (shared pool or thread caches).
+ * Only one lock is held at a time, so the oldest buffer is determined first and
+ * the search is repeated if it has been taken in the meantime.
+ * Returns false if there are no free buffers.
+ */
+bool CImageBufferPool::FreeOldestBuffer() const
+{
+	for (;;)
+	{
+		//Find the oldest buffer (-1 = shared pool, otherwise index of the thread cache)
+		int source = -2;
+		unsigned long long oldest = 0;
+		{
+			CSingleLock lock(&m_CriticalSect, TRUE);
+			if (!m_SharedBuffers.empty())
+			{
+				source = -1;
+				oldest = m_SharedBuffers.front().sequence;
+			}
+		}
+		for (int i=0; i<THREAD_CACHE_COUNT; i++)
+		{
+			CThreadCache & cache = m_ThreadCaches[i];
+			CSingleLock lock(&cache.lock, TRUE);
+			if (!cache.buffers.empty() && (source == -2 || cache.buffers.front().sequence < oldest))
+			{
+				source = i;
+				oldest = cache.buffers.front().sequence;
+			}
+		}
+		if (source == -2)
+			return false;
+
+		//Remove it (if still there)
+		CFreeBuffer freeBuffer;
+		bool found = false;
+		if (source == -1)
+		{
+			CSingleLock lock(&m_CriticalSect, TRUE);
+			if (!m_SharedBuffers.empty() && m_SharedBuffers.front().sequence == oldest)
+			{
+				freeBuffer = m_SharedBuffers.front();
+				std::pair<std::multimap<CBufferKey, CFreeBufferList::iterator>::iterator,
+						  std::multimap<CBufferKey, CFreeBufferList::iterator>::iterator> range = m_FreeBuffers.equal_range(freeBuffer.key);
+				for (std::multimap<CBufferKey, CFreeBufferList::iterator>::iterator it = range.first; it != range.second; it++)
+				{
+					if (it->second == m_SharedBuffers.begin())
+					{
+						m_FreeBuffers.erase(it);
+						break;
+					}
+				}
+				m_SharedBuffers.pop_front();
+				found = true;
+			}
+		}
+		else
+		{
+			CThreadCache & cache = m_ThreadCaches[source];
+			CSingleLock lock(&cache.lock, TRUE);
+			if (!cache.buffers.empty() && cache.buffers.front().sequence == oldest)
+			{
+				freeBuffer = cache.buffers.front();
+				cache.buffers.erase(cache.buffers.begin());
+				found = true;
+			}
+		}
+
+		if (found)
+		{
+			m_BytesHeld -= freeBuffer.key.size;
+			m_BuffersHeld--;
+			m_Discarded++;
+			fastFree(freeBuffer.buffer);
+			return true;
+		}
+	}
+}
+
+/*
+ * Adds the given size to the held memory if that does not exceed the memory cap.
+ * Returns false otherwise.
+ */
+bool CImageBufferPool::ReserveBytes(size_t size) const
+{
+	size_t held = m_BytesHeld;
+	do
+	{
+		if (held + size > m_MaxBytesHeld)
+			return false;
+	} while (!m_BytesHeld.compare_exchange_weak(held, held + size));
+	return true;
+}
+
+/*
+ * Frees free buffers until the held memory is within the memory cap
+ * (least recently released first, see FreeOldestBuffer()).
+ */
+void CImageBufferPool::TrimToMaxBytes() const
+{
+	while (m_BytesHeld > m_MaxBytesHeld && FreeOldestBuffer())
+		;
+}
+
+/*
+ * Returns the free buffer cache for the calling thread
+ */
+CImageBufferPool::CThreadCache & CImageBufferPool::GetThreadCache() const
+{
+	size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % THREAD_CACHE_COUNT;
+	return m_ThreadCaches[index];
+}
+
+
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#ifndef IMAGEBUFFERPOOL_H
+#define IMAGEBUFFERPOOL_H
+
+#include "opencv2\opencv.hpp"
+#include "afxwin.h"
+#include <afxmt.h>
+#include <map>
+#include <list>
+#include <vector>
+#include <atomic>
+
+namespace PRImA {
+
+
+/*
+ * Struct CImageBufferPoolStatistics
+ *
+ * Snapshot of the usage counters of an image buffer pool.
+ */
+struct CImageBufferPoolStatistics
+{
+	long long	requests;		//Number of buffer allocations
+	long long	hits;			//Allocations served with a recycled buffer
+	long long	misses;			//Allocations that needed new memory
+	long long	discarded;		//Released buffers that were freed because of the memory cap
+	size_t		bytesHeld;		//Memory of the free buffers kept for recycling
+	size_t		buffersHeld;	//Number of free buffers kept for recycling
+
+	inline double GetHitRate() const { return requests > 0 ? (double)hits / (double)requests : 0.0; };
+};
+
+
+/*
+ * Class CImageBufferPool
+ *
+ * OpenCV matrix allocator that keeps released pixel buffers and hands them out again
+ * for matrices with the same type and size (e.g. the pages of a multi-page document).
+ *
+ * Released buffers are first kept in a small cache belonging to the releasing thread
+ * (threads are mapped to a fixed number of caches) and are passed on to the shared
+ * pool when that cache is full. The memory of all free buffers is limited by a cap:
+ * If a released buffer would exceed the cap, the least recently released free buffers
+ * (shared pool and thread caches) are freed first. Only if that is not enough, or the buffer
+ * is larger than the cap, the released buffer itself is freed.
+ *
+ * Usage: COpenCvImage::SetBufferPool(pool) (see COpenCvImage::AllocateMatrix())
+ * or set the 'allocator' of a cv::Mat before calling create().
+ * The pool has to stay alive until all matrices allocated by it have been released.
+ */
+class CImageBufferPool : public cv::MatAllocator
+{
+public:
+	static const size_t DEFAULT_MAX_BYTES_HELD	= 256 * 1024 * 1024;
+	static const int	THREAD_CACHE_COUNT		= 16;
+	static const int	THREAD_CACHE_SIZE		= 4;	//Free buffers per thread cache
+
+private:
+	/*
+	 * Pool key (type and size in bytes of a buffer)
+	 */
+	struct CBufferKey
+	{
+		int		type;
+		size_t	size;
+
+		inline bool operator<(const CBufferKey & other) const
+		{
+			return type < other.type || (type == other.type && size < other.size);
+		};
+		inline bool operator==(const CBufferKey & other) const
+		{
+			return type == other.type && size == other.size;
+		};
+	};
+
+	/*
+	 * Free buffer with its release sequence number (age)
+	 */
+	struct CFreeBuffer
+	{
+		CBufferKey			key;
+		uchar *				buffer;
+		unsigned long long	sequence;
+	};
+
+	typedef std::list<CFreeBuffer> CFreeBufferList;
+
+	/*
+	 * Small cache of free buffers used by a group of threads (oldest first)
+	 */
+	struct CThreadCache
+	{
+		CCriticalSection			lock;
+		std::vector<CFreeBuffer>	buffers;
+	};
+
+public:
+	CImageBufferPool(size_t maxBytesHeld = DEFAULT_MAX_BYTES_HELD);
+	~CImageBufferPool();
+
+	//cv::MatAllocator
+	cv::UMatData *	allocate(int dims, const int * sizes, int type, void * data, size_t * step,
+							 int flags, cv::UMatUsageFlags usageFlags) const;
+	bool			allocate(cv::UMatData * data, int accessflags, cv::UMatUsageFlags usageFlags) const;
+	void			deallocate(cv::UMatData * data) const;
+
+	void			SetMaxBytesHeld(size_t maxBytesHeld);
+	inline size_t	GetMaxBytesHeld() const { return m_MaxBytesHeld; };
+
+	void Clear();
+
+	CImageBufferPoolStatistics	GetStatistics() const;
+	inline double				GetHitRate() const { return GetStatistics().GetHitRate(); };
+	void						ResetStatistics();
+
+private:
+	uchar *			TakeBuffer(const CBufferKey & key) const;
+	void			ReturnBuffer(const CBufferKey & key, uchar * buffer) const;
+	bool			ReserveBytes(size_t size) const;
+	void			TrimToMaxBytes() const;
+	bool			FreeOldestBuffer() const;
+	void			InsertIntoSharedPool(const CFreeBuffer & freeBuffer) const;
+	CThreadCache &	GetThreadCache() const;
+
+private:
+	std::atomic<size_t>								m_MaxBytesHeld;
+
+	mutable CCriticalSection						m_CriticalSect;		//For m_SharedBuffers and m_FreeBuffers
+	mutable CFreeBufferList							m_SharedBuffers;	//Shared pool in release order (oldest first)
+	mutable std::multimap<CBufferKey, CFreeBufferList::iterator>	m_FreeBuffers;	//Index of the shared pool
+	mutable CThreadCache							m_ThreadCaches[THREAD_CACHE_COUNT];
+	mutable std::atomic<unsigned long long>			m_ReleaseSequence;	//Age of released buffers
+
+	mutable std::atomic<size_t>						m_BytesHeld;
+	mutable std::atomic<size_t>						m_BuffersHeld;
+	mutable std::atomic<long long>					m_Requests;
+	mutable std::atomic<long long>					m_Hits;
+	mutable std::atomic<long long>					m_Discarded;
+};
+
+
+}
+
+#endif
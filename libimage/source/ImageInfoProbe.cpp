@@ -0,0 +1,395 @@
+#include "ImageInfoProbe.h"
+#include "OpenCvTiffReader.h"
+#include <vector>
+#include <climits>
+#include <cmath>
+
+namespace PRImA {
+
+
+/*
+ * Class CImageInfoProbe
+ *
+ * Reads image metadata from the file headers without decoding any pixel data.
+ */
+
+/*
+ * Reads the metadata of the given image file (for multi-page files: size and depth of the first page).
+ * Only the headers are read (up to the first pixel data).
+ * Returns NULL if the file could not be read or the format is not supported.
+ */
+CImageInfo * CImageInfoProbe::Probe(CUniString filePath)
+{
+	if (filePath.IsEmpty())
+		return NULL;
+
+	FILE * file = fopen(filePath.ToC_Str(), "rb");
+	if (file == NULL)
+		return NULL;
+
+	uchar signature[12];
+	size_t n = fread(signature, 1, 12, file);
+
+	CImageInfo * info = new CImageInfo();
+	bool success = false;
+	if (n >= 8 && memcmp(signature, "\x89PNG\r\n\x1A\n", 8) == 0)
+		success = ProbePng(file, info);
+	else if (n >= 3 && signature[0] == 0xFF && signature[1] == 0xD8 && signature[2] == 0xFF)
+		success = ProbeJpeg(file, info);
+	else if (n >= 2 && signature[0] == 'B' && signature[1] == 'M')
+		success = ProbeBmp(file, info);
+	else if (n >= 12 && memcmp(signature, "\0\0\0\x0CjP  \r\n\x87\n", 12) == 0)
+		success = ProbeJp2(file, info);
+	else if (n >= 4 && signature[0] == 0xFF && signature[1] == 0x4F && signature[2] == 0xFF && signature[3] == 0x51)
+		success = ProbeJ2k(file, info);
+	else if (n >= 4 && ((signature[0] == 'I' && signature[1] == 'I' && (signature[2] == 42 || signature[2] == 43) && signature[3] == 0)
+					|| (signature[0] == 'M' && signature[1] == 'M' && signature[2] == 0 && (signature[3] == 42 || signature[3] == 43))))
+	{
+		fclose(file);
+		file = NULL;
+		success = ProbeTiff(filePath, info); //Classic TIFF and BigTIFF
+	}
+
+	if (file != NULL)
+		fclose(file);
+	if (!success)
+	{
+		delete info;
+		return NULL;
+	}
+	return info;
+}
+
+/*
+ * PNG - Image header chunk (IHDR) and physical pixel dimensions (pHYs)
+ */
+bool CImageInfoProbe::ProbePng(FILE * file, CImageInfo * info)
+{
+	fseek(file, 8, SEEK_SET);
+
+	bool headerFound = false;
+	uchar chunk[13];
+	while (fread(chunk, 1, 8, file) == 8)
+	{
+		long length = (long)ReadUInt32BE(chunk);
+		long next = ftell(file) + length + 4; //Data and CRC
+
+		if (memcmp(chunk + 4, "IHDR", 4) == 0)
+		{
+			if (length < 13 || fread(chunk, 1, 13, file) != 13)
+				return false;
+			info->width = (int)ReadUInt32BE(chunk);
+			info->height = (int)ReadUInt32BE(chunk + 4);
+			int bitDepth = chunk[8];
+			switch (chunk[9]) //Colour type
+			{
+				case 0:		info->channels = 1; break;	//Grey
+				case 2:		info->channels = 3; break;	//RGB
+				case 3:		info->channels = 1; break;	//Palette
+				case 4:		info->channels = 2; break;	//Grey and alpha
+				case 6:		info->channels = 4; break;	//RGB and alpha
+				default:	return false;
+			}
+			info->bitsPerPixel = bitDepth * info->channels;
+			info->blackAndWhite = chunk[9] == 0 && bitDepth == 1; //Palette images can have any two colours
+			headerFound = true;
+		}
+		else if (memcmp(chunk + 4, "pHYs", 4) == 0)
+		{
+			if (length >= 9 && fread(chunk, 1, 9, file) == 9 && chunk[8] == 1) //Unit is metre
+			{
+				info->resolutionX = (float)ReadUInt32BE(chunk) * 0.0254f;
+				info->resolutionY = (float)ReadUInt32BE(chunk + 4) * 0.0254f;
+			}
+		}
+		else if (memcmp(chunk + 4, "IDAT", 4) == 0 || memcmp(chunk + 4, "IEND", 4) == 0)
+			break; //Pixel data (pHYs has to be placed before)
+
+		if (fseek(file, next, SEEK_SET) != 0)
+			break;
+	}
+	info->pageCount = 1;
+	return headerFound;
+}
+
+/*
+ * JPEG - Frame header (SOFn), JFIF header (APP0) and EXIF resolution (APP1).
+ * The segments are skipped up to the frame header.
+ */
+bool CImageInfoProbe::ProbeJpeg(FILE * file, CImageInfo * info)
+{
+	fseek(file, 2, SEEK_SET);
+
+	bool frameFound = false;
+	bool jfifResolution = false;
+	while (!frameFound)
+	{
+		int marker = fgetc(file);
+		if (marker != 0xFF)
+			break; //Corrupt or end of file
+		while (marker == 0xFF) //Fill bytes
+			marker = fgetc(file);
+		if (marker == EOF || marker == 0xD9 || marker == 0xDA)
+			break; //End of image or start of scan (no frame header)
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+			continue; //Markers without segment
+
+		uchar buffer[14];
+		if (fread(buffer, 1, 2, file) != 2)
+			break;
+		long length = (long)ReadUInt16BE(buffer) - 2;
+		if (length < 0)
+			break;
+		long next = ftell(file) + length;
+
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) //Start of frame
+		{
+			if (length < 6 || fread(buffer, 1, 6, file) != 6)
+				break;
+			info->height = ReadUInt16BE(buffer + 1);
+			info->width = ReadUInt16BE(buffer + 3);
+			info->channels = buffer[5];
+			info->bitsPerPixel = buffer[0] * buffer[5];
+			frameFound = true;
+		}
+		else if (marker == 0xE0 && length >= 12) //JFIF
+		{
+			if (fread(buffer, 1, 12, file) == 12 && memcmp(buffer, "JFIF\0", 5) == 0 && (buffer[7] == 1 || buffer[7] == 2))
+			{
+				float factor = buffer[7] == 2 ? 2.54f : 1.0f; //Dots per cm or per inch
+				info->resolutionX = ReadUInt16BE(buffer + 8) * factor;
+				info->resolutionY = ReadUInt16BE(buffer + 10) * factor;
+				jfifResolution = true;
+			}
+		}
+		else if (marker == 0xE1 && length > 14 && !jfifResolution) //EXIF
+		{
+			std::vector<uchar> data((size_t)length);
+			if (fread(data.data(), 1, data.size(), file) == data.size() && memcmp(data.data(), "Exif\0\0", 6) == 0)
+				ReadExifResolution(data.data() + 6, data.size() - 6, info);
+		}
+
+		if (fseek(file, next, SEEK_SET) != 0)
+			break;
+	}
+	info->pageCount = 1;
+	return frameFound;
+}
+
+/*
+ * Reads the resolution from the first image file directory of EXIF data (TIFF structure)
+ */
+void CImageInfoProbe::ReadExifResolution(const uchar * data, size_t size, CImageInfo * info)
+{
+	if (size < 8)
+		return;
+	bool littleEndian = data[0] == 'I';
+
+	size_t ifd = littleEndian ? ReadUInt32LE(data + 4) : ReadUInt32BE(data + 4);
+	if (ifd + 2 > size)
+		return;
+	int entries = littleEndian ? ReadUInt16LE(data + ifd) : ReadUInt16BE(data + ifd);
+
+	float x = 0.0f, y = 0.0f;
+	int unit = 2; //Inch
+	for (int i = 0; i < entries; i++)
+	{
+		const uchar * entry = data + ifd + 2 + i * 12;
+		if (entry + 12 > data + size)
+			break;
+		int tag = littleEndian ? ReadUInt16LE(entry) : ReadUInt16BE(entry);
+		if (tag == 282 || tag == 283) //X/Y resolution (rational)
+		{
+			size_t offset = littleEndian ? ReadUInt32LE(entry + 8) : ReadUInt32BE(entry + 8);
+			if (offset + 8 > size)
+				continue;
+			unsigned int numerator = littleEndian ? ReadUInt32LE(data + offset) : ReadUInt32BE(data + offset);
+			unsigned int denominator = littleEndian ? ReadUInt32LE(data + offset + 4) : ReadUInt32BE(data + offset + 4);
+			float value = denominator != 0 ? (float)numerator / (float)denominator : 0.0f;
+			if (tag == 282)
+				x = value;
+			else
+				y = value;
+		}
+		else if (tag == 296) //Resolution unit (short)
+			unit = littleEndian ? ReadUInt16LE(entry + 8) : ReadUInt16BE(entry + 8);
+	}
+
+	if (unit == 2 || unit == 3)
+	{
+		float factor = unit == 3 ? 2.54f : 1.0f;
+		info->resolutionX = x * factor;
+		info->resolutionY = y * factor;
+	}
+}
+
+/*
+ * BMP - Bitmap info header (BITMAPCOREHEADER or BITMAPINFOHEADER and later versions)
+ */
+bool CImageInfoProbe::ProbeBmp(FILE * file, CImageInfo * info)
+{
+	fseek(file, 0, SEEK_SET);
+
+	uchar header[54];
+	size_t n = fread(header, 1, 54, file);
+	if (n < 26)
+		return false;
+
+	unsigned int headerSize = ReadUInt32LE(header + 14);
+	int bitCount;
+	if (headerSize == 12) //Core header
+	{
+		info->width = ReadUInt16LE(header + 18);
+		info->height = ReadUInt16LE(header + 20);
+		bitCount = ReadUInt16LE(header + 24);
+	}
+	else if (headerSize >= 40 && n >= 54)
+	{
+		info->width = (int)ReadUInt32LE(header + 18);
+		info->height = abs((int)ReadUInt32LE(header + 22)); //Negative for top-down bitmaps
+		bitCount = ReadUInt16LE(header + 28);
+		int pixelsPerMetreX = (int)ReadUInt32LE(header + 38);
+		int pixelsPerMetreY = (int)ReadUInt32LE(header + 42);
+		if (pixelsPerMetreX > 0 && pixelsPerMetreY > 0)
+		{
+			info->resolutionX = pixelsPerMetreX * 0.0254f;
+			info->resolutionY = pixelsPerMetreY * 0.0254f;
+		}
+	}
+	else
+		return false;
+
+	info->bitsPerPixel = bitCount;
+	info->channels = bitCount <= 8 ? 1 : (bitCount == 32 ? 4 : 3); //Palette images have one channel
+	info->pageCount = 1;
+
+	//1 bit images are black and white only if the palette is (the two colours can be anything)
+	if (bitCount == 1)
+	{
+		int entrySize = headerSize == 12 ? 3 : 4; //RGBTRIPLE or RGBQUAD
+		uchar palette[8];
+		if (fseek(file, 14 + (long)headerSize, SEEK_SET) == 0 && fread(palette, 1, 2 * entrySize, file) == (size_t)(2 * entrySize))
+		{
+			const uchar * first = palette;
+			const uchar * second = palette + entrySize;
+			bool firstBlack = first[0] == 0 && first[1] == 0 && first[2] == 0;
+			bool firstWhite = first[0] == 0xFF && first[1] == 0xFF && first[2] == 0xFF;
+			bool secondBlack = second[0] == 0 && second[1] == 0 && second[2] == 0;
+			bool secondWhite = second[0] == 0xFF && second[1] == 0xFF && second[2] == 0xFF;
+			info->blackAndWhite = (firstBlack && secondWhite) || (firstWhite && secondBlack);
+		}
+	}
+	return true;
+}
+
+/*
+ * JPEG 2000 (JP2 file format) - Image header box (ihdr) and resolution boxes (resc, resd) of the JP2 header box
+ */
+bool CImageInfoProbe::ProbeJp2(FILE * file, CImageInfo * info)
+{
+	fseek(file, 12, SEEK_SET); //After signature box
+
+	bool headerFound = false;
+	bool captureResolution = false;
+	long end = LONG_MAX; //End of the current super box
+	uchar buffer[16];
+	while (ftell(file) < end && fread(buffer, 1, 8, file) == 8)
+	{
+		long start = ftell(file) - 8;
+		long long length = ReadUInt32BE(buffer);
+		if (length == 1) //Extended length
+		{
+			if (fread(buffer + 8, 1, 8, file) != 8)
+				break;
+			length = ((long long)ReadUInt32BE(buffer + 8) << 32) | ReadUInt32BE(buffer + 12);
+		}
+		else if (length == 0) //Up to the end of the file
+			length = LLONG_MAX / 2;
+		const uchar * type = buffer + 4;
+
+		if (memcmp(type, "jp2h", 4) == 0 || memcmp(type, "res ", 4) == 0)
+		{
+			//Super box - Continue with the contained boxes
+			end = (long)min((long long)end, start + length);
+			continue;
+		}
+		if (memcmp(type, "jp2c", 4) == 0)
+			break; //Codestream
+
+		if (memcmp(type, "ihdr", 4) == 0)
+		{
+			if (fread(buffer, 1, 14, file) != 14)
+				break;
+			info->height = (int)ReadUInt32BE(buffer);
+			info->width = (int)ReadUInt32BE(buffer + 4);
+			info->channels = ReadUInt16BE(buffer + 8);
+			if (buffer[10] != 0xFF) //Otherwise different depths per component
+				info->bitsPerPixel = ((buffer[10] & 0x7F) + 1) * info->channels;
+			headerFound = true;
+		}
+		else if (memcmp(type, "resc", 4) == 0 || (memcmp(type, "resd", 4) == 0 && !captureResolution))
+		{
+			if (fread(buffer, 1, 10, file) == 10 && ReadJp2Resolution(buffer, info))
+				captureResolution = memcmp(type, "resc", 4) == 0;
+		}
+
+		if (start + length >= end || fseek(file, (long)(start + length), SEEK_SET) != 0)
+			break;
+	}
+	info->pageCount = 1;
+	return headerFound;
+}
+
+/*
+ * Reads a JPEG 2000 resolution box (grid points per metre as fractions with decimal exponents)
+ */
+bool CImageInfoProbe::ReadJp2Resolution(const uchar * data, CImageInfo * info)
+{
+	unsigned short verticalNumerator = ReadUInt16BE(data);
+	unsigned short verticalDenominator = ReadUInt16BE(data + 2);
+	unsigned short horizontalNumerator = ReadUInt16BE(data + 4);
+	unsigned short horizontalDenominator = ReadUInt16BE(data + 6);
+	if (verticalDenominator == 0 || horizontalDenominator == 0)
+		return false;
+
+	info->resolutionY = (float)(verticalNumerator * pow(10.0, (signed char)data[8]) / verticalDenominator * 0.0254);
+	info->resolutionX = (float)(horizontalNumerator * pow(10.0, (signed char)data[9]) / horizontalDenominator * 0.0254);
+	return true;
+}
+
+/*
+ * JPEG 2000 codestream - Image and tile size marker segment (SIZ)
+ */
+bool CImageInfoProbe::ProbeJ2k(FILE * file, CImageInfo * info)
+{
+	fseek(file, 0, SEEK_SET);
+
+	uchar header[45];
+	if (fread(header, 1, 45, file) != 45)
+		return false;
+
+	info->width = (int)(ReadUInt32BE(header + 8) - ReadUInt32BE(header + 16));
+	info->height = (int)(ReadUInt32BE(header + 12) - ReadUInt32BE(header + 20));
+	info->channels = ReadUInt16BE(header + 40);
+	info->bitsPerPixel = ((header[42] & 0x7F) + 1) * info->channels;
+	info->pageCount = 1;
+	return info->width > 0 && info->height > 0;
+}
+
+/*
+ * TIFF - First image file directory (via libtiff, no pixel data is read) and number of directories
+ */
+bool CImageInfoProbe::ProbeTiff(CUniString filePath, CImageInfo * info)
+{
+	COpenCvTiffReader tiffReader;
+	if (!tiffReader.Open(filePath))
+		return false;
+
+	CImageInfo * pageInfo = tiffReader.ReadImageInfo();
+	*info = *pageInfo;
+	delete pageInfo;
+	return info->width > 0 && info->height > 0;
+}
+
+
+} //end namespace
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "opencvimage.h"
+#include <cstdio>
+
+namespace PRImA {
+
+/*
+ * Class CImageInfoProbe
+ *
+ * Reads image metadata (width, height, bits per pixel, channels, page count and resolution)
+ * from the file headers without decoding any pixel data.
+ * Supported formats: PNG, JPEG (JFIF and EXIF resolution), BMP, JPEG 2000 (JP2 and raw codestream)
+ * and TIFF. The format is detected from the file signature, not from the extension.
+ */
+class CImageInfoProbe
+{
+private:
+	CImageInfoProbe(void);
+
+public:
+	static CImageInfo * Probe(CUniString filePath);
+
+private:
+	static bool ProbePng(FILE * file, CImageInfo * info);
+	static bool ProbeJpeg(FILE * file, CImageInfo * info);
+	static bool ProbeBmp(FILE * file, CImageInfo * info);
+	static bool ProbeJp2(FILE * file, CImageInfo * info);
+	static bool ProbeJ2k(FILE * file, CImageInfo * info);
+	static bool ProbeTiff(CUniString filePath, CImageInfo * info);
+
+	static void ReadExifResolution(const uchar * data, size_t size, CImageInfo * info);
+	static bool ReadJp2Resolution(const uchar * data, CImageInfo * info);
+
+	static inline unsigned int		ReadUInt32BE(const uchar * p) { return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3]; };
+	static inline unsigned short	ReadUInt16BE(const uchar * p) { return (unsigned short)((p[0] << 8) | p[1]); };
+	static inline unsigned int		ReadUInt32LE(const uchar * p) { return ((unsigned int)p[3] << 24) | ((unsigned int)p[2] << 16) | ((unsigned int)p[1] << 8) | p[0]; };
+	static inline unsigned short	ReadUInt16LE(const uchar * p) { return (unsigned short)((p[1] << 8) | p[0]); };
+};
+
+} //end namespace
@@ -1,5 +1,8 @@
 #include "StdAfx.h"
 #include "ImageTransformer.h"
+#include "LocalStatistics.h"
+#include "RowKernelHelpers.h"
+#include "BinaryMorphology.h"
 #include "math.h"
 #include "typeinfo.h"
 
@@ -26,11 +29,11 @@ COpenCvImage * CImageTransformer::Resize(COpenCvImage * image, int newWidth, int
 	if (newWidth < 1 || newHeight < 1 || image == NULL)
 		return NULL;
 
-	Mat resizedData(newHeight, newWidth, image->GetData().type());
+	Mat resizedData = COpenCvImage::AllocateMatrix(newHeight, newWidth, image->GetData(false).type());
 
 	int method = highQuality ? INTER_AREA : INTER_LINEAR;
 
-	resize(image->GetData(), resizedData, Size(newWidth, newHeight), 0.0, 0.0, method);
+	resize(image->GetData(false), resizedData, Size(newWidth, newHeight), 0.0, 0.0, method);
 
 	int type = COpenCvImage::TYPE_COLOUR;
 	if (typeid(*image) == typeid(COpenCvBiLevelImage))
@@ -50,14 +53,14 @@ void CImageTransformer::Rotate(COpenCvImage * source, bool clockwise)
 	//1=CW, 2=CCW, 3=180
 	if (clockwise)
 	{
-		Mat temp = source->GetData().t();
+		Mat temp = source->GetData(false).t();
 		//transpose(source->GetData(), source->GetData());  
 		flip(temp, temp, 1); //transpose+flip(1)=CW
 		source->SetData(temp);
 	} 
 	else //Counter clockwise
 	{
-		Mat temp = source->GetData().t();
+		Mat temp = source->GetData(false).t();
 		//transpose(source->GetData(), source->GetData());  
 		flip(temp, temp, 0); //transpose+flip(0)=CCW     
 		source->SetData(temp);
@@ -105,367 +108,136 @@ COpenCvImage * CImageTransformer::Dilate(COpenCvImage * image)
 }
 
 /*
- * Erosion of binary image
+ * Erosion of binary image (3x3 cross, pixels outside the image are white)
+ * See CBinaryMorphology for other structuring elements and operations.
  */
 COpenCvImage * CImageTransformer::Erode(COpenCvBiLevelImage * image)
 {
-	COpenCvBiLevelImage * res = (COpenCvBiLevelImage*)image->CreateSubImage(0, 0, image->GetWidth(), image->GetHeight());
-
-	int x,y;
-
-	//Set the border to white
-	x = image->GetWidth()-1;
-	for (int y=0; y<image->GetHeight(); y++)
-	{
-		res->SetWhite(0, y);
-		if (x >= 0)
-			res->SetWhite(x, y);
-	}
-	y = image->GetHeight()-1;
-	for (int x=0; x<image->GetWidth(); x++)
-	{
-		res->SetWhite(x, 0);
-		if (y >= 0)
-			res->SetWhite(x, y);
-	}
-
-	//Now erode the rest
-	for (y=1; y<image->GetHeight()-1; y++)
-	{
-		for (x=1; x<image->GetWidth()-1; x++)
-		{
-			if (image->IsBlack(x,y)) 
-			{
-				if (image->IsWhite(x-1,y)
-					||	image->IsWhite(x+1,y)
-					||	image->IsWhite(x,y-1)
-					||	image->IsWhite(x,y+1))
-				{
-					res->SetWhite(x,y);
-				}
-			}
-		}
-	}
-	return res;
+	return CBinaryMorphology::Apply(image, CBinaryMorphology::OPERATION_ERODE, CStructuringElement::Cross(3));
 }
 
 /*
- * Dilation of binary image
+ * Dilation of binary image (3x3 cross)
+ * See CBinaryMorphology for other structuring elements and operations.
  */
 COpenCvImage * CImageTransformer::Dilate(COpenCvBiLevelImage * image)
 {
-	COpenCvBiLevelImage * res = (COpenCvBiLevelImage*)image->CreateSubImage(0, 0, image->GetWidth(), image->GetHeight());
-
-	int x,y;
-
-	//Horizontally
-	for (y=0; y<image->GetHeight(); y++)
-	{
-		for (x=1; x<image->GetWidth()-1; x++)
-		{
-			if (image->IsBlack(x,y))
-			{
-				res->SetBlack(x-1,y);
-				res->SetBlack(x+1,y);
-			}
-		}
-	}
-	//Vertically
-	for (x=0; x<image->GetWidth(); x++)
-	{
-		for (y=1; y<image->GetHeight()-1; y++)
-		{
-			if (image->IsBlack(x,y))
-			{
-				res->SetBlack(x,y-1);
-				res->SetBlack(x,y+1);
-			}
-		}
-	}
-	return res;
+	return CBinaryMorphology::Apply(image, CBinaryMorphology::OPERATION_DILATE, CStructuringElement::Cross(3));
 }
 
 /*
- * Erosion of greyscale image
+ * Erosion of greyscale image (maximum over the pixel and its 4-neighbourhood, clipped at the borders).
+ * The cross is the union of a horizontal and a vertical line, so the result is the maximum of two line filters.
  */
 COpenCvImage * CImageTransformer::Erode(COpenCvGreyScaleImage * image)
 {
-	//TODO Use OpenCV method
-
-	COpenCvGreyScaleImage * res = (COpenCvGreyScaleImage*)image->Clone();
+	Mat src = image->GetData(false);
+	Mat horizontal, vertical;
+	CLocalStatistics::MaxFilter(src, horizontal, 1, 0);
+	CLocalStatistics::MaxFilter(src, vertical, 0, 1);
+	cv::max(horizontal, vertical, horizontal);
+	return CreateGreyScaleResult(image, horizontal);
+}
 
-	int x,y,i,max;
-	int right = image->GetWidth()-1;
-	int bottom = image->GetHeight()-1;
-	int * arr = new int[5];
+/*
+ * Dilation of greyscale image (minimum over the pixel and its 4-neighbourhood, clipped at the borders)
+ */
+COpenCvImage * CImageTransformer::Dilate(COpenCvGreyScaleImage * image)
+{
+	Mat src = image->GetData(false);
+	Mat horizontal, vertical;
+	CLocalStatistics::MinFilter(src, horizontal, 1, 0);
+	CLocalStatistics::MinFilter(src, vertical, 0, 1);
+	cv::min(horizontal, vertical, horizontal);
+	return CreateGreyScaleResult(image, horizontal);
+}
 
-	//Corners
-	// Top Left
-	arr[0] = image->GetGreyLevel(0,0);
-	arr[1] = image->GetGreyLevel(0,1);
-	arr[2] = image->GetGreyLevel(1,0);
-	max = 0;
-	for (i=0; i<3; i++)
-	{
-		if (arr[i] > max)
-			max = arr[i];
-	}
-	res->SetGreyLevel(0,0,max);
-	// Top right
-	arr[0] = image->GetGreyLevel(right,0);
-	arr[1] = image->GetGreyLevel(right,1);
-	arr[2] = image->GetGreyLevel(right-1,0);
-	max = 0;
-	for (i=0; i<3; i++)
-	{
-		if (arr[i] > max)
-			max = arr[i];
-	}
-	res->SetGreyLevel(right,0,max);
-	// Bottom Left
-	arr[0] = image->GetGreyLevel(0,bottom);
-	arr[1] = image->GetGreyLevel(0,bottom-1);
-	arr[2] = image->GetGreyLevel(1,bottom);
-	max = 0;
-	for (i=0; i<3; i++)
-	{
-		if (arr[i] > max)
-			max = arr[i];
-	}
-	res->SetGreyLevel(0,bottom,max);
-	// Bottom Right
-	arr[0] = image->GetGreyLevel(right,bottom);
-	arr[1] = image->GetGreyLevel(right,bottom-1);
-	arr[2] = image->GetGreyLevel(right-1,bottom);
-	max = 0;
-	for (i=0; i<3; i++)
-	{
-		if (arr[i] > max)
-			max = arr[i];
-	}
-	res->SetGreyLevel(right,bottom,max);
-
-		//Borders
-	// Left, Right
-	for (y=1; y<bottom; y++)
-	{
-		//Left
-		arr[0] = image->GetGreyLevel(0,y);
-		arr[1] = image->GetGreyLevel(0,y-1);
-		arr[2] = image->GetGreyLevel(0,y+1);
-		arr[3] = image->GetGreyLevel(1,y);
-		max = 0;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] > max)
-				max = arr[i];
-		}
-		res->SetGreyLevel(0,y,max);
-		//Right
-		arr[0] = image->GetGreyLevel(right,y);
-		arr[1] = image->GetGreyLevel(right,y-1);
-		arr[2] = image->GetGreyLevel(right,y+1);
-		arr[3] = image->GetGreyLevel(right-1,y);
-		max = 0;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] > max)
-				max = arr[i];
-		}
-		res->SetGreyLevel(right,y,max);
-	}
-	// Top, Bottom
-	for (x=1; x<right; x++)
-	{
-		//Top
-		arr[0] = image->GetGreyLevel(x,0);
-		arr[1] = image->GetGreyLevel(x-1,0);
-		arr[2] = image->GetGreyLevel(x+1,0);
-		arr[3] = image->GetGreyLevel(x,1);
-		max = 0;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] > max)
-				max = arr[i];
-		}
-		res->SetGreyLevel(x,0,max);
-		//Right
-		arr[0] = image->GetGreyLevel(x,bottom);
-		arr[1] = image->GetGreyLevel(x-1,bottom);
-		arr[2] = image->GetGreyLevel(x+1,bottom);
-		arr[3] = image->GetGreyLevel(x,bottom-1);
-		max = 0;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] > max)
-				max = arr[i];
-		}
-		res->SetGreyLevel(x,bottom,max);
-	}
+/*
+ * Erosion with a rectangular structuring element (thins the dark objects of an image).
+ * Bilevel images: See CBinaryMorphology (pixels outside the image are white).
+ * Greyscale images: Maximum over the window (clipped at the borders). O(1) per pixel regardless of the
+ *                   window size (separable van Herk / Gil-Werman filter, see CLocalStatistics::MaxFilter()).
+ * Note: Works only for bilevel and greyscale images. For colour the input image is returned!
+ *
+ * 'width', 'height' - Size of the rectangle (origin in the centre, see CStructuringElement::Rectangle())
+ */
+COpenCvImage * CImageTransformer::Erode(COpenCvImage * image, int width, int height)
+{
+	return ApplyMorphology(image, CBinaryMorphology::OPERATION_ERODE, width, height);
+}
 
-	//Now erode the rest (center)
-	for (y=1; y<image->GetHeight()-1; y++)
-	{
-		for (x=1; x<image->GetWidth()-1; x++)
-		{
-			//Find the maximum grey value
-			max = 0;
-			arr[0] = image->GetGreyLevel(x,y);
-			arr[1] = image->GetGreyLevel(x-1,y);
-			arr[2] = image->GetGreyLevel(x+1,y);
-			arr[3] = image->GetGreyLevel(x,y-1);
-			arr[4] = image->GetGreyLevel(x,y+1);
-			for (i=0; i<5; i++)
-			{
-				if (arr[i] > max)
-					max = arr[i];
-			}
-			res->SetGreyLevel(x,y,max);
-		}
-	}
-	delete [] arr;
-	return res;
+/*
+ * Dilation with a rectangular structuring element (thickens the dark objects of an image).
+ * Greyscale images: Minimum over the reflected window (see Erode())
+ */
+COpenCvImage * CImageTransformer::Dilate(COpenCvImage * image, int width, int height)
+{
+	return ApplyMorphology(image, CBinaryMorphology::OPERATION_DILATE, width, height);
 }
 
 /*
- * Dilation of greyscale image
+ * Opening with a rectangular structuring element (erosion followed by dilation).
+ * Removes dark structures smaller than the rectangle, e.g. text for background estimation
+ * (a closing in the usual grey level convention where bright is foreground).
  */
-COpenCvImage * CImageTransformer::Dilate(COpenCvGreyScaleImage * image)
+COpenCvImage * CImageTransformer::Open(COpenCvImage * image, int width, int height)
 {
-	//TODO Use OpenCV method
+	return ApplyMorphology(image, CBinaryMorphology::OPERATION_OPEN, width, height);
+}
 
-	COpenCvGreyScaleImage * res = (COpenCvGreyScaleImage*)image->Clone();
+/*
+ * Closing with a rectangular structuring element (dilation followed by erosion).
+ * Fills bright gaps smaller than the rectangle.
+ */
+COpenCvImage * CImageTransformer::Close(COpenCvImage * image, int width, int height)
+{
+	return ApplyMorphology(image, CBinaryMorphology::OPERATION_CLOSE, width, height);
+}
 
-	int x,y, min, i;
-	int * arr = new int[5];
-	int right = image->GetWidth()-1;
-	int bottom = image->GetHeight()-1;
+/*
+ * Morphological operation with a rectangular structuring element (see Erode(), Dilate(), Open() and Close())
+ * 'operation' - One of CBinaryMorphology::OPERATION_ERODE, _DILATE, _OPEN or _CLOSE
+ */
+COpenCvImage * CImageTransformer::ApplyMorphology(COpenCvImage * image, int operation, int width, int height)
+{
+	if (image == NULL || width < 1 || height < 1)
+		return NULL;
 
-	//Corners
-	// Top Left
-	arr[0] = image->GetGreyLevel(0,0);
-	arr[1] = image->GetGreyLevel(0,1);
-	arr[2] = image->GetGreyLevel(1,0);
-	min = 256;
-	for (i=0; i<3; i++)
+	if (typeid(*image) == typeid(COpenCvBiLevelImage))
+		return CBinaryMorphology::Apply((COpenCvBiLevelImage*)image, operation, CStructuringElement::Rectangle(width, height));
+	if (typeid(*image) != typeid(COpenCvGreyScaleImage))
+		return image;
+
+	//Window of the element (erosion) and of the reflected element (dilation)
+	int left = width / 2;
+	int right = width - 1 - left;
+	int top = height / 2;
+	int bottom = height - 1 - top;
+
+	Mat result;
+	Mat src = image->GetData(false);
+	if (operation == CBinaryMorphology::OPERATION_ERODE || operation == CBinaryMorphology::OPERATION_OPEN)
 	{
-		if (arr[i] < min)
-			min = arr[i];
-	}
-	res->SetGreyLevel(0,0,min);
-	// Top right
-	arr[0] = image->GetGreyLevel(right,0);
-	arr[1] = image->GetGreyLevel(right,1);
-	arr[2] = image->GetGreyLevel(right-1,0);
-	min = 256;
-	for (i=0; i<3; i++)
-	{
-		if (arr[i] < min)
-			min = arr[i];
-	}
-	res->SetGreyLevel(right,0,min);
-	// Bottom Left
-	arr[0] = image->GetGreyLevel(0,bottom);
-	arr[1] = image->GetGreyLevel(0,bottom-1);
-	arr[2] = image->GetGreyLevel(1,bottom);
-	min = 256;
-	for (i=0; i<3; i++)
-	{
-		if (arr[i] < min)
-			min = arr[i];
-	}
-	res->SetGreyLevel(0,bottom,min);
-	// Bottom Right
-	arr[0] = image->GetGreyLevel(right,bottom);
-	arr[1] = image->GetGreyLevel(right,bottom-1);
-	arr[2] = image->GetGreyLevel(right-1,bottom);
-	min = 256;
-	for (i=0; i<3; i++)
-	{
-		if (arr[i] < min)
-			min = arr[i];
-	}
-	res->SetGreyLevel(right,bottom,min);
-
-	//Borders
-	// Left, Right
-	for (y=1; y<bottom; y++)
-	{
-		//Left
-		arr[0] = image->GetGreyLevel(0,y);
-		arr[1] = image->GetGreyLevel(0,y-1);
-		arr[2] = image->GetGreyLevel(0,y+1);
-		arr[3] = image->GetGreyLevel(1,y);
-		min = 256;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] < min)
-				min = arr[i];
-		}
-		res->SetGreyLevel(0,y,min);
-		//Right
-		arr[0] = image->GetGreyLevel(right,y);
-		arr[1] = image->GetGreyLevel(right,y-1);
-		arr[2] = image->GetGreyLevel(right,y+1);
-		arr[3] = image->GetGreyLevel(right-1,y);
-		min = 256;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] < min)
-				min = arr[i];
-		}
-		res->SetGreyLevel(right,y,min);
-	}
-	// Top, Bottom
-	for (x=1; x<right; x++)
-	{
-		//Top
-		arr[0] = image->GetGreyLevel(x,0);
-		arr[1] = image->GetGreyLevel(x-1,0);
-		arr[2] = image->GetGreyLevel(x+1,0);
-		arr[3] = image->GetGreyLevel(x,1);
-		min = 256;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] < min)
-				min = arr[i];
-		}
-		res->SetGreyLevel(x,0,min);
-		//Right
-		arr[0] = image->GetGreyLevel(x,bottom);
-		arr[1] = image->GetGreyLevel(x-1,bottom);
-		arr[2] = image->GetGreyLevel(x+1,bottom);
-		arr[3] = image->GetGreyLevel(x,bottom-1);
-		min = 256;
-		for (i=0; i<4; i++)
-		{
-			if (arr[i] < min)
-				min = arr[i];
-		}
-		res->SetGreyLevel(x,bottom,min);
+		CLocalStatistics::MaxFilter(src, result, left, right, top, bottom);
+		if (operation == CBinaryMorphology::OPERATION_OPEN)
+			CLocalStatistics::MinFilter(result, result, right, left, bottom, top);
 	}
-
-	//Rest (center)
-	for (y=1; y<bottom; y++)
+	else
 	{
-		for (x=1; x<right; x++)
-		{
-			//Find the minimum grey value
-			int min = 256;
-			arr[0] = image->GetGreyLevel(x,y);
-			arr[1] = image->GetGreyLevel(x-1,y);
-			arr[2] = image->GetGreyLevel(x+1,y);
-			arr[3] = image->GetGreyLevel(x,y-1);
-			arr[4] = image->GetGreyLevel(x,y+1);
-			for (i=0; i<5; i++)
-			{
-				if (arr[i] < min)
-					min = arr[i];
-			}
-			res->SetGreyLevel(x,y,min);
-		}
+		CLocalStatistics::MinFilter(src, result, right, left, bottom, top);
+		if (operation == CBinaryMorphology::OPERATION_CLOSE)
+			CLocalStatistics::MaxFilter(result, result, left, right, top, bottom);
 	}
-	delete [] arr;
+	return CreateGreyScaleResult((COpenCvGreyScaleImage*)image, result);
+}
+
+/*
+ * Creates a greyscale image for the given pixel data with the image info of the source image
+ */
+COpenCvImage * CImageTransformer::CreateGreyScaleResult(COpenCvGreyScaleImage * source, Mat data)
+{
+	COpenCvImage * res = COpenCvImage::Create(data, COpenCvImage::TYPE_GREYSCALE, false);
+	res->CopyImageInfo(source->GetImageInfo());
 	return res;
 }
 
@@ -481,7 +253,7 @@ COpenCvBiLevelImage * CImageTransformer::Binarize(COpenCvImage * source, int thr
 	//Create image
 	COpenCvBiLevelImage * destImage = NULL;
 	
-	if (source->GetData().channels() == 1)
+	if (source->GetData(false).channels() == 1)
 	{
 		destImage = COpenCvImage::CreateB(source->GetWidth(), source->GetHeight(), RGBWHITE);
 		destImage->CopyImageInfo(source->GetImageInfo());
@@ -489,19 +261,19 @@ COpenCvBiLevelImage * CImageTransformer::Binarize(COpenCvImage * source, int thr
 	else //Source is RGB
 	{
 		Mat destMat;
-		cvtColor(source->GetData(), destMat, CV_RGB2GRAY, 1);
+		cvtColor(source->GetData(false), destMat, CV_RGB2GRAY, 1);
 		destImage = (COpenCvBiLevelImage*)COpenCvImage::Create(destMat, COpenCvImage::TYPE_BILEVEL, false);
 		destImage->CopyImageInfo(source->GetImageInfo());
 		source = destImage;
 	}
 
-	int maxVal = COpenCvImage::CalcMaxValueForColorChannel(destImage->GetData());
+	int maxVal = COpenCvImage::CalcMaxValueForColorChannel(destImage->GetData(false));
 	thresh = min(maxVal, thresh);
 	thresh = max(0, thresh);
 
 	try
 	{
-		threshold(source->GetData(), destImage->GetData(), thresh, maxVal, 
+		threshold(source->GetData(false), destImage->GetData(), thresh, maxVal, 
 					THRESH_BINARY);
 	}
 	catch (Exception & exc)
@@ -522,7 +294,7 @@ COpenCvBiLevelImage * CImageTransformer::OtsuBinarization(COpenCvImage * source)
 	//Create image
 	COpenCvBiLevelImage * destImage = NULL;
 	
-	if (source->GetData().channels() == 1)
+	if (source->GetData(false).channels() == 1)
 	{
 		destImage = COpenCvImage::CreateB(source->GetWidth(), source->GetHeight(), RGBWHITE);
 		destImage->CopyImageInfo(source->GetImageInfo());
@@ -530,18 +302,18 @@ COpenCvBiLevelImage * CImageTransformer::OtsuBinarization(COpenCvImage * source)
 	else //Source is RGB
 	{
 		Mat destMat;
-		cvtColor(source->GetData(), destMat, CV_RGB2GRAY, 1);
+		cvtColor(source->GetData(false), destMat, CV_RGB2GRAY, 1);
 		destImage = (COpenCvBiLevelImage*)COpenCvImage::Create(destMat, COpenCvImage::TYPE_BILEVEL, false);
 		destImage->CopyImageInfo(source->GetImageInfo());
 		source = destImage;
 	}
 
-	int maxVal = COpenCvImage::CalcMaxValueForColorChannel(destImage->GetData());
+	int maxVal = COpenCvImage::CalcMaxValueForColorChannel(destImage->GetData(false));
 	int thresh = 0;
 
 	try
 	{
-		threshold(source->GetData(), destImage->GetData(), thresh, maxVal, 
+		threshold(source->GetData(false), destImage->GetData(), thresh, maxVal, 
 					THRESH_BINARY | THRESH_OTSU);
 	}
 	catch (Exception & exc)
@@ -570,10 +342,10 @@ COpenCvBiLevelImage * CImageTransformer::OtsuBinarization(COpenCvImage * source)
 		info->resolutionY = source->GetImageInfo()->resolutionY;
 	}
 
-	int maxVal = COpenCvImage::CalcMaxValueForColorChannel(destImage->GetData());
+	int maxVal = COpenCvImage::CalcMaxValueForColorChannel(destImage->GetData(false));
 	int thresh = 0;
 
-	threshold(source->GetData(), destImage->GetData(), thresh, maxVal, 
+	threshold(source->GetData(false), destImage->GetData(), thresh, maxVal, 
 				THRESH_BINARY | THRESH_OTSU);
 
 	return destImage;
@@ -679,15 +451,17 @@ COpenCvBiLevelImage * CImageTransformer::OtsuBinarization(COpenCvImage * source)
 //    pdef("w",40,"Local window size. Should always be positive");
 //}
 
-COpenCvBiLevelImage * CImageTransformer::SauvolaBinarization(COpenCvImage * source, double k /*= 0.3*/, int w /*= 40*/,
-													   CAlgorithm * stopSignalSource /*= NULL*/)
-{
-	if (source == NULL || typeid(*source) == typeid(COpenCvBiLevelImage))
-		return NULL;
+//Local binarisation methods
+static const int LOCAL_SAUVOLA	= 0;
+static const int LOCAL_NIBLACK	= 1;
+static const int LOCAL_WOLF		= 2;
+static const int LOCAL_NICK		= 3;
 
-	bool isGreyScale = 	typeid(*source) == typeid(COpenCvGreyScaleImage);
-
-	//Check params
+/*
+ * Clamps the parameters of the Sauvola binarisation ('k' to 0.05..0.95, 'w' to 0..1000)
+ */
+static void CheckSauvolaParams(double & k, int & w)
+{
     if(k<0.05)
 		k = 0.05;
 	if (k > 0.95)
@@ -696,178 +470,501 @@ COpenCvBiLevelImage * CImageTransformer::SauvolaBinarization(COpenCvImage * sour
 		w = 0;
 	if (w>1000)
 		w = 1000;
+}
 
-	int whalf = w / 2;
-
-	//Create image
-	COpenCvBiLevelImage * destImage = COpenCvImage::CreateB(source->GetWidth(), source->GetHeight(), RGBWHITE);
-	destImage->CopyImageInfo(source->GetImageInfo());
-
-	const int image_width  = source->GetWidth();
-	const int image_height = source->GetHeight();
-
-    // Calculate the integral image, and integral of the squared image
-	int64_t ** integral_image = new int64_t * [image_height];
-	int64_t ** rowsum_image = new int64_t * [image_height];
-	int64_t ** integral_sqimg = new int64_t * [image_height];
-	int64_t ** rowsum_sqimg = new int64_t * [image_height];
-	int i = 0;
-	try {
-		for (i=0; i<image_height; i++)
+/*
+ * Computes the local thresholds of one row (see CLocalThresholdKernel) from the local means and variances ('n' values).
+ * Same operation order as the scalar formulas, so the SIMD part yields identical thresholds.
+ *
+ * 'minGrey', 'maxDeviation' - Image statistics (Wolf-Jolion only)
+ */
+static void LocalThresholds(int method, double k, double minGrey, double maxDeviation,
+							const double * means, const double * variances, double * thresholds, int n)
+{
+	int x = 0;
+#if CV_SIMD128_64F
+	v_float64x2 vk = v_setall_f64(k);
+	v_float64x2 one = v_setall_f64(1.0);
+	switch (method)
+	{
+	case LOCAL_SAUVOLA:
 		{
-			integral_image[i] = new int64_t[image_width];
-			rowsum_image[i] = new int64_t[image_width];
-			integral_sqimg[i] = new int64_t[image_width];
-			rowsum_sqimg[i] = new int64_t[image_width];
-			if (	integral_image[i] == NULL
-				||	rowsum_image[i] == NULL
-				||	integral_sqimg[i] == NULL
-				||	rowsum_sqimg[i] == NULL)
+			v_float64x2 r = v_setall_f64(128.0);
+			for (; x <= n - 2; x += 2)
 			{
-				CleanUpForSauvola(integral_image, rowsum_image, integral_sqimg, rowsum_sqimg, i-1);
-				delete destImage;
-				return NULL;
+				v_float64x2 m = v_load(means + x);
+				v_store(thresholds + x, m * (one + vk * ((v_sqrt(v_load(variances + x)) / r) - one)));
 			}
 		}
+		break;
+	case LOCAL_NIBLACK:
+		for (; x <= n - 2; x += 2)
+			v_store(thresholds + x, v_load(means + x) + vk * v_sqrt(v_load(variances + x)));
+		break;
+	case LOCAL_WOLF:
+		{
+			v_float64x2 oneMinusK = v_setall_f64(1 - k);
+			v_float64x2 kMin = v_setall_f64(k * minGrey);
+			v_float64x2 vMin = v_setall_f64(minGrey);
+			v_float64x2 vMaxDeviation = v_setall_f64(maxDeviation);
+			for (; x <= n - 2; x += 2)
+			{
+				v_float64x2 m = v_load(means + x);
+				v_float64x2 deviation = maxDeviation > 0.0 ? v_sqrt(v_load(variances + x)) / vMaxDeviation : v_setzero_f64();
+				v_store(thresholds + x, oneMinusK * m + kMin + vk * deviation * (m - vMin));
+			}
+		}
+		break;
+	case LOCAL_NICK:
+		for (; x <= n - 2; x += 2)
+		{
+			v_float64x2 m = v_load(means + x);
+			v_store(thresholds + x, m + vk * v_sqrt(v_load(variances + x) + m * m));
+		}
+		break;
 	}
-	catch (CMemoryException * )
+#endif
+	for (; x < n; x++)
 	{
-		CleanUpForSauvola(integral_image, rowsum_image, integral_sqimg, rowsum_sqimg, i-1);
-		delete destImage;
-		return NULL;
+		switch (method)
+		{
+		case LOCAL_SAUVOLA:
+			thresholds[x] = means[x] * (1 + k * ((sqrt(variances[x]) / 128) - 1));
+			break;
+		case LOCAL_NIBLACK:
+			thresholds[x] = means[x] + k * sqrt(variances[x]);
+			break;
+		case LOCAL_WOLF:
+			{
+				double deviation = maxDeviation > 0.0 ? sqrt(variances[x]) / maxDeviation : 0.0;
+				thresholds[x] = (1 - k) * means[x] + k * minGrey + k * deviation * (means[x] - minGrey);
+			}
+			break;
+		case LOCAL_NICK:
+			thresholds[x] = means[x] + k * sqrt(variances[x] + means[x] * means[x]);
+			break;
+		}
 	}
+}
+
+/*
+ * Parallel loop body for the local binarisation methods based on local mean and variance (bands of rows).
+ * The local statistics are calculated once per pixel and applied to all given weighting factors 'k'
+ * (one destination matrix each). Pixels darker than the local threshold become black (0), all others white (255).
+ * Stops early if the stop signal source signals a stop.
+ *
+ * Thresholds (m = mean, s = standard deviation, v = variance):
+ *   Sauvola: m * (1 + k * (s / 128 - 1))
+ *   Niblack: m + k * s
+ *   Wolf-Jolion: (1 - k) * m + k * M + k * s / R * (m - M) (M = minimum grey level, R = maximum deviation of the image)
+ *   NICK: m + k * sqrt(v + m * m)
+ */
+class CLocalThresholdKernel : public ParallelLoopBody
+{
+public:
+	CLocalThresholdKernel(const CLocalStatistics & statistics, int method, int whalf, const std::vector<double> & k,
+						  const std::vector<Mat> & dests, CAlgorithm * stopSignalSource)
+		: m_Statistics(statistics), m_Method(method), m_Whalf(whalf), m_K(k), m_Dests(dests), m_StopSignalSource(stopSignalSource)
+	{
+		m_MinGrey = 0.0;
+		m_MaxDeviation = 0.0;
+	};
 
-	int xmin,ymin,xmax,ymax;
-    double diagsum,idiagsum,diff,sqdiagsum,sqidiagsum,sqdiff,area;
-    double mean,std,threshold;
-
-    for(int y=0; y<image_height; y++){
-		RGBCOLOUR col = source->GetRGBColor(0,y);
-		int graylevel = isGreyScale ? col.R : (int)(col.R*0.3 + col.G*0.59+ col.B*0.11);
-        rowsum_image[y][0] = graylevel;
-        rowsum_sqimg[y][0] = graylevel*graylevel;
-    }
-    for(int x=1; x<image_width; x++){
-        for(int y=0; y<image_height; y++){
-			RGBCOLOUR col = source->GetRGBColor(x,y);
-			int graylevel = isGreyScale ? col.R : (int)(col.R*0.3 + col.G*0.59+ col.B*0.11);
-            rowsum_image[y][x] = rowsum_image[y][x-1] + graylevel;
-            rowsum_sqimg[y][x] = rowsum_sqimg[y][x-1] + graylevel*graylevel;
-        }
-    }
+	inline void SetImageStatistics(double minGrey, double maxDeviation) { m_MinGrey = minGrey; m_MaxDeviation = maxDeviation; };
 
-	//Cancelled?
-	if (stopSignalSource != NULL && stopSignalSource->HasStopSignal())
+	void operator()(const Range & rows) const
 	{
-		delete destImage;
-		CleanUpForSauvola(integral_image, rowsum_image, integral_sqimg, rowsum_sqimg, image_height);
-		return NULL;
+		int width = m_Statistics.GetWidth();
+		CLocalStatistics::CRowCursor cursor(m_Statistics, m_Whalf);
+		std::vector<double> thresholds(width);
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			if (m_StopSignalSource != NULL && m_StopSignalSource->HasStopSignal())
+				return;
+
+			cursor.Calculate(y);
+			const uchar * grey = cursor.GetGrey();
+			const double * means = cursor.GetMeans();
+			const double * variances = cursor.GetVariances();
+			for (unsigned int i = 0; i < m_K.size(); i++)
+			{
+				uchar * dst = (uchar*)m_Dests[i].ptr<uchar>(y);
+				LocalThresholds(m_Method, m_K[i], m_MinGrey, m_MaxDeviation, means, variances, &thresholds[0], width);
+				for (int x = 0; x < width; x++)
+					dst[x] = grey[x] < thresholds[x] ? 0 : 255;
+			}
+		}
 	}
 
-    for(int x=0; x<image_width; x++){
-        integral_image[0][x] = rowsum_image[0][x];
-        integral_sqimg[0][x] = rowsum_sqimg[0][x];
-    }
-    for(int x=0; x<image_width; x++){
-        for(int y=1; y<image_height; y++){
-            integral_image[y][x] = integral_image[y-1][x] + rowsum_image[y][x];
-            integral_sqimg[y][x] = integral_sqimg[y-1][x] + rowsum_sqimg[y][x];
-        }
-    }
+private:
+	const CLocalStatistics &		m_Statistics;
+	int								m_Method;
+	int								m_Whalf;
+	const std::vector<double> &		m_K;
+	const std::vector<Mat> &		m_Dests;
+	CAlgorithm *					m_StopSignalSource;
+	double							m_MinGrey;		//Wolf-Jolion
+	double							m_MaxDeviation;	//Wolf-Jolion
+};
 
-	//Cancelled?
-	if (stopSignalSource != NULL && stopSignalSource->HasStopSignal())
+/*
+ * Parallel loop body collecting the minimum grey level and the maximum local variance of each row
+ * (image statistics for the Wolf-Jolion binarisation)
+ */
+class CImageStatisticsKernel : public ParallelLoopBody
+{
+public:
+	CImageStatisticsKernel(const CLocalStatistics & statistics, int whalf, std::vector<double> & minGrey, std::vector<double> & maxVariance)
+		: m_Statistics(statistics), m_Whalf(whalf), m_MinGrey(minGrey), m_MaxVariance(maxVariance) {};
+
+	void operator()(const Range & rows) const
 	{
-		delete destImage;
-		CleanUpForSauvola(integral_image, rowsum_image, integral_sqimg, rowsum_sqimg, image_height);
-		return NULL;
+		int width = m_Statistics.GetWidth();
+		CLocalStatistics::CRowCursor cursor(m_Statistics, m_Whalf);
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			cursor.Calculate(y);
+			const uchar * grey = cursor.GetGrey();
+			const double * variances = cursor.GetVariances();
+			double minGrey = 255.0;
+			double maxVariance = 0.0;
+			for (int x = 0; x < width; x++)
+			{
+				minGrey = min(minGrey, (double)grey[x]);
+				maxVariance = max(maxVariance, variances[x]);
+			}
+			m_MinGrey[y] = minGrey;
+			m_MaxVariance[y] = maxVariance;
+		}
 	}
 
-    //Calculate the mean and standard deviation using the integral image
-    for(int x=0; x<image_width; x++)
-	{
-        for(int y=0; y<image_height; y++){
-            xmin = max(0,x-whalf);
-            ymin = max(0,y-whalf);
-            xmax = min(image_width-1,x+whalf);
-            ymax = min(image_height-1,y+whalf);
-            area = (xmax-xmin+1)*(ymax-ymin+1);
-            // area can't be 0 here
-            // proof (assuming whalf >= 0):
-            // we'll prove that (xmax-xmin+1) > 0,
-            // (ymax-ymin+1) is analogous
-            // It's the same as to prove: xmax >= xmin
-            // image_width - 1 >= 0         since image_width > i >= 0
-            // i + whalf >= 0               since i >= 0, whalf >= 0
-            // i + whalf >= i - whalf       since whalf >= 0
-            // image_width - 1 >= i - whalf since image_width > i
-            // --IM
-            ASSERT(area);
-            if(!xmin && !ymin){ // Point at origin
-                diff   = (double)integral_image[ymax][xmax];
-                sqdiff = (double)integral_sqimg[ymax][xmax];
-            }
-            else if(!xmin && ymin){ // first column
-                diff   = (double)(integral_image[ymax][xmax] - integral_image[ymin-1][xmax]);
-                sqdiff = (double)(integral_sqimg[ymax][xmax] - integral_sqimg[ymin-1][xmax]);
-            }
-            else if(xmin && !ymin){ // first row
-                diff   = (double)(integral_image[ymax][xmax] - integral_image[ymax][xmin-1]);
-                sqdiff = (double)(integral_sqimg[ymax][xmax] - integral_sqimg[ymax][xmin-1]);
-            }
-            else{ // rest of the image
-                diagsum    = (double)(integral_image[ymax][xmax] + integral_image[ymin-1][xmin-1]);
-                idiagsum   = (double)(integral_image[ymin-1][xmax] + integral_image[ymax][xmin-1]);
-                diff       = diagsum - idiagsum;
-                sqdiagsum  = (double)(integral_sqimg[ymax][xmax] + integral_sqimg[ymin-1][xmin-1]);
-                sqidiagsum = (double)(integral_sqimg[ymin-1][xmax] + integral_sqimg[ymax][xmin-1]);
-                sqdiff     = sqdiagsum - sqidiagsum;
-            }
-
-            mean = diff/area;
-            std  = sqrt((sqdiff - diff*diff/area)/(area-1));
-
-			//Thresholding
-            threshold = mean*(1+k*((std/128)-1));
-			RGBCOLOUR col = source->GetRGBColor(x,y);
-			int graylevel = isGreyScale ? col.R : (int)(col.R*0.3 + col.G*0.59+ col.B*0.11);
-            if(graylevel < threshold)
-                destImage->SetBlack(x, y);
-            else
-                destImage->SetWhite(x, y);
-        }
+private:
+	const CLocalStatistics &	m_Statistics;
+	int							m_Whalf;
+	std::vector<double> &		m_MinGrey;
+	std::vector<double> &		m_MaxVariance;
+};
+
+/*
+ * Local thresholding into the given 8 bit destination matrices (0 = black, 255 = white).
+ * There is one threshold pass per distinct window size, serving all weighting factors with that window size.
+ *
+ * 'method' - LOCAL_SAUVOLA, LOCAL_NIBLACK, LOCAL_WOLF or LOCAL_NICK
+ * 'whalf', 'k', 'dests' - Half window size, weighting factor and destination matrix for each result
+ * Returns false if cancelled.
+ */
+static bool LocalThreshold(const CLocalStatistics & statistics, int method, const std::vector<int> & whalf,
+						   const std::vector<double> & k, const std::vector<Mat> & dests, CAlgorithm * stopSignalSource)
+{
+	int width = statistics.GetWidth();
+	int height = statistics.GetHeight();
+
+	//Streaming statistics: One band per thread (each band has to fill its window first, so the bands should not be too small)
+	int maxWhalf = *std::max_element(whalf.begin(), whalf.end());
+	double bands = statistics.GetMode() == CLocalStatistics::MODE_STREAMING
+					? max(1, min(getNumThreads(), height / (4 * (2 * maxWhalf + 1))))
+					: GetRowBandCount(width, height);
+
+	std::vector<bool> done(whalf.size(), false);
+	for (unsigned int i = 0; i < whalf.size(); i++)
+	{
+		if (done[i])
+			continue;
 
 		//Cancelled?
 		if (stopSignalSource != NULL && stopSignalSource->HasStopSignal())
+			return false;
+
+		//Collect all results with this window size
+		std::vector<double> passK;
+		std::vector<Mat> passDests;
+		for (unsigned int j = i; j < whalf.size(); j++)
 		{
-			delete destImage;
-			CleanUpForSauvola(integral_image, rowsum_image, integral_sqimg, rowsum_sqimg, image_height);
-			return NULL;
+			if (!done[j] && whalf[j] == whalf[i])
+			{
+				passK.push_back(k[j]);
+				passDests.push_back(dests[j]);
+				done[j] = true;
+			}
 		}
-    }
 
-	CleanUpForSauvola(integral_image, rowsum_image, integral_sqimg, rowsum_sqimg, image_height);
+		CLocalThresholdKernel kernel(statistics, method, whalf[i], passK, passDests, stopSignalSource);
+		if (method == LOCAL_WOLF)
+		{
+			std::vector<double> minGrey(height), maxVariance(height);
+			parallel_for_(Range(0, height), CImageStatisticsKernel(statistics, whalf[i], minGrey, maxVariance), bands);
+			kernel.SetImageStatistics(*std::min_element(minGrey.begin(), minGrey.end()),
+									  sqrt(*std::max_element(maxVariance.begin(), maxVariance.end())));
+		}
 
-	return destImage;
+		parallel_for_(Range(0, height), kernel, bands);
+	}
+
+	//Cancelled?
+	return stopSignalSource == NULL || !stopSignalSource->HasStopSignal();
+}
+
+/*
+ * Local binarisation for several parameter sets (see CLocalThresholdKernel).
+ * The local statistics are shared by all parameter sets.
+ *
+ * 'method' - LOCAL_SAUVOLA, LOCAL_NIBLACK, LOCAL_WOLF or LOCAL_NICK
+ * 'params' - Pairs of weighting factor 'k' and local window size 'w'
+ * 'streaming' - Use running sums instead of integral images (bounded memory)
+ * Returns: New bi-level images in the order of 'params', or an empty list (cancelled, out of memory or the source is bi-level)
+ */
+static std::vector<COpenCvBiLevelImage*> LocalBinarization(COpenCvImage * source, int method,
+														   const std::vector<std::pair<double, int> > & params,
+														   bool streaming, CAlgorithm * stopSignalSource)
+{
+	std::vector<COpenCvBiLevelImage*> res;
+	if (source == NULL || typeid(*source) == typeid(COpenCvBiLevelImage) || params.empty())
+		return res;
+
+	std::vector<int> whalf;
+	std::vector<double> k;
+	std::vector<Mat> dests;
+	int maxWhalf = 0;
+	for (unsigned int i = 0; i < params.size(); i++)
+	{
+		double curK = params[i].first;
+		int curW = params[i].second;
+
+		//Check params (the other methods need at least two pixels per window for the variance)
+		if (method == LOCAL_SAUVOLA)
+			CheckSauvolaParams(curK, curW);
+		else
+			curW = max(3, min(1000, curW));
+
+		whalf.push_back(curW / 2);
+		k.push_back(curK);
+		maxWhalf = max(maxWhalf, curW / 2);
+
+		//Create image
+		COpenCvBiLevelImage * destImage = COpenCvImage::CreateB(source->GetWidth(), source->GetHeight(), RGBWHITE);
+		destImage->CopyImageInfo(source->GetImageInfo());
+		res.push_back(destImage);
+		dests.push_back(destImage->GetData());
+	}
+
+	CLocalStatistics statistics(source, maxWhalf, streaming ? CLocalStatistics::MODE_STREAMING : CLocalStatistics::MODE_INTEGRALS);
+
+	bool success = statistics.IsValid();
+	if (success)
+	{
+		try
+		{
+			success = LocalThreshold(statistics, method, whalf, k, dests, stopSignalSource);
+		}
+		catch (std::bad_alloc &)
+		{
+			success = false;
+		}
+	}
+
+	if (!success)
+	{
+		for (unsigned int i = 0; i < res.size(); i++)
+			delete res[i];
+		res.clear();
+	}
+	return res;
+}
+
+/*
+ * Local binarisation with one parameter set (see LocalBinarization() above)
+ */
+static COpenCvBiLevelImage * LocalBinarization(COpenCvImage * source, int method, double k, int w,
+											   bool streaming, CAlgorithm * stopSignalSource)
+{
+	std::vector<std::pair<double, int> > params;
+	params.push_back(std::pair<double, int>(k, w));
+
+	std::vector<COpenCvBiLevelImage*> res = LocalBinarization(source, method, params, streaming, stopSignalSource);
+	return res.empty() ? NULL : res[0];
+}
+
+/*
+ * Sauvola binarisation (see above) based on one contiguous integral image and squared integral image
+ * (see CLocalStatistics). The threshold pass runs in parallel on bands of rows.
+ *
+ * 'k' - Weighting factor (0.05..0.95)
+ * 'w' - Local window size (0..1000)
+ * 'stopSignalSource' - If not NULL, the binarisation is cancelled when the algorithm receives a stop signal
+ * Returns: New bi-level image or NULL (cancelled, out of memory or the source is bi-level)
+ */
+COpenCvBiLevelImage * CImageTransformer::SauvolaBinarization(COpenCvImage * source, double k /*= 0.3*/, int w /*= 40*/,
+													   CAlgorithm * stopSignalSource /*= NULL*/)
+{
+	return LocalBinarization(source, LOCAL_SAUVOLA, k, w, false, stopSignalSource);
+}
+
+/*
+ * Sauvola binarisation for several parameter sets (e.g. for parameter tuning).
+ * The integral images are calculated only once, and there is one threshold pass per distinct window size.
+ * The results are identical to calling SauvolaBinarization() for each parameter set.
+ *
+ * 'params' - Pairs of weighting factor 'k' (0.05..0.95) and local window size 'w' (0..1000)
+ * 'stopSignalSource' - If not NULL, the binarisation is cancelled when the algorithm receives a stop signal
+ * Returns: New bi-level images in the order of 'params', or an empty list (cancelled, out of memory or the source is bi-level)
+ */
+std::vector<COpenCvBiLevelImage*> CImageTransformer::SauvolaBinarizationSweep(COpenCvImage * source,
+																			  const std::vector<std::pair<double, int> > & params,
+																			  CAlgorithm * stopSignalSource /*= NULL*/)
+{
+	return LocalBinarization(source, LOCAL_SAUVOLA, params, false, stopSignalSource);
+}
+
+/*
+ * Sauvola binarisation with bounded memory (see SauvolaBinarization()).
+ * No integral images are created. The image is processed in horizontal bands of rows, each keeping
+ * only the rows of the current window and running column sums, so the working memory is
+ * O(width * w) per band instead of O(width * height). The result is identical to SauvolaBinarization().
+ *
+ * 'k' - Weighting factor (0.05..0.95)
+ * 'w' - Local window size (0..1000)
+ * 'stopSignalSource' - If not NULL, the binarisation is cancelled when the algorithm receives a stop signal
+ * Returns: New bi-level image or NULL (cancelled, out of memory or the source is bi-level)
+ */
+COpenCvBiLevelImage * CImageTransformer::SauvolaBinarizationStreamed(COpenCvImage * source, double k /*= 0.3*/, int w /*= 40*/,
+																	 CAlgorithm * stopSignalSource /*= NULL*/)
+{
+	return LocalBinarization(source, LOCAL_SAUVOLA, k, w, true, stopSignalSource);
+}
+
+/*
+ * Niblack binarisation (threshold = local mean + k * local standard deviation).
+ *
+ * 'k' - Weighting factor (usually negative, e.g. -0.2)
+ * 'w' - Local window size (3..1000)
+ * 'stopSignalSource' - If not NULL, the binarisation is cancelled when the algorithm receives a stop signal
+ * Returns: New bi-level image or NULL (cancelled, out of memory or the source is bi-level)
+ */
+COpenCvBiLevelImage * CImageTransformer::NiblackBinarization(COpenCvImage * source, double k /*= -0.2*/, int w /*= 40*/,
+															 CAlgorithm * stopSignalSource /*= NULL*/)
+{
+	return LocalBinarization(source, LOCAL_NIBLACK, k, w, false, stopSignalSource);
+}
+
+/*
+ * Wolf-Jolion binarisation (Sauvola variant normalised by the image contrast):
+ * threshold = (1 - k) * m + k * M + k * s / R * (m - M), with local mean m, local standard deviation s,
+ * minimum grey level M and maximum local standard deviation R of the image.
+ *
+ * 'k' - Weighting factor (e.g. 0.5)
+ * 'w' - Local window size (3..1000)
+ * 'stopSignalSource' - If not NULL, the binarisation is cancelled when the algorithm receives a stop signal
+ * Returns: New bi-level image or NULL (cancelled, out of memory or the source is bi-level)
+ */
+COpenCvBiLevelImage * CImageTransformer::WolfBinarization(COpenCvImage * source, double k /*= 0.5*/, int w /*= 40*/,
+														  CAlgorithm * stopSignalSource /*= NULL*/)
+{
+	return LocalBinarization(source, LOCAL_WOLF, k, w, false, stopSignalSource);
 }
 
 /*
- * Deletes arrays used by the Sauvola binarisation
+ * NICK binarisation (Niblack variant for low contrast images):
+ * threshold = m + k * sqrt(v + m * m), with local mean m and local variance v.
+ *
+ * 'k' - Weighting factor (-0.2..-0.1 recommended)
+ * 'w' - Local window size (3..1000)
+ * 'stopSignalSource' - If not NULL, the binarisation is cancelled when the algorithm receives a stop signal
+ * Returns: New bi-level image or NULL (cancelled, out of memory or the source is bi-level)
  */
-void CImageTransformer::CleanUpForSauvola(int64_t ** array1, int64_t ** array2, 
-										  int64_t ** array3, int64_t ** array4, int count)
+COpenCvBiLevelImage * CImageTransformer::NickBinarization(COpenCvImage * source, double k /*= -0.2*/, int w /*= 40*/,
+														  CAlgorithm * stopSignalSource /*= NULL*/)
 {
-	for (int i = 0; i < count; i++)
-  	{
-  		delete [] array1[i];
-  		delete [] array2[i];
-  		delete [] array3[i];
-  		delete [] array4[i];
-  	}
-	delete [] array1;
-	delete [] array2;
-	delete [] array3;
-	delete [] array4;
+	return LocalBinarization(source, LOCAL_NICK, k, w, false, stopSignalSource);
+}
+
+/*
+ * Parallel loop body for the Bernsen binarisation (bands of rows)
+ */
+class CBernsenKernel : public ParallelLoopBody
+{
+public:
+	CBernsenKernel(const CLocalStatistics & statistics, const Mat & mins, const Mat & maxs, const Mat & dest,
+				   int contrastThreshold, CAlgorithm * stopSignalSource)
+		: m_Statistics(statistics), m_Mins(mins), m_Maxs(maxs), m_Dest(dest), m_ContrastThreshold(contrastThreshold),
+		  m_StopSignalSource(stopSignalSource) {};
+
+	void operator()(const Range & rows) const
+	{
+		int width = m_Statistics.GetWidth();
+		std::vector<uchar> buffer(width);
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			if (m_StopSignalSource != NULL && m_StopSignalSource->HasStopSignal())
+				return;
+
+			const uchar * grey = m_Statistics.GetGreyRow(y, &buffer[0]);
+			const uchar * mins = m_Mins.ptr<uchar>(y);
+			const uchar * maxs = m_Maxs.ptr<uchar>(y);
+			uchar * dst = (uchar*)m_Dest.ptr<uchar>(y);
+			for (int x = 0; x < width; x++)
+			{
+				int mid = (mins[x] + maxs[x]) / 2;
+				if (maxs[x] - mins[x] < m_ContrastThreshold)	//Low contrast: whole window is background or foreground
+					dst[x] = mid >= 128 ? 255 : 0;
+				else
+					dst[x] = grey[x] < mid ? 0 : 255;
+			}
+		}
+	}
+
+private:
+	const CLocalStatistics &	m_Statistics;
+	const Mat &					m_Mins;
+	const Mat &					m_Maxs;
+	const Mat &					m_Dest;
+	int							m_ContrastThreshold;
+	CAlgorithm *				m_StopSignalSource;
+};
+
+/*
+ * Bernsen binarisation (threshold = mid-range of the local minimum and maximum).
+ * Windows with a contrast (maximum - minimum) below the contrast threshold are regarded as
+ * homogeneous and set to white or black depending on the mid-range.
+ * Local minimum and maximum are calculated with van Herk / Gil-Werman filters (see CLocalStatistics).
+ *
+ * 'contrastThreshold' - Minimum local contrast
+ * 'w' - Local window size (3..1000)
+ * 'stopSignalSource' - If not NULL, the binarisation is cancelled when the algorithm receives a stop signal
+ * Returns: New bi-level image or NULL (cancelled, out of memory or the source is bi-level)
+ */
+COpenCvBiLevelImage * CImageTransformer::BernsenBinarization(COpenCvImage * source, int contrastThreshold /*= 15*/, int w /*= 31*/,
+															 CAlgorithm * stopSignalSource /*= NULL*/)
+{
+	if (source == NULL || typeid(*source) == typeid(COpenCvBiLevelImage))
+		return NULL;
+
+	//Check params
+	w = max(3, min(1000, w));
+
+	CLocalStatistics statistics(source, w / 2, CLocalStatistics::MODE_MIN_MAX);
+	Mat mins, maxs;
+	if (!statistics.IsValid() || !statistics.GetMinMax(w / 2, mins, maxs))
+		return NULL;
+
+	//Cancelled?
+	if (stopSignalSource != NULL && stopSignalSource->HasStopSignal())
+		return NULL;
+
+	//Create image
+	COpenCvBiLevelImage * destImage = COpenCvImage::CreateB(source->GetWidth(), source->GetHeight(), RGBWHITE);
+	destImage->CopyImageInfo(source->GetImageInfo());
+	Mat dest = destImage->GetData();
+
+	parallel_for_(Range(0, dest.rows), CBernsenKernel(statistics, mins, maxs, dest, contrastThreshold, stopSignalSource),
+				  GetRowBandCount(dest.cols, dest.rows));
+
+	//Cancelled?
+	if (stopSignalSource != NULL && stopSignalSource->HasStopSignal())
+	{
+		delete destImage;
+		return NULL;
+	}
+	return destImage;
 }
 
 /*
@@ -931,21 +1028,21 @@ COpenCvColourImage * CImageTransformer::ConvertToColour(COpenCvImage * source)
 	cv::Mat colourMat;
 
 	//Check number of channels in source (CopenCvBiLevel image can have 3 channels in some cases)
-	if (source->GetData().type() == CV_8UC1)
+	if (source->GetData(false).type() == CV_8UC1)
 	{
 		colourMat.create(source->GetHeight(), source->GetWidth(), CV_8UC3);
 
 		//if (typeid(*thumbnail) == typeid(COpenCvColourImage))
 		//	cvtColor(thumbnail->GetData(), thumbMat, CV_BGR2BGRA); //RGB colour to RGB with alpha
 		//else
-		cvtColor(source->GetData(), colourMat, CV_GRAY2BGR); //BW or greyscale to RGB with alpha
+		cvtColor(source->GetData(false), colourMat, CV_GRAY2BGR); //BW or greyscale to RGB with alpha
 
 		res->SetData(colourMat);
 		//thumbMat.copyTo(colPixData(cv::Rect(x, y, thumbWidth, thumbHeight)));
 	}
-	else //Already colour
+	else //Already colour (copy-on-write, the pixels may be shared with clones of the source)
 	{
-		res->SetData(source->GetData());
+		res->ShareDataFrom(source);
 	}
 	//Some params
 	res->CopyImageInfo(source->GetImageInfo());
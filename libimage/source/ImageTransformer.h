@@ -2,6 +2,7 @@
 
 #include "opencvimage.h"
 #include "algorithm.h"
+#include <vector>
 
 namespace PRImA 
 {
@@ -26,11 +27,21 @@ public:
 	
 	static COpenCvImage * Erode(COpenCvImage * image);
 	static COpenCvImage * Dilate(COpenCvImage * image);
+	static COpenCvImage * Erode(COpenCvImage * image, int width, int height);
+	static COpenCvImage * Dilate(COpenCvImage * image, int width, int height);
+	static COpenCvImage * Open(COpenCvImage * image, int width, int height);
+	static COpenCvImage * Close(COpenCvImage * image, int width, int height);
 	
 	static COpenCvBiLevelImage * Binarize(COpenCvImage * source, int threshold);
 	static COpenCvBiLevelImage * OtsuBinarization(COpenCvImage * source);
 	static COpenCvBiLevelImage * SauvolaBinarization(COpenCvImage * source, double k = 0.3, int w = 40, PRImA::CAlgorithm * stopSignalSource = NULL);
-	static void CleanUpForSauvola(int64_t ** array1, int64_t ** array2, int64_t ** array3, int64_t ** array4, int count);
+	static COpenCvBiLevelImage * SauvolaBinarizationStreamed(COpenCvImage * source, double k = 0.3, int w = 40, PRImA::CAlgorithm * stopSignalSource = NULL);
+	static std::vector<COpenCvBiLevelImage*> SauvolaBinarizationSweep(COpenCvImage * source, const std::vector<std::pair<double, int> > & params,
+																		 PRImA::CAlgorithm * stopSignalSource = NULL);
+	static COpenCvBiLevelImage * NiblackBinarization(COpenCvImage * source, double k = -0.2, int w = 40, PRImA::CAlgorithm * stopSignalSource = NULL);
+	static COpenCvBiLevelImage * WolfBinarization(COpenCvImage * source, double k = 0.5, int w = 40, PRImA::CAlgorithm * stopSignalSource = NULL);
+	static COpenCvBiLevelImage * NickBinarization(COpenCvImage * source, double k = -0.2, int w = 40, PRImA::CAlgorithm * stopSignalSource = NULL);
+	static COpenCvBiLevelImage * BernsenBinarization(COpenCvImage * source, int contrastThreshold = 15, int w = 31, PRImA::CAlgorithm * stopSignalSource = NULL);
 
 	static COpenCvGreyScaleImage * ConvertToGreyScale(COpenCvImage * source);
 	static COpenCvColourImage * ConvertToColour(COpenCvImage * source);
@@ -42,6 +53,8 @@ private:
 	static COpenCvImage * Erode(COpenCvGreyScaleImage * image);
 	static COpenCvImage * Dilate(COpenCvBiLevelImage * image);
 	static COpenCvImage * Dilate(COpenCvGreyScaleImage * image);
+	static COpenCvImage * ApplyMorphology(COpenCvImage * image, int operation, int width, int height);
+	static COpenCvImage * CreateGreyScaleResult(COpenCvGreyScaleImage * source, cv::Mat data);
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,629 @@
+#include "LocalStatistics.h"
+#include "RowKernelHelpers.h"
+#include "opencv2/core/hal/intrin.hpp"
+#include <typeinfo>
+#include <limits>
+
+using namespace cv;
+
+namespace PRImA {
+
+
+/*
+ * Minimum operation for the van Herk / Gil-Werman filter ('T' - uchar or ushort)
+ */
+template<class T>
+struct CMinOperation
+{
+	static inline T Neutral() { return (std::numeric_limits<T>::max)(); };
+	static inline T Apply(T a, T b) { return a < b ? a : b; };
+#if CV_SIMD128
+	static inline v_uint8x16 Apply(const v_uint8x16 & a, const v_uint8x16 & b) { return v_min(a, b); };
+	static inline v_uint16x8 Apply(const v_uint16x8 & a, const v_uint16x8 & b) { return v_min(a, b); };
+#endif
+};
+
+/*
+ * Maximum operation for the van Herk / Gil-Werman filter ('T' - uchar or ushort)
+ */
+template<class T>
+struct CMaxOperation
+{
+	static inline T Neutral() { return 0; };
+	static inline T Apply(T a, T b) { return a > b ? a : b; };
+#if CV_SIMD128
+	static inline v_uint8x16 Apply(const v_uint8x16 & a, const v_uint8x16 & b) { return v_max(a, b); };
+	static inline v_uint16x8 Apply(const v_uint16x8 & a, const v_uint16x8 & b) { return v_max(a, b); };
+#endif
+};
+
+#if CV_SIMD128
+/*
+ * Vectorised part of ApplyRows(). Returns the number of processed elements.
+ */
+template<class Op>
+static inline int ApplyRowsSimd(const uchar * a, const uchar * b, uchar * dst, int n)
+{
+	int x = 0;
+	for (; x <= n - 16; x += 16)
+		v_store(dst + x, Op::Apply(v_load(a + x), v_load(b + x)));
+	return x;
+}
+
+template<class Op>
+static inline int ApplyRowsSimd(const ushort * a, const ushort * b, ushort * dst, int n)
+{
+	int x = 0;
+	for (; x <= n - 8; x += 8)
+		v_store(dst + x, Op::Apply(v_load(a + x), v_load(b + x)));
+	return x;
+}
+#endif
+
+/*
+ * Applies the min/max operation to two rows element-wise
+ */
+template<class Op, class T>
+static inline void ApplyRows(const T * a, const T * b, T * dst, int n)
+{
+	int x = 0;
+#if CV_SIMD128
+	x = ApplyRowsSimd<Op>(a, b, dst, n);
+#endif
+	for (; x < n; x++)
+		dst[x] = Op::Apply(a[x], b[x]);
+}
+
+/*
+ * One-dimensional van Herk / Gil-Werman filter (window [i-before, i+after], clipped to the row).
+ * The row is padded with 'before' neutral values at the start and 'after' at the end and divided into
+ * blocks of k = before+after+1 values. 'g' holds the running extremum from the start of each block,
+ * 'h' the one from the end of each block, so every window is covered by h (first block part) and g (second block part).
+ *
+ * 'g', 'h' - Buffers for n+before+after values
+ */
+template<class Op, class T>
+static void VanHerkRow(const T * src, T * dst, int n, int before, int after, T * g, T * h)
+{
+	int k = before + after + 1;
+	int m = n + before + after;
+	for (int j = 0; j < m; j++)
+	{
+		T v = (j < before || j >= n + before) ? Op::Neutral() : src[j - before];
+		g[j] = (j % k == 0) ? v : Op::Apply(g[j - 1], v);
+	}
+	for (int j = m - 1; j >= 0; j--)
+	{
+		T v = (j < before || j >= n + before) ? Op::Neutral() : src[j - before];
+		h[j] = (j % k == k - 1 || j == m - 1) ? v : Op::Apply(h[j + 1], v);
+	}
+	for (int i = 0; i < n; i++)
+		dst[i] = Op::Apply(h[i], g[i + k - 1]);
+}
+
+/*
+ * Parallel loop body for the horizontal pass of the van Herk filter (bands of rows)
+ */
+template<class Op, class T>
+class CVanHerkRowKernel : public ParallelLoopBody
+{
+public:
+	CVanHerkRowKernel(const Mat & src, const Mat & dst, int before, int after)
+		: m_Src(src), m_Dst(dst), m_Before(before), m_After(after) {};
+
+	void operator()(const Range & rows) const
+	{
+		int n = m_Src.cols;
+		std::vector<T> g(n + m_Before + m_After), h(n + m_Before + m_After);
+		for (int y = rows.start; y < rows.end; y++)
+			VanHerkRow<Op, T>(m_Src.ptr<T>(y), (T*)m_Dst.ptr<T>(y), n, m_Before, m_After, &g[0], &h[0]);
+	}
+
+private:
+	const Mat &	m_Src;
+	const Mat &	m_Dst;
+	int			m_Before;
+	int			m_After;
+};
+
+/*
+ * Parallel loop body for the vertical pass of the van Herk filter (stripes of columns).
+ * Same algorithm as VanHerkRow() with row segments as elements, so the operations can be vectorised.
+ * The whole stripe is read before it is written, so source and destination can be the same matrix.
+ */
+template<class Op, class T>
+class CVanHerkColumnKernel : public ParallelLoopBody
+{
+public:
+	static const int STRIPE_WIDTH = 256;
+
+	CVanHerkColumnKernel(const Mat & src, const Mat & dst, int before, int after)
+		: m_Src(src), m_Dst(dst), m_Before(before), m_After(after) {};
+
+	void operator()(const Range & stripes) const
+	{
+		int height = m_Src.rows;
+		int k = m_Before + m_After + 1;
+		int m = height + m_Before + m_After;
+		std::vector<T> neutral(STRIPE_WIDTH, Op::Neutral());
+		std::vector<T> g((size_t)m * STRIPE_WIDTH), h((size_t)m * STRIPE_WIDTH);
+
+		for (int s = stripes.start; s < stripes.end; s++)
+		{
+			int x0 = s * STRIPE_WIDTH;
+			int n = min(STRIPE_WIDTH, m_Src.cols - x0);
+			for (int j = 0; j < m; j++)
+			{
+				const T * v = (j < m_Before || j >= height + m_Before) ? &neutral[0] : m_Src.ptr<T>(j - m_Before) + x0;
+				if (j % k == 0)
+					memcpy(&g[(size_t)j * n], v, n * sizeof(T));
+				else
+					ApplyRows<Op>(&g[(size_t)(j - 1) * n], v, &g[(size_t)j * n], n);
+			}
+			for (int j = m - 1; j >= 0; j--)
+			{
+				const T * v = (j < m_Before || j >= height + m_Before) ? &neutral[0] : m_Src.ptr<T>(j - m_Before) + x0;
+				if (j % k == k - 1 || j == m - 1)
+					memcpy(&h[(size_t)j * n], v, n * sizeof(T));
+				else
+					ApplyRows<Op>(&h[(size_t)(j + 1) * n], v, &h[(size_t)j * n], n);
+			}
+			for (int i = 0; i < height; i++)
+				ApplyRows<Op>(&h[(size_t)i * n], &g[(size_t)(i + k - 1) * n], (T*)m_Dst.ptr<T>(i) + x0, n);
+		}
+	}
+
+private:
+	const Mat &	m_Src;
+	const Mat &	m_Dst;
+	int			m_Before;
+	int			m_After;
+};
+
+/*
+ * Separable van Herk / Gil-Werman min/max filter for single channel matrices of type 'T'.
+ * Window [x-left, x+right] x [y-top, y+bottom], clipped at the borders.
+ * Passes with an extent of one pixel are skipped.
+ */
+template<template<class> class Op, class T>
+static void VanHerkFilter(const Mat & src, Mat & dst, int left, int right, int top, int bottom)
+{
+	left = max(0, left);
+	right = max(0, right);
+	top = max(0, top);
+	bottom = max(0, bottom);
+
+	Mat temp = src;
+	if (left + right > 0)
+	{
+		temp = COpenCvImage::AllocateMatrix(src.rows, src.cols, src.type());
+		parallel_for_(Range(0, src.rows), CVanHerkRowKernel<Op<T>, T>(src, temp, left, right), GetRowBandCount(src));
+	}
+
+	if (top + bottom == 0)
+	{
+		dst = temp.data == src.data ? COpenCvImage::CloneMatrix(src) : temp;
+		return;
+	}
+	if (dst.rows != src.rows || dst.cols != src.cols || dst.type() != src.type())
+		dst = COpenCvImage::AllocateMatrix(src.rows, src.cols, src.type());
+	int stripes = (src.cols + CVanHerkColumnKernel<Op<T>, T>::STRIPE_WIDTH - 1) / CVanHerkColumnKernel<Op<T>, T>::STRIPE_WIDTH;
+	parallel_for_(Range(0, stripes), CVanHerkColumnKernel<Op<T>, T>(temp, dst, top, bottom));
+}
+
+/*
+ * Van Herk / Gil-Werman filter for 8 or 16 bit single channel matrices (see VanHerkFilter())
+ */
+template<template<class> class Op>
+static void VanHerkFilter(const Mat & src, Mat & dst, int left, int right, int top, int bottom)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(src.type() == CV_8UC1 || src.type() == CV_16UC1);
+
+	if (src.empty())
+	{
+		dst = Mat();
+		return;
+	}
+	if (src.depth() == CV_16U)
+		VanHerkFilter<Op, ushort>(src, dst, left, right, top, bottom);
+	else
+		VanHerkFilter<Op, uchar>(src, dst, left, right, top, bottom);
+}
+
+
+/*
+ * Class CLocalStatistics
+ *
+ * Local (windowed) statistics of the grey levels of an image.
+ */
+
+/*
+ * Constructor
+ *
+ * 'source' - Grey scale or colour image
+ * 'maxWhalf' - Maximum half window size that will be requested (determines the width of the squared sums)
+ * 'mode' - MODE_INTEGRALS, MODE_STREAMING or MODE_MIN_MAX
+ */
+CLocalStatistics::CLocalStatistics(COpenCvImage * source, int maxWhalf, int mode /*= MODE_INTEGRALS*/)
+{
+	m_Data = source->GetData(false);
+	m_IsGreyScale = typeid(*source) == typeid(COpenCvGreyScaleImage);
+	m_Mode = mode;
+	m_MaxWhalf = maxWhalf;
+	m_NarrowSquareSums = HasNarrowSquareSums(maxWhalf);
+	m_Stride = m_Data.cols + 1;
+	m_Valid = true;
+
+	//Weight tables (same products as 'col.R*0.3 + col.G*0.59 + col.B*0.11')
+	for (int i = 0; i < 256; i++)
+	{
+		m_Weights[0][i] = i * 0.3;
+		m_Weights[1][i] = i * 0.59;
+		m_Weights[2][i] = i * 0.11;
+	}
+
+	if (mode == MODE_STREAMING)
+		return;
+
+	try
+	{
+		//Grey levels
+		if (m_Data.depth() == CV_8U && m_Data.channels() == 1 && m_IsGreyScale)
+			m_Grey = m_Data;
+		else
+		{
+			m_Grey = COpenCvImage::AllocateMatrix(m_Data.rows, m_Data.cols, CV_8UC1);
+			for (int y = 0; y < m_Data.rows; y++)
+				ConvertRow(y, m_Grey.ptr<uchar>(y));
+		}
+
+		if (mode == MODE_INTEGRALS)
+			CalculateIntegrals();
+	}
+	catch (std::bad_alloc &)
+	{
+		m_Valid = false;
+	}
+	catch (cv::Exception &)
+	{
+		m_Valid = false;
+	}
+}
+
+/*
+ * Destructor
+ */
+CLocalStatistics::~CLocalStatistics(void)
+{
+}
+
+/*
+ * Checks if the squared sums of a window fit into 32 bit (windows up to 256x256 pixels)
+ */
+bool CLocalStatistics::HasNarrowSquareSums(int whalf)
+{
+	int windowSize = 2 * whalf + 1;
+	return (uint64_t)windowSize * windowSize * 255 * 255 <= 0xFFFFFFFFull;
+}
+
+/*
+ * Converts row 'y' of the source into 'dst' (width grey levels)
+ */
+void CLocalStatistics::ConvertRow(int y, uchar * dst) const
+{
+	int width = m_Data.cols;
+	int channels = m_Data.channels();
+	for (int x = 0; x < width; x++)
+	{
+		int c[3];
+		for (int i = 0; i < 3; i++)
+		{
+			int channel = channels == 1 ? 0 : i;
+			c[i] = m_Data.depth() == CV_8U ? m_Data.ptr<uchar>(y)[x * channels + channel] : m_Data.ptr<ushort>(y)[x * channels + channel] / 256;
+		}
+		dst[x] = (uchar)(m_IsGreyScale ? c[0] : (int)(m_Weights[0][c[0]] + m_Weights[1][c[1]] + m_Weights[2][c[2]]));
+	}
+}
+
+/*
+ * Returns a pointer to the grey levels of row 'y', using 'buffer' (width values) if a conversion is necessary
+ */
+const uchar * CLocalStatistics::GetGreyRow(int y, uchar * buffer) const
+{
+	if (!m_Grey.empty())
+		return m_Grey.ptr<uchar>(y);
+	if (m_Data.depth() == CV_8U && m_Data.channels() == 1 && m_IsGreyScale)
+		return m_Data.ptr<uchar>(y);
+	ConvertRow(y, buffer);
+	return buffer;
+}
+
+/*
+ * Calculates the integral image and the integral of the squared image.
+ * The values are accumulated modulo 2^32 (or 2^64): Window sums are exact as long as the
+ * true window sum fits into the type (see HasNarrowSquareSums()).
+ */
+void CLocalStatistics::CalculateIntegrals()
+{
+	int width = m_Grey.cols;
+	int height = m_Grey.rows;
+	size_t size = (size_t)m_Stride * (height + 1);
+	m_Sums.assign(size, 0);
+	if (m_NarrowSquareSums)
+		m_SqSums32.assign(size, 0);
+	else
+		m_SqSums64.assign(size, 0);
+
+	for (int y = 0; y < height; y++)
+	{
+		const uchar * src = m_Grey.ptr<uchar>(y);
+		const uint32_t * sumAbove = &m_Sums[(size_t)y * m_Stride];
+		uint32_t * sum = &m_Sums[(size_t)(y + 1) * m_Stride];
+		uint32_t rowSum = 0;
+		for (int x = 0; x < width; x++)
+		{
+			rowSum += src[x];
+			sum[x + 1] = sumAbove[x + 1] + rowSum;
+		}
+
+		if (m_NarrowSquareSums)
+		{
+			const uint32_t * sqSumAbove = &m_SqSums32[(size_t)y * m_Stride];
+			uint32_t * sqSum = &m_SqSums32[(size_t)(y + 1) * m_Stride];
+			uint32_t rowSqSum = 0;
+			for (int x = 0; x < width; x++)
+			{
+				rowSqSum += (uint32_t)(src[x] * src[x]);
+				sqSum[x + 1] = sqSumAbove[x + 1] + rowSqSum;
+			}
+		}
+		else
+		{
+			const uint64 * sqSumAbove = &m_SqSums64[(size_t)y * m_Stride];
+			uint64 * sqSum = &m_SqSums64[(size_t)(y + 1) * m_Stride];
+			uint64 rowSqSum = 0;
+			for (int x = 0; x < width; x++)
+			{
+				rowSqSum += (uint64)(src[x] * src[x]);
+				sqSum[x + 1] = sqSumAbove[x + 1] + rowSqSum;
+			}
+		}
+	}
+}
+
+/*
+ * Calculates the local minimum and maximum of all pixels (van Herk / Gil-Werman filter).
+ * Returns false if out of memory.
+ */
+bool CLocalStatistics::GetMinMax(int whalf, Mat & mins, Mat & maxs) const
+{
+	try
+	{
+		Mat grey = m_Grey;
+		if (grey.empty())
+		{
+			grey = COpenCvImage::AllocateMatrix(m_Data.rows, m_Data.cols, CV_8UC1);
+			for (int y = 0; y < grey.rows; y++)
+			{
+				const uchar * row = GetGreyRow(y, grey.ptr<uchar>(y));
+				if (row != grey.ptr<uchar>(y))
+					memcpy(grey.ptr<uchar>(y), row, grey.cols);
+			}
+		}
+		VanHerkFilter<CMinOperation>(grey, mins, whalf, whalf, whalf, whalf);
+		VanHerkFilter<CMaxOperation>(grey, maxs, whalf, whalf, whalf, whalf);
+	}
+	catch (std::bad_alloc &)
+	{
+		return false;
+	}
+	catch (cv::Exception &)
+	{
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Minimum filter for 8 or 16 bit single channel matrices (O(1) per pixel, independent of the window size).
+ * 'rx', 'ry' - Horizontal and vertical radius (window (2rx+1) x (2ry+1), clipped at the borders)
+ * 'dst' may be the same matrix as 'src'.
+ */
+void CLocalStatistics::MinFilter(const Mat & src, Mat & dst, int rx, int ry)
+{
+	VanHerkFilter<CMinOperation>(src, dst, rx, rx, ry, ry);
+}
+
+/*
+ * Minimum filter with an asymmetric window [x-left, x+right] x [y-top, y+bottom] (see above)
+ */
+void CLocalStatistics::MinFilter(const Mat & src, Mat & dst, int left, int right, int top, int bottom)
+{
+	VanHerkFilter<CMinOperation>(src, dst, left, right, top, bottom);
+}
+
+/*
+ * Maximum filter for 8 or 16 bit single channel matrices (see MinFilter())
+ */
+void CLocalStatistics::MaxFilter(const Mat & src, Mat & dst, int rx, int ry)
+{
+	VanHerkFilter<CMaxOperation>(src, dst, rx, rx, ry, ry);
+}
+
+/*
+ * Maximum filter with an asymmetric window [x-left, x+right] x [y-top, y+bottom] (see MinFilter())
+ */
+void CLocalStatistics::MaxFilter(const Mat & src, Mat & dst, int left, int right, int top, int bottom)
+{
+	VanHerkFilter<CMaxOperation>(src, dst, left, right, top, bottom);
+}
+
+
+/*
+ * Class CLocalStatistics::CRowCursor
+ *
+ * Calculates the local mean and variance for a sequence of rows.
+ */
+
+/*
+ * Constructor
+ *
+ * 'whalf' - Half window size (window (2*whalf+1) x (2*whalf+1)), not larger than the one passed to the statistics
+ */
+CLocalStatistics::CRowCursor::CRowCursor(const CLocalStatistics & statistics, int whalf) : m_Statistics(statistics)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(whalf <= statistics.m_MaxWhalf && statistics.m_Mode != MODE_MIN_MAX);
+
+	m_Whalf = whalf;
+	m_Width = statistics.GetWidth();
+	m_Height = statistics.GetHeight();
+	m_Grey = NULL;
+	m_BufferRows = 0;
+	m_FirstRow = 0;
+	m_NextRow = 0;
+
+	m_Means.resize(m_Width);
+	m_Variances.resize(m_Width);
+	m_ColSums.resize(m_Width + 1, 0);
+	m_Sums.resize(m_Width);
+	if (statistics.m_NarrowSquareSums)
+	{
+		m_ColSqSums32.resize(m_Width + 1, 0);
+		m_SqSums32.resize(m_Width);
+	}
+	else
+	{
+		m_ColSqSums64.resize(m_Width + 1, 0);
+		m_SqSums64.resize(m_Width);
+	}
+}
+
+/*
+ * Calculates mean and variance of all pixels in row 'y'.
+ * In streaming mode, the rows have to be requested in ascending order.
+ */
+void CLocalStatistics::CRowCursor::Calculate(int y)
+{
+	if (m_Statistics.m_Mode == MODE_STREAMING)
+	{
+		if (m_Statistics.m_NarrowSquareSums)
+			CalculateStreamed<uint32_t>(y, m_ColSqSums32, m_SqSums32, m_RunningSqSums32);
+		else
+			CalculateStreamed<uint64>(y, m_ColSqSums64, m_SqSums64, m_RunningSqSums64);
+	}
+	else
+	{
+		m_Grey = m_Statistics.m_Grey.ptr<uchar>(y);
+		if (m_Statistics.m_NarrowSquareSums)
+			CalculateFromIntegrals<uint32_t>(y, m_ColSqSums32, m_SqSums32, m_Statistics.m_SqSums32);
+		else
+			CalculateFromIntegrals<uint64>(y, m_ColSqSums64, m_SqSums64, m_Statistics.m_SqSums64);
+	}
+}
+
+/*
+ * Window sums of row 'y' from the integral images
+ */
+template<class SqType>
+void CLocalStatistics::CRowCursor::CalculateFromIntegrals(int y, std::vector<SqType> & colSqSums, std::vector<SqType> & sqSums,
+														  const std::vector<SqType> & integralSqSums)
+{
+	int stride = m_Statistics.m_Stride;
+	int ymin = max(0, y - m_Whalf);
+	int ymax = min(m_Height - 1, y + m_Whalf);
+
+	SubtractRows(&m_Statistics.m_Sums[(size_t)(ymax + 1) * stride], &m_Statistics.m_Sums[(size_t)ymin * stride], &m_ColSums[0], m_Width + 1);
+	SubtractRows(&integralSqSums[(size_t)(ymax + 1) * stride], &integralSqSums[(size_t)ymin * stride], &colSqSums[0], m_Width + 1);
+	WindowSums(&m_ColSums[0], &m_Sums[0], m_Width, m_Whalf);
+	WindowSums(&colSqSums[0], &sqSums[0], m_Width, m_Whalf);
+
+	CalculateMeanVariance(&sqSums[0], ymax - ymin + 1);
+}
+
+/*
+ * Window sums of row 'y' from running column sums over a ring buffer of the window rows.
+ * When moving on, the rows that leave the window are subtracted and the rows that enter it are added.
+ */
+template<class SqType>
+void CLocalStatistics::CRowCursor::CalculateStreamed(int y, std::vector<SqType> & colSqSums, std::vector<SqType> & sqSums,
+													 std::vector<SqType> & runningSqSums)
+{
+	int ymin = max(0, y - m_Whalf);
+	int ymax = min(m_Height - 1, y + m_Whalf);
+
+	//First row?
+	if (m_RingBuffer.empty())
+	{
+		m_BufferRows = min(m_Height, 2 * m_Whalf + 1);
+		m_RingBuffer.resize((size_t)m_BufferRows * m_Width);
+		m_RunningSums.assign(m_Width, 0);
+		runningSqSums.assign(m_Width, 0);
+		m_FirstRow = ymin;
+		m_NextRow = ymin;
+	}
+
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(ymin >= m_FirstRow);
+
+	//Remove rows that left the window (before adding, they may share the ring buffer slot)
+	for (; m_FirstRow < ymin && m_FirstRow < m_NextRow; m_FirstRow++)
+	{
+		const uchar * grey = &m_RingBuffer[(size_t)(m_FirstRow % m_BufferRows) * m_Width];
+		for (int x = 0; x < m_Width; x++)
+		{
+			m_RunningSums[x] -= grey[x];
+			runningSqSums[x] -= (SqType)(grey[x] * grey[x]);
+		}
+	}
+	//Skipped rows
+	m_FirstRow = ymin;
+	m_NextRow = max(m_NextRow, ymin);
+	//Add rows that entered the window
+	for (; m_NextRow <= ymax; m_NextRow++)
+	{
+		uchar * buffer = &m_RingBuffer[(size_t)(m_NextRow % m_BufferRows) * m_Width];
+		const uchar * grey = m_Statistics.GetGreyRow(m_NextRow, buffer);
+		if (grey != buffer)
+			memcpy(buffer, grey, m_Width);
+		for (int x = 0; x < m_Width; x++)
+		{
+			m_RunningSums[x] += buffer[x];
+			runningSqSums[x] += (SqType)(buffer[x] * buffer[x]);
+		}
+	}
+
+	//Horizontal window sums
+	for (int x = 0; x < m_Width; x++)
+	{
+		m_ColSums[x + 1] = m_ColSums[x] + m_RunningSums[x];
+		colSqSums[x + 1] = colSqSums[x] + runningSqSums[x];
+	}
+	WindowSums(&m_ColSums[0], &m_Sums[0], m_Width, m_Whalf);
+	WindowSums(&colSqSums[0], &sqSums[0], m_Width, m_Whalf);
+
+	m_Grey = &m_RingBuffer[(size_t)(y % m_BufferRows) * m_Width];
+	CalculateMeanVariance(&sqSums[0], ymax - ymin + 1);
+}
+
+/*
+ * Mean and sample variance from the window sums.
+ * (Same arithmetic as the original Sauvola implementation, so the thresholds are identical.)
+ */
+template<class SqType>
+void CLocalStatistics::CRowCursor::CalculateMeanVariance(const SqType * sqSums, int windowHeight)
+{
+	for (int x = 0; x < m_Width; x++)
+	{
+		int windowWidth = min(m_Width - 1, x + m_Whalf) - max(0, x - m_Whalf) + 1;
+		double area = windowWidth * windowHeight;
+		double diff = (double)m_Sums[x];
+		double sqdiff = (double)sqSums[x];
+		m_Means[x] = diff / area;
+		m_Variances[x] = (sqdiff - diff * diff / area) / (area - 1);
+	}
+}
+
+
+} //end namespace
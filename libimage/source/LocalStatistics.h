@@ -0,0 +1,121 @@
+#pragma once
+
+#include "opencvimage.h"
+#include <vector>
+
+namespace PRImA {
+
+/*
+ * Class CLocalStatistics
+ *
+ * Local (windowed) statistics of the grey levels of an image, shared by the local binarisation methods
+ * (see CImageTransformer). The window of a pixel is (2*whalf+1) x (2*whalf+1), clipped at the image borders.
+ *
+ * Mean and variance are calculated in O(1) per pixel, either from integral images (any row order)
+ * or, in streaming mode, from running column sums over a ring buffer of the window rows
+ * (O(width * whalf) memory, rows have to be requested in ascending order per cursor).
+ * Minimum and maximum are calculated with van Herk / Gil-Werman filters (also O(1) per pixel),
+ * which are also available for 8 and 16 bit matrices with arbitrary rectangular windows (MinFilter(), MaxFilter()).
+ *
+ * The grey level of colour images is 0.3*c0 + 0.59*c1 + 0.11*c2 (channels in storage order),
+ * 16 bit values are divided by 256.
+ *
+ * Usage: Create one statistics object per image, then one CRowCursor per thread / band of rows.
+ */
+class CLocalStatistics
+{
+public:
+	/*
+	 * Calculates the local mean and variance for a sequence of rows.
+	 * Not thread-safe (use one cursor per thread).
+	 */
+	class CRowCursor
+	{
+	public:
+		CRowCursor(const CLocalStatistics & statistics, int whalf);
+
+		void Calculate(int y);
+
+		inline const uchar *	GetGrey() const { return m_Grey; };				//Grey levels of the current row
+		inline const double *	GetMeans() const { return &m_Means[0]; };
+		inline const double *	GetVariances() const { return &m_Variances[0]; };	//Sample variance (divided by n-1)
+
+	private:
+		template<class SqType> void CalculateFromIntegrals(int y, std::vector<SqType> & colSqSums, std::vector<SqType> & sqSums,
+															const std::vector<SqType> & integralSqSums);
+		template<class SqType> void CalculateStreamed(int y, std::vector<SqType> & colSqSums, std::vector<SqType> & sqSums,
+													  std::vector<SqType> & runningSqSums);
+		template<class SqType> void CalculateMeanVariance(const SqType * sqSums, int windowHeight);
+
+	private:
+		const CLocalStatistics &	m_Statistics;
+		int							m_Whalf;
+		int							m_Width;
+		int							m_Height;
+
+		const uchar *				m_Grey;
+		std::vector<double>			m_Means;
+		std::vector<double>			m_Variances;
+
+		std::vector<uint32_t>		m_ColSums;		//Cumulated column sums over the window rows (width+1 values)
+		std::vector<uint32_t>		m_Sums;			//Window sums
+		std::vector<uint32_t>		m_ColSqSums32;
+		std::vector<uint32_t>		m_SqSums32;
+		std::vector<uint64>			m_ColSqSums64;
+		std::vector<uint64>			m_SqSums64;
+
+		std::vector<uint32_t>		m_RunningSums;	//Streaming mode: sums per column over the window rows
+		std::vector<uint32_t>		m_RunningSqSums32;
+		std::vector<uint64>			m_RunningSqSums64;
+		std::vector<uchar>			m_RingBuffer;	//Streaming mode: grey levels of the window rows
+		int							m_BufferRows;
+		int							m_FirstRow;		//Streaming mode: first row within the column sums
+		int							m_NextRow;		//Streaming mode: next row to be added to the column sums
+	};
+
+public:
+	static const int MODE_INTEGRALS	= 0;	//Mean and variance from integral images (any row order)
+	static const int MODE_STREAMING	= 1;	//Mean and variance from running sums (ascending rows per cursor)
+	static const int MODE_MIN_MAX	= 2;	//Minimum and maximum only (GetMinMax())
+
+public:
+	CLocalStatistics(COpenCvImage * source, int maxWhalf, int mode = MODE_INTEGRALS);
+	~CLocalStatistics(void);
+
+	inline bool IsValid() const { return m_Valid; };			//False if the grey levels or integral images could not be allocated
+	inline int	GetMode() const { return m_Mode; };
+	inline int	GetWidth() const { return m_Data.cols; };
+	inline int	GetHeight() const { return m_Data.rows; };
+
+	const uchar * GetGreyRow(int y, uchar * buffer) const;
+
+	bool GetMinMax(int whalf, cv::Mat & mins, cv::Mat & maxs) const;
+
+	static void MinFilter(const cv::Mat & src, cv::Mat & dst, int rx, int ry);
+	static void MinFilter(const cv::Mat & src, cv::Mat & dst, int left, int right, int top, int bottom);
+	static void MaxFilter(const cv::Mat & src, cv::Mat & dst, int rx, int ry);
+	static void MaxFilter(const cv::Mat & src, cv::Mat & dst, int left, int right, int top, int bottom);
+
+	static bool HasNarrowSquareSums(int whalf);
+
+private:
+	void ConvertRow(int y, uchar * dst) const;
+	void CalculateIntegrals();
+
+private:
+	cv::Mat					m_Data;			//Source pixel data
+	bool					m_IsGreyScale;
+	double					m_Weights[3][256];
+	cv::Mat					m_Grey;			//8 bit grey levels (not in streaming mode)
+	int						m_Mode;
+	int						m_MaxWhalf;
+	bool					m_Valid;
+	bool					m_NarrowSquareSums;	//32 bit squared sums suffice for the maximum window size
+
+	int						m_Stride;		//Integral images: (width+1) x (height+1), leading zero row and column
+	std::vector<uint32_t>	m_Sums;
+	std::vector<uint32_t>	m_SqSums32;
+	std::vector<uint64>		m_SqSums64;
+};
+
+} //end namespace
@@ -1,4 +1,7 @@
 #include "OpenCvImage.h"
+#include "RowKernelHelpers.h"
+#include "opencv2/core/hal/intrin.hpp"
+#include <atomic>
 
 using namespace cv;
 
@@ -12,6 +15,8 @@ namespace PRImA {
  * CC 01/11/2013 - created
  */
 
+CImageBufferPool * COpenCvImage::s_BufferPool = NULL;
+
 /*
  * Constructor
  */
@@ -21,6 +26,10 @@ COpenCvImage::COpenCvImage(void)
 	m_OrigImageDataIsGdiCompatible = false;
 	m_MaxValueForColorChannel = 255; //Default
 	m_ImageInfo = NULL;
+	m_PackedData = NULL;
+	m_PackedType = CV_8UC1;
+	m_CopyOnWrite = false;
+	m_DataGeneration = std::make_shared<std::atomic<unsigned int> >(0);
 }
 
 /*
@@ -32,6 +41,7 @@ COpenCvImage::~COpenCvImage(void)
 
 	ResetGdiCompatiblePixelData();
 	delete m_ImageInfo;
+	delete m_PackedData;
 }
 
 /*
@@ -67,7 +77,7 @@ COpenCvImage * COpenCvImage::Create(Mat data, int enforceType, bool ensurePixelV
 
 	if (enforceType == TYPE_AUTO) //Auto detect image type
 	{
-		//Determine if colour, grey scale or bi-level (heuristic not using all pixels)
+		//Determine if colour, grey scale or bi-level (checks all pixels)
 		if (data.depth() == CV_8U) //8 bit
 			img = COpenCvImageOps<uchar>::DetectColorDepthAndCreateImage(data);
 		else //16 bit
@@ -123,23 +133,14 @@ out2:*/
 	img->SetData(data);
 
 	//Fix for greyscale image created as 3-channel image
-	if (data.type() == CV_8UC3 && typeid(*img) == typeid(COpenCvGreyScaleImage))
+	if ((data.type() == CV_8UC3 || data.type() == CV_16UC3) && typeid(*img) == typeid(COpenCvGreyScaleImage))
 	{
-		//Create empty image
-		COpenCvGreyScaleImage * temp = COpenCvImage::CreateG(img->GetWidth(), img->GetHeight(), RGBWHITE);
-
-		//Convert
-		RGBCOLOUR cur;
-		for (int x=0; x < img->GetWidth(); x++)
-		{
-			for(int y=0; y < img->GetHeight(); y++)
-			{
-				cur = img->GetRGBColor(x, y);
-				temp->SetGreyLevel(x, y, (int)max(0.0, min(255.0, 0.299*cur.R + 0.587*cur.G + 0.114*cur.B)));
-			}
-		}
-		delete img;
-		img = temp;
+		Mat grey = AllocateMatrix(data.rows, data.cols, CV_MAKETYPE(data.depth(), 1));
+		if (data.depth() == CV_8U) //8 bit
+			COpenCvImageOps<uchar>::ConvertToGreyScale(data, grey);
+		else //16 bit
+			COpenCvImageOps<ushort>::ConvertToGreyScale(data, grey);
+		img->SetData(grey);
 	}
 
 	img->SetMaxValueForColorChannel(maxValueForColorChannel);
@@ -159,19 +160,22 @@ COpenCvImage * COpenCvImage::Create(int type, int width, int height, RGBCOLOUR b
 	if (type == TYPE_BILEVEL)
 	{
 		ret = new COpenCvBiLevelImage();
-		Mat data(height, width, CV_8UC1, CV_RGB(backColour.R, backColour.G, backColour.B));
+		Mat data = AllocateMatrix(height, width, CV_8UC1);
+		data.setTo(Scalar(CV_RGB(backColour.R, backColour.G, backColour.B)));
 		ret->SetData(data);
 	}
 	else if (type == TYPE_GREYSCALE)
 	{
 		ret = new COpenCvGreyScaleImage();
-		Mat data(height, width, CV_8UC1, CV_RGB(backColour.R, backColour.G, backColour.B));
+		Mat data = AllocateMatrix(height, width, CV_8UC1);
+		data.setTo(Scalar(CV_RGB(backColour.R, backColour.G, backColour.B)));
 		ret->SetData(data);
 	}
 	else //Colour
 	{
 		ret = new COpenCvColourImage();
-		Mat data(height, width, CV_8UC3, CV_RGB(backColour.R, backColour.G, backColour.B));
+		Mat data = AllocateMatrix(height, width, CV_8UC3);
+		data.setTo(Scalar(CV_RGB(backColour.R, backColour.G, backColour.B)));
 		ret->SetData(data);
 	}
 	return ret;
@@ -204,6 +208,40 @@ COpenCvColourImage * COpenCvImage::CreateC(int width, int height, RGBCOLOUR back
 	return dynamic_cast<COpenCvColourImage*>(Create(COpenCvImage::TYPE_COLOUR, width, height, backColour));
 }
 
+/*
+ * Sets the buffer pool to be used for new pixel matrices of all images (see AllocateMatrix()).
+ * Matrices loaded by OpenCV functions (e.g. imread) are not affected.
+ * Should be called before images are created (not thread-safe). The pool has to stay alive
+ * until all images using it have been deleted.
+ *
+ * 'pool' - Buffer pool or NULL to use the default OpenCV allocator
+ */
+void COpenCvImage::SetBufferPool(CImageBufferPool * pool)
+{
+	s_BufferPool = pool;
+}
+
+/*
+ * Allocates a new (uninitialised) pixel matrix using the buffer pool, if set.
+ */
+Mat COpenCvImage::AllocateMatrix(int rows, int cols, int type)
+{
+	Mat data;
+	data.allocator = s_BufferPool;
+	data.create(rows, cols, type);
+	return data;
+}
+
+/*
+ * Deep copy of the given matrix (or matrix region) using the buffer pool, if set.
+ */
+Mat COpenCvImage::CloneMatrix(Mat source)
+{
+	Mat copy = AllocateMatrix(source.rows, source.cols, source.type());
+	source.copyTo(copy);
+	return copy;
+}
+
 /*
  * Creates a new image from a rectangular subsection of this image
  * 'type' - TYPE_BILEVEL, TYPE_GREYSCALE, TYPE_COLOUR or TYPE_AUTO
@@ -213,17 +251,80 @@ COpenCvImage * COpenCvImage::CreateSubImage(int left, int top, int width, int he
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(left >=0 && top >=0 && left+width-1 < GetWidth() && top+height-1 < GetHeight());
 
-	//Get sub matrix
-	Mat subImageData = m_Data(Rect(left, top, width, height));
-
-	//We need to make a copy, otherwise they will share the same pixel array
 	Mat copy;
-	copy.create(height, width, subImageData.type());
-	subImageData.copyTo(copy);
+	if (m_PackedData != NULL) //Unpack only the requested region
+	{
+		copy = AllocateMatrix(height, width, m_PackedType);
+		m_PackedData->ToMat(copy, m_PackedType, m_MaxValueForColorChannel, left, top, width, height);
+	}
+	else
+	{
+		//Get sub matrix
+		Mat subImageData = m_Data(Rect(left, top, width, height));
+
+		//We need to make a copy, otherwise they will share the same pixel array
+		copy = CloneMatrix(subImageData);
+	}
 
 	return COpenCvImage::Create(copy, type, false);
 }
 
+/*
+ * Creates a new image of the same type that shares the pixel data of the given rectangular
+ * area with this image (no copying).
+ * The OpenCV matrix is reference counted, so the view stays valid if this image is deleted.
+ * Images with packed storage cannot be shared this way and a copy is made instead (see CreateSubImage()).
+ *
+ * 'writeMode' - VIEW_WRITE_THROUGH: Changes to the view are visible in this image (and vice versa).
+ *                                    If this image shares its pixels copy-on-write, it gets its own copy first.
+ *               VIEW_COPY_ON_WRITE: The view gets its own copy of the pixels when it is changed for the first time.
+ *                                   Changes to this image are visible in the view until then.
+ * Cached data derived from the pixels (e.g. the integral image of bi-level images) is invalidated
+ * in both images when either of them changes the shared pixels.
+ */
+COpenCvImage * COpenCvImage::CreateView(int left, int top, int width, int height, int writeMode /*= VIEW_COPY_ON_WRITE*/)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(left >=0 && top >=0 && left+width-1 < GetWidth() && top+height-1 < GetHeight());
+
+	if (m_PackedData != NULL)
+		return CreateSubImage(left, top, width, height);
+
+	COpenCvImage * view = NULL;
+	if (typeid(*this) == typeid(COpenCvBiLevelImage))
+		view = new COpenCvBiLevelImage();
+	else if (typeid(*this) == typeid(COpenCvGreyScaleImage))
+		view = new COpenCvGreyScaleImage();
+	else
+		view = new COpenCvColourImage();
+
+	//Write-through: This image and the view have to own the pixels together, they must not be shared with copy-on-write clones
+	if (writeMode == VIEW_WRITE_THROUGH && m_CopyOnWrite)
+		Detach();
+
+	view->SetData(m_Data(Rect(left, top, width, height))); //Matrix header for the region (shares the pixel array)
+	view->m_MaxValueForColorChannel = m_MaxValueForColorChannel;
+	view->m_CopyOnWrite = writeMode == VIEW_COPY_ON_WRITE;
+	view->m_DataGeneration = m_DataGeneration; //Changes of either image invalidate the cached data of the other
+	view->CopyImageInfo(m_ImageInfo);
+	return view;
+}
+
+/*
+ * Makes sure this image has its own copy of the pixel data (if the data is shared with other images)
+ * and disables copy-on-write for this image.
+ */
+void COpenCvImage::Detach()
+{
+	if (m_Data.u != NULL && m_Data.u->refcount > 1)
+	{
+		ResetGdiCompatiblePixelData(); //Might point to the shared data
+		m_Data = CloneMatrix(m_Data);
+		m_DataGeneration = std::make_shared<std::atomic<unsigned int> >(m_DataGeneration->load()); //Same content, cached data stays valid
+	}
+	m_CopyOnWrite = false;
+}
+
 /*
  * Returns the maximum value one colour channel of the image according to the depth.
  * At the moment this can be either 255 (8bit) or 65535 (16bit).
@@ -239,26 +340,77 @@ int COpenCvImage::CalcMaxValueForColorChannel(Mat data)
  */
 void COpenCvImage::CopyFrom(COpenCvImage * other)
 {
-	m_Data = other->m_Data.clone();
+	m_CopyOnWrite = false;
+	delete m_PackedData;
+	m_PackedData = NULL;
+	if (other->m_PackedData != NULL)
+	{
+		m_PackedData = new CPackedBitMatrix(*other->m_PackedData);
+		m_PackedType = other->m_PackedType;
+		m_Data.release();
+	}
+	else
+		m_Data = CloneMatrix(other->m_Data);
+	OnDataChanged();
 	//m_GdiCompatibleData = other->m_GdiCompatibleData; //Shouldn't copy this (only a viewing copy anyway)
 	m_OrigImageDataIsGdiCompatible = other->m_OrigImageDataIsGdiCompatible;
 	m_MaxValueForColorChannel = other->m_MaxValueForColorChannel; 
 	CopyImageInfo(other->GetImageInfo());
 }
 
+/*
+ * Takes over image data and properties from the given image without copying the pixels.
+ * Both images use copy-on-write afterwards, so changes to one image are not visible in the other.
+ * If the pixels of the other image are already shared without copy-on-write (e.g. write-through view),
+ * a deep copy is made instead (see CopyFrom()).
+ */
+void COpenCvImage::ShareDataFrom(COpenCvImage * other)
+{
+	bool sharedWriteThrough = !other->m_CopyOnWrite && other->m_Data.u != NULL && other->m_Data.u->refcount > 1;
+	if (other->m_PackedData != NULL || sharedWriteThrough)
+	{
+		CopyFrom(other);
+		return;
+	}
+
+	delete m_PackedData;
+	m_PackedData = NULL;
+	ResetGdiCompatiblePixelData();
+	m_Data = other->m_Data;
+	m_DataGeneration = other->m_DataGeneration;
+	m_CopyOnWrite = true;
+	other->m_CopyOnWrite = true;
+	m_MaxValueForColorChannel = other->m_MaxValueForColorChannel; 
+	CopyImageInfo(other->GetImageInfo());
+}
+
 /*
  * Sets the internal OpenCV image data (pixel matrix).
  */
 void COpenCvImage::SetData(Mat imageData)
 {
+	delete m_PackedData;
+	m_PackedData = NULL;
 	m_Data = imageData;
+	m_CopyOnWrite = false;
+	OnDataChanged();
 }
 
 /*
  * Returns the internal OpenCV image data (pixel matrix).
+ * Images using packed storage are unpacked first.
+ *
+ * 'forWriting' - Set to false if the pixels will only be read. Otherwise shared data
+ *                is copied first (copy-on-write) and cached data is invalidated.
  */
-Mat COpenCvImage::GetData()
+Mat COpenCvImage::GetData(bool forWriting /*= true*/)
 {
+	EnsureMatrixData();
+	if (forWriting)
+	{
+		PrepareForWriting();
+		OnDataChanged(); //The caller might modify the pixels
+	}
 	return m_Data;
 }
 
@@ -267,7 +419,7 @@ Mat COpenCvImage::GetData()
  */
 int COpenCvImage::GetWidth()
 {
-	return m_Data.cols;
+	return m_PackedData != NULL ? m_PackedData->GetWidth() : m_Data.cols;
 }
 
 /* 
@@ -275,7 +427,67 @@ int COpenCvImage::GetWidth()
  */
 int COpenCvImage::GetHeight()
 {
-	return m_Data.rows;
+	return m_PackedData != NULL ? m_PackedData->GetHeight() : m_Data.rows;
+}
+
+/*
+ * Returns the memory used by the pixel data of this image in bytes (packed or matrix storage)
+ */
+size_t COpenCvImage::GetMemorySize()
+{
+	if (m_PackedData != NULL)
+		return m_PackedData->GetMemorySize();
+	return m_Data.isContinuous() ? m_Data.total() * m_Data.elemSize() : m_Data.step[0] * (size_t)m_Data.rows;
+}
+
+/*
+ * Converts the pixel matrix to packed storage (one bit per pixel).
+ * Only suitable for bi-level data (pixels are regarded as black if the first channel is 0, otherwise white).
+ */
+void COpenCvImage::PackData()
+{
+	if (m_PackedData != NULL)
+		return;
+
+	ResetGdiCompatiblePixelData(); //Might point to the matrix data
+
+	m_PackedData = new CPackedBitMatrix();
+	m_PackedData->FromMat(m_Data);
+	m_PackedType = m_Data.type();
+	m_Data.release();
+}
+
+/*
+ * Converts packed storage back to the OpenCV pixel matrix (same type as before packing).
+ */
+void COpenCvImage::UnpackData()
+{
+	if (m_PackedData == NULL)
+		return;
+
+	Mat data = AllocateMatrix(m_PackedData->GetHeight(), m_PackedData->GetWidth(), m_PackedType);
+	m_PackedData->ToMat(data, m_PackedType, m_MaxValueForColorChannel);
+	delete m_PackedData;
+	m_PackedData = NULL;
+	m_Data = data;
+}
+
+/*
+ * Returns the pixel layout (depth and number of channels) of the image data.
+ * One of LAYOUT_8U_C1, LAYOUT_16U_C1, LAYOUT_8U_C3, LAYOUT_16U_C3 or LAYOUT_UNSUPPORTED.
+ */
+int COpenCvImage::GetPixelLayout()
+{
+	EnsureMatrixData();
+
+	switch (m_Data.type())
+	{
+	case CV_8UC1:	return LAYOUT_8U_C1;
+	case CV_16UC1:	return LAYOUT_16U_C1;
+	case CV_8UC3:	return LAYOUT_8U_C3;
+	case CV_16UC3:	return LAYOUT_16U_C3;
+	}
+	return LAYOUT_UNSUPPORTED;
 }
 
 /*
@@ -286,6 +498,14 @@ RGBCOLOUR COpenCvImage::GetRGBColor(int x, int y)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	//Packed B/W
+	if (m_PackedData != NULL)
+	{
+		uchar pixel = m_PackedData->Get(x, y) ? 0 : 255;
+		RGBCOLOUR rgb = {pixel, pixel, pixel};
+		return rgb;
+	}
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -325,6 +545,10 @@ void COpenCvImage::SetRGBColor(int x, int y, RGBCOLOUR col)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	EnsureMatrixData(); //Arbitrary colours cannot be stored in packed form
+	PrepareForWriting();
+	OnDataChanged();
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -355,25 +579,26 @@ uint8_t * COpenCvImage::GetGdiCompatiblePixelData()
 {
 	if (m_GdiCompatibleData == NULL)
 	{
+		EnsureMatrixData();
+
 		int height = GetHeight();
 		int width = GetWidth();
 		int bitsPerChannel = m_Data.depth() == CV_8U ? 8 : 16;
 		int bpp = bitsPerChannel * m_Data.channels();
 		int scanlineBytes = width * bpp / 8;
 		int scanlineBytesCorrected = scanlineBytes;
-		if (scanlineBytesCorrected % 4 != 0)
+		if (scanlineBytesCorrected % 4 != 0 || !m_Data.isContinuous()) //Views (ROI) have gaps between the rows
 		{
 			m_OrigImageDataIsGdiCompatible = false;
-			scanlineBytesCorrected += (4 - (scanlineBytes % 4)); //Scanline has to be multiple of 4 byte
+			if (scanlineBytesCorrected % 4 != 0)
+				scanlineBytesCorrected += (4 - (scanlineBytes % 4)); //Scanline has to be multiple of 4 byte
 			m_GdiCompatibleData = new uint8_t[scanlineBytesCorrected * height];
 
 			int i;
-			int startPos = 0;
 			int startPosCorrected = 0;
 			for (i=0; i<height; i++)
 			{
-				memcpy(m_GdiCompatibleData+startPosCorrected, m_Data.data+startPos, scanlineBytes);
-				startPos += scanlineBytes;
+				memcpy(m_GdiCompatibleData+startPosCorrected, m_Data.ptr(i), scanlineBytes);
 				startPosCorrected += scanlineBytesCorrected;
 			}
 		}
@@ -421,6 +646,10 @@ void COpenCvImage::CopyImageInfo(CImageInfo * other)
 	m_ImageInfo->resolutionY = other->resolutionY;
 	if (m_ImageInfo->bitsPerPixel == 0)
 		m_ImageInfo->bitsPerPixel = other->bitsPerPixel;
+	if (m_ImageInfo->channels == 0)
+		m_ImageInfo->channels = other->channels;
+	if (m_ImageInfo->pageCount == 0)
+		m_ImageInfo->pageCount = other->pageCount;
 }
 
 /*
@@ -431,22 +660,35 @@ void COpenCvImage::Resize(int newWidth, int newHeight)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(newWidth > 0 && newHeight > 0);
 
-	m_Data = m_Data(Rect(0, 0, newWidth, newHeight)).clone();
+	EnsureMatrixData();
+	m_Data = CloneMatrix(m_Data(Rect(0, 0, newWidth, newHeight)));
+	m_CopyOnWrite = false;
 	ResetGdiCompatiblePixelData();
+	OnDataChanged();
 }
 
 /*
  * Resizes the pixel matrix (no scaling).
  *
  * 'originX', 'originY' - Origin of the resized matrix within the current matrix (offset).
+ * 'copyData' - If false, the pixel array is not copied and the image refers to the region of the old array
+ *              (which stays allocated as long as it is in use).
  */
-void COpenCvImage::Resize(int originX, int originY, int newWidth, int newHeight)
+void COpenCvImage::Resize(int originX, int originY, int newWidth, int newHeight, bool copyData /*= true*/)
 {
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(originX > 0 && originY > 0 && newWidth > 0 && newHeight > 0 && originX < GetWidth() && originY < GetHeight());
 
-	m_Data = m_Data(Rect(originX, originY, newWidth, newHeight)).clone();
+	EnsureMatrixData();
+	if (copyData)
+	{
+		m_Data = CloneMatrix(m_Data(Rect(originX, originY, newWidth, newHeight)));
+		m_CopyOnWrite = false;
+	}
+	else
+		m_Data = m_Data(Rect(originX, originY, newWidth, newHeight));
 	ResetGdiCompatiblePixelData();
+	OnDataChanged();
 }
 
 
@@ -471,12 +713,12 @@ COpenCvGreyScaleImage::~COpenCvGreyScaleImage(void)
 }
 
 /*
- * Creates a deep copy.
+ * Creates a copy. The pixel data is shared until one of the images is changed (copy-on-write).
  */
 COpenCvImage * COpenCvGreyScaleImage::Clone()
 {
 	COpenCvImage * copy = new COpenCvGreyScaleImage();
-	copy->CopyFrom(this);
+	copy->ShareDataFrom(this);
 	return copy;
 }
 
@@ -546,6 +788,8 @@ void COpenCvGreyScaleImage::SetGreyLevel(int x, int y, int level)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	PrepareForWriting();
+
 	//Grey 
 	if (m_Data.channels() == 1)
 	{
@@ -577,6 +821,9 @@ COpenCvBiLevelImage::COpenCvBiLevelImage(void) : COpenCvImage()
 {
 	m_NumberOfBlackPixels = -1L;
 	m_NumberOfWhitePixels = -1L;
+	m_PixelCountGeneration = 0;
+	m_IntegralImageValid = false;
+	m_IntegralImageGeneration = 0;
 }
 
 /*
@@ -587,12 +834,19 @@ COpenCvBiLevelImage::~COpenCvBiLevelImage(void)
 }
 
 /*
- * Creates a deep copy.
+ * Creates a copy. The pixel data is shared until one of the images is changed (copy-on-write).
+ * Cached pixel counts and the integral image are taken over.
  */
 COpenCvImage * COpenCvBiLevelImage::Clone()
 {
-	COpenCvImage * copy = new COpenCvBiLevelImage();
-	copy->CopyFrom(this);
+	COpenCvBiLevelImage * copy = new COpenCvBiLevelImage();
+	copy->ShareDataFrom(this);
+	copy->m_NumberOfBlackPixels = m_NumberOfBlackPixels;
+	copy->m_NumberOfWhitePixels = m_NumberOfWhitePixels;
+	copy->m_PixelCountGeneration = m_PixelCountGeneration;
+	copy->m_IntegralImage = m_IntegralImage; //Never changed in place (see BuildIntegralImage())
+	copy->m_IntegralImageGeneration = m_IntegralImageGeneration;
+	copy->m_IntegralImageValid = m_IntegralImageValid.load();
 	return copy;
 }
 
@@ -612,6 +866,10 @@ bool COpenCvBiLevelImage::IsBlack(int x, int y)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	//Packed B/W
+	if (m_PackedData != NULL)
+		return m_PackedData->Get(x, y);
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -638,6 +896,10 @@ bool COpenCvBiLevelImage::IsBlack(int x, int y, bool borderValue)
 	if (x < 0 || y < 0 || x >= GetWidth() || y >= GetHeight())
 		return borderValue;
 
+	//Packed B/W
+	if (m_PackedData != NULL)
+		return m_PackedData->Get(x, y);
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -663,6 +925,10 @@ bool COpenCvBiLevelImage::IsWhite(int x, int y)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	//Packed B/W
+	if (m_PackedData != NULL)
+		return !m_PackedData->Get(x, y);
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -689,6 +955,10 @@ bool COpenCvBiLevelImage::IsWhite(int x, int y, bool borderValue)
 	if (x < 0 || y < 0 || x >= GetWidth() || y >= GetHeight())
 		return borderValue;
 
+	//Packed B/W
+	if (m_PackedData != NULL)
+		return !m_PackedData->Get(x, y);
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -726,6 +996,16 @@ void COpenCvBiLevelImage::SetBlack(int x, int y)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	m_IntegralImageValid = false;
+	PrepareForWriting();
+
+	//Packed B/W
+	if (m_PackedData != NULL)
+	{
+		m_PackedData->Set(x, y, true);
+		return;
+	}
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -746,6 +1026,16 @@ void COpenCvBiLevelImage::SetWhite(int x, int y)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	m_IntegralImageValid = false;
+	PrepareForWriting();
+
+	//Packed B/W
+	if (m_PackedData != NULL)
+	{
+		m_PackedData->Set(x, y, false);
+		return;
+	}
+
 	//Grey / B/W
 	if (m_Data.channels() == 1)
 	{
@@ -769,6 +1059,10 @@ void COpenCvBiLevelImage::DrawLine(int x1, int y1, int x2, int y2, bool black, b
 	ASSERT(x1 >=0 && y1 >=0 && x1 < GetWidth() && y1 < GetHeight()
 		&& x2 >=0 && y2 >=0 && x2 < GetWidth() && y2 < GetHeight());
 
+	EnsureMatrixData();
+	PrepareForWriting();
+	m_IntegralImageValid = false;
+
 	int col = black ? 0 : m_MaxValueForColorChannel;
 	int lineType = isothetic ? 8 : 4; //Isothetic = 8-connected line; otherwise 4-connected line
 	line(m_Data, Point(x1,y1), Point(x2,y2), CV_RGB(col, col, col), 1, lineType);
@@ -781,7 +1075,15 @@ void COpenCvBiLevelImage::And(COpenCvBiLevelImage * b)
 {
 	if (b == NULL)
 		return;
-	bitwise_or(m_Data, b->GetData(), m_Data);
+	m_IntegralImageValid = false;
+	PrepareForWriting();
+	if (m_PackedData != NULL) //Word-wise
+	{
+		CPackedBitMatrix temp;
+		m_PackedData->And(b->GetPackedDataOrPack(temp));
+		return;
+	}
+	bitwise_or(m_Data, b->GetMatrixDataOrUnpack(), m_Data);
 	//bitwise_not(m_Data, m_Data);
 }
 
@@ -790,6 +1092,16 @@ void COpenCvBiLevelImage::And(COpenCvBiLevelImage * b)
  */
 void COpenCvBiLevelImage::AndOffset(COpenCvBiLevelImage * b, int offx, int offy)
 {
+	m_IntegralImageValid = false;
+	PrepareForWriting();
+
+	if (m_PackedData != NULL) //Word-wise
+	{
+		CPackedBitMatrix temp;
+		m_PackedData->AndOffset(b->GetPackedDataOrPack(temp), offx, offy);
+		return;
+	}
+
 	int x, y;
 
 	for(y = 0; y < GetHeight(); y++)
@@ -820,7 +1132,15 @@ void COpenCvBiLevelImage::Xor(COpenCvBiLevelImage * b)
 {
 	if (b == NULL)
 		return;
-	bitwise_xor(m_Data, b->GetData(), m_Data);
+	m_IntegralImageValid = false;
+	PrepareForWriting();
+	if (m_PackedData != NULL) //Word-wise
+	{
+		CPackedBitMatrix temp;
+		m_PackedData->Xor(b->GetPackedDataOrPack(temp));
+		return;
+	}
+	bitwise_xor(m_Data, b->GetMatrixDataOrUnpack(), m_Data);
 	bitwise_not(m_Data, m_Data);
 }
 
@@ -831,8 +1151,17 @@ void COpenCvBiLevelImage::XorOffset(COpenCvBiLevelImage * b, int offx, int offy)
 {
 	if (b == NULL)
 		return;
+	m_IntegralImageValid = false;
+	PrepareForWriting();
 
-	Mat pixelsSmall = b->GetData();
+	if (m_PackedData != NULL) //Word-wise
+	{
+		CPackedBitMatrix temp;
+		m_PackedData->XorOffset(b->GetPackedDataOrPack(temp), offx, offy);
+		return;
+	}
+
+	Mat pixelsSmall = b->GetMatrixDataOrUnpack();
 	Mat pixelsLarge = m_Data(cv::Rect(offx, offy, b->GetWidth(), b->GetHeight()));
 
 	bitwise_xor(pixelsLarge, pixelsSmall, pixelsLarge);
@@ -847,58 +1176,199 @@ void COpenCvBiLevelImage::FloodFill(int x, int y, bool black)
 	//Sanity check (evaluated in debug mode only)
 	ASSERT(x >=0 && y >=0 && x < GetWidth() && y < GetHeight());
 
+	EnsureMatrixData();
+	PrepareForWriting();
+	m_IntegralImageValid = false;
+
 	int col = black ? 0 : m_MaxValueForColorChannel;
 	floodFill(m_Data, Point(x, y), CV_RGB(col, col, col));
 }
 
 /*
- * Counts the black or white pixels within the specified rectangular area.
- * TODO: use runs not the single pixels
+ * Called when the pixel data might have been changed
  */
-long COpenCvBiLevelImage::CountPixels(int left, int top, int right, int bottom, bool black /*= true*/)
+void COpenCvBiLevelImage::OnDataChanged()
 {
-	int x,y;
-	long count = 0L;
-	if (black) //avoids the condition within the loop
+	m_IntegralImageValid = false;
+}
+
+/*
+ * Switches between packed storage (one bit per pixel in 64 bit words) and the OpenCV pixel matrix (one byte or word per pixel).
+ * Packed storage needs an eighth of the memory (8 bit images) and allows word-wise boolean operations and pixel counting.
+ * Operations that need the OpenCV matrix (GetData(), FloodFill(), DrawLine(), ...) switch back to matrix storage automatically.
+ * The conversion is lossless for bi-level pixel data.
+ */
+void COpenCvBiLevelImage::SetPackedStorage(bool packed)
+{
+	if (packed)
+		PackData();
+	else
+		UnpackData();
+}
+
+/*
+ * Replaces the pixel data with the given packed pixel data (the image takes ownership).
+ * The image is using packed storage afterwards.
+ *
+ * 'type' - OpenCV matrix type to use when unpacking (e.g. CV_8UC1)
+ */
+void COpenCvBiLevelImage::SetPackedData(CPackedBitMatrix * packedData, int type /*= CV_8UC1*/)
+{
+	ResetGdiCompatiblePixelData(); //Might point to the matrix data
+
+	if (packedData != m_PackedData)
+		delete m_PackedData;
+	m_PackedData = packedData;
+	m_PackedType = type;
+	m_MaxValueForColorChannel = CV_MAT_DEPTH(type) == CV_8U ? 255 : 65535;
+	m_Data.release();
+	m_CopyOnWrite = false;
+	OnDataChanged();
+}
+
+/*
+ * Returns the packed pixel data of this image. If the image is not using packed storage,
+ * the given temporary matrix is filled and returned (this image is not changed).
+ */
+const CPackedBitMatrix & COpenCvBiLevelImage::GetPackedDataOrPack(CPackedBitMatrix & temp)
+{
+	if (m_PackedData != NULL)
+		return *m_PackedData;
+	temp.FromMat(m_Data);
+	return temp;
+}
+
+/*
+ * Returns the OpenCV pixel matrix of this image. If the image is using packed storage,
+ * a temporary unpacked copy is returned (this image is not changed).
+ */
+Mat COpenCvBiLevelImage::GetMatrixDataOrUnpack()
+{
+	if (m_PackedData == NULL)
+		return m_Data;
+	Mat temp;
+	m_PackedData->ToMat(temp, m_PackedType, m_MaxValueForColorChannel);
+	return temp;
+}
+
+/*
+ * Builds the integral image (summed-area table) of the black pixels, if not available.
+ * Rectangular CountPixels() queries take constant time while the table is valid.
+ * The table is only built on request: Call this method before counting many rectangles
+ * (e.g. in a loop or from several threads). Any change of the pixel data invalidates the table.
+ * Thread-safe (concurrent calls build the table once).
+ */
+void COpenCvBiLevelImage::BuildIntegralImage()
+{
+	CSingleLock lock(&m_IntegralImageLock, TRUE);
+
+	if (IsIntegralImageValid())
+		return;
+
+	unsigned int generation = m_DataGeneration->load(); //Changes from now on invalidate the table
+
+	int width = GetWidth();
+	int height = GetHeight();
+
+	//(height+1) x (width+1), first row and column are 0
+	//A new matrix is used (a clone might share the old table and readers use it until the table is valid)
+	Mat table(height+1, width+1, CV_32SC1);
+	memset(table.ptr<int>(0), 0, (width+1) * sizeof(int));
+
+	if (m_PackedData != NULL)
 	{
-		for (y=top; y<=bottom; y++)
-			for (x=left; x<=right; x++)
-				if (this->IsBlack(x, y))
-					count++;
+		for (int y=0; y<height; y++)
+		{
+			const int * prev = table.ptr<int>(y);
+			int * cur = table.ptr<int>(y+1);
+			int rowSum = 0;
+			cur[0] = 0;
+			for (int x=0; x<width; x++)
+			{
+				rowSum += m_PackedData->Get(x, y) ? 1 : 0;
+				cur[x+1] = prev[x+1] + rowSum;
+			}
+		}
 	}
 	else
 	{
-		for (y=top; y<=bottom; y++)
-			for (x=left; x<=right; x++)
-				if (this->IsWhite(x, y))
-					count++;
+		ForEachRow([&](int y, auto row)
+		{
+			const int * prev = table.ptr<int>(y);
+			int * cur = table.ptr<int>(y+1);
+			int rowSum = 0;
+			cur[0] = 0;
+			for (int x=0; x<width; x++)
+			{
+				if (row[x] == 0) //Black
+					rowSum++;
+				cur[x+1] = prev[x+1] + rowSum;
+			}
+		});
 	}
-	return count;
+	m_IntegralImage = table;
+	m_IntegralImageGeneration = generation;
+	m_IntegralImageValid = true;
 }
 
 /*
  * Counts the black or white pixels within the specified rectangular area.
- * Uses borderValue if outside the image dimensions.
+ * Constant time if the integral image is available (see BuildIntegralImage()). Otherwise the bits (packed storage)
+ * or pixels of the rectangle are counted. The image is not changed, so concurrent calls are safe.
  */
-long COpenCvBiLevelImage::CountPixels(bool borderValue, int left, int top, int right, int bottom, bool black /*= true*/)
+long COpenCvBiLevelImage::CountPixels(int left, int top, int right, int bottom, bool black /*= true*/)
 {
-	int x, y;
-	long count = 0L;
-	if (black) //avoids the condition within the loop
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(left >= 0 && top >= 0 && right < GetWidth() && bottom < GetHeight());
+
+	if (left > right || top > bottom)
+		return 0L;
+
+	long area = (long)(right-left+1) * (bottom-top+1);
+	long blackCount;
+	if (IsIntegralImageValid())
+		blackCount = CountBlackPixelsUsingIntegralImage(left, top, right, bottom);
+	else if (m_PackedData != NULL) //Popcount
+		blackCount = m_PackedData->CountBits(left, top, right, bottom);
+	else if (m_Data.channels() == 1) //Black = 0
+		blackCount = area - (long)countNonZero(m_Data(Rect(left, top, right-left+1, bottom-top+1)));
+	else
 	{
-		for (y = top; y <= bottom; y++)
-			for (x = left; x <= right; x++)
-				if (this->IsBlack(x, y, borderValue))
-					count++;
+		blackCount = 0L;
+		for (int y=top; y<=bottom; y++)
+			for (int x=left; x<=right; x++)
+				if (IsBlack(x, y))
+					blackCount++;
 	}
-	else
+	return black ? blackCount : area - blackCount;
+}
+
+/*
+ * Counts the black or white pixels within the specified rectangular area.
+ * Uses borderValue if outside the image dimensions.
+ */
+long COpenCvBiLevelImage::CountPixels(bool borderValue, int left, int top, int right, int bottom, bool black /*= true*/)
+{
+	if (left > right || top > bottom)
+		return 0L;
+
+	//Part within the image
+	int l = max(0, left);
+	int t = max(0, top);
+	int r = min(GetWidth()-1, right);
+	int b = min(GetHeight()-1, bottom);
+	long insideArea = 0L;
+	long inside = 0L;
+	if (l <= r && t <= b)
 	{
-		for (y = top; y <= bottom; y++)
-			for (x = left; x <= right; x++)
-				if (this->IsWhite(x, y, borderValue))
-					count++;
+		insideArea = (long)(r-l+1) * (b-t+1);
+		inside = CountPixels(l, t, r, b, black);
 	}
-	return count;
+
+	//Pixels outside the image count if the border value is the requested one
+	//(IsBlack() and IsWhite() both return the border value)
+	long outside = borderValue ? (long)(right-left+1) * (bottom-top+1) - insideArea : 0L;
+	return inside + outside;
 }
 
 /*
@@ -924,19 +1394,33 @@ long COpenCvBiLevelImage::CountPixels(vector<CRect *> * rects, bool black /*= tr
  * Counts the pixels for the whole image.
  *
  * 'black' - count black pixels (true) or white pixels (false).
- * 'forceRefresh' (optional) - Clears the count buffer and recounts if set to true. Use this option if the image content has changed.
+ * 'forceRefresh' (optional) - Clears the count buffer and recounts if set to true. Use this option if the image content has changed
+ *                             without using the methods of this image (e.g. through the matrix returned by GetData(false)).
+ *                             Changes made through this image or an image sharing its pixel data are detected automatically.
  */
 long COpenCvBiLevelImage::CountPixels(bool black, bool forceRefresh /*= false*/)
 {
-	if (forceRefresh)
+	unsigned int generation = m_DataGeneration->load();
+	if (forceRefresh || generation != m_PixelCountGeneration)
 	{
 		m_NumberOfBlackPixels = -1L;
 		m_NumberOfWhitePixels = -1L;
+		m_PixelCountGeneration = generation;
 	}
 
 	long count = 0L;
 	int height = GetHeight();
 	int width = GetWidth();
+	bool integralImageValid = IsIntegralImageValid();
+	if (integralImageValid || m_PackedData != NULL) //Integral image or popcount
+	{
+		if (m_NumberOfBlackPixels < 0L)
+		{
+			m_NumberOfBlackPixels = integralImageValid ? (long)m_IntegralImage.at<int>(height, width) : m_PackedData->CountBits();
+			m_NumberOfWhitePixels = (width*height) - m_NumberOfBlackPixels;
+		}
+		return black ? m_NumberOfBlackPixels : m_NumberOfWhitePixels;
+	}
 	if (black)
 	{
 		if (m_NumberOfBlackPixels >= 0L)	//already counted
@@ -956,7 +1440,7 @@ long COpenCvBiLevelImage::CountPixels(bool black, bool forceRefresh /*= false*/)
 		m_NumberOfWhitePixels = 0L;
 		for (int x=0; x<width; x++)
 			for (int y=0; y<height; y++)
-				if (IsBlack(x, y))
+				if (!IsBlack(x, y))
 					m_NumberOfWhitePixels++;
 		m_NumberOfBlackPixels = (width*height) - m_NumberOfWhitePixels; //Total area - #black pixels
 		return m_NumberOfWhitePixels;
@@ -985,12 +1469,12 @@ COpenCvColourImage::~COpenCvColourImage(void)
 }
 
 /*
- * Creates a deep copy.
+ * Creates a copy. The pixel data is shared until one of the images is changed (copy-on-write).
  */
 COpenCvImage * COpenCvColourImage::Clone()
 {
 	COpenCvImage * copy = new COpenCvColourImage();
-	copy->CopyFrom(this);
+	copy->ShareDataFrom(this);
 	return copy;
 }
 
@@ -1018,6 +1502,11 @@ CImageInfo::CImageInfo()
 	resolutionY = 0;
 	bitsPerPixel = 0;
 	//resolutionUnit = 0;
+	width = 0;
+	height = 0;
+	channels = 0;
+	pageCount = 0;
+	blackAndWhite = false;
 }
 
 
@@ -1031,74 +1520,268 @@ CImageInfo::CImageInfo()
  */
 
 /*
- * Binarises the given image using the middle of the grey scale value range (e.g. 128 for 8bit depth).
+ * Vector types for the pixel kernels below (if SIMD is supported by the OpenCV build)
+ */
+#if CV_SIMD128
+template<class T> struct COpenCvSimd;
+
+template<> struct COpenCvSimd<uchar>
+{
+	typedef v_uint8x16 Vec;
+	static const int LANES = 16;
+	static inline Vec SetAll(uchar value) { return v_setall_u8(value); };
+};
+
+template<> struct COpenCvSimd<ushort>
+{
+	typedef v_uint16x8 Vec;
+	static const int LANES = 8;
+	static inline Vec SetAll(ushort value) { return v_setall_u16(value); };
+};
+#endif
+
+static const int IMAGE_CONTENT_COLOUR	= 1;	//Pixels with different channel values
+static const int IMAGE_CONTENT_GREY		= 2;	//Pixels that are neither black nor white
+
+/*
+ * Returns the content flags (IMAGE_CONTENT_COLOUR, IMAGE_CONTENT_GREY) of one pixel row.
  */
 template<class T>
-void COpenCvImageOps<T>::MiddleThreshold(Mat data)
+static int ClassifyImageRow(const T * row, int width, int channels, T maxValue)
 {
-	int maxValueForColorChannel = COpenCvImage::CalcMaxValueForColorChannel(data); //8 or 16 bit
-	int x, y, width = data.cols, height = data.rows;
-	T thresh = maxValueForColorChannel / 2;
-	for (y=0; y<height; y++)
+	int flags = 0;
+	int x = 0;
+#if CV_SIMD128
+	typedef typename COpenCvSimd<T>::Vec Vec;
+	const int lanes = COpenCvSimd<T>::LANES;
+	Vec zero = COpenCvSimd<T>::SetAll(0);
+	Vec white = COpenCvSimd<T>::SetAll(maxValue);
+	Vec colour = zero;
+	Vec grey = zero;
+	if (channels == 3)
 	{
-		for (x=0; x<width; x++)
-			data.at<T>(y,x) = (T)(data.at<T>(y,x) < thresh ? 0 : maxValueForColorChannel);
+		for (; x <= width - lanes; x += lanes)
+		{
+			Vec c0, c1, c2;
+			v_load_deinterleave(row + x * 3, c0, c1, c2);
+			colour |= (c0 != c1) | (c1 != c2);
+			grey |= (c0 != zero) & (c0 != white);
+		}
 	}
+	else if (channels == 1)
+	{
+		for (; x <= width - lanes; x += lanes)
+		{
+			Vec c0 = v_load(row + x);
+			grey |= (c0 != zero) & (c0 != white);
+		}
+	}
+	if (v_check_any(colour))
+		return IMAGE_CONTENT_COLOUR;
+	if (v_check_any(grey))
+		flags |= IMAGE_CONTENT_GREY;
+#endif
+	//Remaining pixels
+	for (; x < width; x++)
+	{
+		const T * pixel = row + x * channels;
+		if (channels >= 3 && (pixel[0] != pixel[1] || pixel[1] != pixel[2]))
+			return IMAGE_CONTENT_COLOUR;
+		if (pixel[0] != 0 && pixel[0] != maxValue)
+			flags |= IMAGE_CONTENT_GREY;
+	}
+	return flags;
 }
 
 /*
- * Auto-detects the colour depth of the given image and returns an instance of the appropriate image sub-class.
+ * Parallel loop body classifying the pixels of a band of rows (see DetectColorDepthAndCreateImage()).
+ * Stops as soon as colour has been found (in any band).
  */
 template<class T>
-COpenCvImage * COpenCvImageOps<T>::DetectColorDepthAndCreateImage(Mat data)
+class CImageContentClassifier : public ParallelLoopBody
 {
-	COpenCvImage * img = NULL;
-	int maxValueForColorChannel = COpenCvImage::CalcMaxValueForColorChannel(data); //8 or 16 bit
+public:
+	CImageContentClassifier(const Mat & data, std::atomic<int> * flags) : m_Data(data), m_Flags(flags) {};
 
-	//Determine if colour, grey scale or bi-level (heuristic not using all pixels)
-	//(Fast for colour, slow for grey scale and B/W)
-	int x, y, width = data.cols, height = data.rows;
-	int startX = 0;
-	int stepX = max(2, width / 1000);
-	Vec<T,3> pixel;
-	bool grey = false;
-	for (y=0; y<height; y+=2)
+	void operator()(const Range & rows) const
 	{
-		for (x=startX; x<width; x+=stepX)
+		T maxValue = (T)COpenCvImage::CalcMaxValueForColorChannel(m_Data);
+		int flags = 0;
+		for (int y = rows.start; y < rows.end; y++)
 		{
-			pixel = data.at<Vec<T,3>>(y,x);
-			if (	pixel[0] != pixel[1]
-				||	pixel[1] != pixel[2]
-				||	pixel[0] != pixel[2]) //Colour
-				{
-					return new COpenCvColourImage();
-					//goto out;
-				}
-			else //All three channels have the same value
+			if (flags & IMAGE_CONTENT_COLOUR || m_Flags->load() & IMAGE_CONTENT_COLOUR)
+				break;
+			flags |= ClassifyImageRow<T>(m_Data.ptr<T>(y), m_Data.cols, m_Data.channels(), maxValue);
+		}
+		if (flags != 0)
+			m_Flags->fetch_or(flags);
+	}
+
+private:
+	const Mat &			m_Data;
+	std::atomic<int> *	m_Flags;
+};
+
+/*
+ * Parallel loop body for MiddleThreshold()
+ */
+template<class T>
+class CMiddleThresholdKernel : public ParallelLoopBody
+{
+public:
+	CMiddleThresholdKernel(const Mat & data) : m_Data(data) {};
+
+	void operator()(const Range & rows) const
+	{
+		int maxValueForColorChannel = COpenCvImage::CalcMaxValueForColorChannel(m_Data); //8 or 16 bit
+		T thresh = maxValueForColorChannel / 2;
+		int n = m_Data.cols * m_Data.channels(); //All channels
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			T * row = (T*)m_Data.ptr<T>(y);
+			int x = 0;
+#if CV_SIMD128
+			//The comparison result has all bits set, which is the maximum value of the channel
+			typename COpenCvSimd<T>::Vec t = COpenCvSimd<T>::SetAll(thresh);
+			for (; x <= n - COpenCvSimd<T>::LANES; x += COpenCvSimd<T>::LANES)
+				v_store(row + x, v_load(row + x) >= t);
+#endif
+			for (; x < n; x++)
+				row[x] = (T)(row[x] < thresh ? 0 : maxValueForColorChannel);
+		}
+	}
+
+private:
+	const Mat & m_Data;
+};
+
+//0.299, 0.587, 0.114 in 14 bit fixed point (the weights add up to exactly 1.0)
+static const unsigned GREY_WEIGHT_0 = 4899;
+static const unsigned GREY_WEIGHT_1 = 9617;
+static const unsigned GREY_WEIGHT_2 = 1868;
+
+#if CV_SIMD128
+/*
+ * Weighted sum of three 16 bit channel vectors (widening multiplication, see CGreyScaleConversionKernel)
+ */
+static inline v_uint16x8 WeightedGreyLevels(const v_uint16x8 & c0, const v_uint16x8 & c1, const v_uint16x8 & c2)
+{
+	v_uint32x4 a0, a1, b0, b1, c0w, c1w;
+	v_mul_expand(c0, v_setall_u16((ushort)GREY_WEIGHT_0), a0, a1);
+	v_mul_expand(c1, v_setall_u16((ushort)GREY_WEIGHT_1), b0, b1);
+	v_mul_expand(c2, v_setall_u16((ushort)GREY_WEIGHT_2), c0w, c1w);
+	return v_pack((a0 + b0 + c0w) >> 14, (a1 + b1 + c1w) >> 14);
+}
+
+/*
+ * Vectorised part of the grey scale conversion of one 8 bit row. Returns the number of converted pixels.
+ */
+static inline int ConvertRowToGreyScale(const uchar * src, uchar * dst, int width)
+{
+	int x = 0;
+	for (; x <= width - 16; x += 16)
+	{
+		v_uint8x16 c0, c1, c2;
+		v_load_deinterleave(src + x * 3, c0, c1, c2);
+		v_uint16x8 c00, c01, c10, c11, c20, c21;
+		v_expand(c0, c00, c01);
+		v_expand(c1, c10, c11);
+		v_expand(c2, c20, c21);
+		v_store(dst + x, v_pack(WeightedGreyLevels(c00, c10, c20), WeightedGreyLevels(c01, c11, c21)));
+	}
+	return x;
+}
+
+/*
+ * Vectorised part of the grey scale conversion of one 16 bit row. Returns the number of converted pixels.
+ */
+static inline int ConvertRowToGreyScale(const ushort * src, ushort * dst, int width)
+{
+	int x = 0;
+	for (; x <= width - 8; x += 8)
+	{
+		v_uint16x8 c0, c1, c2;
+		v_load_deinterleave(src + x * 3, c0, c1, c2);
+		v_store(dst + x, WeightedGreyLevels(c0, c1, c2));
+	}
+	return x;
+}
+#endif
+
+/*
+ * Parallel loop body for ConvertToGreyScale()
+ */
+template<class T>
+class CGreyScaleConversionKernel : public ParallelLoopBody
+{
+public:
+	CGreyScaleConversionKernel(const Mat & source, const Mat & dest) : m_Source(source), m_Dest(dest) {};
+
+	void operator()(const Range & rows) const
+	{
+		int width = m_Source.cols;
+		for (int y = rows.start; y < rows.end; y++)
+		{
+			const T * src = m_Source.ptr<T>(y);
+			T * dst = (T*)m_Dest.ptr<T>(y);
+			int x = 0;
+#if CV_SIMD128
+			x = ConvertRowToGreyScale(src, dst, width);
+#endif
+			for (; x < width; x++)
 			{
-				if (pixel[0] != 0 && pixel[0] != maxValueForColorChannel) //Grey scale
-				{
-					grey = true;
-					//img = new COpenCvGreyScaleImage();
-					//goto out;
-				}
+				const T * pixel = src + x * 3;
+				dst[x] = (T)((GREY_WEIGHT_0 * pixel[0] + GREY_WEIGHT_1 * pixel[1] + GREY_WEIGHT_2 * pixel[2]) >> 14);
 			}
 		}
-		startX++; //For diagonal pattern
-		if (startX > stepX)
-			startX = 0;
 	}
-//out:
 
-	//Must be black-and-white image
-	//if (img == NULL)
+private:
+	const Mat & m_Source;
+	const Mat & m_Dest;
+};
 
-	if (grey)
-		img = new COpenCvGreyScaleImage();
-	else //B/W
-		img = new COpenCvBiLevelImage();
+/*
+ * Binarises the given image using the middle of the grey scale value range (e.g. 128 for 8bit depth).
+ * All channels are processed. Runs in parallel on bands of rows.
+ */
+template<class T>
+void COpenCvImageOps<T>::MiddleThreshold(Mat data)
+{
+	parallel_for_(Range(0, data.rows), CMiddleThresholdKernel<T>(data), GetRowBandCount(data));
+}
 
-	return img;
+/*
+ * Converts the given three-channel image to a single-channel image of the same depth using 
+ * the weights 0.299, 0.587 and 0.114 for the channels. Runs in parallel on bands of rows
+ * (deinterleaving vector loads and widening fixed-point multiplications).
+ *
+ * 'dest' - Target matrix (has to be allocated with the same size as the source)
+ */
+template<class T>
+void COpenCvImageOps<T>::ConvertToGreyScale(Mat source, Mat dest)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(source.channels() == 3 && dest.channels() == 1 && source.size() == dest.size());
+
+	parallel_for_(Range(0, source.rows), CGreyScaleConversionKernel<T>(source, dest), GetRowBandCount(source));
+}
+
+/*
+ * Auto-detects the colour depth of the given image and returns an instance of the appropriate image sub-class.
+ * All pixels are checked (in parallel on bands of rows).
+ */
+template<class T>
+COpenCvImage * COpenCvImageOps<T>::DetectColorDepthAndCreateImage(Mat data)
+{
+	std::atomic<int> flags(0);
+	parallel_for_(Range(0, data.rows), CImageContentClassifier<T>(data, &flags), GetRowBandCount(data));
+
+	if (flags & IMAGE_CONTENT_COLOUR)
+		return new COpenCvColourImage();
+	if (flags & IMAGE_CONTENT_GREY)
+		return new COpenCvGreyScaleImage();
+	return new COpenCvBiLevelImage(); //Only black and white pixels
 }
 
 
@@ -5,9 +5,15 @@
 
 #include "opencv2\opencv.hpp"
 #include "afxwin.h"
+#include <afxmt.h>
 //#include <pstdint.h>
 #include "extrastring.h"
 #include "image.h"
+#include "PackedBitMatrix.h"
+#include "ImageBufferPool.h"
+#include <type_traits>
+#include <atomic>
+#include <memory>
 
 //using namespace cv;
 
@@ -19,6 +25,78 @@ class COpenCvColourImage;
 template<class T> class COpenCvImageOps;
 class CImageInfo;
 
+
+/*
+ * Class template COpenCvRowSpan
+ *
+ * Typed view of one pixel row of an OpenCV image.
+ * Only the first channel of each pixel is addressed by the index operator
+ * (grey level or bi-level value), which is what the grey scale and bi-level
+ * image classes use.
+ *
+ * Type T: Channel type ('uchar' or 'ushort'; const qualified for read-only access).
+ * C: Number of interleaved channels per pixel (1 or 3).
+ */
+template<class T, int C>
+class COpenCvRowSpan
+{
+public:
+	static const int CHANNELS = C;
+
+	inline COpenCvRowSpan(T * pixels, int width) : m_Pixels(pixels), m_Width(width) {};
+
+	inline T & operator[](int x) const { return m_Pixels[x * C]; };
+	inline T *	GetPixels() const { return m_Pixels; };
+	inline int	GetWidth() const { return m_Width; };
+
+	/*
+	 * Sets all channels of the pixel at the given position to the given value
+	 */
+	inline void SetAllChannels(int x, T value) const 
+	{ 
+		for (int c = 0; c < C; c++) 
+			m_Pixels[x * C + c] = value; 
+	};
+
+private:
+	T * m_Pixels;
+	int m_Width;
+};
+
+
+/*
+ * Class template COpenCvRowAccess
+ *
+ * Typed access to the pixel rows of an OpenCV image. The pixel layout (depth
+ * and number of channels) is resolved once when the object is created, so
+ * pixel loops using it don't need to branch on the image format.
+ *
+ * Type T: Channel type ('uchar' or 'ushort'; const qualified for read-only access).
+ * C: Number of interleaved channels per pixel (1 or 3).
+ */
+template<class T, int C>
+class COpenCvRowAccess
+{
+public:
+	typedef COpenCvRowSpan<T, C> Span;
+	typedef typename std::remove_const<T>::type PixelType;
+	static const int CHANNELS = C;
+
+	inline COpenCvRowAccess(const cv::Mat & data) 
+		: m_Base(data.data), m_Step(data.step[0]), m_Width(data.cols), m_Height(data.rows) {};
+
+	inline Span GetRow(int y) const { return Span((T*)(m_Base + y * m_Step), m_Width); };
+	inline int	GetWidth() const { return m_Width; };
+	inline int	GetHeight() const { return m_Height; };
+
+private:
+	uchar * m_Base;
+	size_t	m_Step;
+	int		m_Width;
+	int		m_Height;
+};
+
+
 /*
  * Class COpenCvImage
  *
@@ -34,6 +112,15 @@ public:
 	static const int TYPE_GREYSCALE = 3;
 	static const int TYPE_BILEVEL	= 4;
 
+	static const int VIEW_WRITE_THROUGH	= 1;
+	static const int VIEW_COPY_ON_WRITE	= 2;
+
+	static const int LAYOUT_UNSUPPORTED	= 0;
+	static const int LAYOUT_8U_C1		= 1;
+	static const int LAYOUT_16U_C1		= 2;
+	static const int LAYOUT_8U_C3		= 3;
+	static const int LAYOUT_16U_C3		= 4;
+
 protected:
 	COpenCvImage(void);
 public:
@@ -47,23 +134,49 @@ public:
 	static COpenCvGreyScaleImage	*	CreateG(int width, int height, RGBCOLOUR backColour);
 	static COpenCvColourImage		*	CreateC(int width, int height, RGBCOLOUR backColour);
 
+	static void							SetBufferPool(CImageBufferPool * pool);
+	static inline CImageBufferPool *	GetBufferPool() { return s_BufferPool; };
+	static cv::Mat						AllocateMatrix(int rows, int cols, int type);
+	static cv::Mat						CloneMatrix(cv::Mat source);
+
 	virtual COpenCvImage * Clone() = 0;
 	void CopyFrom(COpenCvImage * other);
+	void ShareDataFrom(COpenCvImage * other);
 
 	virtual COpenCvImage * CreateSubImage(int left, int top, int width, int height) = 0; //Creates an image of the same type copying the specified frame.
+	COpenCvImage * CreateView(int left, int top, int width, int height, int writeMode = VIEW_COPY_ON_WRITE); //Creates an image of the same type sharing the specified frame.
+
+	void		Detach();
+	inline bool IsCopyOnWrite() { return m_CopyOnWrite; };
 
 	void SetData(cv::Mat imageData);
 
 	int GetWidth();
 	int GetHeight();
 
-	cv::Mat GetData();
+	size_t GetMemorySize();
+
+	cv::Mat GetData(bool forWriting = true);
 
 	RGBCOLOUR	GetRGBColor(int x, int y);
 	void		SetRGBColor(int x, int y, RGBCOLOUR col);
 
 	static int	CalcMaxValueForColorChannel(cv::Mat data);
 	inline void SetMaxValueForColorChannel(int value) { m_MaxValueForColorChannel = value; };
+	inline int	GetMaxValueForColorChannel() { return m_MaxValueForColorChannel; };
+
+	int GetPixelLayout();
+
+	inline bool IsPackedStorage() { return m_PackedData != NULL; };
+
+	template<class T, int C> COpenCvRowAccess<const T, C>	GetRowAccess();
+	template<class T, int C> COpenCvRowAccess<T, C>			GetWritableRowAccess();
+
+	template<class Kernel> void WithRowAccess(Kernel && kernel);
+	template<class Kernel> void WithWritableRowAccess(Kernel && kernel);
+	template<class Kernel> void ForEachRow(Kernel && kernel);
+	template<class Kernel> void ForEachRow(Kernel && kernel, int top, int bottom);
+	template<class Kernel> void ForEachWritableRow(Kernel && kernel);
 
 	//HBITMAP				CreateBitmap();
 	//inline HBITMAP		GetHBitmap() { if (m_ImageHBitmap==NULL) return CreateBitmap(); else return m_ImageHBitmap; };
@@ -84,11 +197,27 @@ public:
 	inline void			SetName(CUniString name) { m_Name = name; };
 
 	void Resize(int newWidth, int newHeight);
-	void Resize(int originX, int originY, int newWidth, int newHeight);
+	void Resize(int originX, int originY, int newWidth, int newHeight, bool copyData = true);
 
 protected:
 	COpenCvImage * CreateSubImage(int left, int top, int width, int height, int type);
 
+	void PackData();
+	void UnpackData();
+	inline void EnsureMatrixData() { if (m_PackedData != NULL) UnpackData(); };
+	inline void PrepareForWriting()
+	{
+		if (m_CopyOnWrite)
+			Detach();
+		if (m_Data.u != NULL && m_Data.u->refcount > 1) //Shared (own cached data is invalidated by OnDataChanged())
+			++*m_DataGeneration;
+	};
+
+	virtual void OnDataChanged() {};	//Called when the pixel data might have been changed (e.g. to invalidate cached data)
+
+private:
+	template<class Access, class Kernel> static void VisitRows(const Access & rows, int top, int bottom, Kernel & kernel);
+
 protected:
 	CUniString		m_FilePath;
 	CUniString		m_Name;
@@ -101,6 +230,18 @@ protected:
 
 	int m_MaxValueForColorChannel;
 
+	CPackedBitMatrix *	m_PackedData;	//One bit per pixel (bi-level images only). If not NULL, m_Data is empty.
+	int					m_PackedType;	//OpenCV matrix type to use when unpacking
+
+	bool			m_CopyOnWrite;	//Copy shared pixel data before the first change
+
+	//Incremented before each change of the pixel data. Shared by all images sharing the pixel array
+	//(views and copy-on-write clones), so cached data of the other images can be checked for validity.
+	std::shared_ptr<std::atomic<unsigned int> >	m_DataGeneration;
+
+private:
+	static CImageBufferPool * s_BufferPool;	//Allocator for new pixel matrices (NULL = OpenCV default)
+
 };
 
 
@@ -155,6 +296,9 @@ public:
 	long CountPixels(vector<CRect *> * rects, bool black = true);
 	long CountPixels(bool black, bool forceRefresh = false);
 
+	void		BuildIntegralImage();
+	inline bool	HasIntegralImage() { return IsIntegralImageValid(); };
+
 	void And(COpenCvBiLevelImage * b);
 	void AndOffset(COpenCvBiLevelImage * b, int offx, int offy);
 
@@ -163,9 +307,42 @@ public:
 
 	void FloodFill(int x, int y, bool black);
 
+	void SetPackedStorage(bool packed);
+	void SetPackedData(CPackedBitMatrix * packedData, int type = CV_8UC1);
+	inline CPackedBitMatrix * GetPackedData() { return m_PackedData; };
+	inline int GetPackedType() { return m_PackedType; };	//Matrix type used when unpacking
+
+protected:
+	void OnDataChanged();
+
 private:
-	long m_NumberOfBlackPixels;
-	long m_NumberOfWhitePixels;
+	const CPackedBitMatrix &	GetPackedDataOrPack(CPackedBitMatrix & temp);
+	cv::Mat						GetMatrixDataOrUnpack();
+
+	/*
+	 * The integral image is valid if it has not been invalidated by this image and the pixel data
+	 * has not been changed through another image sharing it since it was built
+	 */
+	inline bool IsIntegralImageValid() { return m_IntegralImageValid && m_IntegralImageGeneration == m_DataGeneration->load(); };
+
+	/*
+	 * Number of black pixels in the rectangle (inclusive coordinates) using the integral image
+	 */
+	inline long CountBlackPixelsUsingIntegralImage(int left, int top, int right, int bottom)
+	{
+		const int * above = m_IntegralImage.ptr<int>(top);
+		const int * below = m_IntegralImage.ptr<int>(bottom+1);
+		return (long)(below[right+1] - below[left] - above[right+1] + above[left]);
+	};
+
+	long			m_NumberOfBlackPixels;
+	long			m_NumberOfWhitePixels;
+	unsigned int	m_PixelCountGeneration;		//Data generation the pixel counts belong to
+
+	cv::Mat				m_IntegralImage;		//Summed-area table of black pixels (CV_32SC1, (height+1) x (width+1))
+	std::atomic<bool>	m_IntegralImageValid;	//Set after m_IntegralImage has been assigned
+	unsigned int		m_IntegralImageGeneration;	//Data generation the integral image belongs to
+	CCriticalSection	m_IntegralImageLock;	//For BuildIntegralImage()
 };
 
 
@@ -201,6 +378,11 @@ public:
 	float resolutionX;
 	float resolutionY;
 	//unsigned short resolutionUnit;
+	int width;		//0 if not known
+	int height;		//0 if not known
+	int channels;	//Samples per pixel as stored in the file (0 if not known)
+	int pageCount;	//0 if not known
+	bool blackAndWhite;	//Pixels are pure black or white (1 bit grey scale or black/white palette)
 };
 
 
@@ -219,11 +401,138 @@ public:
 	
 	static void MiddleThreshold(cv::Mat data);
 
+	static void ConvertToGreyScale(cv::Mat source, cv::Mat dest);
+
 	static COpenCvImage * DetectColorDepthAndCreateImage(cv::Mat data);
 
 };
 
 
+/*
+ * Template methods of COpenCvImage
+ */
+
+/*
+ * Returns typed read-only access to the pixel rows.
+ * The template arguments have to match the pixel layout of the image (see GetPixelLayout()).
+ */
+template<class T, int C>
+COpenCvRowAccess<const T, C> COpenCvImage::GetRowAccess()
+{
+	EnsureMatrixData();
+
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(m_Data.depth() == cv::DataType<T>::depth && m_Data.channels() == C);
+
+	return COpenCvRowAccess<const T, C>(m_Data);
+}
+
+/*
+ * Returns typed access to the pixel rows that can be used to modify the image.
+ * The template arguments have to match the pixel layout of the image (see GetPixelLayout()).
+ */
+template<class T, int C>
+COpenCvRowAccess<T, C> COpenCvImage::GetWritableRowAccess()
+{
+	EnsureMatrixData();
+	PrepareForWriting();
+	OnDataChanged();
+
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(m_Data.depth() == cv::DataType<T>::depth && m_Data.channels() == C);
+
+	return COpenCvRowAccess<T, C>(m_Data);
+}
+
+/*
+ * Resolves the pixel layout of this image and calls the given kernel once
+ * with a matching read-only COpenCvRowAccess object.
+ *
+ * 'kernel' - Function object (e.g. generic lambda) accepting COpenCvRowAccess<const T, C>
+ *            for all supported layouts.
+ */
+template<class Kernel>
+void COpenCvImage::WithRowAccess(Kernel && kernel)
+{
+	switch (GetPixelLayout())
+	{
+	case LAYOUT_8U_C1:	kernel(COpenCvRowAccess<const uchar, 1>(m_Data)); break;
+	case LAYOUT_16U_C1: kernel(COpenCvRowAccess<const ushort, 1>(m_Data)); break;
+	case LAYOUT_8U_C3:	kernel(COpenCvRowAccess<const uchar, 3>(m_Data)); break;
+	case LAYOUT_16U_C3: kernel(COpenCvRowAccess<const ushort, 3>(m_Data)); break;
+	default: ASSERT(false); break;
+	}
+}
+
+/*
+ * Resolves the pixel layout of this image and calls the given kernel once
+ * with a matching writable COpenCvRowAccess object.
+ *
+ * 'kernel' - Function object (e.g. generic lambda) accepting COpenCvRowAccess<T, C>
+ *            for all supported layouts.
+ */
+template<class Kernel>
+void COpenCvImage::WithWritableRowAccess(Kernel && kernel)
+{
+	int layout = GetPixelLayout();
+	PrepareForWriting();
+	OnDataChanged();
+
+	switch (layout)
+	{
+	case LAYOUT_8U_C1:	kernel(COpenCvRowAccess<uchar, 1>(m_Data)); break;
+	case LAYOUT_16U_C1: kernel(COpenCvRowAccess<ushort, 1>(m_Data)); break;
+	case LAYOUT_8U_C3:	kernel(COpenCvRowAccess<uchar, 3>(m_Data)); break;
+	case LAYOUT_16U_C3: kernel(COpenCvRowAccess<ushort, 3>(m_Data)); break;
+	default: ASSERT(false); break;
+	}
+}
+
+/*
+ * Calls the given kernel for each pixel row of the image (read-only).
+ *
+ * 'kernel' - Function object (e.g. generic lambda) with signature (int y, COpenCvRowSpan<const T, C> row)
+ */
+template<class Kernel>
+void COpenCvImage::ForEachRow(Kernel && kernel)
+{
+	ForEachRow(kernel, 0, GetHeight()-1);
+}
+
+/*
+ * Calls the given kernel for the pixel rows 'top' to 'bottom' (inclusive) of the image (read-only).
+ *
+ * 'kernel' - Function object (e.g. generic lambda) with signature (int y, COpenCvRowSpan<const T, C> row)
+ */
+template<class Kernel>
+void COpenCvImage::ForEachRow(Kernel && kernel, int top, int bottom)
+{
+	WithRowAccess([&](auto rows) { VisitRows(rows, top, bottom, kernel); });
+}
+
+/*
+ * Calls the given kernel for each pixel row of the image. The kernel may modify the pixels.
+ *
+ * 'kernel' - Function object (e.g. generic lambda) with signature (int y, COpenCvRowSpan<T, C> row)
+ */
+template<class Kernel>
+void COpenCvImage::ForEachWritableRow(Kernel && kernel)
+{
+	int bottom = GetHeight()-1;
+	WithWritableRowAccess([&](auto rows) { VisitRows(rows, 0, bottom, kernel); });
+}
+
+/*
+ * Row loop used by the ForEach... methods
+ */
+template<class Access, class Kernel> 
+void COpenCvImage::VisitRows(const Access & rows, int top, int bottom, Kernel & kernel)
+{
+	for (int y = top; y <= bottom; y++)
+		kernel(y, rows.GetRow(y));
+}
+
+
 } //end namespace
 
 
@@ -1,5 +1,6 @@
 #include "OpenCvImageReader.h"
-#include "tiffio.h"
+#include "OpenCvTiffReader.h"
+#include "ImageInfoProbe.h"
 #include "extrafilehelper.h"
 
 using namespace cv;
@@ -21,6 +22,7 @@ namespace PRImA {
 COpenCvImageReader::COpenCvImageReader(void)
 {
 	m_Debug = false;
+	m_PackedBilevel = false;
 }
 
 /*
@@ -66,6 +68,7 @@ COpenCvImage * COpenCvImageReader::Read(CUniString filePath, int enforceType)
  * Supported file types are: .bmp .jpg .jp2 .png .tif
  *
  * 'pageIndex' - If > 0, a multi-page image will be assumed and the corresponding page will be loaded
+ *               (TIFF: only the requested page is decoded)
  * 'enforceType' - Colour depth of image. One of:
  *                      COpenCvImage::TYPE_COLOUR     - RGB colour image
  *                      COpenCvImage::TYPE_GREYSCALE  - Grey scale image
@@ -88,6 +91,15 @@ COpenCvImage * COpenCvImageReader::Read(CUniString filePath, int pageIndex, int
 		else if (enforceType == COpenCvImage::TYPE_AUTO)
 			printf("  Requested type: AUTO\n");
 	}
+	//TIFF - Header and pixel data from one open file (only the requested page is decoded)
+	if (COpenCvTiffReader::IsTiffFile(filePath))
+	{
+		COpenCvImage * img = ReadTiff(filePath, pageIndex, enforceType);
+		if (img != NULL)
+			return img;
+		//Otherwise try the OpenCV decoder
+	}
+
 	CT2CA pszConvertedAnsiString(filePath);
 	string filename(pszConvertedAnsiString);
 	Mat imageData;
@@ -97,7 +109,7 @@ COpenCvImage * COpenCvImageReader::Read(CUniString filePath, int pageIndex, int
 		printf("  Reading image info\n");
 
 	CImageInfo * info = ReadImageInfo(filePath);
-	if (enforceType == COpenCvImage::TYPE_AUTO && info->bitsPerPixel == 1)
+	if (enforceType == COpenCvImage::TYPE_AUTO && info->blackAndWhite)
 	{
 		enforceType = COpenCvImage::TYPE_BILEVEL;
 		ensurePixelValuesAreInRange = false; //Avoid binarisation (save time)
@@ -142,7 +154,7 @@ COpenCvImage * COpenCvImageReader::Read(CUniString filePath, int pageIndex, int
 		return NULL;
 	}
 
-	if (enforceType == COpenCvImage::TYPE_AUTO && info->bitsPerPixel == 1)
+	if (enforceType == COpenCvImage::TYPE_AUTO && info->blackAndWhite)
 		enforceType = COpenCvImage::TYPE_BILEVEL;
 
 	if (m_Debug) 
@@ -153,10 +165,7 @@ COpenCvImage * COpenCvImageReader::Read(CUniString filePath, int pageIndex, int
 	if (img != NULL)
 	{
 		img->SetImageInfo(info);
-		CUniString nameOnly, pathOnly;
-		CExtraFileHelper::SplitPath(filePath, pathOnly, nameOnly);
-		img->SetName(nameOnly);
-		img->SetFilePath(filePath);
+		SetFileNameAndPath(img, filePath);
 	}
 	else
 		delete info;
@@ -184,79 +193,298 @@ COpenCvImage * COpenCvImageReader::ReadMulti(CUniString filePath, int pageIndex,
 }
 
 /*
- * Reads image metadata (such as resolution).
- * At the moment only supported for TIFF images.
+ * Loads a rectangular region of an image (or of a page of a multi-page image).
+ * For TIFF files, only the strips or tiles intersecting the region are decoded
+ * (the OpenCV decoder is only used if libtiff cannot open the file).
+ * Other formats are decoded completely and the region is copied.
+ *
+ * 'pageIndex' - Page of a multi-page image (0 for single-page images)
+ * 'rect' - Region to load (will be clipped to the image)
+ * 'enforceType' - Colour depth of image (see Read())
+ * Returns: Image of the size of the clipped region (with the metadata of the whole image) or NULL.
  */
-CImageInfo * COpenCvImageReader::ReadImageInfo(CUniString filePath)
+COpenCvImage * COpenCvImageReader::ReadRegion(CUniString filePath, int pageIndex, CRect rect, int enforceType)
 {
-	CImageInfo * info = new CImageInfo();
+	if (rect.Width() <= 0 || rect.Height() <= 0)
+		return NULL;
 
-	if (filePath.IsEmpty() || !CExtraFileHelper::FileExists(filePath))
-		return info;
+	if (COpenCvTiffReader::IsTiffFile(filePath))
+	{
+		bool opened = false;
+		COpenCvImage * img = ReadTiff(filePath, pageIndex, enforceType, &rect, &opened);
+		if (img != NULL || opened) //NULL: Region outside the page or decoding error
+			return img;
+		//Otherwise try the OpenCV decoder
+	}
 
-	CUniString lowerCase = filePath.MakeLower();
+	COpenCvImage * img = Read(filePath, pageIndex, enforceType);
+	if (img == NULL)
+		return NULL;
 
-	//Use libtiff
-	if (lowerCase.EndsWith(L".tif") || lowerCase.EndsWith(L".tiff"))
+	int left = max(0, (int)rect.left);
+	int top = max(0, (int)rect.top);
+	int right = min(img->GetWidth(), (int)rect.right);
+	int bottom = min(img->GetHeight(), (int)rect.bottom);
+	COpenCvImage * subImage = NULL;
+	if (left < right && top < bottom)
 	{
-		TIFF * tif;
-		if(!(tif = TIFFOpen(filePath.ToC_Str(), "r")))
-			return info;
-
-		//Resolution
-		unsigned w,h;
-		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
-		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
-
-		float x=0.0f,y=0.0f;
-		TIFFGetField(tif, TIFFTAG_XRESOLUTION, &x);
-		TIFFGetField(tif, TIFFTAG_YRESOLUTION, &y);
-
-		uint16_t ResUnit = RESUNIT_CENTIMETER;
-		TIFFGetField(tif, TIFFTAG_RESOLUTIONUNIT, &ResUnit);
-		if(ResUnit == RESUNIT_CENTIMETER)
-		{
-			info->resolutionX = x * 2.54f;
-			info->resolutionY = y * 2.54f;
-		}
-		else
-		{
-			info->resolutionX = x;
-			info->resolutionY = y;
-		}
-		//TIFFGetField(tif, TIFFTAG_XRESOLUTION, &(info->resolutionX));
-		//TIFFGetField(tif, TIFFTAG_YRESOLUTION, &(info->resolutionY));
-		//TIFFGetField(tif, TIFFTAG_RESOLUTIONUNIT, &(info->resolutionUnit));
-
-		//bits per pixel
-		unsigned short photometric;
-		unsigned short bitsPerSample = 1;
-		TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
-		if (TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric))
+		subImage = img->CreateSubImage(left, top, right - left, bottom - top);
+		subImage->CopyImageInfo(img->GetImageInfo());
+		SetFileNameAndPath(subImage, filePath);
+	}
+	delete img;
+	return subImage;
+}
+
+/*
+ * Loads an image (or a page of a multi-page image) reduced to the given scale (e.g. for previews).
+ * Format-native reduced decoding is used where available:
+ *   TIFF - Pyramid levels (sub-IFDs), otherwise the page is streamed through an area averaging
+ *          downsampler (the full resolution page is never held in memory)
+ *   JPEG - DCT scaling (1/2, 1/4 or 1/8), the remainder is reduced by area interpolation
+ * Other formats are decoded completely and reduced by area interpolation.
+ *
+ * 'pageIndex' - Page of a multi-page image (0 for single-page images)
+ * 'scale' - Target scale (0..1], e.g. 0.25 for a quarter of the width and height. Values >= 1 load the full image.
+ * 'enforceType' - Colour depth of image (see Read()). Bi-level images are reduced to grey scale for TYPE_AUTO.
+ * Returns: Image of the reduced size (with the resolution adjusted accordingly) or NULL.
+ */
+COpenCvImage * COpenCvImageReader::ReadScaled(CUniString filePath, int pageIndex, double scale, int enforceType)
+{
+	if (scale <= 0.0)
+		return NULL;
+	if (scale >= 1.0)
+		return Read(filePath, pageIndex, enforceType);
+
+	if (COpenCvTiffReader::IsTiffFile(filePath))
+	{
+		COpenCvTiffReader tiffReader;
+		if (tiffReader.Open(filePath))
 		{
-			if (photometric == PHOTOMETRIC_MINISWHITE || photometric == PHOTOMETRIC_MINISBLACK)
-			{
-				// Either Black and White, or Greyscale image
-				info->bitsPerPixel = bitsPerSample;
-			}
-			else if (photometric == PHOTOMETRIC_PALETTE)
-			{
-				//Palletized Image
-				info->bitsPerPixel = bitsPerSample;
-			}
-			else if (photometric == PHOTOMETRIC_RGB)
+			if (pageIndex > 0 && !tiffReader.SetPage(pageIndex)) //Not enough pages -> Return first page
+				tiffReader.SetPage(0);
+			COpenCvImage * img = tiffReader.ReadPageScaled(enforceType, scale);
+			if (img != NULL)
 			{
-				//RGB Image
-				unsigned short samplesPerPixel = 1;
-				if (TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel))
-					info->bitsPerPixel = bitsPerSample * samplesPerPixel;
+				SetFileNameAndPath(img, filePath);
+				return img;
 			}
 		}
+		//Otherwise try the OpenCV decoder
+	}
+
+	CT2CA pszConvertedAnsiString(filePath);
+	string filename(pszConvertedAnsiString);
+	bool grey = enforceType == COpenCvImage::TYPE_GREYSCALE || enforceType == COpenCvImage::TYPE_BILEVEL;
+
+	//JPEG: Largest DCT reduction that doesn't go below the target scale
+	int reduction = 1;
+	if (IsJpegFile(filePath) && pageIndex <= 0)
+	{
+		while (reduction < 8 && scale * reduction * 2 <= 1.0)
+			reduction *= 2;
+	}
+
+	Mat imageData;
+	if (reduction == 2)
+		imageData = imread(filename, grey ? IMREAD_REDUCED_GRAYSCALE_2 : IMREAD_REDUCED_COLOR_2);
+	else if (reduction == 4)
+		imageData = imread(filename, grey ? IMREAD_REDUCED_GRAYSCALE_4 : IMREAD_REDUCED_COLOR_4);
+	else if (reduction == 8)
+		imageData = imread(filename, grey ? IMREAD_REDUCED_GRAYSCALE_8 : IMREAD_REDUCED_COLOR_8);
+	else
+	{
+		COpenCvImage * fullImage = Read(filePath, pageIndex, grey ? COpenCvImage::TYPE_GREYSCALE : COpenCvImage::TYPE_COLOUR);
+		if (fullImage == NULL)
+			return NULL;
+		imageData = fullImage->GetData(false);
+		delete fullImage; //The matrix is reference counted
+	}
+	if (imageData.data == NULL)
+		return NULL;
+
+	//Remaining reduction
+	double remainingScale = scale * reduction;
+	int width = max(1, (int)(imageData.cols * remainingScale + 0.5));
+	int height = max(1, (int)(imageData.rows * remainingScale + 0.5));
+	if (width != imageData.cols || height != imageData.rows)
+	{
+		Mat resizedData = COpenCvImage::AllocateMatrix(height, width, imageData.type());
+		resize(imageData, resizedData, Size(width, height), 0.0, 0.0, INTER_AREA);
+		imageData = resizedData;
+	}
+
+	COpenCvImage * img = COpenCvImage::Create(imageData, enforceType, true);
+	if (img != NULL)
+	{
+		CImageInfo * info = ReadImageInfo(filePath);
+		info->resolutionX *= (float)scale;
+		info->resolutionY *= (float)scale;
+		info->width = img->GetWidth();
+		info->height = img->GetHeight();
+		img->SetImageInfo(info);
+		SetFileNameAndPath(img, filePath);
+	}
+	return img;
+}
+
+/*
+ * Loads a page of a TIFF file using libtiff.
+ * If the file has not enough pages, the first page is loaded.
+ *
+ * 'region' - Region to load (NULL for the whole page)
+ * 'opened' - Optional output: Set to true if libtiff could open the file
+ * Returns NULL if the file could not be read (or the region is outside the page).
+ */
+COpenCvImage * COpenCvImageReader::ReadTiff(CUniString filePath, int pageIndex, int enforceType, CRect * region /*= NULL*/,
+											bool * opened /*= NULL*/)
+{
+	COpenCvTiffReader tiffReader;
+	bool isOpen = tiffReader.Open(filePath);
+	if (opened != NULL)
+		*opened = isOpen;
+	if (!isOpen)
+		return NULL;
+	if (pageIndex > 0 && !tiffReader.SetPage(pageIndex)) //Not enough pages -> Return first page
+		tiffReader.SetPage(0);
+	tiffReader.SetPackedBilevel(m_PackedBilevel);
+
+	if (m_Debug) 
+		printf("  Reading TIFF page %d\n", tiffReader.GetCurrentPage());
+
+	COpenCvImage * img = NULL;
+	if (region != NULL)
+		img = tiffReader.ReadPageRegion(enforceType, region->left, region->top, region->Width(), region->Height());
+	else
+		img = tiffReader.ReadPage(enforceType);
+	if (img != NULL)
+		SetFileNameAndPath(img, filePath);
 
-		TIFFClose(tif);
+	if (m_Debug) 
+		printf("  Finished loading\n");
+
+	return img;
+}
+
+/*
+ * Sets name and file path of a loaded image
+ */
+void COpenCvImageReader::SetFileNameAndPath(COpenCvImage * img, CUniString filePath)
+{
+	CUniString nameOnly, pathOnly;
+	CExtraFileHelper::SplitPath(filePath, pathOnly, nameOnly);
+	img->SetName(nameOnly);
+	img->SetFilePath(filePath);
+}
+
+/*
+ * Checks the file extension (.jpg or .jpeg)
+ */
+bool COpenCvImageReader::IsJpegFile(CUniString filePath)
+{
+	CUniString lowerCase = filePath;
+	lowerCase.MakeLower();
+	return lowerCase.EndsWith(L".jpg") || lowerCase.EndsWith(L".jpeg");
+}
+
+/*
+ * Reads image metadata (such as size and resolution) from the file headers (see CImageInfoProbe).
+ * Returns empty metadata if the file could not be read or the format is not supported.
+ */
+CImageInfo * COpenCvImageReader::ReadImageInfo(CUniString filePath)
+{
+	CImageInfo * info = CImageInfoProbe::Probe(filePath);
+	return info != NULL ? info : new CImageInfo();
+}
+
+
+/*
+ * Class COpenCvPageIterator
+ *
+ * Forward iterator over the pages of an image file. Pages are decoded one at a time.
+ * Multi-page files are only supported for TIFF (other formats have one page).
+ */
+
+/*
+ * Constructor
+ *
+ * 'enforceType' - Colour depth of the images (see COpenCvImageReader::Read())
+ */
+COpenCvPageIterator::COpenCvPageIterator(CUniString filePath, int enforceType /*= COpenCvImage::TYPE_AUTO*/)
+{
+	m_FilePath = filePath;
+	m_EnforceType = enforceType;
+	m_PageIndex = -1;
+	m_PackedBilevel = false;
+	m_TiffReader = NULL;
+	if (COpenCvTiffReader::IsTiffFile(filePath))
+	{
+		m_TiffReader = new COpenCvTiffReader();
+		if (!m_TiffReader->Open(filePath))
+		{
+			//Single page, COpenCvImageReader::Read() falls back to the OpenCV decoder
+			delete m_TiffReader;
+			m_TiffReader = NULL;
+		}
 	}
+}
+
+/*
+ * Destructor
+ */
+COpenCvPageIterator::~COpenCvPageIterator(void)
+{
+	delete m_TiffReader;
+}
+
+/*
+ * Returns the number of pages of the file (TIFF: without decoding any pages).
+ * Files that libtiff cannot open are read as one page by the OpenCV decoder.
+ */
+int COpenCvPageIterator::GetPageCount()
+{
+	if (m_TiffReader != NULL)
+		return m_TiffReader->GetPageCount();
+	return 1;
+}
 
-	return info;
+/*
+ * Checks if there is another page after the current one
+ */
+bool COpenCvPageIterator::HasNext()
+{
+	return m_PageIndex + 1 < GetPageCount();
+}
+
+/*
+ * Decodes the next page.
+ * Returns: Instance of COpenCvColourImage, COpenCvGreyScaleImage or COpenCvBiLevelImage or NULL,
+ *          if there are no more pages or the page could not be decoded (see HasNext()).
+ */
+COpenCvImage * COpenCvPageIterator::Next()
+{
+	if (!HasNext())
+		return NULL;
+
+	COpenCvImage * img = NULL;
+	if (m_TiffReader != NULL)
+	{
+		if (m_PageIndex >= 0 && !m_TiffReader->NextPage())
+			return NULL;
+		m_PageIndex = m_TiffReader->GetCurrentPage();
+		m_TiffReader->SetPackedBilevel(m_PackedBilevel);
+		img = m_TiffReader->ReadPage(m_EnforceType);
+		if (img != NULL)
+			COpenCvImageReader::SetFileNameAndPath(img, m_FilePath);
+	}
+	else //Single page
+	{
+		m_PageIndex = 0;
+		COpenCvImageReader reader;
+		reader.SetPackedBilevel(m_PackedBilevel);
+		img = reader.Read(m_FilePath, m_EnforceType);
+	}
+	return img;
 }
 
-} //end namespace
\ No newline at end of file
+} //end namespace
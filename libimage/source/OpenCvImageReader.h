@@ -4,6 +4,8 @@
 
 namespace PRImA {
 
+class COpenCvTiffReader;
+
 /*
  * Class COpenCvImageReader
  *
@@ -13,6 +15,9 @@ namespace PRImA {
  */
 class COpenCvImageReader
 {
+	friend class COpenCvPageIterator;
+	friend class COpenCvPageSource;
+
 public:
 
 	COpenCvImageReader(void);
@@ -24,13 +29,63 @@ public:
 	COpenCvImage * ReadMulti(CUniString filePath, int pageIndex, int enforceType);
 	COpenCvImage * ReadMulti(CUniString filePath, int pageIndex);
 
+	COpenCvImage * ReadRegion(CUniString filePath, int pageIndex, CRect rect, int enforceType);
+
+	COpenCvImage * ReadScaled(CUniString filePath, int pageIndex, double scale, int enforceType);
+
 	inline void setDebug(bool debug) { m_Debug = debug; };
+	inline void SetPackedBilevel(bool packed) { m_PackedBilevel = packed; }; //Bi-level TIFF pages are decoded into packed storage
 
 private:
 	COpenCvImage * Read(CUniString filePath, int pageIndex, int enforceType);
+	COpenCvImage * ReadTiff(CUniString filePath, int pageIndex, int enforceType, CRect * region = NULL, bool * opened = NULL);
 
 	CImageInfo * ReadImageInfo(CUniString filePath);
+
+	static bool IsJpegFile(CUniString filePath);
+
+	static void SetFileNameAndPath(COpenCvImage * img, CUniString filePath);
+
 	bool m_Debug;
+	bool m_PackedBilevel;
+};
+
+
+/*
+ * Class COpenCvPageIterator
+ *
+ * Forward iterator over the pages of an image file. Pages are decoded one at a time.
+ * Multi-page files are only supported for TIFF (other formats have one page).
+ *
+ * Usage:
+ *   COpenCvPageIterator pages(filePath);
+ *   while (pages.HasNext())
+ *   {
+ *       COpenCvImage * page = pages.Next();
+ *       ...
+ *       delete page;
+ *   }
+ */
+class COpenCvPageIterator
+{
+public:
+	COpenCvPageIterator(CUniString filePath, int enforceType = COpenCvImage::TYPE_AUTO);
+	~COpenCvPageIterator(void);
+
+	bool			HasNext();
+	COpenCvImage *	Next();
+
+	inline int		GetPageIndex() { return m_PageIndex; }; //Index of the page returned by the last call of Next() (-1 at the start)
+	int				GetPageCount();
+
+	inline void		SetPackedBilevel(bool packed) { m_PackedBilevel = packed; }; //Bi-level TIFF pages are decoded into packed storage
+
+private:
+	CUniString				m_FilePath;
+	int						m_EnforceType;
+	int						m_PageIndex;
+	bool					m_PackedBilevel;
+	COpenCvTiffReader	*	m_TiffReader;	//NULL for single-page formats
 };
 
 } //end namespace
\ No newline at end of file
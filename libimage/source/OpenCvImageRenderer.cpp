@@ -38,7 +38,7 @@ void COpenCvImageRenderer::Render(COpenCvImage * img, CDC * dc/*, Graphics graph
 	int width = img->GetWidth();
 	uchar buffer[sizeof( BITMAPINFOHEADER ) + 1024]; 
 	BITMAPINFO* bmi = (BITMAPINFO* )buffer; 
-	int bpp = Bpp(img->GetData());
+	int bpp = Bpp(img->GetData(false));
 	FillBitmapInfo(bmi,width,height,bpp,0);
 
 	uint8_t * pixelData = img->GetGdiCompatiblePixelData();
@@ -65,7 +65,7 @@ void COpenCvImageRenderer::Render(COpenCvImage * img, CDC * dc,
 	int width = img->GetWidth();
 	uchar buffer[sizeof( BITMAPINFOHEADER ) + 1024]; 
 	BITMAPINFO* bmi = (BITMAPINFO* )buffer; 
-	int bpp = Bpp(img->GetData());
+	int bpp = Bpp(img->GetData(false));
 	FillBitmapInfo(bmi,width,height,bpp,0);
 
 	uint8_t * pixelData = img->GetGdiCompatiblePixelData();
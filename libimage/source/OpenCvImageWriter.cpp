@@ -1,5 +1,4 @@
 #include "OpenCvImageWriter.h"
-#include "TiffImageWriter.h"
 #include "extrafilehelper.h"
 
 namespace PRImA {
@@ -17,6 +16,7 @@ namespace PRImA {
  */
 COpenCvImageWriter::COpenCvImageWriter(void)
 {
+	m_TiffCompression = COpenCvTiffWriter::COMPRESS_AUTO;
 }
 
 /*
@@ -30,6 +30,7 @@ COpenCvImageWriter::~COpenCvImageWriter(void)
  * Saves the given image to a file.
  *
  * Supported file types are: .bmp .jpg .jp2 .png .tif
+ * TIFF files are written with libtiff (see SetTiffCompression()), bi-level images with one bit per pixel.
  */
 bool COpenCvImageWriter::Write(COpenCvImage * image, CUniString filePath)
 {
@@ -39,37 +40,17 @@ bool COpenCvImageWriter::Write(COpenCvImage * image, CUniString filePath)
 	CUniString lowerCase = filePath;
 	lowerCase.MakeLower();
 
-	//OpenCV cannot write in bi-level format. If the given file is a bi-level image 
-	//and the file extension is TIFF, we use the TiffImageWriter class.
-
-	if (typeid(*image) == typeid(COpenCvBiLevelImage)
-		&& lowerCase.EndsWith(L".tif") || lowerCase.EndsWith(L".tiff"))
+	//OpenCV cannot write in bi-level format and does not write the resolution.
+	//For TIFF files we use our own writer.
+	if (lowerCase.EndsWith(L".tif") || lowerCase.EndsWith(L".tiff"))
 	{
-		COpenCvBiLevelImage * openCVImg = (COpenCvBiLevelImage*)image;
-		//Convert OpenCV image to (old) bi-level image
-		CBiLevelImage bilevel;
-		int width = image->GetWidth();
-		int height = image->GetHeight();
-		bilevel.Create(width, height, RGBWHITE, NULL);
-
-		int x, y;
-		for (y = 0; y < height; y++)
-			for (x = 0; x < width; x++)
-				bilevel.SetPixel(x, y, openCVImg->IsBlack(x, y));
-
-		if (openCVImg->GetImageInfo() != NULL)
-		{
-			bilevel.SetResolution((double)openCVImg->GetImageInfo()->resolutionX, (double)openCVImg->GetImageInfo()->resolutionY);
-			//bilevel.SetResolutionUnit(openCVImg->GetImageInfo()->resolutionUnit);
-		}
-
-		CTiffImageWriter tiffWriter;
-		tiffWriter.WriteImage(&bilevel, const_cast<char*>(filePath.ToC_Str()));
-		return true;
+		COpenCvTiffWriter tiffWriter;
+		tiffWriter.SetCompression(m_TiffCompression);
+		return tiffWriter.Write(image, filePath);
 	}
 
-	//Colour or grey scale (or not a TIFF)
-	bool success = imwrite(filePath.ToC_Str(), image->GetData());
+	//Not a TIFF
+	bool success = imwrite(filePath.ToC_Str(), image->GetData(false));
 
 	if (success)
 		WriteImageInfo(image->GetImageInfo(), filePath);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "opencvimage.h"
+#include "OpenCvTiffWriter.h"
 
 namespace PRImA {
 
@@ -20,8 +21,13 @@ public:
 
 	bool Write(COpenCvImage * image, CUniString filePath);
 
+	inline void SetTiffCompression(int compression) { m_TiffCompression = compression; }; //See COpenCvTiffWriter::COMPRESS_...
+	inline int	GetTiffCompression() { return m_TiffCompression; };
+
 private:
 	void WriteImageInfo(CImageInfo * info, CUniString filePath);
+
+	int m_TiffCompression;
 };
 
 } //end namespace
\ No newline at end of file
@@ -0,0 +1,254 @@
+#include "OpenCvPageSink.h"
+#include "OpenCvImageWriter.h"
+#include "OpenCvTiffWriter.h"
+#include "OpenCvTiffReader.h"
+
+namespace PRImA {
+
+
+/*
+ * Class COpenCvPageSink
+ *
+ * Encodes and writes images on background threads.
+ */
+
+/*
+ * Constructor
+ *
+ * 'threadCount' - Number of writing threads
+ * 'maxQueuedPages' - Maximum number of pages that are queued or being written
+ * 'maxQueuedBytes' - Memory cap for the pages that are queued or being written
+ */
+COpenCvPageSink::COpenCvPageSink(int threadCount /*= DEFAULT_THREAD_COUNT*/, int maxQueuedPages /*= DEFAULT_MAX_QUEUED_PAGES*/,
+								size_t maxQueuedBytes /*= DEFAULT_MAX_QUEUED_BYTES*/)
+	: m_FinishRequested(FALSE, TRUE)
+{
+	m_ThreadCount = max(1, threadCount);
+	m_MaxQueuedPages = max(1, maxQueuedPages);
+	m_MaxQueuedBytes = maxQueuedBytes;
+	m_TiffCompression = 0; //Auto
+	m_QueuedBytes = 0;
+	m_WrittenCount = 0;
+	m_FailedCount = 0;
+	m_Finishing = false;
+}
+
+/*
+ * Destructor (waits until all pages have been written)
+ */
+COpenCvPageSink::~COpenCvPageSink(void)
+{
+	Finish();
+}
+
+/*
+ * Queues the given image for writing. The sink takes ownership of the image.
+ * Waits while the queue is full.
+ *
+ * 'filePath' - Target file (the format is determined by the extension)
+ * 'appendPage' - If true, the image is appended as new page to the given TIFF file.
+ *                The file is created with the first page and closed by Finish().
+ * Returns false if the image is NULL or if 'appendPage' is used with a file that is not a TIFF
+ * (the image is not taken over in that case).
+ */
+bool COpenCvPageSink::Write(COpenCvImage * image, CUniString filePath, bool appendPage /*= false*/)
+{
+	if (image == NULL)
+		return false;
+	if (appendPage && !COpenCvTiffReader::IsTiffFile(filePath)) //Only TIFF supports multiple pages
+		return false;
+
+	CWriteJob job;
+	job.image = image;
+	job.filePath = filePath;
+	job.appendPage = appendPage;
+	job.memorySize = image->GetMemorySize();
+
+	//Start threads (new batch)
+	if (m_Threads.empty())
+	{
+		m_WrittenCount = 0;
+		m_FailedCount = 0;
+		for (int i = 0; i < m_ThreadCount; i++)
+		{
+			CSimpleThread<COpenCvPageSink> * thread = new CSimpleThread<COpenCvPageSink>();
+			m_Threads.push_back(thread);
+			thread->Run(this, &COpenCvPageSink::WritePages);
+		}
+	}
+
+	//Wait for space (backpressure)
+	CSingleLock lock(&m_CriticalSect, TRUE);
+	while (m_QueuedBytes > 0
+		&& ((int)m_Jobs.size() + (int)m_BusyFiles.size() >= m_MaxQueuedPages || m_QueuedBytes + job.memorySize > m_MaxQueuedBytes))
+	{
+		lock.Unlock();
+		m_SpaceAvailable.Lock(); //Signalled by the writing threads after each page
+		lock.Lock();
+	}
+
+	m_Jobs.push_back(job);
+	m_QueuedBytes += job.memorySize;
+	lock.Unlock();
+
+	m_JobQueued.SetEvent();
+	return true;
+}
+
+/*
+ * Waits until all queued pages have been written and closes all multi-page files.
+ * The sink can be used again afterwards (the counts are reset with the next page).
+ * Returns true if all pages since the last call have been written successfully.
+ */
+bool COpenCvPageSink::Finish()
+{
+	CSingleLock lock(&m_CriticalSect, TRUE);
+	m_Finishing = true;
+	lock.Unlock();
+	m_FinishRequested.SetEvent();
+
+	for (unsigned int i = 0; i < m_Threads.size(); i++)
+	{
+		m_Threads[i]->WaitUntilFinished();
+		delete m_Threads[i];
+	}
+	m_Threads.clear();
+	m_FinishRequested.ResetEvent();
+
+	for (std::map<CUniString, COpenCvTiffWriter*>::iterator it = m_PageWriters.begin(); it != m_PageWriters.end(); it++)
+	{
+		it->second->Close();
+		delete it->second;
+	}
+	m_PageWriters.clear();
+
+	m_Finishing = false;
+	return m_FailedCount == 0;
+}
+
+/*
+ * Checks if the given file is being written by one of the threads (call within critical section)
+ */
+bool COpenCvPageSink::IsFileBusy(const CUniString & filePath)
+{
+	for (unsigned int i = 0; i < m_BusyFiles.size(); i++)
+		if (m_BusyFiles[i] == filePath)
+			return true;
+	return false;
+}
+
+/*
+ * Returns the first queued job whose file is not being written by another thread
+ * or m_Jobs.end() (call within critical section).
+ * Taking the first eligible job keeps the page order within each file.
+ */
+std::deque<COpenCvPageSink::CWriteJob>::iterator COpenCvPageSink::FindNextJob()
+{
+	std::deque<CWriteJob>::iterator it = m_Jobs.begin();
+	while (it != m_Jobs.end() && IsFileBusy(it->filePath))
+		it++;
+	return it;
+}
+
+/*
+ * Takes the next eligible job (see FindNextJob()) and marks its file as busy.
+ * Waits while there is none. m_JobQueued (auto reset) releases one thread at a time,
+ * so the signal is passed on if another thread can do something.
+ * Returns false if the thread should terminate (no jobs left and Finish() has been called).
+ */
+bool COpenCvPageSink::TakeJob(CWriteJob & job)
+{
+	CSingleLock lock(&m_CriticalSect, TRUE);
+	while (true)
+	{
+		std::deque<CWriteJob>::iterator it = FindNextJob();
+		if (it != m_Jobs.end())
+		{
+			job = *it;
+			m_Jobs.erase(it);
+			m_BusyFiles.push_back(job.filePath);
+			bool moreJobs = FindNextJob() != m_Jobs.end();
+			lock.Unlock();
+			if (moreJobs)
+				m_JobQueued.SetEvent();
+			return true;
+		}
+		if (m_Finishing && m_Jobs.empty())
+		{
+			lock.Unlock();
+			m_JobQueued.SetEvent(); //Let the next idle thread terminate
+			return false;
+		}
+
+		//Wait for a new job or a released file. Once finishing, only the latter can help
+		//(the finish event stays signalled).
+		bool finishing = m_Finishing;
+		lock.Unlock();
+		if (finishing)
+			m_JobQueued.Lock();
+		else
+		{
+			HANDLE handles[2] = { m_JobQueued.m_hObject, m_FinishRequested.m_hObject };
+			::WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+		}
+		lock.Lock();
+	}
+}
+
+/*
+ * Thread function of the writing threads
+ */
+void COpenCvPageSink::WritePages()
+{
+	COpenCvImageWriter writer;
+	writer.SetTiffCompression(m_TiffCompression);
+
+	CWriteJob job;
+	while (TakeJob(job))
+	{
+		bool success;
+		if (job.appendPage)
+		{
+			//Multi-page file (exclusive to this thread while the file is busy)
+			CSingleLock lock(&m_CriticalSect, TRUE);
+			COpenCvTiffWriter * pageWriter = m_PageWriters[job.filePath];
+			if (pageWriter == NULL)
+			{
+				pageWriter = new COpenCvTiffWriter();
+				pageWriter->SetCompression(m_TiffCompression);
+				m_PageWriters[job.filePath] = pageWriter;
+			}
+			lock.Unlock();
+
+			if (!pageWriter->IsOpen())
+				pageWriter->Open(job.filePath);
+			success = pageWriter->WritePage(job.image);
+		}
+		else
+			success = writer.Write(job.image, job.filePath);
+
+		delete job.image;
+
+		CSingleLock lock(&m_CriticalSect, TRUE);
+		for (unsigned int i = 0; i < m_BusyFiles.size(); i++)
+		{
+			if (m_BusyFiles[i] == job.filePath)
+			{
+				m_BusyFiles.erase(m_BusyFiles.begin() + i);
+				break;
+			}
+		}
+		m_QueuedBytes -= min(m_QueuedBytes, job.memorySize);
+		if (success)
+			m_WrittenCount++;
+		else
+			m_FailedCount++;
+		lock.Unlock();
+
+		m_SpaceAvailable.SetEvent();
+		m_JobQueued.SetEvent(); //The next page of the same file might be waiting
+	}
+}
+
+
+} //end namespace
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "opencvimage.h"
+#include "SimpleThread.h"
+#include <afxmt.h>
+#include <vector>
+#include <deque>
+#include <map>
+
+namespace PRImA {
+
+class COpenCvTiffWriter;
+
+/*
+ * Class COpenCvPageSink
+ *
+ * Encodes and writes images on background threads (counterpart of COpenCvPageSource).
+ * The sink takes ownership of the images and deletes them after writing.
+ *
+ * Pages can be appended to multi-page TIFF files ('appendPage'). Pages of the same file
+ * are written in the order they were passed to the sink.
+ *
+ * Backpressure: Write() waits while 'maxQueuedPages' pages are queued or being written,
+ * or while their memory exceeds 'maxQueuedBytes' (a single page is always accepted).
+ *
+ * Usage: Write() for each page, Finish() to wait until everything has been written.
+ * The written/failed counts refer to the current batch (the pages since the last Finish())
+ * and remain available after Finish() until the next page is written.
+ */
+class COpenCvPageSink
+{
+public:
+	static const int	DEFAULT_THREAD_COUNT		= 2;
+	static const int	DEFAULT_MAX_QUEUED_PAGES	= 4;
+	static const size_t	DEFAULT_MAX_QUEUED_BYTES	= 512 * 1024 * 1024;
+
+private:
+	/*
+	 * Image waiting to be written
+	 */
+	struct CWriteJob
+	{
+		COpenCvImage *	image;
+		CUniString		filePath;
+		bool			appendPage;
+		size_t			memorySize;
+	};
+
+public:
+	COpenCvPageSink(int threadCount = DEFAULT_THREAD_COUNT, int maxQueuedPages = DEFAULT_MAX_QUEUED_PAGES,
+					size_t maxQueuedBytes = DEFAULT_MAX_QUEUED_BYTES);
+	~COpenCvPageSink(void);
+
+	bool Write(COpenCvImage * image, CUniString filePath, bool appendPage = false);
+	bool Finish();
+
+	inline int	GetWrittenCount() { return m_WrittenCount; };
+	inline int	GetFailedCount() { return m_FailedCount; };
+
+	inline void SetTiffCompression(int compression) { m_TiffCompression = compression; }; //See COpenCvTiffWriter::COMPRESS_...
+	inline int	GetTiffCompression() { return m_TiffCompression; };
+
+private:
+	void WritePages();
+	bool TakeJob(CWriteJob & job);
+	std::deque<CWriteJob>::iterator FindNextJob();
+	bool IsFileBusy(const CUniString & filePath);
+
+private:
+	int												m_ThreadCount;
+	int												m_MaxQueuedPages;
+	size_t											m_MaxQueuedBytes;
+	int												m_TiffCompression;
+
+	std::deque<CWriteJob>							m_Jobs;
+	std::vector<CUniString>							m_BusyFiles;	//Files that are being written
+	std::map<CUniString, COpenCvTiffWriter*>		m_PageWriters;	//Open multi-page files
+	size_t											m_QueuedBytes;	//Memory of the queued pages and the pages being written
+	int												m_WrittenCount;
+	int												m_FailedCount;
+	bool											m_Finishing;
+
+	std::vector<CSimpleThread<COpenCvPageSink>*>	m_Threads;
+	CCriticalSection								m_CriticalSect;
+	CEvent											m_JobQueued;
+	CEvent											m_SpaceAvailable;
+	CEvent											m_FinishRequested;	//Manual reset, wakes up all idle threads
+};
+
+} //end namespace
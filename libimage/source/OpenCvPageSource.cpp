@@ -0,0 +1,277 @@
+#include "OpenCvPageSource.h"
+#include "OpenCvImageReader.h"
+#include "OpenCvTiffReader.h"
+#include "extrafilehelper.h"
+#include <algorithm>
+
+namespace PRImA {
+
+
+/*
+ * Class COpenCvPageSource
+ *
+ * Decodes the pages of a list of image files on background threads, ahead of the consumer.
+ */
+
+/*
+ * Constructor
+ *
+ * 'enforceType' - Image type of the decoded pages (see COpenCvImage::TYPE_...)
+ * 'threadCount' - Number of decoding threads
+ * 'maxQueuedPages' - Maximum number of pages that are being decoded or waiting for the consumer
+ * 'maxQueuedBytes' - Memory cap for the decoded pages waiting for the consumer
+ */
+COpenCvPageSource::COpenCvPageSource(int enforceType /*= COpenCvImage::TYPE_AUTO*/, int threadCount /*= DEFAULT_THREAD_COUNT*/,
+									int maxQueuedPages /*= DEFAULT_MAX_QUEUED_PAGES*/, size_t maxQueuedBytes /*= DEFAULT_MAX_QUEUED_BYTES*/)
+	: m_StopRequested(FALSE, TRUE)
+{
+	m_EnforceType = enforceType;
+	m_ThreadCount = max(1, threadCount);
+	m_MaxQueuedPages = max(1, maxQueuedPages);
+	m_MaxQueuedBytes = maxQueuedBytes;
+	m_PackedBilevel = false;
+	m_NextToDecode = 0;
+	m_NextToDeliver = 0;
+	m_QueuedBytes = 0;
+	m_Stop = false;
+}
+
+/*
+ * Destructor
+ */
+COpenCvPageSource::~COpenCvPageSource(void)
+{
+	Stop();
+}
+
+/*
+ * Adds a single page to the list (call before Start()).
+ */
+void COpenCvPageSource::AddPage(CUniString filePath, int pageIndex)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(m_Threads.empty());
+
+	CPageReference page;
+	page.filePath = filePath;
+	page.pageIndex = pageIndex;
+	m_Pages.push_back(page);
+	m_Results.push_back(NULL);
+	m_Decoded.push_back(false);
+}
+
+/*
+ * Adds all pages of the given file to the list (call before Start()).
+ * The number of pages of TIFF files is read from the file header; other formats and TIFF files
+ * that libtiff cannot open have one page (decoded by OpenCV, see COpenCvImageReader::Read()).
+ * Returns the number of added pages.
+ */
+int COpenCvPageSource::AddFile(CUniString filePath)
+{
+	int pageCount = 1;
+	if (COpenCvTiffReader::IsTiffFile(filePath))
+	{
+		COpenCvTiffReader tiffReader;
+		pageCount = tiffReader.Open(filePath) ? tiffReader.GetPageCount() : 1;
+	}
+	for (int i = 0; i < pageCount; i++)
+		AddPage(filePath, i);
+	return pageCount;
+}
+
+/*
+ * Adds all pages of all files in the given folder with the given extension (e.g. "tif") to the list
+ * (call before Start()). The files are added in alphabetical order.
+ * Returns the number of added pages.
+ */
+int COpenCvPageSource::AddFolder(CUniString folderPath, CUniString fileExtension)
+{
+	vector<CUniString> fileNames;
+	CExtraFileHelper::CollectFiles(folderPath, fileExtension, fileNames);
+	std::sort(fileNames.begin(), fileNames.end());
+
+	int pageCount = 0;
+	for (unsigned int i = 0; i < fileNames.size(); i++)
+	{
+		CUniString filePath(folderPath);
+		filePath.Append(_T("\\"));
+		filePath.Append(fileNames[i]);
+		pageCount += AddFile(filePath);
+	}
+	return pageCount;
+}
+
+/*
+ * Starts the decoding threads (called by Next() if necessary). A stopped source cannot be restarted.
+ */
+void COpenCvPageSource::Start()
+{
+	if (!m_Threads.empty() || m_Stop)
+		return;
+
+	int threadCount = min(m_ThreadCount, max(1, (int)m_Pages.size()));
+	for (int i = 0; i < threadCount; i++)
+	{
+		CSimpleThread<COpenCvPageSource> * thread = new CSimpleThread<COpenCvPageSource>();
+		m_Threads.push_back(thread);
+		thread->Run(this, &COpenCvPageSource::DecodePages);
+	}
+}
+
+/*
+ * Stops the decoding threads (pages that are being decoded are finished first)
+ * and deletes all pages that have not been handed out.
+ */
+void COpenCvPageSource::Stop()
+{
+	CSingleLock lock(&m_CriticalSect, TRUE);
+	m_Stop = true;
+	lock.Unlock();
+	m_StopRequested.SetEvent();
+
+	for (unsigned int i = 0; i < m_Threads.size(); i++)
+	{
+		m_Threads[i]->WaitUntilFinished();
+		delete m_Threads[i];
+	}
+	m_Threads.clear();
+
+	for (unsigned int i = 0; i < m_Results.size(); i++)
+	{
+		delete m_Results[i];
+		m_Results[i] = NULL;
+	}
+	m_QueuedBytes = 0;
+}
+
+/*
+ * Checks if there are pages left that have not been handed out (false after Stop())
+ */
+bool COpenCvPageSource::HasNext()
+{
+	return !m_Stop && m_NextToDeliver < (int)m_Pages.size();
+}
+
+/*
+ * Returns the next page of the list (in list order), waiting for it to be decoded if necessary.
+ * The caller takes ownership of the image.
+ * Returns: Instance of COpenCvColourImage, COpenCvGreyScaleImage or COpenCvBiLevelImage or NULL,
+ *          if there are no more pages, the page could not be decoded or the source has been stopped.
+ */
+COpenCvImage * COpenCvPageSource::Next()
+{
+	if (!HasNext())
+		return NULL;
+	if (m_Threads.empty())
+		Start();
+
+	CSingleLock lock(&m_CriticalSect, TRUE);
+	while (!m_Decoded[m_NextToDeliver])
+	{
+		if (m_Stop)
+			return NULL;
+		lock.Unlock();
+		WaitForEvent(m_PageDecoded);
+		lock.Lock();
+	}
+
+	COpenCvImage * img = m_Results[m_NextToDeliver];
+	m_Results[m_NextToDeliver] = NULL;
+	if (img != NULL)
+		m_QueuedBytes -= min(m_QueuedBytes, img->GetMemorySize());
+	m_NextToDeliver++;
+	lock.Unlock();
+
+	m_SpaceAvailable.SetEvent();
+	return img;
+}
+
+/*
+ * Checks the queue limits (call within critical section).
+ * The page the consumer is waiting for is always allowed, so oversized pages cannot block the source.
+ */
+bool COpenCvPageSource::CanStartDecoding()
+{
+	if (m_NextToDecode == m_NextToDeliver)
+		return true;
+	return m_NextToDecode - m_NextToDeliver < m_MaxQueuedPages && m_QueuedBytes < m_MaxQueuedBytes;
+}
+
+/*
+ * Blocks until the given event or the stop event is signalled (call outside the critical section).
+ * The events stay signalled until a thread has been released, so a state change between
+ * checking the condition and waiting is not lost.
+ * Returns false if the source has been stopped.
+ */
+bool COpenCvPageSource::WaitForEvent(CEvent & evt)
+{
+	HANDLE handles[2] = { evt.m_hObject, m_StopRequested.m_hObject };
+	return ::WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0;
+}
+
+/*
+ * Thread function of the decoding threads.
+ * Each thread keeps the last TIFF file open, so consecutive pages of a multi-page file
+ * don't require walking the directory chain from the start.
+ */
+void COpenCvPageSource::DecodePages()
+{
+	COpenCvTiffReader tiffReader;
+	tiffReader.SetPackedBilevel(m_PackedBilevel);
+	COpenCvImageReader reader;
+	reader.SetPackedBilevel(m_PackedBilevel);
+	CUniString openTiffPath;
+
+	while (true)
+	{
+		//Claim the next page
+		CSingleLock lock(&m_CriticalSect, TRUE);
+		while (!m_Stop && m_NextToDecode < (int)m_Pages.size() && !CanStartDecoding())
+		{
+			lock.Unlock();
+			WaitForEvent(m_SpaceAvailable);
+			lock.Lock();
+		}
+		if (m_Stop || m_NextToDecode >= (int)m_Pages.size())
+			break;
+		int index = m_NextToDecode++;
+		bool moreSpace = CanStartDecoding();
+		CPageReference page = m_Pages[index];
+		lock.Unlock();
+
+		if (moreSpace)
+			m_SpaceAvailable.SetEvent(); //Pass on to the next waiting thread
+
+		//Decode
+		COpenCvImage * img = NULL;
+		if (COpenCvTiffReader::IsTiffFile(page.filePath))
+		{
+			if (!tiffReader.IsOpen() || !(openTiffPath == page.filePath))
+			{
+				tiffReader.Open(page.filePath);
+				openTiffPath = page.filePath;
+			}
+			if (tiffReader.IsOpen() && tiffReader.SetPage(page.pageIndex))
+				img = tiffReader.ReadPage(m_EnforceType);
+			if (img != NULL)
+				COpenCvImageReader::SetFileNameAndPath(img, page.filePath);
+			else
+				img = reader.ReadMulti(page.filePath, page.pageIndex, m_EnforceType); //Fallback
+		}
+		else
+			img = reader.Read(page.filePath, m_EnforceType);
+
+		//Queue
+		lock.Lock();
+		m_Results[index] = img;
+		m_Decoded[index] = true;
+		if (img != NULL)
+			m_QueuedBytes += img->GetMemorySize();
+		lock.Unlock();
+
+		m_PageDecoded.SetEvent();
+	}
+}
+
+
+} //end namespace
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "opencvimage.h"
+#include "SimpleThread.h"
+#include <afxmt.h>
+#include <vector>
+
+namespace PRImA {
+
+/*
+ * Struct CPageReference
+ *
+ * File path and page index of a page to decode.
+ */
+struct CPageReference
+{
+	CUniString	filePath;
+	int			pageIndex;
+};
+
+
+/*
+ * Class COpenCvPageSource
+ *
+ * Decodes the pages of a list of image files (multi-page TIFF files contribute all their pages)
+ * on background threads, ahead of the consumer. Decoded pages are handed out in list order.
+ *
+ * Backpressure: The worker threads only start decoding a page if fewer than 'maxQueuedPages' pages
+ * are being decoded or waiting for the consumer, and if the memory of the waiting pages is below
+ * 'maxQueuedBytes' (the page directly needed by the consumer is always decoded).
+ *
+ * Usage:
+ *   COpenCvPageSource source;
+ *   source.AddFolder(folder, _T("tif"));
+ *   source.Start();
+ *   while (source.HasNext())
+ *   {
+ *       COpenCvImage * page = source.Next(); //NULL if the page could not be decoded
+ *       ...
+ *       delete page;
+ *   }
+ */
+class COpenCvPageSource
+{
+public:
+	static const int	DEFAULT_THREAD_COUNT		= 2;
+	static const int	DEFAULT_MAX_QUEUED_PAGES	= 4;
+	static const size_t	DEFAULT_MAX_QUEUED_BYTES	= 512 * 1024 * 1024;
+
+public:
+	COpenCvPageSource(int enforceType = COpenCvImage::TYPE_AUTO, int threadCount = DEFAULT_THREAD_COUNT,
+						int maxQueuedPages = DEFAULT_MAX_QUEUED_PAGES, size_t maxQueuedBytes = DEFAULT_MAX_QUEUED_BYTES);
+	~COpenCvPageSource(void);
+
+	void AddPage(CUniString filePath, int pageIndex);
+	int  AddFile(CUniString filePath);
+	int  AddFolder(CUniString folderPath, CUniString fileExtension);
+
+	inline int						GetPageCount() { return (int)m_Pages.size(); };
+	inline const CPageReference &	GetPage(int index) { return m_Pages[index]; };
+
+	inline void SetPackedBilevel(bool packed) { m_PackedBilevel = packed; }; //Bi-level TIFF pages are decoded into packed storage
+
+	void Start();
+	void Stop();
+
+	bool			HasNext();
+	COpenCvImage *	Next();
+	inline int		GetPageIndex() { return m_NextToDeliver - 1; }; //Index (in the page list) of the page returned by the last call of Next()
+
+private:
+	void DecodePages();
+	bool CanStartDecoding();
+	bool WaitForEvent(CEvent & evt);
+
+private:
+	int										m_EnforceType;
+	int										m_ThreadCount;
+	int										m_MaxQueuedPages;
+	size_t									m_MaxQueuedBytes;
+	bool									m_PackedBilevel;
+
+	std::vector<CPageReference>				m_Pages;
+	std::vector<COpenCvImage*>				m_Results;		//Decoded pages waiting for the consumer
+	std::vector<bool>						m_Decoded;		//Page decoded (result may be NULL)
+	int										m_NextToDecode;
+	int										m_NextToDeliver;
+	size_t									m_QueuedBytes;	//Memory of the decoded pages waiting for the consumer
+	bool									m_Stop;
+
+	std::vector<CSimpleThread<COpenCvPageSource>*>	m_Threads;
+	CCriticalSection						m_CriticalSect;
+	CEvent									m_PageDecoded;
+	CEvent									m_SpaceAvailable;
+	CEvent									m_StopRequested;	//Manual reset, wakes up all waiting threads
+};
+
+} //end namespace
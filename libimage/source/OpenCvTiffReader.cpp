@@ -0,0 +1,949 @@
+#include "OpenCvTiffReader.h"
+
+using namespace cv;
+
+namespace PRImA {
+
+
+/*
+ * Decodes the rows of the current TIFF directory within the given region, strip by strip
+ * (or tile by tile). Only the strips/tiles intersecting the region are decoded.
+ * The rows are passed to the given row handler:
+ *   uchar * GetDirectRows(int row, int rows, tmsize_t scanlineSize)
+ *           - Destination for decoding a whole strip in place or NULL
+ *   void ProcessRow(int y, int x, uchar * src)
+ *           - Handles the decoded samples of image row 'y'. 'src' starts at image column 'x'
+ *             (always byte aligned) and covers the region columns. If 'src' is a pointer returned
+ *             by GetDirectRows(), the samples are converted in place.
+ */
+template<class RowHandler>
+static bool ReadTiffRows(TIFF * tif, uint32 width, uint32 height, Rect region, RowHandler & handler)
+{
+	uint32 regionBottom = (uint32)(region.y + region.height);
+	if (TIFFIsTiled(tif))
+	{
+		uint32 tileWidth = 0, tileHeight = 0;
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tileWidth);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &tileHeight);
+		tmsize_t tileSize = TIFFTileSize(tif);
+		if (tileWidth == 0 || tileHeight == 0 || tileSize <= 0)
+			return false;
+		tmsize_t tileRowSize = TIFFTileRowSize(tif);
+
+		unsigned short bitsPerSample = 1, samplesPerPixel = 1;
+		TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+		TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+		size_t bitsPerPixel = (size_t)bitsPerSample * samplesPerPixel;
+
+		//Band of tile rows covering the region columns
+		uint32 firstCol = ((uint32)region.x / tileWidth) * tileWidth;
+		uint32 endCol = min((uint32)(region.x + region.width), width);
+		size_t bandRowSize = ((size_t)(endCol - firstCol) * bitsPerPixel + 7) / 8;
+		std::vector<uchar> band(bandRowSize * tileHeight);
+		std::vector<uchar> tile((size_t)tileSize);
+
+		for (uint32 row = ((uint32)region.y / tileHeight) * tileHeight; row < regionBottom; row += tileHeight)
+		{
+			int rows = (int)min(tileHeight, height - row);
+			for (uint32 col = firstCol; col < endCol; col += tileWidth)
+			{
+				if (TIFFReadEncodedTile(tif, TIFFComputeTile(tif, col, row, 0, 0), tile.data(), tileSize) < 0)
+					return false;
+				size_t offset = (size_t)(col - firstCol) * bitsPerPixel / 8; //Tile width is a multiple of 16
+				size_t bytes = min((size_t)tileRowSize, bandRowSize - offset);
+				for (int i = 0; i < rows; i++)
+					memcpy(&band[i * bandRowSize + offset], &tile[(size_t)i * tileRowSize], bytes);
+			}
+			for (uint32 y = max(row, (uint32)region.y); y < min(row + rows, regionBottom); y++)
+				handler.ProcessRow((int)y, (int)firstCol, &band[(y - row) * bandRowSize]);
+		}
+	}
+	else //Strips
+	{
+		uint32 rowsPerStrip = height;
+		TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+		rowsPerStrip = min(max(rowsPerStrip, (uint32)1), height);
+		tmsize_t scanlineSize = TIFFScanlineSize(tif);
+		if (scanlineSize <= 0)
+			return false;
+
+		std::vector<uchar> buffer;
+		for (uint32 row = ((uint32)region.y / rowsPerStrip) * rowsPerStrip; row < regionBottom; row += rowsPerStrip)
+		{
+			int rows = (int)min(rowsPerStrip, height - row);
+			tmsize_t size = scanlineSize * rows;
+			uchar * dest = handler.GetDirectRows((int)row, rows, scanlineSize);
+			if (dest == NULL)
+			{
+				buffer.resize((size_t)size);
+				dest = buffer.data();
+			}
+			if (TIFFReadEncodedStrip(tif, TIFFComputeStrip(tif, row, 0), dest, size) < 0)
+				return false;
+			for (uint32 y = max(row, (uint32)region.y); y < min(row + rows, regionBottom); y++)
+				handler.ProcessRow((int)y, 0, dest + (size_t)(y - row) * scanlineSize);
+		}
+	}
+	return true;
+}
+
+/*
+ * Row handler for ReadTiffRows() - Expands 1 bit samples to an 8 bit matrix (0 and 255)
+ */
+class CTiffBilevelRowExpander
+{
+public:
+	CTiffBilevelRowExpander(Mat & data, Rect region, bool minIsWhite) : m_Data(data), m_Region(region), m_MinIsWhite(minIsWhite)
+	{
+		//Lookup table for 8 pixels (a set bit is white for min-is-black)
+		for (int b = 0; b < 256; b++)
+			for (int i = 0; i < 8; i++)
+				m_Table[b][i] = (((b >> (7 - i)) & 1) != 0) != minIsWhite ? 255 : 0;
+	};
+	inline uchar * GetDirectRows(int, int, tmsize_t) { return NULL; };
+	inline void ProcessRow(int y, int x, uchar * src)
+	{
+		uchar * dst = m_Data.ptr<uchar>(y - m_Region.y);
+		int count = m_Region.width;
+		int offset = m_Region.x - x; //In bits
+		if (offset % 8 == 0)
+		{
+			src += offset / 8;
+			int bytes = count / 8;
+			for (int i = 0; i < bytes; i++, dst += 8)
+				memcpy(dst, m_Table[src[i]], 8);
+			if (count % 8 != 0)
+				memcpy(dst, m_Table[src[bytes]], count % 8);
+		}
+		else //Not byte aligned
+		{
+			for (int i = 0; i < count; i++)
+			{
+				int bit = offset + i;
+				dst[i] = (((src[bit >> 3] >> (7 - (bit & 7))) & 1) != 0) != m_MinIsWhite ? 255 : 0;
+			}
+		}
+	};
+private:
+	Mat &	m_Data;
+	Rect	m_Region;
+	bool	m_MinIsWhite;
+	uchar	m_Table[256][8];
+};
+
+/*
+ * Row handler for ReadTiffRows() - Packs 1 bit samples straight into a packed bit matrix
+ */
+class CTiffBilevelRowPacker
+{
+public:
+	CTiffBilevelRowPacker(CPackedBitMatrix * bits, Rect region, bool minIsWhite) : m_Bits(bits), m_Region(region), m_Invert(!minIsWhite) {};
+	inline uchar * GetDirectRows(int, int, tmsize_t) { return NULL; };
+	inline void ProcessRow(int y, int x, uchar * src)
+	{
+		int offset = m_Region.x - x; //In bits
+		if (offset % 8 == 0)
+			m_Bits->SetRowBits(y - m_Region.y, 0, m_Region.width, src + offset / 8, m_Invert); //Set bit = black
+		else //Not byte aligned
+		{
+			for (int i = 0; i < m_Region.width; i++)
+			{
+				int bit = offset + i;
+				m_Bits->Set(i, y - m_Region.y, (((src[bit >> 3] >> (7 - (bit & 7))) & 1) != 0) != m_Invert);
+			}
+		}
+	};
+private:
+	CPackedBitMatrix *	m_Bits;
+	Rect				m_Region;
+	bool				m_Invert;
+};
+
+/*
+ * Row handler for ReadTiffRows() - 8 bit samples (one or three channels) into a matrix of the same layout.
+ * Strips are decoded in place if the region covers whole rows. RGB is converted to BGR and min-is-white is inverted.
+ */
+class CTiffByteRowHandler
+{
+public:
+	CTiffByteRowHandler(Mat & data, Rect region, bool rgb, bool minIsWhite)
+		: m_Data(data), m_Region(region), m_Rgb(rgb), m_Invert(minIsWhite) {};
+	inline uchar * GetDirectRows(int row, int rows, tmsize_t scanlineSize)
+	{
+		if (!m_Data.isContinuous() || scanlineSize != (tmsize_t)m_Data.step[0]
+			|| row < m_Region.y || row + rows > m_Region.y + m_Region.height)
+			return NULL;
+		return m_Data.ptr<uchar>(row - m_Region.y);
+	};
+	inline void ProcessRow(int y, int x, uchar * src)
+	{
+		int channels = m_Rgb ? 3 : 1;
+		int count = m_Region.width;
+		uchar * dst = m_Data.ptr<uchar>(y - m_Region.y);
+		src += (m_Region.x - x) * channels;
+		if (src != dst)
+			memcpy(dst, src, count * channels);
+		if (m_Rgb)
+		{
+			for (int i = 0; i < count; i++, dst += 3)
+				std::swap(dst[0], dst[2]);
+		}
+		else if (m_Invert)
+		{
+			for (int i = 0; i < count; i++)
+				dst[i] = (uchar)~dst[i];
+		}
+	};
+private:
+	Mat &	m_Data;
+	Rect	m_Region;
+	bool	m_Rgb;
+	bool	m_Invert;
+};
+
+/*
+ * Area averaging downsampler for rows arriving top to bottom.
+ * Each source pixel is added to the target pixel it falls into; target pixels are the
+ * (rounded) mean of their source pixels. Only one target row is accumulated at a time.
+ */
+class CAreaDownsampler
+{
+public:
+	CAreaDownsampler(int width, int height, int targetWidth, int targetHeight, int channels)
+		: m_Height(height), m_TargetHeight(targetHeight), m_Channels(channels),
+		  m_ColumnMap(width), m_ColumnCounts(targetWidth, 0), m_Sums((size_t)targetWidth * channels, 0)
+	{
+		m_Result = COpenCvImage::AllocateMatrix(targetHeight, targetWidth, CV_8UC(channels));
+		for (int x = 0; x < width; x++)
+		{
+			m_ColumnMap[x] = (int)((int64)x * targetWidth / width);
+			m_ColumnCounts[m_ColumnMap[x]]++;
+		}
+		m_CurrentRow = 0;
+		m_RowCount = 0;
+	};
+	inline void AddRow(int y, const uchar * src)
+	{
+		int targetRow = (int)((int64)y * m_TargetHeight / m_Height);
+		if (targetRow != m_CurrentRow)
+		{
+			Flush();
+			m_CurrentRow = targetRow;
+		}
+		int width = (int)m_ColumnMap.size();
+		if (m_Channels == 1)
+		{
+			for (int x = 0; x < width; x++)
+				m_Sums[m_ColumnMap[x]] += src[x];
+		}
+		else
+		{
+			for (int x = 0; x < width; x++, src += m_Channels)
+			{
+				uint64 * sum = &m_Sums[(size_t)m_ColumnMap[x] * m_Channels];
+				for (int c = 0; c < m_Channels; c++)
+					sum[c] += src[c];
+			}
+		}
+		m_RowCount++;
+	};
+	inline Mat & Finish()
+	{
+		Flush();
+		return m_Result;
+	};
+private:
+	void Flush()
+	{
+		if (m_RowCount == 0)
+			return;
+		uchar * dst = m_Result.ptr<uchar>(m_CurrentRow);
+		for (size_t i = 0; i < m_Sums.size(); i++)
+		{
+			uint64 count = (uint64)m_ColumnCounts[i / m_Channels] * m_RowCount;
+			dst[i] = (uchar)((m_Sums[i] + count / 2) / count);
+			m_Sums[i] = 0;
+		}
+		m_RowCount = 0;
+	};
+private:
+	int					m_Height;
+	int					m_TargetHeight;
+	int					m_Channels;
+	std::vector<int>	m_ColumnMap;		//Source column -> target column
+	std::vector<int>	m_ColumnCounts;		//Source columns per target column
+	std::vector<uint64>	m_Sums;				//Current target row
+	int					m_CurrentRow;
+	int					m_RowCount;			//Source rows added to the current target row
+	Mat					m_Result;
+};
+
+/*
+ * Row handler for ReadTiffRows() - Converts whole rows (1 bit, 8 bit grey or 8 bit RGB samples)
+ * to 8 bit grey scale or BGR and passes them on to an area downsampler.
+ */
+class CTiffDownsamplingRowHandler
+{
+public:
+	CTiffDownsamplingRowHandler(CAreaDownsampler & downsampler, int width, bool bilevel, bool rgb, bool minIsWhite, bool grey)
+		: m_Downsampler(downsampler), m_Width(width), m_Bilevel(bilevel), m_Rgb(rgb), m_Invert(minIsWhite), m_Grey(grey),
+		  m_Row((size_t)width * (grey ? 1 : 3))
+	{
+		for (int b = 0; b < 256; b++)
+			for (int i = 0; i < 8; i++)
+				m_Table[b][i] = (((b >> (7 - i)) & 1) != 0) != minIsWhite ? 255 : 0;
+	};
+	inline uchar * GetDirectRows(int, int, tmsize_t) { return NULL; };
+	inline void ProcessRow(int y, int, uchar * src)
+	{
+		uchar * dst = m_Row.data();
+		if (m_Bilevel)
+		{
+			int bytes = m_Width / 8;
+			for (int i = 0; i < bytes; i++, dst += 8)
+				memcpy(dst, m_Table[src[i]], 8);
+			if (m_Width % 8 != 0)
+				memcpy(dst, m_Table[src[bytes]], m_Width % 8);
+		}
+		else if (m_Rgb && m_Grey)
+		{
+			for (int x = 0; x < m_Width; x++, src += 3)
+				dst[x] = (uchar)((src[2] * 1868 + src[1] * 9617 + src[0] * 4899 + (1 << 13)) >> 14);
+		}
+		else if (m_Rgb)
+		{
+			for (int x = 0; x < m_Width; x++, src += 3, dst += 3)
+			{
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+			}
+		}
+		else if (m_Invert)
+		{
+			for (int x = 0; x < m_Width; x++)
+				dst[x] = (uchar)~src[x];
+		}
+		else
+		{
+			m_Downsampler.AddRow(y, src); //Grey scale, min-is-black
+			return;
+		}
+		m_Downsampler.AddRow(y, m_Row.data());
+	};
+private:
+	CAreaDownsampler &	m_Downsampler;
+	int					m_Width;
+	bool				m_Bilevel;
+	bool				m_Rgb;
+	bool				m_Invert;
+	bool				m_Grey;
+	std::vector<uchar>	m_Row;
+	uchar				m_Table[256][8];
+};
+
+
+/*
+ * Class COpenCvTiffReader
+ *
+ * TIFF reader (libtiff) for single pages of (multi-page) TIFF files.
+ */
+
+/*
+ * Constructor
+ */
+COpenCvTiffReader::COpenCvTiffReader(void)
+{
+	m_Tif = NULL;
+	m_CurrentPage = 0;
+	m_PageCount = -1;
+	m_PackedBilevel = false;
+}
+
+/*
+ * Destructor
+ */
+COpenCvTiffReader::~COpenCvTiffReader(void)
+{
+	Close();
+}
+
+/*
+ * Checks the file extension (.tif or .tiff)
+ */
+bool COpenCvTiffReader::IsTiffFile(CUniString filePath)
+{
+	CUniString lowerCase = filePath;
+	lowerCase.MakeLower();
+	return lowerCase.EndsWith(L".tif") || lowerCase.EndsWith(L".tiff");
+}
+
+/*
+ * Opens the given TIFF file (only the first directory is read)
+ * Returns false if the file could not be opened.
+ */
+bool COpenCvTiffReader::Open(CUniString filePath)
+{
+	Close();
+
+	if (filePath.IsEmpty())
+		return false;
+
+	if (!(m_Tif = TIFFOpen(filePath.ToC_Str(), "r")))
+		return false;
+
+	m_FilePath = filePath;
+	m_CurrentPage = 0;
+	m_PageCount = -1;
+	m_PageOffsets.push_back(TIFFCurrentDirOffset(m_Tif));
+	return true;
+}
+
+/*
+ * Closes the file
+ */
+void COpenCvTiffReader::Close()
+{
+	if (m_Tif != NULL)
+		TIFFClose(m_Tif);
+	m_Tif = NULL;
+	m_PageOffsets.clear();
+	m_CurrentPage = 0;
+	m_PageCount = -1;
+}
+
+/*
+ * Returns the number of pages (directories) of the file.
+ * Only the directory chain is followed, no page is decoded.
+ */
+int COpenCvTiffReader::GetPageCount()
+{
+	if (m_Tif == NULL)
+		return 0;
+	if (m_PageCount < 0)
+		m_PageCount = TIFFNumberOfDirectories(m_Tif);
+	return m_PageCount;
+}
+
+/*
+ * Makes the given page the current page (for ReadImageInfo() and ReadPage()).
+ * Pages that have been visited before are located directly via their cached directory offset,
+ * otherwise the directory chain is followed from the last known page (without decoding any pages).
+ * Returns false if the page does not exist (the current page is not changed then).
+ */
+bool COpenCvTiffReader::SetPage(int pageIndex)
+{
+	if (m_Tif == NULL || pageIndex < 0)
+		return false;
+	if (pageIndex == m_CurrentPage)
+		return true;
+	if (pageIndex >= GetPageCount())
+		return false;
+
+	//Known directory offset
+	if (pageIndex < (int)m_PageOffsets.size())
+	{
+		if (!TIFFSetSubDirectory(m_Tif, m_PageOffsets[pageIndex]))
+			return false;
+		m_CurrentPage = pageIndex;
+		return true;
+	}
+
+	//Continue from the last known page
+	int previousPage = m_CurrentPage;
+	int lastKnown = (int)m_PageOffsets.size() - 1;
+	if (m_CurrentPage != lastKnown)
+	{
+		if (!TIFFSetSubDirectory(m_Tif, m_PageOffsets[lastKnown]))
+			return false;
+		m_CurrentPage = lastKnown;
+	}
+	while (m_CurrentPage < pageIndex)
+	{
+		if (!TIFFReadDirectory(m_Tif)) //Broken directory chain
+		{
+			TIFFSetSubDirectory(m_Tif, m_PageOffsets[previousPage]);
+			m_CurrentPage = previousPage;
+			return false;
+		}
+		m_CurrentPage++;
+		m_PageOffsets.push_back(TIFFCurrentDirOffset(m_Tif));
+	}
+	return true;
+}
+
+/*
+ * Advances to the next page (for iterating over all pages of a file).
+ * Returns false if there are no more pages.
+ */
+bool COpenCvTiffReader::NextPage()
+{
+	return SetPage(m_CurrentPage + 1);
+}
+
+/*
+ * Reads the metadata (such as size and resolution) of the current page.
+ */
+CImageInfo * COpenCvTiffReader::ReadImageInfo()
+{
+	CImageInfo * info = new CImageInfo();
+	if (m_Tif == NULL)
+		return info;
+
+	//Size
+	uint32 width = 0, height = 0;
+	unsigned short samplesPerPixel = 1;
+	TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(m_Tif, TIFFTAG_IMAGELENGTH, &height);
+	TIFFGetFieldDefaulted(m_Tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+	info->width = (int)width;
+	info->height = (int)height;
+	info->channels = samplesPerPixel;
+	info->pageCount = GetPageCount();
+
+	//Resolution
+	float x=0.0f,y=0.0f;
+	TIFFGetField(m_Tif, TIFFTAG_XRESOLUTION, &x);
+	TIFFGetField(m_Tif, TIFFTAG_YRESOLUTION, &y);
+
+	uint16_t ResUnit = RESUNIT_CENTIMETER;
+	TIFFGetField(m_Tif, TIFFTAG_RESOLUTIONUNIT, &ResUnit);
+	if(ResUnit == RESUNIT_CENTIMETER)
+	{
+		info->resolutionX = x * 2.54f;
+		info->resolutionY = y * 2.54f;
+	}
+	else
+	{
+		info->resolutionX = x;
+		info->resolutionY = y;
+	}
+
+	//bits per pixel
+	unsigned short photometric;
+	unsigned short bitsPerSample = 1;
+	TIFFGetField(m_Tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+	if (TIFFGetField(m_Tif, TIFFTAG_PHOTOMETRIC, &photometric))
+	{
+		if (photometric == PHOTOMETRIC_MINISWHITE || photometric == PHOTOMETRIC_MINISBLACK)
+		{
+			// Either Black and White, or Greyscale image
+			info->bitsPerPixel = bitsPerSample;
+			info->blackAndWhite = bitsPerSample == 1;
+		}
+		else if (photometric == PHOTOMETRIC_PALETTE)
+		{
+			//Palletized Image
+			info->bitsPerPixel = bitsPerSample;
+		}
+		else if (photometric == PHOTOMETRIC_RGB)
+		{
+			//RGB Image
+			unsigned short samplesPerPixel = 1;
+			if (TIFFGetField(m_Tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel))
+				info->bitsPerPixel = bitsPerSample * samplesPerPixel;
+		}
+	}
+	return info;
+}
+
+/*
+ * Decodes the current page (header and pixel data are read from the open file).
+ * The pixel data is converted as by cv::imread() (8 bit colour or 8 bit grey scale).
+ * Bi-level pages are decoded without grey scale intermediate (into packed storage if
+ * SetPackedBilevel(true) has been called).
+ *
+ * 'enforceType' - Colour depth of image. One of:
+ *                      COpenCvImage::TYPE_COLOUR     - RGB colour image
+ *                      COpenCvImage::TYPE_GREYSCALE  - Grey scale image
+ *                      COpenCvImage::TYPE_BILEVEL    - Black-and-white image
+ *                      COpenCvImage::TYPE_AUTO       - Auto-detect
+ * Returns: Instance of COpenCvColourImage, COpenCvGreyScaleImage or COpenCvBiLevelImage or NULL.
+ */
+COpenCvImage * COpenCvTiffReader::ReadPage(int enforceType)
+{
+	return ReadPageRegion(enforceType, 0, 0, INT_MAX, INT_MAX);
+}
+
+/*
+ * Decodes a rectangular region of the current page. Only the strips or tiles intersecting
+ * the region are decoded. See ReadPage().
+ *
+ * 'left', 'top', 'width', 'height' - Region (will be clipped to the page)
+ * Returns: Image of the size of the (clipped) region or NULL if the region is empty or the page could not be decoded.
+ */
+COpenCvImage * COpenCvTiffReader::ReadPageRegion(int enforceType, int left, int top, int width, int height)
+{
+	if (m_Tif == NULL)
+		return NULL;
+
+	bool ensurePixelValuesAreInRange = true;
+	CImageInfo * info = ReadImageInfo();
+	if (enforceType == COpenCvImage::TYPE_AUTO && info->bitsPerPixel == 1)
+	{
+		enforceType = COpenCvImage::TYPE_BILEVEL;
+		ensurePixelValuesAreInRange = false; //Avoid binarisation (save time)
+	}
+
+	uint32 pageWidth = 0, pageHeight = 0;
+	TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &pageWidth);
+	TIFFGetField(m_Tif, TIFFTAG_IMAGELENGTH, &pageHeight);
+	Rect region = ClipRegion(left, top, width, height, pageWidth, pageHeight);
+	if (region.width <= 0 || region.height <= 0)
+	{
+		delete info;
+		return NULL;
+	}
+
+	bool minIsWhite = false;
+	int layout = GetSampleLayout(minIsWhite);
+
+	if (layout == SAMPLES_BILEVEL && enforceType == COpenCvImage::TYPE_BILEVEL && m_PackedBilevel)
+	{
+		//Straight into packed storage
+		CPackedBitMatrix * bits = new CPackedBitMatrix(region.width, region.height);
+		CTiffBilevelRowPacker packer(bits, region, minIsWhite);
+		if (!ReadTiffRows(m_Tif, pageWidth, pageHeight, region, packer))
+		{
+			delete bits;
+			delete info;
+			return NULL;
+		}
+		COpenCvBiLevelImage * img = new COpenCvBiLevelImage();
+		img->SetPackedData(bits, CV_8UC1);
+		img->SetImageInfo(info);
+		return img;
+	}
+
+	bool grey = IsGreyDecoding(enforceType, layout);
+	if (layout == SAMPLES_BILEVEL && grey)
+		ensurePixelValuesAreInRange = false; //Only 0 and 255
+
+	Mat imageData;
+	bool success = DecodeRegion(imageData, layout, minIsWhite, grey, region);
+
+	if (!success)
+	{
+		delete info;
+		return NULL;
+	}
+
+	COpenCvImage * img = COpenCvImage::Create(imageData, enforceType, ensurePixelValuesAreInRange);
+	if (img != NULL)
+		img->SetImageInfo(info);
+	else
+		delete info;
+	return img;
+}
+
+/*
+ * Determines the sample layout of the current page for direct decoding (SAMPLES_BILEVEL, SAMPLES_GREY8,
+ * SAMPLES_RGB8 or SAMPLES_OTHER).
+ *
+ * 'minIsWhite' (out) - Photometric interpretation of one sample layouts
+ */
+int COpenCvTiffReader::GetSampleLayout(bool & minIsWhite)
+{
+	unsigned short photometric = 0, bitsPerSample = 1, samplesPerPixel = 1, planarConfig = PLANARCONFIG_CONTIG;
+	if (!TIFFGetField(m_Tif, TIFFTAG_PHOTOMETRIC, &photometric))
+		return SAMPLES_OTHER;
+	TIFFGetFieldDefaulted(m_Tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+	TIFFGetFieldDefaulted(m_Tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+	TIFFGetFieldDefaulted(m_Tif, TIFFTAG_PLANARCONFIG, &planarConfig);
+
+	minIsWhite = photometric == PHOTOMETRIC_MINISWHITE;
+	if ((photometric == PHOTOMETRIC_MINISBLACK || photometric == PHOTOMETRIC_MINISWHITE) && samplesPerPixel == 1)
+	{
+		if (bitsPerSample == 1)
+			return SAMPLES_BILEVEL;
+		if (bitsPerSample == 8)
+			return SAMPLES_GREY8;
+	}
+	else if (photometric == PHOTOMETRIC_RGB && samplesPerPixel == 3 && bitsPerSample == 8 && planarConfig == PLANARCONFIG_CONTIG)
+		return SAMPLES_RGB8;
+	return SAMPLES_OTHER;
+}
+
+/*
+ * Checks if a page with the given sample layout is decoded to one channel (grey scale) for the requested image type
+ */
+bool COpenCvTiffReader::IsGreyDecoding(int enforceType, int layout)
+{
+	return enforceType == COpenCvImage::TYPE_GREYSCALE || enforceType == COpenCvImage::TYPE_BILEVEL
+		|| (enforceType == COpenCvImage::TYPE_AUTO && (layout == SAMPLES_BILEVEL || layout == SAMPLES_GREY8));
+}
+
+/*
+ * Decodes the given region of the current directory into an 8 bit matrix (common layouts directly, others via RGBA).
+ * The matrix is (re)allocated if it doesn't have the size of the region.
+ *
+ * 'grey' - If true, an 8 bit grey scale matrix is created, otherwise an 8 bit BGR matrix (see IsGreyDecoding()).
+ */
+bool COpenCvTiffReader::DecodeRegion(Mat & data, int layout, bool minIsWhite, bool grey, Rect region)
+{
+	uint32 width = 0, height = 0;
+	TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(m_Tif, TIFFTAG_IMAGELENGTH, &height);
+
+	int type = grey ? CV_8UC1 : CV_8UC3;
+	if (data.rows != region.height || data.cols != region.width || data.type() != type)
+		data = COpenCvImage::AllocateMatrix(region.height, region.width, type);
+
+	if (layout == SAMPLES_BILEVEL && grey)
+	{
+		CTiffBilevelRowExpander expander(data, region, minIsWhite);
+		return ReadTiffRows(m_Tif, width, height, region, expander);
+	}
+	else if (layout == SAMPLES_GREY8 && grey)
+	{
+		CTiffByteRowHandler handler(data, region, false, minIsWhite);
+		return ReadTiffRows(m_Tif, width, height, region, handler);
+	}
+	else if (layout == SAMPLES_RGB8 && !grey)
+	{
+		CTiffByteRowHandler handler(data, region, true, false);
+		return ReadTiffRows(m_Tif, width, height, region, handler);
+	}
+	//Any other layout (palette, 16 bit, YCbCr, ...) or conversion
+	return DecodeRGBA(data, grey, region);
+}
+
+/*
+ * Decodes the current page reduced to the given scale without holding the full resolution page in memory.
+ * If the page has reduced resolution versions (pyramid levels in sub-IFDs), the smallest level that is
+ * at least as large as the target size is decoded. The rows are streamed through an area averaging
+ * downsampler (strip by strip or tile row by tile row).
+ * Bi-level pages are reduced to grey scale unless a bi-level image is requested.
+ *
+ * 'scale' - Target scale (0..1], e.g. 0.25 for a quarter of the width and height. Values >= 1 decode the full page.
+ * Returns: Image of the reduced size (the resolution in the image info is adjusted) or NULL.
+ */
+COpenCvImage * COpenCvTiffReader::ReadPageScaled(int enforceType, double scale)
+{
+	if (m_Tif == NULL || scale <= 0.0)
+		return NULL;
+	if (scale >= 1.0)
+		return ReadPage(enforceType);
+
+	uint32 pageWidth = 0, pageHeight = 0;
+	TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &pageWidth);
+	TIFFGetField(m_Tif, TIFFTAG_IMAGELENGTH, &pageHeight);
+	if (pageWidth == 0 || pageHeight == 0)
+		return NULL;
+
+	int targetWidth = max(1, (int)(pageWidth * scale + 0.5));
+	int targetHeight = max(1, (int)(pageHeight * scale + 0.5));
+	CImageInfo * info = ReadImageInfo();
+
+	//Pyramid level (the full resolution directory is restored below)
+	bool reducedLevel = SelectReducedLevel(targetWidth, targetHeight);
+	uint32 width = pageWidth, height = pageHeight;
+	if (reducedLevel)
+	{
+		TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(m_Tif, TIFFTAG_IMAGELENGTH, &height);
+	}
+
+	bool minIsWhite = false;
+	int layout = GetSampleLayout(minIsWhite);
+	bool grey = IsGreyDecoding(enforceType, layout);
+	CAreaDownsampler downsampler((int)width, (int)height, targetWidth, targetHeight, grey ? 1 : 3);
+
+	bool success = true;
+	if (layout != SAMPLES_OTHER && (layout == SAMPLES_RGB8 || grey))
+	{
+		//Row by row
+		CTiffDownsamplingRowHandler handler(downsampler, (int)width, layout == SAMPLES_BILEVEL, layout == SAMPLES_RGB8, minIsWhite, grey);
+		success = ReadTiffRows(m_Tif, width, height, Rect(0, 0, (int)width, (int)height), handler);
+	}
+	else
+	{
+		//Band by band (one strip or one row of tiles at a time)
+		uint32 bandHeight = height;
+		if (TIFFIsTiled(m_Tif))
+			TIFFGetField(m_Tif, TIFFTAG_TILELENGTH, &bandHeight);
+		else
+			TIFFGetFieldDefaulted(m_Tif, TIFFTAG_ROWSPERSTRIP, &bandHeight);
+		bandHeight = min(max(bandHeight, (uint32)1), height);
+
+		Mat band;
+		for (uint32 row = 0; row < height && success; row += bandHeight)
+		{
+			int rows = (int)min(bandHeight, height - row);
+			success = DecodeRegion(band, layout, minIsWhite, grey, Rect(0, (int)row, (int)width, rows));
+			for (int i = 0; i < rows && success; i++)
+				downsampler.AddRow((int)row + i, band.ptr<uchar>(i));
+		}
+	}
+
+	if (reducedLevel)
+		TIFFSetSubDirectory(m_Tif, m_PageOffsets[m_CurrentPage]);
+
+	if (!success)
+	{
+		delete info;
+		return NULL;
+	}
+
+	info->resolutionX *= (float)targetWidth / (float)pageWidth;
+	info->resolutionY *= (float)targetHeight / (float)pageHeight;
+	info->width = targetWidth;
+	info->height = targetHeight;
+
+	if (enforceType == COpenCvImage::TYPE_AUTO && grey)
+		enforceType = COpenCvImage::TYPE_GREYSCALE;
+	COpenCvImage * img = COpenCvImage::Create(downsampler.Finish(), enforceType, true);
+	if (img != NULL)
+		img->SetImageInfo(info);
+	else
+		delete info;
+	return img;
+}
+
+/*
+ * Looks for a reduced resolution version of the current page (sub-IFD) that is at least as large as the
+ * given target size and makes the smallest of these the current directory.
+ * Returns true if a reduced version has been selected (restore the page directory afterwards).
+ */
+bool COpenCvTiffReader::SelectReducedLevel(int targetWidth, int targetHeight)
+{
+	uint16 count = 0;
+	uint64 * offsets = NULL;
+	if (!TIFFGetField(m_Tif, TIFFTAG_SUBIFD, &count, &offsets) || count == 0 || offsets == NULL)
+		return false;
+	std::vector<uint64> levels(offsets, offsets + count); //The array belongs to the current directory
+
+	uint32 pageWidth = 0;
+	TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &pageWidth);
+
+	uint64 bestLevel = 0;
+	uint32 bestWidth = pageWidth;
+	for (unsigned int i = 0; i < levels.size(); i++)
+	{
+		if (!TIFFSetSubDirectory(m_Tif, levels[i]))
+			continue;
+		uint32 subfileType = 0, width = 0, height = 0;
+		TIFFGetFieldDefaulted(m_Tif, TIFFTAG_SUBFILETYPE, &subfileType);
+		TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(m_Tif, TIFFTAG_IMAGELENGTH, &height);
+		if ((subfileType & FILETYPE_MASK) == 0
+			&& width >= (uint32)targetWidth && height >= (uint32)targetHeight && width < bestWidth)
+		{
+			bestLevel = levels[i];
+			bestWidth = width;
+		}
+	}
+
+	if (bestLevel != 0 && TIFFSetSubDirectory(m_Tif, bestLevel))
+		return true;
+	TIFFSetSubDirectory(m_Tif, m_PageOffsets[m_CurrentPage]);
+	return false;
+}
+
+/*
+ * Decodes the given region of the current page strip by strip (or tile by tile) using the RGBA interface
+ * of libtiff (handles all photometric interpretations, bit depths and compressions supported by libtiff).
+ * Only the strips or tiles intersecting the region are decoded.
+ *
+ * 'data' - Matrix of the size of the region (8 bit grey scale if 'grey' is true, otherwise 8 bit BGR)
+ */
+bool COpenCvTiffReader::DecodeRGBA(Mat & data, bool grey, Rect region)
+{
+	char emsg[1024];
+	if (!TIFFRGBAImageOK(m_Tif, emsg))
+		return false;
+
+	uint32 width = 0, height = 0;
+	TIFFGetField(m_Tif, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(m_Tif, TIFFTAG_IMAGELENGTH, &height);
+	if (width == 0 || height == 0)
+		return false;
+
+	int channels = grey ? 1 : 3;
+	int regionRight = region.x + region.width;
+	int regionBottom = region.y + region.height;
+
+	//Note: The RGBA rasters are bottom-up
+	if (TIFFIsTiled(m_Tif))
+	{
+		uint32 tileWidth = 0, tileHeight = 0;
+		TIFFGetField(m_Tif, TIFFTAG_TILEWIDTH, &tileWidth);
+		TIFFGetField(m_Tif, TIFFTAG_TILELENGTH, &tileHeight);
+		if (tileWidth == 0 || tileHeight == 0)
+			return false;
+
+		std::vector<uint32> raster((size_t)tileWidth * tileHeight);
+		for (int row = (region.y / tileHeight) * tileHeight; row < regionBottom; row += tileHeight)
+		{
+			int firstRow = max(row, region.y);
+			int endRow = min(row + (int)tileHeight, regionBottom);
+			for (int col = (region.x / tileWidth) * tileWidth; col < regionRight; col += tileWidth)
+			{
+				if (!TIFFReadRGBATile(m_Tif, col, row, raster.data()))
+					return false;
+				int firstCol = max(col, region.x);
+				int endCol = min(col + (int)tileWidth, regionRight);
+				for (int y = firstRow; y < endRow; y++)
+					ConvertRGBARow(&raster[(size_t)(tileHeight - 1 - (y - row)) * tileWidth + (firstCol - col)],
+									data.ptr<uchar>(y - region.y) + (firstCol - region.x) * channels, endCol - firstCol, grey);
+			}
+		}
+	}
+	else //Strips
+	{
+		uint32 rowsPerStrip = height;
+		TIFFGetFieldDefaulted(m_Tif, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+		rowsPerStrip = min(max(rowsPerStrip, (uint32)1), height);
+
+		std::vector<uint32> raster((size_t)width * rowsPerStrip);
+		for (int row = (region.y / rowsPerStrip) * rowsPerStrip; row < regionBottom; row += rowsPerStrip)
+		{
+			if (!TIFFReadRGBAStrip(m_Tif, row, raster.data()))
+				return false;
+			int rows = min((int)rowsPerStrip, (int)height - row);
+			for (int y = max(row, region.y); y < min(row + rows, regionBottom); y++)
+				ConvertRGBARow(&raster[(size_t)(rows - 1 - (y - row)) * width + region.x], data.ptr<uchar>(y - region.y), region.width, grey);
+		}
+	}
+	return true;
+}
+
+/*
+ * Clips the given region to the page
+ */
+Rect COpenCvTiffReader::ClipRegion(int left, int top, int width, int height, uint32 pageWidth, uint32 pageHeight)
+{
+	int64 right = min((int64)left + width, (int64)pageWidth);
+	int64 bottom = min((int64)top + height, (int64)pageHeight);
+	left = max(left, 0);
+	top = max(top, 0);
+	return Rect(left, top, (int)max(right - left, (int64)0), (int)max(bottom - top, (int64)0));
+}
+
+/*
+ * Converts one row of libtiff RGBA pixels to BGR or grey scale (same weights as OpenCV)
+ */
+void COpenCvTiffReader::ConvertRGBARow(const uint32 * src, uchar * dst, int width, bool grey)
+{
+	if (grey)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			uint32 p = src[x];
+			dst[x] = (uchar)((TIFFGetB(p) * 1868 + TIFFGetG(p) * 9617 + TIFFGetR(p) * 4899 + (1 << 13)) >> 14);
+		}
+	}
+	else
+	{
+		for (int x = 0; x < width; x++)
+		{
+			uint32 p = src[x];
+			*dst++ = (uchar)TIFFGetB(p);
+			*dst++ = (uchar)TIFFGetG(p);
+			*dst++ = (uchar)TIFFGetR(p);
+		}
+	}
+}
+
+
+} //end namespace
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "opencvimage.h"
+#include "tiffio.h"
+#include <vector>
+
+namespace PRImA {
+
+/*
+ * Class COpenCvTiffReader
+ *
+ * TIFF reader (libtiff) for single pages of (multi-page) TIFF files.
+ * Pages are located via their image file directories (IFD) without decoding the other pages.
+ * The IFD offsets are cached, so a page can be revisited without walking the directory chain again.
+ *
+ * The header and the pixel data of a page are read from the same open file. Common layouts
+ * (1 bit bi-level, 8 bit grey scale and 8 bit RGB) are decoded strip by strip (or tile by tile)
+ * straight into the destination; all others via the RGBA interface of libtiff.
+ * Regions of a page can be decoded without decoding the whole page (see ReadPageRegion()).
+ * Reduced versions of a page are decoded via pyramid levels (sub-IFDs) if available, otherwise
+ * streamed through an area averaging downsampler (see ReadPageScaled()).
+ *
+ * Usage: Open(), SetPage() or NextPage(), ReadPage(), Close()
+ */
+class COpenCvTiffReader
+{
+private:
+	static const int SAMPLES_OTHER		= 0;
+	static const int SAMPLES_BILEVEL	= 1;	//1 bit, one sample (min-is-black or min-is-white)
+	static const int SAMPLES_GREY8		= 2;	//8 bit, one sample (min-is-black or min-is-white)
+	static const int SAMPLES_RGB8		= 3;	//8 bit, three samples (RGB, contiguous)
+
+public:
+	COpenCvTiffReader(void);
+	~COpenCvTiffReader(void);
+
+	static bool IsTiffFile(CUniString filePath);
+
+	bool Open(CUniString filePath);
+	void Close();
+	inline bool IsOpen() { return m_Tif != NULL; };
+
+	int		GetPageCount();
+	bool	SetPage(int pageIndex);
+	bool	NextPage();
+	inline int GetCurrentPage() { return m_CurrentPage; };
+
+	CImageInfo *	ReadImageInfo();
+	COpenCvImage *	ReadPage(int enforceType);
+	COpenCvImage *	ReadPageRegion(int enforceType, int left, int top, int width, int height);
+	COpenCvImage *	ReadPageScaled(int enforceType, double scale);
+
+	inline void SetPackedBilevel(bool packed) { m_PackedBilevel = packed; };
+	inline bool IsPackedBilevel() { return m_PackedBilevel; };
+
+private:
+	int  GetSampleLayout(bool & minIsWhite);
+	bool DecodeRegion(cv::Mat & data, int layout, bool minIsWhite, bool grey, cv::Rect region);
+	bool DecodeRGBA(cv::Mat & data, bool grey, cv::Rect region);
+	bool SelectReducedLevel(int targetWidth, int targetHeight);
+
+	static bool IsGreyDecoding(int enforceType, int layout);
+
+	static cv::Rect ClipRegion(int left, int top, int width, int height, uint32 pageWidth, uint32 pageHeight);
+
+	static void ConvertRGBARow(const uint32 * src, uchar * dst, int width, bool grey);
+
+private:
+	TIFF					*	m_Tif;
+	CUniString					m_FilePath;
+	int							m_CurrentPage;
+	int							m_PageCount;		//-1 if not known yet
+	bool						m_PackedBilevel;	//Decode bi-level pages into packed storage
+	std::vector<uint64>			m_PageOffsets;		//IFD offsets of the pages visited so far (in order, without gaps)
+};
+
+} //end namespace
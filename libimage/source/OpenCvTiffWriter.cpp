@@ -0,0 +1,268 @@
+#include "OpenCvTiffWriter.h"
+
+using namespace cv;
+
+namespace PRImA {
+
+
+/*
+ * Packs one row of a bi-level OpenCV matrix into bytes (most significant bit first, set bit = black).
+ * A pixel is black if its first channel is 0.
+ */
+template<class T>
+static void PackBilevelRow(const T * src, int width, int channels, uchar * dst)
+{
+	for (int x = 0; x < width; x += 8)
+	{
+		int n = min(8, width - x);
+		uchar value = 0;
+		for (int i = 0; i < n; i++, src += channels)
+			if (*src == 0)
+				value |= (uchar)(0x80 >> i);
+		*dst++ = value;
+	}
+}
+
+/*
+ * Copies one row of an OpenCV matrix to a TIFF scanline (BGR is converted to RGB).
+ */
+template<class T>
+static void CopyRow(const T * src, int width, int channels, T * dst)
+{
+	if (channels == 3)
+	{
+		for (int x = 0; x < width; x++, src += 3, dst += 3)
+		{
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+		}
+	}
+	else
+		memcpy(dst, src, width * channels * sizeof(T));
+}
+
+
+/*
+ * Class COpenCvTiffWriter
+ *
+ * TIFF writer (libtiff) for OpenCV images with selectable compression and resolution tags.
+ */
+
+/*
+ * Constructor
+ */
+COpenCvTiffWriter::COpenCvTiffWriter(void)
+{
+	m_Tif = NULL;
+	m_Compression = COMPRESS_AUTO;
+	m_PageCount = 0;
+}
+
+/*
+ * Destructor
+ */
+COpenCvTiffWriter::~COpenCvTiffWriter(void)
+{
+	Close();
+}
+
+/*
+ * Saves the given image as single-page TIFF file.
+ */
+bool COpenCvTiffWriter::Write(COpenCvImage * image, CUniString filePath)
+{
+	if (!Open(filePath))
+		return false;
+	bool success = WritePage(image);
+	Close();
+	return success;
+}
+
+/*
+ * Creates a new TIFF file (an existing file will be overwritten).
+ * Use WritePage() to add pages and Close() to finish the file.
+ */
+bool COpenCvTiffWriter::Open(CUniString filePath)
+{
+	Close();
+
+	if (filePath.IsEmpty())
+		return false;
+
+	m_Tif = TIFFOpen(filePath.ToC_Str(), "w");
+	m_PageCount = 0;
+	return m_Tif != NULL;
+}
+
+/*
+ * Finishes and closes the file
+ */
+void COpenCvTiffWriter::Close()
+{
+	if (m_Tif != NULL)
+		TIFFClose(m_Tif);
+	m_Tif = NULL;
+}
+
+/*
+ * Appends the given image as new page (directory) to the open file.
+ * Bi-level images are written with one bit per pixel, grey scale and colour images with
+ * 8 or 16 bits per sample.
+ */
+bool COpenCvTiffWriter::WritePage(COpenCvImage * image)
+{
+	if (m_Tif == NULL || image == NULL || image->GetWidth() <= 0 || image->GetHeight() <= 0)
+		return false;
+
+	bool success;
+	if (typeid(*image) == typeid(COpenCvBiLevelImage))
+		success = WriteBilevel((COpenCvBiLevelImage*)image);
+	else
+		success = WriteGreyOrColour(image);
+
+	if (success)
+		success = TIFFWriteDirectory(m_Tif) != 0;
+	if (success)
+		m_PageCount++;
+	return success;
+}
+
+/*
+ * Returns the libtiff compression scheme for the selected compression
+ */
+int COpenCvTiffWriter::GetTiffCompression(bool bilevel)
+{
+	switch (m_Compression)
+	{
+		case COMPRESS_NONE:		return COMPRESSION_NONE;
+		case COMPRESS_G3:		return bilevel ? COMPRESSION_CCITTFAX3 : COMPRESSION_LZW;
+		case COMPRESS_G4:		return bilevel ? COMPRESSION_CCITTFAX4 : COMPRESSION_LZW;
+		case COMPRESS_LZW:		return COMPRESSION_LZW;
+		case COMPRESS_DEFLATE:	return COMPRESSION_ADOBE_DEFLATE;
+	}
+	return bilevel ? COMPRESSION_CCITTFAX4 : COMPRESSION_LZW; //Auto
+}
+
+/*
+ * Sets size, compression and resolution of the current page
+ */
+void COpenCvTiffWriter::SetCommonFields(COpenCvImage * image, bool bilevel)
+{
+	TIFFSetField(m_Tif, TIFFTAG_IMAGEWIDTH, (uint32)image->GetWidth());
+	TIFFSetField(m_Tif, TIFFTAG_IMAGELENGTH, (uint32)image->GetHeight());
+	TIFFSetField(m_Tif, TIFFTAG_COMPRESSION, GetTiffCompression(bilevel));
+	TIFFSetField(m_Tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(m_Tif, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
+
+	CImageInfo * info = image->GetImageInfo();
+	if (info != NULL && info->resolutionX > 0.0f && info->resolutionY > 0.0f)
+	{
+		TIFFSetField(m_Tif, TIFFTAG_XRESOLUTION, info->resolutionX);
+		TIFFSetField(m_Tif, TIFFTAG_YRESOLUTION, info->resolutionY);
+		TIFFSetField(m_Tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
+	}
+}
+
+/*
+ * Writes a bi-level image with one bit per pixel (min-is-white).
+ * The rows are packed strip by strip from the OpenCV matrix or the packed storage of the image.
+ */
+bool COpenCvTiffWriter::WriteBilevel(COpenCvBiLevelImage * image)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+
+	SetCommonFields(image, true);
+	TIFFSetField(m_Tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(m_Tif, TIFFTAG_BITSPERSAMPLE, 1);
+	TIFFSetField(m_Tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE); //Set bit = black
+
+	int compression = GetTiffCompression(true);
+	uint32 rowsPerStrip;
+	if (compression == COMPRESSION_CCITTFAX3 || compression == COMPRESSION_CCITTFAX4)
+	{
+		if (compression == COMPRESSION_CCITTFAX3)
+			TIFFSetField(m_Tif, TIFFTAG_GROUP3OPTIONS, GROUP3OPT_2DENCODING);
+		rowsPerStrip = (uint32)height; //One strip (CCITT codes each row relative to the previous one)
+	}
+	else
+		rowsPerStrip = TIFFDefaultStripSize(m_Tif, 0);
+	rowsPerStrip = min(max(rowsPerStrip, (uint32)1), (uint32)height);
+	TIFFSetField(m_Tif, TIFFTAG_ROWSPERSTRIP, rowsPerStrip);
+
+	tmsize_t scanlineSize = TIFFScanlineSize(m_Tif);
+	std::vector<uchar> strip((size_t)scanlineSize * rowsPerStrip);
+
+	CPackedBitMatrix * packedData = image->GetPackedData();
+	Mat data;
+	if (packedData == NULL)
+		data = image->GetData(false);
+
+	for (int row = 0, stripIndex = 0; row < height; row += rowsPerStrip, stripIndex++)
+	{
+		int rows = min((int)rowsPerStrip, height - row);
+		for (int i = 0; i < rows; i++)
+		{
+			uchar * dst = &strip[(size_t)i * scanlineSize];
+			if (packedData != NULL)
+				packedData->GetRowBits(row + i, 0, width, dst, false);
+			else if (data.depth() == CV_8U)
+				PackBilevelRow(data.ptr<uchar>(row + i), width, data.channels(), dst);
+			else
+				PackBilevelRow(data.ptr<ushort>(row + i), width, data.channels(), dst);
+		}
+		if (TIFFWriteEncodedStrip(m_Tif, stripIndex, strip.data(), scanlineSize * rows) < 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Writes a grey scale or colour image (8 or 16 bits per sample).
+ */
+bool COpenCvTiffWriter::WriteGreyOrColour(COpenCvImage * image)
+{
+	Mat data = image->GetData(false);
+	int channels = data.channels();
+	if ((channels != 1 && channels != 3) || (data.depth() != CV_8U && data.depth() != CV_16U))
+		return false;
+
+	int width = data.cols;
+	int height = data.rows;
+
+	SetCommonFields(image, false);
+	TIFFSetField(m_Tif, TIFFTAG_SAMPLESPERPIXEL, channels);
+	TIFFSetField(m_Tif, TIFFTAG_BITSPERSAMPLE, data.depth() == CV_8U ? 8 : 16);
+	TIFFSetField(m_Tif, TIFFTAG_PHOTOMETRIC, channels == 1 ? PHOTOMETRIC_MINISBLACK : PHOTOMETRIC_RGB);
+
+	int compression = GetTiffCompression(false);
+	if (compression == COMPRESSION_LZW || compression == COMPRESSION_ADOBE_DEFLATE)
+		TIFFSetField(m_Tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+
+	uint32 rowsPerStrip = min(max(TIFFDefaultStripSize(m_Tif, 0), (uint32)1), (uint32)height);
+	TIFFSetField(m_Tif, TIFFTAG_ROWSPERSTRIP, rowsPerStrip);
+
+	//Note: The strip buffer may be changed by libtiff (predictor), so the rows are always copied
+	tmsize_t scanlineSize = TIFFScanlineSize(m_Tif);
+	std::vector<uchar> strip((size_t)scanlineSize * rowsPerStrip);
+
+	for (int row = 0, stripIndex = 0; row < height; row += rowsPerStrip, stripIndex++)
+	{
+		int rows = min((int)rowsPerStrip, height - row);
+		for (int i = 0; i < rows; i++)
+		{
+			uchar * dst = &strip[(size_t)i * scanlineSize];
+			if (data.depth() == CV_8U)
+				CopyRow(data.ptr<uchar>(row + i), width, channels, dst);
+			else
+				CopyRow(data.ptr<ushort>(row + i), width, channels, (ushort*)dst);
+		}
+		if (TIFFWriteEncodedStrip(m_Tif, stripIndex, strip.data(), scanlineSize * rows) < 0)
+			return false;
+	}
+	return true;
+}
+
+
+} //end namespace
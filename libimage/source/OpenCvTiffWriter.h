@@ -0,0 +1,53 @@
+#pragma once
+
+#include "opencvimage.h"
+#include "tiffio.h"
+
+namespace PRImA {
+
+/*
+ * Class COpenCvTiffWriter
+ *
+ * TIFF writer (libtiff) for OpenCV images with selectable compression and resolution tags.
+ * Bi-level images are written with one bit per pixel; the rows are packed straight from the
+ * OpenCV matrix (or from packed storage).
+ * Supports multi-page files (Open(), WritePage() for each page, Close()).
+ */
+class COpenCvTiffWriter
+{
+public:
+	static const int COMPRESS_AUTO		= 0;	//CCITT G4 for bi-level, LZW otherwise
+	static const int COMPRESS_NONE		= 1;
+	static const int COMPRESS_G3		= 2;	//CCITT Group 3 (bi-level only, LZW otherwise)
+	static const int COMPRESS_G4		= 3;	//CCITT Group 4 (bi-level only, LZW otherwise)
+	static const int COMPRESS_LZW		= 4;
+	static const int COMPRESS_DEFLATE	= 5;
+
+public:
+	COpenCvTiffWriter(void);
+	~COpenCvTiffWriter(void);
+
+	bool Write(COpenCvImage * image, CUniString filePath);
+
+	bool Open(CUniString filePath);
+	bool WritePage(COpenCvImage * image);
+	void Close();
+	inline bool IsOpen() { return m_Tif != NULL; };
+	inline int	GetPageCount() { return m_PageCount; };
+
+	inline void SetCompression(int compression) { m_Compression = compression; };
+	inline int	GetCompression() { return m_Compression; };
+
+private:
+	int  GetTiffCompression(bool bilevel);
+	void SetCommonFields(COpenCvImage * image, bool bilevel);
+	bool WriteBilevel(COpenCvBiLevelImage * image);
+	bool WriteGreyOrColour(COpenCvImage * image);
+
+private:
+	TIFF	*	m_Tif;
+	int			m_Compression;
+	int			m_PageCount;
+};
+
+} //end namespace
@@ -0,0 +1,363 @@
+#include "PackedBitMatrix.h"
+#include "opencv2/core/hal/hal.hpp"
+
+using namespace cv;
+
+namespace PRImA {
+
+/*
+ * Class CPackedBitMatrix
+ *
+ * Bi-level pixel matrix with one bit per pixel.
+ * Pixels are stored row by row in 64 bit words (bit 0 of a word is the leftmost pixel).
+ * Each row is padded to a whole number of words; the padding bits are always 0.
+ * A set bit (1) means black, a cleared bit (0) means white.
+ */
+
+/*
+ * Packs the rows of an OpenCV matrix (pixel is black if the first channel is 0)
+ */
+template<class T>
+static void PackRows(const Mat & data, int wordsPerRow, std::vector<uint64_t> & words)
+{
+	int width = data.cols;
+	int channels = data.channels();
+	for (int y = 0; y < data.rows; y++)
+	{
+		const T * src = data.ptr<T>(y);
+		uint64_t * dst = &words[(size_t)y * wordsPerRow];
+		for (int x = 0; x < width; x += CPackedBitMatrix::WORD_BITS)
+		{
+			int n = min(CPackedBitMatrix::WORD_BITS, width - x);
+			uint64_t word = 0;
+			for (int i = 0; i < n; i++)
+				word |= (uint64_t)(src[(x + i) * channels] == 0) << i;
+			dst[x >> 6] = word;
+		}
+	}
+}
+
+/*
+ * Unpacks the bits of the given region into the rows of an OpenCV matrix (black = 0, white = 'whiteValue' in all channels)
+ */
+template<class T>
+static void UnpackRows(const std::vector<uint64_t> & words, int wordsPerRow, int left, int top, Mat & data, int whiteValue)
+{
+	int width = data.cols;
+	int channels = data.channels();
+	T white = (T)whiteValue;
+	for (int y = 0; y < data.rows; y++)
+	{
+		const uint64_t * src = &words[(size_t)(y + top) * wordsPerRow];
+		T * dst = data.ptr<T>(y);
+		for (int x = left; x < left + width; x++)
+		{
+			T val = ((src[x >> 6] >> (x & 63)) & 1) ? (T)0 : white;
+			for (int c = 0; c < channels; c++)
+				*dst++ = val;
+		}
+	}
+}
+
+/*
+ * Constructor (empty matrix)
+ */
+CPackedBitMatrix::CPackedBitMatrix()
+{
+	m_Width = 0;
+	m_Height = 0;
+	m_WordsPerRow = 0;
+}
+
+/*
+ * Constructor
+ *
+ * 'black' - Initial value of all pixels
+ */
+CPackedBitMatrix::CPackedBitMatrix(int width, int height, bool black /*= false*/)
+{
+	Create(width, height, black);
+}
+
+/*
+ * (Re)allocates the matrix and sets all pixels to the given value
+ */
+void CPackedBitMatrix::Create(int width, int height, bool black /*= false*/)
+{
+	m_Width = width;
+	m_Height = height;
+	m_WordsPerRow = (width + WORD_BITS - 1) / WORD_BITS;
+	m_Words.assign((size_t)m_WordsPerRow * height, black ? ~(uint64_t)0 : 0);
+	if (black)
+		ClearPadding();
+}
+
+/*
+ * Packs the given OpenCV pixel matrix (8 or 16 bit, one or three channels).
+ * A pixel is regarded as black if the value of its first channel is 0 (see COpenCvBiLevelImage::IsBlack()).
+ */
+void CPackedBitMatrix::FromMat(const Mat & data)
+{
+	Create(data.cols, data.rows);
+	if (data.depth() == CV_8U)
+		PackRows<uchar>(data, m_WordsPerRow, m_Words);
+	else
+		PackRows<ushort>(data, m_WordsPerRow, m_Words);
+}
+
+/*
+ * Unpacks the bits into an OpenCV pixel matrix of the given type.
+ *
+ * 'type' - OpenCV matrix type (e.g. CV_8UC1)
+ * 'whiteValue' - Channel value for white pixels (black is 0)
+ */
+void CPackedBitMatrix::ToMat(Mat & data, int type, int whiteValue) const
+{
+	ToMat(data, type, whiteValue, 0, 0, m_Width, m_Height);
+}
+
+/*
+ * Unpacks the bits of the given region into an OpenCV pixel matrix of the given type.
+ *
+ * 'type' - OpenCV matrix type (e.g. CV_8UC1)
+ * 'whiteValue' - Channel value for white pixels (black is 0)
+ * 'left', 'top', 'width', 'height' - Region (has to be within the matrix)
+ */
+void CPackedBitMatrix::ToMat(Mat & data, int type, int whiteValue, int left, int top, int width, int height) const
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(left >= 0 && top >= 0 && left + width <= m_Width && top + height <= m_Height);
+
+	data.create(height, width, type);
+	if (data.depth() == CV_8U)
+		UnpackRows<uchar>(m_Words, m_WordsPerRow, left, top, data, whiteValue);
+	else
+		UnpackRows<ushort>(m_Words, m_WordsPerRow, left, top, data, whiteValue);
+}
+
+/*
+ * Sets a row segment from bits packed into bytes with the most significant bit first
+ * (as used by TIFF and BMP files, for instance).
+ *
+ * 'x' - Start of the segment (has to be a multiple of 8)
+ * 'count' - Number of pixels
+ * 'src' - Packed bits (a set bit means black, unless 'invert' is true)
+ */
+void CPackedBitMatrix::SetRowBits(int y, int x, int count, const uchar * src, bool invert)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(x % 8 == 0 && x >= 0 && x + count <= m_Width);
+
+	uint64_t * row = GetRow(y);
+	int bytes = (count + 7) / 8;
+	for (int i = 0; i < bytes; i++)
+	{
+		uint64_t value = ReverseBits(invert ? (uchar)~src[i] : src[i]);
+		int n = count - i * 8;
+		if (n < 8) //Last byte (the remaining bits are padding)
+			value &= ((uint64_t)1 << n) - 1;
+		int bit = x + i * 8;
+		int shift = bit & 63;
+		uint64_t & word = row[bit >> 6];
+		word = (word & ~((uint64_t)0xFF << shift)) | (value << shift);
+	}
+}
+
+/*
+ * Copies a row segment to bytes with the most significant bit first (see SetRowBits()).
+ * Unused bits of the last byte are set to 0.
+ *
+ * 'x' - Start of the segment (has to be a multiple of 8)
+ * 'count' - Number of pixels
+ * 'dst' - Packed bits (a set bit means black, unless 'invert' is true)
+ */
+void CPackedBitMatrix::GetRowBits(int y, int x, int count, uchar * dst, bool invert) const
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(x % 8 == 0 && x >= 0 && x + count <= m_Width);
+
+	const uint64_t * row = GetRow(y);
+	int bytes = (count + 7) / 8;
+	for (int i = 0; i < bytes; i++)
+	{
+		int bit = x + i * 8;
+		uchar value = ReverseBits((uchar)(row[bit >> 6] >> (bit & 63)));
+		if (invert)
+			value = (uchar)~value;
+		int n = count - i * 8;
+		if (n < 8) //Last byte
+			value &= (uchar)(0xFF << (8 - n));
+		dst[i] = value;
+	}
+}
+
+/*
+ * Pixel-wise 'and' operation (result pixel is black if both pixels are black).
+ * Both matrices must have the same size.
+ */
+void CPackedBitMatrix::And(const CPackedBitMatrix & other)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(other.m_Width == m_Width && other.m_Height == m_Height);
+
+	size_t count = m_Words.size();
+	uint64_t * dst = m_Words.data();
+	const uint64_t * src = other.m_Words.data();
+	for (size_t i = 0; i < count; i++)
+		dst[i] &= src[i];
+}
+
+/*
+ * Pixel-wise 'and' operation with the other matrix placed at the given offset.
+ * Pixels not covered by the other matrix are set to white.
+ */
+void CPackedBitMatrix::AndOffset(const CPackedBitMatrix & other, int offx, int offy)
+{
+	for (int y = 0; y < m_Height; y++)
+	{
+		uint64_t * dst = GetRow(y);
+		int sy = y - offy;
+		if (sy < 0 || sy >= other.m_Height)
+		{
+			memset(dst, 0, m_WordsPerRow * sizeof(uint64_t));
+			continue;
+		}
+		const uint64_t * src = other.GetRow(sy);
+		for (int w = 0; w < m_WordsPerRow; w++)
+			dst[w] &= ReadBits(src, other.m_WordsPerRow, w * WORD_BITS - offx);
+	}
+	ClearPadding();
+}
+
+/*
+ * Pixel-wise 'xor' operation (result pixel is black if the pixels differ).
+ * Both matrices must have the same size.
+ */
+void CPackedBitMatrix::Xor(const CPackedBitMatrix & other)
+{
+	//Sanity check (evaluated in debug mode only)
+	ASSERT(other.m_Width == m_Width && other.m_Height == m_Height);
+
+	size_t count = m_Words.size();
+	uint64_t * dst = m_Words.data();
+	const uint64_t * src = other.m_Words.data();
+	for (size_t i = 0; i < count; i++)
+		dst[i] ^= src[i];
+}
+
+/*
+ * Pixel-wise 'xor' operation with the other matrix placed at the given offset.
+ * Only the area covered by the other matrix is changed.
+ */
+void CPackedBitMatrix::XorOffset(const CPackedBitMatrix & other, int offx, int offy)
+{
+	int top = max(0, offy);
+	int bottom = min(m_Height, offy + other.m_Height) - 1;
+	int left = max(0, offx);
+	int right = min(m_Width, offx + other.m_Width) - 1;
+	if (left > right)
+		return;
+
+	for (int y = top; y <= bottom; y++)
+	{
+		uint64_t * dst = GetRow(y);
+		const uint64_t * src = other.GetRow(y - offy);
+		for (int w = left / WORD_BITS; w <= right / WORD_BITS; w++)
+			dst[w] ^= ReadBits(src, other.m_WordsPerRow, w * WORD_BITS - offx);
+	}
+	ClearPadding();
+}
+
+/*
+ * Inverts all pixels (black becomes white and vice versa)
+ */
+void CPackedBitMatrix::Invert()
+{
+	size_t count = m_Words.size();
+	uint64_t * dst = m_Words.data();
+	for (size_t i = 0; i < count; i++)
+		dst[i] = ~dst[i];
+	ClearPadding();
+}
+
+/*
+ * Returns the number of set bits (black pixels) of the whole matrix.
+ */
+long CPackedBitMatrix::CountBits() const
+{
+	long count = 0L;
+	int rowBytes = m_WordsPerRow * (int)sizeof(uint64_t);
+	for (int y = 0; y < m_Height; y++)
+		count += hal::normHamming((const uchar*)GetRow(y), rowBytes);
+	return count;
+}
+
+/*
+ * Returns the number of set bits (black pixels) within the given rectangle (inclusive coordinates).
+ * The rectangle is clipped to the matrix.
+ */
+long CPackedBitMatrix::CountBits(int left, int top, int right, int bottom) const
+{
+	left = max(0, left);
+	top = max(0, top);
+	right = min(m_Width - 1, right);
+	bottom = min(m_Height - 1, bottom);
+	if (left > right || top > bottom)
+		return 0L;
+
+	int firstWord = left / WORD_BITS;
+	int lastWord = right / WORD_BITS;
+	long count = 0L;
+	if (firstWord == lastWord)
+	{
+		uint64_t mask = RangeMask(left & 63, right & 63);
+		for (int y = top; y <= bottom; y++)
+			count += PopCount(GetRow(y)[firstWord] & mask);
+	}
+	else
+	{
+		uint64_t firstMask = RangeMask(left & 63, 63);
+		uint64_t lastMask = RangeMask(0, right & 63);
+		for (int y = top; y <= bottom; y++)
+		{
+			const uint64_t * row = GetRow(y);
+			count += PopCount(row[firstWord] & firstMask);
+			for (int w = firstWord + 1; w < lastWord; w++)
+				count += PopCount(row[w]);
+			count += PopCount(row[lastWord] & lastMask);
+		}
+	}
+	return count;
+}
+
+/*
+ * Reads 64 bits of a row starting at the given bit position (can be negative or beyond the row).
+ * Bits outside the row are 0.
+ */
+uint64_t CPackedBitMatrix::ReadBits(const uint64_t * row, int wordsPerRow, int bitPos)
+{
+	int wordIndex = bitPos >= 0 ? bitPos / WORD_BITS : -((-bitPos + WORD_BITS - 1) / WORD_BITS);
+	int shift = bitPos - wordIndex * WORD_BITS;
+
+	uint64_t lo = (wordIndex >= 0 && wordIndex < wordsPerRow) ? row[wordIndex] : 0;
+	if (shift == 0)
+		return lo;
+	uint64_t hi = (wordIndex + 1 >= 0 && wordIndex + 1 < wordsPerRow) ? row[wordIndex + 1] : 0;
+	return (lo >> shift) | (hi << (WORD_BITS - shift));
+}
+
+/*
+ * Resets the padding bits at the end of each row
+ */
+void CPackedBitMatrix::ClearPadding()
+{
+	int usedBits = m_Width % WORD_BITS;
+	if (usedBits == 0 || m_WordsPerRow == 0)
+		return;
+	uint64_t mask = RangeMask(0, usedBits - 1);
+	for (int y = 0; y < m_Height; y++)
+		GetRow(y)[m_WordsPerRow - 1] &= mask;
+}
+
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#ifndef PACKEDBITMATRIX_H
+#define PACKEDBITMATRIX_H
+
+#include "opencv2\opencv.hpp"
+#include "afxwin.h"
+#include <vector>
+#include <stdint.h>
+
+namespace PRImA {
+
+/*
+ * Class CPackedBitMatrix
+ *
+ * Bi-level pixel matrix with one bit per pixel.
+ * Pixels are stored row by row in 64 bit words (bit 0 of a word is the leftmost pixel).
+ * Each row is padded to a whole number of words; the padding bits are always 0.
+ * A set bit (1) means black, a cleared bit (0) means white.
+ */
+class CPackedBitMatrix
+{
+public:
+	static const int WORD_BITS = 64;
+
+public:
+	CPackedBitMatrix();
+	CPackedBitMatrix(int width, int height, bool black = false);
+
+	void Create(int width, int height, bool black = false);
+
+	void FromMat(const cv::Mat & data);
+	void ToMat(cv::Mat & data, int type, int whiteValue) const;
+	void ToMat(cv::Mat & data, int type, int whiteValue, int left, int top, int width, int height) const;
+
+	inline int	GetWidth() const { return m_Width; };
+	inline int	GetHeight() const { return m_Height; };
+	inline int	GetWordsPerRow() const { return m_WordsPerRow; };
+	inline size_t GetMemorySize() const { return m_Words.size() * sizeof(uint64_t); };
+
+	inline uint64_t *		GetRow(int y) { return &m_Words[(size_t)y * m_WordsPerRow]; };
+	inline const uint64_t * GetRow(int y) const { return &m_Words[(size_t)y * m_WordsPerRow]; };
+
+	inline bool Get(int x, int y) const
+	{
+		return ((GetRow(y)[x >> 6] >> (x & 63)) & 1) != 0;
+	};
+	inline void Set(int x, int y, bool black)
+	{
+		uint64_t & word = GetRow(y)[x >> 6];
+		if (black)
+			word |= (uint64_t)1 << (x & 63);
+		else
+			word &= ~((uint64_t)1 << (x & 63));
+	};
+
+	void SetRowBits(int y, int x, int count, const uchar * src, bool invert);
+	void GetRowBits(int y, int x, int count, uchar * dst, bool invert) const;
+
+	void And(const CPackedBitMatrix & other);
+	void AndOffset(const CPackedBitMatrix & other, int offx, int offy);
+	void Xor(const CPackedBitMatrix & other);
+	void XorOffset(const CPackedBitMatrix & other, int offx, int offy);
+	void Invert();
+
+	long CountBits() const;
+	long CountBits(int left, int top, int right, int bottom) const;
+
+	static inline int PopCount(uint64_t word)
+	{
+#if defined(__GNUC__)
+		return __builtin_popcountll(word);
+#else
+		word = word - ((word >> 1) & 0x5555555555555555ULL);
+		word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+		word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+		return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
+	};
+
+	static inline uchar ReverseBits(uchar value)
+	{
+		return (uchar)(((value * 0x0202020202ULL) & 0x010884422010ULL) % 1023);
+	};
+
+	static uint64_t ReadBits(const uint64_t * row, int wordsPerRow, int bitPos);
+	static inline uint64_t RangeMask(int first, int last)
+	{
+		return (~(uint64_t)0 << first) & (~(uint64_t)0 >> (63 - last));
+	};
+	void ClearPadding();
+
+private:
+	int						m_Width;
+	int						m_Height;
+	int						m_WordsPerRow;
+	std::vector<uint64_t>	m_Words;
+};
+
+
+}
+
+#endif
@@ -58,7 +58,7 @@ COpenCvBiLevelImage * CProjectionProfile::CalculateVerticalProjectionProfile(COp
 
 	//Count
 	for (int x = 0; x<width; x++)
-		profile.at(x) = cv::countNonZero(inputImage->GetData()(cv::Rect(x, 0, 1, height)));
+		profile.at(x) = cv::countNonZero(inputImage->GetData(false)(cv::Rect(x, 0, 1, height)));
 
 	//Draw
 	for (int x = 0; x < width; x++)
@@ -81,7 +81,7 @@ COpenCvBiLevelImage * CProjectionProfile::CalculateVerticalProjectionProfile(COp
 
 	//Count
 	for (int x = 0; x<width; x++)
-		profile.at(x) = cv::sum(inputImage->GetData()(cv::Rect(x, 0, 1, inputImage->GetHeight())))[0];
+		profile.at(x) = cv::sum(inputImage->GetData(false)(cv::Rect(x, 0, 1, inputImage->GetHeight())))[0];
 
 	//Draw
 	for (int x = 0; x < width; x++)
@@ -135,7 +135,7 @@ COpenCvBiLevelImage * CProjectionProfile::CalculateHorizontalProjectionProfile(C
 
 	//Count
 	for (int y = 0; y<inputImage->GetHeight(); y++)
-		profile.at(y) = cv::countNonZero(inputImage->GetData()(cv::Rect(0, y, inputImage->GetWidth(), 1)));
+		profile.at(y) = cv::countNonZero(inputImage->GetData(false)(cv::Rect(0, y, inputImage->GetWidth(), 1)));
 
 	//Draw
 	for (int y = 0; y<inputImage->GetHeight(); y++)
@@ -158,7 +158,7 @@ COpenCvBiLevelImage * CProjectionProfile::CalculateHorizontalProjectionProfile(C
 
 	//Count
 	for (int y = 0; y<height; y++)
-		profile.at(y) = cv::sum(inputImage->GetData()(cv::Rect(0, y, width, 1)))[0];
+		profile.at(y) = cv::sum(inputImage->GetData(false)(cv::Rect(0, y, width, 1)))[0];
 
 	//Draw
 	for (int y = 0; y<height; y++)
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+
+namespace PRImA {
+
+/*
+ * Internal helpers shared by the parallel row kernels of the library (not part of the public interface).
+ */
+
+/*
+ * Number of row bands for parallel row kernels (roughly 64K values per band)
+ *
+ * 'values' - Number of values per row (width * channels)
+ * 'rows' - Number of rows to process
+ */
+inline double GetRowBandCount(int values, int rows)
+{
+	double bands = (double)values * rows / (1 << 16);
+	return bands > 1.0 ? bands : 1.0;
+}
+
+/*
+ * Number of row bands for a parallel row kernel over all values of the given matrix
+ */
+inline double GetRowBandCount(const cv::Mat & data)
+{
+	return GetRowBandCount(data.cols * data.channels(), data.rows);
+}
+
+/*
+ * Computes the differences of two integral rows (cumulated column sums over the rows in between)
+ */
+template<class T>
+inline void SubtractRows(const T * bottom, const T * top, T * dst, int n)
+{
+	for (int x = 0; x < n; x++)
+		dst[x] = bottom[x] - top[x];
+}
+
+#if CV_SIMD128
+template<>
+inline void SubtractRows<unsigned>(const unsigned * bottom, const unsigned * top, unsigned * dst, int n)
+{
+	int x = 0;
+	for (; x <= n - 4; x += 4)
+		cv::v_store(dst + x, cv::v_load(bottom + x) - cv::v_load(top + x));
+	for (; x < n; x++)
+		dst[x] = bottom[x] - top[x];
+}
+
+template<>
+inline void SubtractRows<uint64>(const uint64 * bottom, const uint64 * top, uint64 * dst, int n)
+{
+	int x = 0;
+	for (; x <= n - 2; x += 2)
+		cv::v_store(dst + x, cv::v_load(bottom + x) - cv::v_load(top + x));
+	for (; x < n; x++)
+		dst[x] = bottom[x] - top[x];
+}
+#endif
+
+/*
+ * Computes the horizontal window sums for one row from the cumulated column sums (n+1 values).
+ * The window of value x is [x-whalf, x+whalf], clipped to the row.
+ */
+template<class T>
+inline void WindowSums(const T * colSums, T * dst, int n, int whalf)
+{
+	int x = 0;
+	for (; x < n && x - whalf < 0; x++)
+		dst[x] = colSums[x + whalf + 1 < n ? x + whalf + 1 : n] - colSums[0];
+	for (; x + whalf + 1 <= n; x++)
+		dst[x] = colSums[x + whalf + 1] - colSums[x - whalf];
+	for (; x < n; x++)
+		dst[x] = colSums[n] - colSums[x - whalf];
+}
+
+} //end namespace
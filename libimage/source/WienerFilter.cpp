@@ -30,47 +30,208 @@ Federico Bolelli: federico.bolelli@unimore.it
 */
 
 #include "WienerFilter.h"
+#include "RowKernelHelpers.h"
+#include "opencv2/core/hal/intrin.hpp"
+
+#include <vector>
 
 using namespace cv;
 
+// The local mean and variance are calculated from integer box sums (sliding window, replicated borders):
+// running column sums over the window rows and a running sum over the window columns of each row.
+// No full-size intermediate matrices are needed.
+
+static inline int Clamp(int i, int n){
+	return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+// Adds the row 'add' to the column sums and removes the row 'sub' (if not NULL)
+template<typename T, typename SqT>
+static inline void UpdateColumnSums(const T* add, const T* sub, unsigned* sums, SqT* sqSums, int n){
+	for (int x = 0; x < n; ++x) {
+		sums[x] += add[x];
+		sqSums[x] += (SqT)add[x] * add[x];
+	}
+	if (sub != NULL) {
+		for (int x = 0; x < n; ++x) {
+			sums[x] -= sub[x];
+			sqSums[x] -= (SqT)sub[x] * sub[x];
+		}
+	}
+}
+
+#if CV_SIMD128
+// 8 bit: sums and squared sums of a column fit into 32 bit (the differences are exact modulo 2^32)
+template<>
+inline void UpdateColumnSums<uchar, unsigned>(const uchar* add, const uchar* sub, unsigned* sums, unsigned* sqSums, int n){
+	if (sub == NULL) {
+		for (int x = 0; x < n; ++x) {
+			sums[x] += add[x];
+			sqSums[x] += (unsigned)add[x] * add[x];
+		}
+		return;
+	}
+	int x = 0;
+	for (; x <= n - 8; x += 8) {
+		v_uint16x8 a = v_load_expand(add + x);
+		v_uint16x8 b = v_load_expand(sub + x);
+		v_uint16x8 aa = a * a; // 255 * 255 fits into 16 bit
+		v_uint16x8 bb = b * b;
+		v_uint32x4 a0, a1, b0, b1, aa0, aa1, bb0, bb1;
+		v_expand(a, a0, a1);
+		v_expand(b, b0, b1);
+		v_expand(aa, aa0, aa1);
+		v_expand(bb, bb0, bb1);
+		v_store(sums + x, v_load(sums + x) + a0 - b0);
+		v_store(sums + x + 4, v_load(sums + x + 4) + a1 - b1);
+		v_store(sqSums + x, v_load(sqSums + x) + aa0 - bb0);
+		v_store(sqSums + x + 4, v_load(sqSums + x + 4) + aa1 - bb1);
+	}
+	for (; x < n; ++x) {
+		sums[x] += add[x] - sub[x];
+		sqSums[x] += (unsigned)add[x] * add[x] - (unsigned)sub[x] * sub[x];
+	}
+}
+#endif
+
+// Applies the filter to one row. 'sums' - window sums, 'sqTerms' - exact variance numerators n*sqSum - sum^2
+// ('exact') or window squared sums, 'values' - buffer for w values.
+// Same operation order as the scalar formula, so the SIMD part yields identical results.
+template<typename T>
+static void FilterRow(const T* src, T* dst, const double* sums, const double* sqTerms, double* values, int w, double n, bool exact, double noiseVariance){
+	int c = 0;
+#if CV_SIMD128_64F
+	v_float64x2 vn = v_setall_f64(n), vnn = v_setall_f64(n * n), vnoise = v_setall_f64(noiseVariance), zero = v_setzero_f64();
+	for (; c <= w - 2; c += 2) {
+		v_float64x2 mean = v_load(sums + c) / vn;
+		v_float64x2 sq = v_load(sqTerms + c);
+		v_float64x2 variance = exact ? sq / vnn : sq / vn - mean * mean;
+		v_float64x2 pixels((double)src[c], (double)src[c + 1]);
+		v_store(values + c, mean + v_max(zero, variance - vnoise) / v_max(variance, vnoise) * (pixels - mean));
+	}
+#endif
+	for (; c < w; ++c) {
+		double mean = sums[c] / n;
+		double variance = exact ? sqTerms[c] / (n * n) : sqTerms[c] / n - mean * mean;
+		values[c] = mean + std::max(0., variance - noiseVariance) / std::max(variance, noiseVariance) * (src[c] - mean);
+	}
+	for (c = 0; c < w; ++c)
+		dst[c] = saturate_cast<T>(values[c]);
+}
+
+// Parallel loop body (bands of rows). Either applies the filter (rowVarianceSums == NULL) or sums up the local
+// variances per row for the noise estimation.
+// T - pixel type (uchar or ushort), SqT - type of the squared column sums (unsigned or uint64)
+template<typename T, typename SqT>
+class WienerFilterBody : public ParallelLoopBody {
+public:
+	WienerFilterBody(const Mat& src, const Mat& dst, const Size& block, double noiseVariance, double* rowVarianceSums, int firstRow)
+		: src_(src), dst_(dst), block_(block), noiseVariance_(noiseVariance), rowVarianceSums_(rowVarianceSums), firstRow_(firstRow) {}
+
+	void operator()(const Range& range) const {
+		int h = src_.rows;
+		int w = src_.cols;
+		int rw = block_.width / 2;
+		int rh = block_.height / 2;
+		uint64 n = (uint64)block_.width * block_.height;
+		// Exact variance numerator n*sqSum - sum^2 in 64 bit?
+		double maxValue = sizeof(T) == 1 ? 255.0 : 65535.0;
+		bool exact = (double)n * n * maxValue * maxValue < 9.0e18;
+
+		std::vector<unsigned> colSums(w, 0);
+		std::vector<SqT> colSqSums(w, 0);
+		std::vector<double> windowSums, windowSqTerms, values; // Filter only
+		if (rowVarianceSums_ == NULL) {
+			windowSums.resize(w);
+			windowSqTerms.resize(w);
+			values.resize(w);
+		}
+		for (int i = -rh; i <= rh; ++i)
+			UpdateColumnSums<T, SqT>(src_.ptr<T>(Clamp(range.start + i, h)), NULL, &colSums[0], &colSqSums[0], w);
+
+		for (int r = range.start; r < range.end; ++r){
+			if (r > range.start)
+				UpdateColumnSums<T, SqT>(src_.ptr<T>(Clamp(r + rh, h)), src_.ptr<T>(Clamp(r - rh - 1, h)), &colSums[0], &colSqSums[0], w);
+
+			// get row pointers
+			T const * const srcRow = src_.ptr<T>(r);
+			T * const dstRow = rowVarianceSums_ == NULL ? (T*)dst_.ptr<T>(r) : NULL;
+
+			uint64 sum = 0, sqSum = 0;
+			for (int i = -rw; i <= rw; ++i) {
+				sum += colSums[Clamp(i, w)];
+				sqSum += colSqSums[Clamp(i, w)];
+			}
+			// Summed up in double: each term fits into 64 bit, the sum over a row may not (16 bit, large blocks, wide rows)
+			double rowSum = 0.0;
+			for (int c = 0; c < w; ++c) {
+				if (rowVarianceSums_ != NULL) {
+					rowSum += exact ? (double)(int64)(n * sqSum - sum * sum) : (double)sqSum * n - (double)sum * sum;
+				}
+				else {
+					windowSums[c] = (double)sum;
+					windowSqTerms[c] = exact ? (double)(int64)(n * sqSum - sum * sum) : (double)sqSum;
+				}
+				// slide the window
+				int in = Clamp(c + rw + 1, w);
+				int out = Clamp(c - rw, w);
+				sum += (uint64)colSums[in] - colSums[out];
+				sqSum += (uint64)colSqSums[in] - colSqSums[out];
+			}
+			if (rowVarianceSums_ != NULL)
+				rowVarianceSums_[r - firstRow_] = rowSum / ((double)n * n);
+			else
+				FilterRow<T>(srcRow, dstRow, &windowSums[0], &windowSqTerms[0], &values[0], w, (double)n, exact, noiseVariance_);
+		}
+	}
+
+private:
+	const Mat& src_;
+	const Mat& dst_;
+	Size block_;
+	double noiseVariance_;
+	double* rowVarianceSums_;
+	int firstRow_;
+};
+
+void WienerFilterVarianceSums(const Mat& src, int firstRow, int endRow, double* rowVarianceSums, const Size& block){
+
+	assert(("Invalid block dimensions", block.width % 2 == 1 && block.height % 2 == 1 && block.width > 1 && block.height > 1));
+	assert(("src must be a one channel 8 or 16 bit grayscale image", src.channels() == 1 && (src.depth() == CV_8U || src.depth() == CV_16U)));
+
+	Range rows(firstRow, endRow);
+	if (src.depth() == CV_8U)
+		parallel_for_(rows, WienerFilterBody<uchar, unsigned>(src, src, block, 0.0, rowVarianceSums, firstRow), PRImA::GetRowBandCount(src.cols, endRow - firstRow));
+	else
+		parallel_for_(rows, WienerFilterBody<ushort, uint64>(src, src, block, 0.0, rowVarianceSums, firstRow), PRImA::GetRowBandCount(src.cols, endRow - firstRow));
+}
+
 double WienerFilterImpl(const Mat& src, Mat& dst, double noiseVariance, const Size& block){
 
 	assert(("Invalid block dimensions", block.width % 2 == 1 && block.height % 2 == 1 && block.width > 1 && block.height > 1));
-	assert(("src and dst must be one channel grayscale images", src.channels() == 1, dst.channels() == 1));
+	assert(("src must be a one channel 8 or 16 bit grayscale image", src.channels() == 1 && (src.depth() == CV_8U || src.depth() == CV_16U)));
 	
 	int h = src.rows;
 	int w = src.cols;
 
-	dst = Mat1b(h, w);
-
-	Mat1d means, sqrMeans, variances;
-	Mat1d avgVarianceMat; 
-
-	boxFilter(src, means, CV_64F, block, Point(-1, -1), true, BORDER_REPLICATE);
-	sqrBoxFilter(src, sqrMeans, CV_64F, block, Point(-1, -1), true, BORDER_REPLICATE);
-
-	Mat1d means2 = means.mul(means);
-	variances = sqrMeans - (means.mul(means));
-
 	if (noiseVariance < 0){
-		// I have to estimate the noiseVariance
-		reduce(variances, avgVarianceMat, 1, CV_REDUCE_SUM, -1);
-		reduce(avgVarianceMat, avgVarianceMat, 0, CV_REDUCE_SUM, -1);
-		noiseVariance = avgVarianceMat(0, 0) / (h*w);
+		// I have to estimate the noiseVariance (average of all local variances, first pass)
+		std::vector<double> rowVarianceSums(h);
+		WienerFilterVarianceSums(src, 0, h, h > 0 ? &rowVarianceSums[0] : NULL, block);
+		double sum = 0.0;
+		for (int r = 0; r < h; ++r)
+			sum += rowVarianceSums[r];
+		noiseVariance = sum / ((double)h * w);
 	}
 
-	for (int r = 0; r < h; ++r){
-		// get row pointers
-		uchar const * const srcRow = src.ptr<uchar>(r);
-		uchar * const dstRow = dst.ptr<uchar>(r);
-		double * const varRow = variances.ptr<double>(r);
-		double * const meanRow = means.ptr<double>(r);
-		for (int c = 0; c < w; ++c) {
-			dstRow[c] = saturate_cast<uchar>(
-				meanRow[c] + max(0., varRow[c] - noiseVariance) / max(varRow[c], noiseVariance) * (srcRow[c] - meanRow[c])
-			);
-		}
-	}
+	// Second pass
+	if (dst.data == src.data)
+		dst = Mat(); // not in place
+	dst.create(h, w, src.type());
+	if (src.depth() == CV_8U)
+		parallel_for_(Range(0, h), WienerFilterBody<uchar, unsigned>(src, dst, block, noiseVariance, NULL, 0), PRImA::GetRowBandCount(src.cols, h));
+	else
+		parallel_for_(Range(0, h), WienerFilterBody<ushort, uint64>(src, dst, block, noiseVariance, NULL, 0), PRImA::GetRowBandCount(src.cols, h));
 
 	return noiseVariance;
 }
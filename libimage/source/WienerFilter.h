@@ -37,7 +37,7 @@ Federico Bolelli: federico.bolelli@unimore.it
 
 #include <assert.h>
 
-/** @brief Implementation of the adaptive Wiener filter
+/** @brief Implementation of the adaptive Wiener filter (8 or 16 bit)
 
 This function applies to the src image the adaptive Wiener filter and 
 store the result in the dst image. The formula that will be apply is 
@@ -50,8 +50,12 @@ around each pixel (they depend on block dimension) e v^2 is the noise
 variance calculated as the average of all the local estimated variances
 if not given.
 
-@param[in] src input grayscale image (Mat1b)
-@param[out] dst output grayscale image (Mat1b)
+The local means and variances are calculated from integer box sums with a sliding
+window (replicated borders), row bands are processed in parallel. The noise variance
+is estimated in a separate first pass. No full-size intermediate matrices are needed.
+
+@param[in] src input grayscale image (Mat1b or Mat1w)
+@param[out] dst output grayscale image (same type as src)
 @param[in] block dimension of the block (width, height) to use in order
 			to compute the filtering process, default is 5x5
 
@@ -61,12 +65,25 @@ double WienerFilter(const cv::Mat& src, cv::Mat& dst, const cv::Size& block = cv
 
 /** @overload 
 
-@param[in] src input grayscale image (Mat1b)
-@param[out] dst output grayscale image (Mat1b)
+@param[in] src input grayscale image (Mat1b or Mat1w)
+@param[out] dst output grayscale image (same type as src)
 @param[in] noiseVariance noise variance to use in order to calculate Wiener filter (must be positive)
 @param[in] block dimension of the block (width, height) to use in order
 			to compute the filtering process, default is 5x5
 
 @return estimated noise variance
 */
-void WienerFilter(const cv::Mat& src, cv::Mat& dst, double noiseVariance, const cv::Size& block = cv::Size(5, 5));
\ No newline at end of file
+void WienerFilter(const cv::Mat& src, cv::Mat& dst, double noiseVariance, const cv::Size& block = cv::Size(5, 5));
+
+/** @brief Sums of the local variances per row, as used for the noise variance estimation
+
+The estimated noise variance is the sum of all row sums (in row order) divided by the number 
+of pixels. Allows the estimation for parts of an image (e.g. tiles processed separately).
+
+@param[in] src input grayscale image (Mat1b or Mat1w)
+@param[in] firstRow first row to sum up
+@param[in] endRow row after the last row to sum up
+@param[out] rowVarianceSums sums for the rows (endRow - firstRow values)
+@param[in] block dimension of the block (width, height), default is 5x5
+*/
+void WienerFilterVarianceSums(const cv::Mat& src, int firstRow, int endRow, double* rowVarianceSums, const cv::Size& block = cv::Size(5, 5));
@@ -26,6 +26,8 @@ COpenCvImage * ThresholdBinarization(COpenCvImage * inputImage, int argc, char *
 COpenCvImage * OtsuBinarization(COpenCvImage * inputImage, bool forceOutput);
 COpenCvImage * SauvolaBinarization(COpenCvImage * inputImage, int argc, char * argv[], bool forceOutput);
 COpenCvImage * AdaptiveBinarization(COpenCvImage * inputImage, bool forceOutput);
+COpenCvImage * AdaptiveBinarizationComparison(COpenCvImage * inputImage);
+COpenCvImage * CopyOnWriteCheck(COpenCvImage * inputImage);
 COpenCvImage * Erode(COpenCvImage * inputImage, int argc, char * argv[], bool forceOutput);
 COpenCvImage * Dilate(COpenCvImage * inputImage, int argc, char * argv[], bool forceOutput);
 COpenCvBiLevelImage * ProjectionProfile(COpenCvImage * inputImage, bool vertical, int argc, char * argv[], bool forceOutput);
@@ -83,6 +85,10 @@ int main(int argc, char * argv[])
 		outputImage = SauvolaBinarization(inputImage, argc, argv, forceOutput);
 	else if (operation == CUniString(_T("AdaptiveBin")) || operation == CUniString(_T("adaptivebin")))
 		outputImage = AdaptiveBinarization(inputImage, forceOutput);
+	else if (operation == CUniString(_T("AdaptiveBinCompare")) || operation == CUniString(_T("adaptivebincompare")))
+		outputImage = AdaptiveBinarizationComparison(inputImage);
+	else if (operation == CUniString(_T("CopyOnWriteCheck")) || operation == CUniString(_T("copyonwritecheck")))
+		outputImage = CopyOnWriteCheck(inputImage);
 	else if (operation == CUniString(_T("Erode")) || operation == CUniString(_T("erode")))
 		outputImage = Erode(inputImage, argc, argv, forceOutput);
 	else if (operation == CUniString(_T("Dilate")) || operation == CUniString(_T("dilate")))
@@ -183,6 +189,11 @@ void ShowUsage()
 	printf("                              param1: window size; 10...200 (recommendation: 50)\n");
 	printf("                              param2: weight; 0.05...0.95 (recommendation: 0.4)\n");
 	printf("           AdaptiveBin  - Adaptive binarisation based on Gatos et al. 2005\n");
+	printf("           AdaptiveBinCompare - Compares the tiled adaptive binarisation with the full-image one\n");
+	printf("                              (number of differing pixels per configuration;\n");
+	printf("                               output image: differences of the first mismatch, if any)\n");
+	printf("           CopyOnWriteCheck - Checks that writing through a view of a cloned image\n");
+	printf("                              leaves the clone unchanged (no output image)\n");
 	printf("           Erode - Morphological operation (thinning) (for bitonal or greyscale)\n");
 	printf("           Dilate - Morphological operation (growing) (for bitonal or greyscale)\n");
 	printf("           HProfile - Horizontal projection profile\n");
@@ -281,6 +292,115 @@ COpenCvImage * AdaptiveBinarization(COpenCvImage * inputImage, bool forceOutput)
 	return res;
 }
 
+/*
+ * Compares the tiled execution of the adaptive binarisation with the full-image execution, which should
+ * give identical results. Covers thresholding without upsampling, upsampled thresholding (post-processing at
+ * double and at original resolution) and tile heights that make the tile borders cross text components.
+ * Returns an image with the differing pixels in black for the first configuration with differences (or NULL).
+ */
+COpenCvImage * AdaptiveBinarizationComparison(COpenCvImage * inputImage)
+{
+	if (typeid(*inputImage) == typeid(COpenCvBiLevelImage))
+	{
+		cout << ",INFO,Input image already in binary format"; //CSV output
+		return NULL;
+	}
+
+	const char * upsampleModes[] = { "NoUpsampling", "Upsampled", "UpsampledDownsampleFirst" };
+	const int tileHeights[] = { 64, 200, 512 };
+
+	COpenCvBiLevelImage * differences = NULL;
+	bool error = false;
+	for (int mode = 0; mode < 3; mode++)
+	{
+		//Reference: full-image execution
+		CAdaptiveBinariser fullBinariser(inputImage);
+		fullBinariser.SetUpsample(mode > 0, mode == 2);
+		fullBinariser.Run();
+		COpenCvBiLevelImage * full = fullBinariser.GetOutputImage();
+
+		for (int i = 0; i < 3; i++)
+		{
+			CAdaptiveBinariser tiledBinariser(inputImage);
+			tiledBinariser.SetUpsample(mode > 0, mode == 2);
+			tiledBinariser.SetTiling(true, tileHeights[i]);
+			tiledBinariser.Run();
+			COpenCvBiLevelImage * tiled = tiledBinariser.GetOutputImage();
+
+			cout << "," << upsampleModes[mode] << "/Tiles" << tileHeights[i]; //CSV output
+			if (full == NULL || tiled == NULL
+				|| full->GetWidth() != tiled->GetWidth() || full->GetHeight() != tiled->GetHeight())
+			{
+				cout << ",ERROR"; //CSV output
+				error = true;
+				delete tiled;
+				continue;
+			}
+
+			//Count differing pixels
+			int count = 0;
+			COpenCvBiLevelImage * diff = differences == NULL ? COpenCvImage::CreateB(full->GetWidth(), full->GetHeight(), RGBWHITE) : NULL;
+			for (int y = 0; y < full->GetHeight(); y++)
+			{
+				for (int x = 0; x < full->GetWidth(); x++)
+				{
+					if (full->IsBlack(x, y) != tiled->IsBlack(x, y))
+					{
+						count++;
+						if (diff != NULL)
+							diff->SetBlack(x, y);
+					}
+				}
+			}
+			cout << "," << count; //CSV output
+
+			if (count > 0 && diff != NULL)
+				differences = diff;
+			else
+				delete diff;
+			delete tiled;
+		}
+		delete full;
+	}
+
+	if (error)
+		cout << ",ERROR,internal binarisation error"; //CSV output
+	else if (differences != NULL)
+		cout << ",ERROR,Tiled results differ"; //CSV output
+	else
+		cout << ",SUCCESS,Results identical"; //CSV output
+	return differences;
+}
+
+/*
+ * Checks the pixel sharing of clones and views: Clone(), then a write-through view of the original,
+ * then a write through the view. The clone has to stay unchanged and the original has to show the change.
+ */
+COpenCvImage * CopyOnWriteCheck(COpenCvImage * inputImage)
+{
+	cv::Mat original = COpenCvImage::CloneMatrix(inputImage->GetData(false));
+	COpenCvImage * clone = inputImage->Clone();
+
+	COpenCvImage * view = inputImage->CreateView(0, 0, min(16, inputImage->GetWidth()), min(16, inputImage->GetHeight()),
+												 COpenCvImage::VIEW_WRITE_THROUGH);
+	cv::Mat viewData = view->GetData();
+	cv::bitwise_not(viewData, viewData);
+
+	bool cloneUnchanged = cv::norm(clone->GetData(false), original, cv::NORM_INF) == 0.0;
+	bool writtenThrough = cv::norm(inputImage->GetData(false), original, cv::NORM_INF) != 0.0;
+
+	if (!cloneUnchanged)
+		cout << ",ERROR,Write through the view changed the clone"; //CSV output
+	else if (!writtenThrough)
+		cout << ",ERROR,Write through the view not visible in the original"; //CSV output
+	else
+		cout << ",SUCCESS,Clone unchanged"; //CSV output
+
+	delete view;
+	delete clone;
+	return NULL;
+}
+
 /*
  * Thinning operation (if colour image it will be converted to greyscale first)
  */